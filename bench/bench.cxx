@@ -0,0 +1,376 @@
+// Microbenchmarks of the building blocks: environments, identifiers, the
+// passes over expressions and types, the lexer and the pretty printer, each
+// on its own. Built by `make bench`.
+//
+// It also checks that a big module parsed in chunks on several threads
+// comes out the same as one parsed in one go.
+
+#include "ast.hxx"
+#include "env.hxx"
+#include "lexer.hxx"
+#include "mem.hxx"
+#include "parser.hxx"
+#include "tc.hxx"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace miniml;
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  /// What the operations return is added to this, so that they can't be
+  /// optimised away.
+  volatile size_t sink;
+
+  /// Measurements of one operation.
+  struct Result final
+  {
+    String name;
+    unsigned long iters;
+    double ns;
+    /// Objects counted by mem for each operation.
+    double allocs;
+    /// Bytes of input for each operation, for throughput.
+    size_t bytes;
+  };
+
+  /// How long each of the samples of an operation takes at least.
+  std::chrono::milliseconds sample_time {20};
+  const unsigned samples = 5;
+
+  String filter;
+  std::vector<Result> results;
+
+  /// Run \a f \a iters times.
+  /// \return How long it took, in nanoseconds.
+  template <typename F>
+  double time(F &f, unsigned long iters)
+  {
+    auto start = Clock::now();
+    for (unsigned long i = 0; i < iters; ++i) sink = sink + f();
+    std::chrono::duration<double, std::nano> t = Clock::now() - start;
+    return t.count();
+  }
+
+  /// Time an operation: the median over several samples, each of enough
+  /// iterations to take #sample_time.
+  template <typename F>
+  void measure(const String &name, F f, size_t bytes = 0)
+  {
+    if (name.find(filter) == String::npos) return;
+
+    // also warms up the caches
+    unsigned long iters = 1;
+    std::chrono::duration<double, std::nano> want = sample_time;
+    double t;
+    while ((t = time(f, iters)) < want.count() / 4) iters *= 2;
+    iters = std::max(1.0, iters * want.count() / std::max(t, 1.0));
+
+    auto allocs = mem::thread_allocs;
+    std::vector<double> ts;
+    for (unsigned i = 0; i < samples; ++i) ts.push_back(time(f, iters));
+    allocs = mem::thread_allocs - allocs;
+
+    std::sort(ts.begin(), ts.end());
+    results.push_back(Result {name, iters, ts[samples / 2] / iters,
+                              double(allocs) / (iters * samples), bytes});
+
+    auto &r = results.back();
+    std::cout << std::left << std::setw(20) << r.name << std::right
+              << std::setw(12) << r.iters << std::fixed
+              << std::setprecision(1) << std::setw(14) << r.ns
+              << std::setw(10) << r.allocs;
+    if (r.bytes) std::cout << std::setw(10) << r.bytes * 1e3 / r.ns;
+    std::cout << std::endl;
+  }
+
+  String name(const char *base, size_t n)
+  { return String(base) + "/" + std::to_string(n); }
+
+
+  /// A chain of \a depth environment layers, each binding one name, `x0`
+  /// in the outermost, so that finding it goes through all of them.
+  Ptr<Env<Expr>> env_chain(size_t depth)
+  {
+    auto val = ptr<IntExpr>(0);
+    Ptr<Env<Expr>> env;
+    for (size_t i = 0; i < depth; ++i) {
+      env = ptr<Env<Expr>>(env);
+      env->insert(Id("x" + std::to_string(i)), val);
+    }
+    return env;
+  }
+
+  /// An expression with 2^\a depth leaves: applications, some of them under
+  /// lambdas binding `x1`, with the leaves using `x0` to `x7`.
+  Ptr<Expr> expr_tree(unsigned depth, unsigned &leaf)
+  {
+    if (depth == 0) return ptr<IdExpr>(Id("x" + std::to_string(leaf++ % 8)));
+    auto l = expr_tree(depth - 1, leaf), r = expr_tree(depth - 1, leaf);
+    Ptr<Expr> e = ptr<AppExpr>(l, r);
+    if (depth % 3 == 0) e = ptr<LamExpr>(Id("x1"), ptr<IntType>(), e);
+    return e;
+  }
+
+  Ptr<Expr> expr_tree(unsigned depth)
+  {
+    unsigned leaf = 0;
+    return expr_tree(depth, leaf);
+  }
+
+  /// `t -> t -> ... -> int`, with \a depth arrows.
+  Ptr<Type> arrow_chain(size_t depth)
+  {
+    Ptr<Type> t = ptr<IntType>();
+    for (size_t i = 0; i < depth; ++i) {
+      t = ptr<ArrowType>(ptr<IdType>(Id("t")), t);
+    }
+    return t;
+  }
+
+  /// Some source code, about \a bytes long.
+  String source(size_t bytes)
+  {
+    String src;
+    for (unsigned i = 0; src.size() < bytes; ++i) {
+      auto n = std::to_string(i);
+      src += "fun f" + n + " (x: int) (s: string): int =\n"
+             "  if (x < " + n + ") (x * 2 + 1) (f" + n + " (x - 1) \"str\")"
+             "; // comment\n";
+    }
+    return src;
+  }
+
+  /// A module of about \a bytes of independent declarations, with strings
+  /// and comments that have `val` and `fun` in them.
+  String module(size_t bytes)
+  {
+    String src = "big =>\n";
+    for (unsigned i = 0; src.size() < bytes; ++i) {
+      auto n = std::to_string(i);
+      src += "val v" + n + " = \"a val, a \\\"fun\\\" \" // val fun\n"
+             "fun f" + n + " (x: int) (s: string): int =\n"
+             "  if (x < " + n + ") (x * 2 + 1) (f" + n + " (x - 1) s)\n";
+    }
+    return src;
+  }
+
+  /// The declarations \a parse gives, with where each of them is, or the
+  /// error it throws.
+  String parsed(std::function<Ptr<Input>()> parse)
+  {
+    SStream out;
+    try {
+      auto mod = dyn_cast<ModuleInput>(parse());
+      out << mod->name << std::endl;
+      for (auto &d: *mod->decls) {
+        out << *d->ppr() << ' ' << *d->start().file() << ':' << d->start()
+            << '-' << d->end() << std::endl;
+      }
+    } catch (Exception &e) {
+      out << e << std::endl;
+    }
+    return out.str();
+  }
+
+  /// Check that parsing \a src in chunks gives the same as in one go.
+  bool same_parse(const String &what, const String &src)
+  {
+    String file = "big.mml";
+    auto chunked = parsed([&] { return Parser().parse(src, &file); });
+    auto whole = parsed([&] {
+      return Parser().parse(Lexer(src, &file).tokens());
+    });
+    if (chunked == whole) return true;
+    std::cerr << "parse/chunks: " << what << " differs parsed in chunks"
+              << std::endl;
+    return false;
+  }
+
+  /// Parse a module of over a megabyte in chunks, and the same with an error
+  /// in one of the middle chunks, or a declaration cut short, and check
+  /// they come out as if it had been parsed in one go.
+  bool check_parse()
+  {
+    if (String("parse/chunks").find(filter) == String::npos) return true;
+    // as if there were enough cores for it to be split even here
+    auto threads = Parser::threads;
+    Parser::threads = 4;
+
+    auto src = module(1200 << 10);
+    bool ok = same_parse("a module", src);
+    for (double at: {0.5, 0.75}) {
+      auto i = src.find("\nfun ", size_t(src.size() * at)) + 1;
+      auto bad = src;
+      bad.insert(i, "val bad = 1 + )\n");
+      ok &= same_parse("an error", bad);
+
+      // where the error should be
+      auto line = std::count(src.begin(), src.begin() + i, '\n') + 1;
+      String at_bad = "')'" + std::to_string(line) + ":14";
+      auto got = parsed([&] {
+        String file = "big.mml";
+        return Parser().parse(bad, &file);
+      });
+      if (got.find(at_bad) == String::npos) {
+        std::cerr << "parse/chunks: expected an error at " << at_bad
+                  << ", got " << got;
+        ok = false;
+      }
+
+      auto cut = src;
+      cut.insert(i, "val bad =\n");
+      ok &= same_parse("a declaration cut short", cut);
+    }
+
+    Parser::threads = threads;
+    return ok;
+  }
+
+
+  void run()
+  {
+    std::cout << std::left << std::setw(20) << "operation" << std::right
+              << std::setw(12) << "iterations" << std::setw(14) << "ns/op"
+              << std::setw(10) << "allocs" << std::setw(10) << "MB/s"
+              << std::endl;
+
+    for (size_t depth: {1, 16, 256, 4096}) {
+      auto env = env_chain(depth);
+      Id x0("x0");
+      measure(name("env_lookup", depth),
+              [&] { return size_t(env->lookup(x0).get()); });
+    }
+
+    {
+      String str("some_identifier");
+      measure("id/make", [&] { return Id(str).hash(); });
+      Id a(str), b(str);
+      measure("id/equal", [&] { return size_t(a == b); });
+      measure("id/hash", [&] { return std::hash<Id>()(a); });
+    }
+
+    for (unsigned depth: {4, 8, 12}) {
+      auto e = expr_tree(depth);
+      auto size = size_t(1) << depth;
+      measure(name("fv", size), [&] { return fv(e)->size(); });
+      auto one = ptr<IntExpr>(1);
+      Id x0("x0");
+      measure(name("subst", size),
+              [&] { return size_t(e->subst(x0, one).get()); });
+    }
+
+    for (size_t depth: {16, 256, 4096}) {
+      auto t = arrow_chain(depth), u = arrow_chain(depth);
+      auto env = ptr<Env<Type>>();
+      env->insert(Id("t"), ptr<IntType>());
+      measure(name("nf", depth), [&] { return size_t(nf(t, env).get()); });
+      auto tn = nf(t, env), un = nf(u, env);
+      auto e = ptr<IntExpr>(0);
+      measure(name("check_eq", depth),
+              [&] { check_eq(tn, un, e); return size_t(1); });
+    }
+
+    {
+      // every run adds the source to the positions used up, so not too big
+      auto src = source(64 * 1024);
+      measure("lexer/64k", [&] { return Lexer(src).tokens().size(); },
+              src.size());
+    }
+
+    for (unsigned depth: {6, 10}) {
+      auto e = expr_tree(depth);
+      measure(name("ppr", size_t(1) << depth),
+              [&] { return e->ppr()->string()->size(); });
+    }
+  }
+
+  void usage(const char *prog)
+  {
+    std::cerr << "usage: " << prog << " [--filter STR] [--time MS]"
+              << " [--save FILE] [--budget FILE [--slack PCT]]" << std::endl
+              << "  --filter STR   only run operations whose names contain STR"
+              << std::endl
+              << "  --time MS      time each sample for at least MS ms"
+              << " (default 20)" << std::endl
+              << "  --save FILE    write the ns/op of each operation to FILE"
+              << std::endl
+              << "  --budget FILE  fail if an operation takes more ns/op than"
+              << " FILE says," << std::endl
+              << "  --slack PCT    by more than PCT% (default 25)" << std::endl;
+    std::exit(2);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *save = nullptr, *budget = nullptr;
+  double slack = 25;
+  for (int i = 1; i < argc; ++i) {
+    String arg = argv[i];
+    if (i + 1 >= argc) usage(argv[0]);
+    if (arg == "--filter") {
+      filter = argv[++i];
+    } else if (arg == "--time") {
+      sample_time = std::chrono::milliseconds(std::atoi(argv[++i]));
+    } else if (arg == "--save") {
+      save = argv[++i];
+    } else if (arg == "--budget") {
+      budget = argv[++i];
+    } else if (arg == "--slack") {
+      slack = std::atof(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (!check_parse()) return 1;
+  run();
+
+  if (save) {
+    std::ofstream out(save);
+    for (auto &r: results) {
+      out << r.name << ' ' << std::fixed << std::setprecision(1) << r.ns
+          << std::endl;
+    }
+    if (!out.good()) {
+      std::cerr << "couldn't write " << save << std::endl;
+      return 2;
+    }
+  }
+
+  if (budget) {
+    std::ifstream in(budget);
+    if (in.fail()) {
+      std::cerr << "couldn't read " << budget << std::endl;
+      return 2;
+    }
+    std::map<String, double> limits;
+    String name;
+    double ns;
+    while (in >> name >> ns) limits[name] = ns;
+
+    bool over = false;
+    for (auto &r: results) {
+      auto it = limits.find(r.name);
+      if (it == limits.end() || r.ns <= it->second * (1 + slack / 100)) {
+        continue;
+      }
+      std::cerr << r.name << ": " << r.ns << " ns/op, over the budget of "
+                << it->second << std::endl;
+      over = true;
+    }
+    if (over) return 1;
+  }
+}
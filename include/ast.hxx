@@ -7,6 +7,7 @@
 
 #include "ast/type.hxx"
 #include "ast/expr.hxx"
+#include "ast/pool.hxx"
 #include "ast/decl.hxx"
 
 #endif /* end of include guard: AST_HXX_7IWKV1PR */
@@ -4,6 +4,7 @@
 #include "id.hxx"
 #include "env.hxx"
 #include "ast/expr.hxx"
+#include "ast/pool.hxx"
 #include "ast/type.hxx"
 #include "ppr.hxx"
 #include "pos.hxx"
@@ -58,6 +59,13 @@ public:
 
   /// Typechecks the declaration.
   Ptr<Type> type_of(Ptr<Env<Type>>) const;
+  /// Typechecks the declaration, producing typed IR for its definition, with
+  /// the declared type if there is one. \sa miniml::typecheck
+  Ptr<ir::Node> typecheck(Ptr<Env<Type>>) const;
+  /// Likewise, for a declaration whose definition has been added to \a pool
+  /// as \a root.
+  Ptr<ir::Node> typecheck(Ptr<Env<Type>>, const Ptr<const ExprPool> &pool,
+                          ExprPool::Ref root) const;
 
   inline Id name() const { return m_name; }
   inline Ptr<Expr> def() const { return m_def; }
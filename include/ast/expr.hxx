@@ -4,14 +4,21 @@
 #include "pos.hxx"
 #include "dup.hxx"
 #include "ppr.hxx"
+#include "mem.hxx"
 #include "id.hxx"
 #include "ptr.hxx"
 #include "ast/type.hxx"
 #include "visitor.hxx"
+#include "hamt.hxx"
+#include "stream.hxx"
+#include "walk.hxx"
 #include <unordered_set>
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <mutex>
 #include <utility>
+#include <vector>
 
 namespace miniml
 {
@@ -31,8 +38,22 @@ enum class ExprType
   TUPLE,   ///< Tuple
   DOT,     ///< Dot expression (tuple indexing)
   BUILTIN, ///< Builtin expression
+  CLOSURE, ///< Function value made by evaluating typed IR
+  ARRAY,   ///< Int array, made by the `array_` builtins
+  UNOP,    ///< Unary operator expression
+  INDEX,   ///< Array indexing
+  REF,     ///< Reference cell, made by `ref`
+  MAP,     ///< Persistent map, made by the `intmap_` and `stringmap_` builtins
+  LAZY,    ///< Suspended computation, made by `lazy`
+  STREAM,  ///< Lazy sequence, made by the stream builtins
 };
 
+namespace ir
+{
+  struct Node;
+  struct Frame;
+}
+
 /// Abstract base class for expressions.
 class Expr: public Pretty, public HasPos, public Dup<Expr>
 {
@@ -44,13 +65,22 @@ public:
 
   // Substitutes \a expr for all occurrences of \a var in \a this.
   Ptr<Expr> subst(Id var, const Ptr<Expr> expr);
+
+  using Pretty::ppr;
+  /// Subclasses with subexpressions don't override this, so that they're
+  /// all printed together by one \ref Walk.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  /// Like #ppr, but streamed and laid out to fit the stream's width.
+  void print(PprStream&, unsigned prec = 0) const override;
 protected:
   inline Expr(Pos start = Pos(), Pos end = Pos()): HasPos(start, end) {}
 };
 
 
 /// Identifier expression.
-class IdExpr final: public Expr
+class IdExpr final:
+  public Expr, mem::Counted<mem::Kind::ID_EXPR, IdExpr>
 {
 public:
   IdExpr(const IdExpr&) = default;
@@ -68,7 +98,7 @@ public:
   Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
 
   /// \return The identifier value.
-  inline Id id() const { return m_id; }
+  inline const Id &id() const { return m_id; }
 
   inline Ptr<Expr> dup() const override
   { return ptr<IdExpr>(id(), start(), end()); }
@@ -79,7 +109,8 @@ private:
 
 
 /// Integer literals.
-class IntExpr final: public Expr
+class IntExpr final:
+  public Expr, mem::Counted<mem::Kind::INT_EXPR, IntExpr>
 {
 public:
   IntExpr(const IntExpr&) = default;
@@ -108,7 +139,8 @@ private:
 
 
 /// Boolean literals.
-class BoolExpr final: public Expr
+class BoolExpr final:
+  public Expr, mem::Counted<mem::Kind::BOOL_EXPR, BoolExpr>
 {
 public:
   BoolExpr(const BoolExpr&) = default;
@@ -137,7 +169,8 @@ private:
 
 
 /// String literals.
-class StringExpr final: public Expr
+class StringExpr final:
+  public Expr, mem::Counted<mem::Kind::STRING_EXPR, StringExpr>
 {
 public:
   StringExpr(const StringExpr&) = default;
@@ -150,12 +183,12 @@ public:
 
   /// \param[in] val The value of this literal.
   StringExpr(String &&val, Pos start = Pos(), Pos end = Pos()):
-    Expr(start, end), m_val(ptr<String>(std::forward<String>(val)))
+    Expr(start, end), m_val(mem::string(std::forward<String>(val)))
   {}
 
   /// \param[in] val The value of this literal.
   StringExpr(const String &val, Pos start = Pos(), Pos end = Pos()):
-    Expr(start, end), m_val(ptr<String>(val))
+    Expr(start, end), m_val(mem::string(String(val)))
   {}
 
   /// \return ExprType::STRING
@@ -176,7 +209,8 @@ private:
 
 
 /// Application expression.
-class AppExpr final: public Expr
+class AppExpr final:
+  public Expr, mem::Counted<mem::Kind::APP_EXPR, AppExpr>
 {
 public:
   AppExpr(const AppExpr&) = default;
@@ -187,18 +221,17 @@ public:
     Expr(start, end), m_left(left), m_right(right)
   {}
 
+  ~AppExpr() { release(m_left); release(m_right); }
+
   /// \return ExprType::APP
   inline ExprType type() const override { return ExprType::APP; }
 
-  virtual Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
   /// \return The left part (operator).
   inline Ptr<Expr> left() const { return m_left; }
   /// \return The right part (operand).
   inline Ptr<Expr> right() const { return m_right; }
 
-  inline Ptr<Expr> dup() const override
-  { return ptr<AppExpr>(left()->dup(), right()->dup(), start(), end()); }
+  Ptr<Expr> dup() const override;
 
 private:
   Ptr<Expr> m_left;   ///< Operator.
@@ -207,7 +240,8 @@ private:
 
 
 /// Lambda term (function) expression.
-class LamExpr final: public Expr
+class LamExpr final:
+  public Expr, mem::Counted<mem::Kind::LAM_EXPR, LamExpr>
 {
 public:
   LamExpr(const LamExpr&) = default;
@@ -219,11 +253,11 @@ public:
     Expr(start, end), m_var(var), m_ty(ty), m_body(body), m_env(env)
   {}
 
+  ~LamExpr() { release(m_ty); release(m_body); }
+
   /// \return ExprType::LAM
   inline ExprType type() const override { return ExprType::LAM; }
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
   /// \return The bound variable.
   inline Id var() const { return m_var; }
   /// \return The argument type.
@@ -233,11 +267,10 @@ public:
 
   Ptr<Expr> apply(const Ptr<Expr>) const;
 
-  inline Ptr<Env<Expr>> env() { return m_env; }
+  inline Ptr<Env<Expr>> env() const { return m_env; }
   inline void set_env(Ptr<Env<Expr>> env) { m_env = env; }
 
-  inline Ptr<Expr> dup() const override
-  { return ptr<LamExpr>(var(), ty()->dup(), body()->dup(), start(), end()); }
+  Ptr<Expr> dup() const override;
 
 private:
   Id m_var;           ///< Bound variable.
@@ -249,7 +282,8 @@ private:
 };
 
 
-class IfExpr final: public Expr
+class IfExpr final:
+  public Expr, mem::Counted<mem::Kind::IF_EXPR, IfExpr>
 {
 public:
   IfExpr(const IfExpr&) = default;
@@ -261,6 +295,8 @@ public:
     Expr(start, end), m_cond(cond), m_then(thenCase), m_else(elseCase)
   {}
 
+  ~IfExpr() { release(m_cond); release(m_then); release(m_else); }
+
   inline Ptr<Expr> cond() const { return m_cond; }
   inline Ptr<Expr> thenCase() const { return m_then; }
   inline Ptr<Expr> elseCase() const { return m_else; }
@@ -268,13 +304,7 @@ public:
   /// \return ExprType::IF
   inline ExprType type() const override { return ExprType::IF; }
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
-  inline Ptr<Expr> dup() const override
-  {
-    return ptr<IfExpr>(cond()->dup(), thenCase()->dup(), elseCase()->dup(),
-                       start(), end());
-  }
+  Ptr<Expr> dup() const override;
 
 private:
   Ptr<Expr> m_cond, m_then, m_else;
@@ -282,7 +312,8 @@ private:
 
 
 /// Expressions with type annotations.
-class TypeExpr final: public Expr
+class TypeExpr final:
+  public Expr, mem::Counted<mem::Kind::TYPE_EXPR, TypeExpr>
 {
 public:
   TypeExpr(const TypeExpr&) = default;
@@ -293,18 +324,17 @@ public:
     Expr(start, end), m_expr(expr), m_ty(ty)
   {}
 
+  ~TypeExpr() { release(m_expr); release(m_ty); }
+
   /// \return ExprType::TYPE
   inline ExprType type() const override { return ExprType::TYPE; }
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
   /// \return The inner expression.
   inline Ptr<Expr> expr() const { return m_expr; }
   /// \return The assigned type.
   inline Ptr<Type> ty() const { return m_ty; }
 
-  inline Ptr<Expr> dup() const override
-  { return ptr<TypeExpr>(expr()->dup(), ty()->dup(), start(), end()); }
+  Ptr<Expr> dup() const override;
 
 private:
   Ptr<Expr> m_expr; ///< Expression.
@@ -313,7 +343,8 @@ private:
 
 
 /// Tuple expressions.
-class TupleExpr final: public Expr
+class TupleExpr final:
+  public Expr, mem::Counted<mem::Kind::TUPLE_EXPR, TupleExpr>
 {
 public:
   using Exprs = std::vector<Ptr<Expr>>;
@@ -331,21 +362,20 @@ public:
     TupleExpr(ptr<Exprs>(exprs), start, end)
   {}
 
+  ~TupleExpr()
+  {
+    if (m_exprs.use_count() == 1) {
+      for (auto &e: *m_exprs) release(e);
+    }
+  }
+
   /// \return `ExprType::TUPLE`
   inline ExprType type() const override { return ExprType::TUPLE; }
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
   /// The inner expressions.
   inline Ptr<Exprs> exprs() const { return m_exprs; }
 
-  inline Ptr<Expr> dup() const override
-  {
-    auto es = ptr<Exprs>();
-    es->reserve(exprs()->size());
-    for (auto e: *exprs()) { es->push_back(e->dup()); }
-    return ptr<TupleExpr>(es, start(), end());
-  }
+  Ptr<Expr> dup() const override;
 
 private:
   Ptr<Exprs> m_exprs;
@@ -353,7 +383,8 @@ private:
 
 
 /// Dot expressions, i.e. tuple projections
-class DotExpr final: public Expr
+class DotExpr final:
+  public Expr, mem::Counted<mem::Kind::DOT_EXPR, DotExpr>
 {
 public:
   DotExpr(const DotExpr&) = default;
@@ -364,18 +395,17 @@ public:
     Expr(start, end), m_expr(expr), m_index(index)
   {}
 
+  ~DotExpr() { release(m_expr); }
+
   /// \return `ExprType::DOT`
   inline ExprType type() const override { return ExprType::DOT; }
 
-  Ptr<Ppr> ppr(unsigned=0, bool pos = false) const override;
-
   /// Tuple expression
   inline Ptr<Expr> expr() const { return m_expr; }
   /// Which element to project
   inline unsigned index() const { return m_index; }
 
-  inline Ptr<Expr> dup() const override
-  { return ptr<DotExpr>(expr()->dup(), index(), start(), end()); }
+  Ptr<Expr> dup() const override;
 
 private:
   Ptr<Expr> m_expr;
@@ -387,7 +417,8 @@ private:
   * Builtin expressions for side effects or other things that can't be
   * expressed in the language itself.
   */
-class BuiltinExpr final: public Expr
+class BuiltinExpr final:
+  public Expr, mem::Counted<mem::Kind::BUILTIN_EXPR, BuiltinExpr>
 {
 public:
   /// Function arguments.
@@ -414,10 +445,15 @@ public:
   /// \sa #need_arg
   void give_arg(Ptr<Expr> arg);
 
+  /// Copy of this builtin with another argument given, leaving this one
+  /// untouched (it might be shared).
+  /// \sa #give_arg
+  Ptr<BuiltinExpr> with_arg(Ptr<Expr> arg) const;
+
   /// Run the effects. Make sure all arguments are given otherwise an
   /// assert will fail.
   /// \sa #need_arg \sa #give_arg
-  Ptr<Expr> run();
+  Ptr<Expr> run() const;
 
   /// \return `ExprType::BUILTIN`
   inline ExprType type() const override { return ExprType::BUILTIN; }
@@ -444,12 +480,372 @@ private:
 };
 
 
+/**
+ * Function values made when a lambda's typed IR is evaluated (\sa ir::eval):
+ * the lambda's IR with the values of the variables it captured.
+ */
+class ClosureExpr final:
+  public Expr, mem::Counted<mem::Kind::CLOSURE_EXPR, ClosureExpr>
+{
+public:
+  ClosureExpr(const ClosureExpr&) = default;
+  ClosureExpr(ClosureExpr&&) = default;
+
+  /// \param lam IR for the lambda, with #ir::Op::LAM.
+  /// \param frame Values of the enclosing lambdas' variables.
+  ClosureExpr(Ptr<ir::Node> lam, Ptr<ir::Frame> frame):
+    m_lam(lam), m_frame(frame)
+  {}
+
+  /// \return `ExprType::CLOSURE`
+  inline ExprType type() const override { return ExprType::CLOSURE; }
+
+  /// Prints the lambda the closure was made from.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override { return ptr<ClosureExpr>(*this); }
+
+  /// Type of the function.
+  Ptr<Type> ty() const;
+
+  inline Ptr<ir::Node> lam() const { return m_lam; }
+  inline Ptr<ir::Frame> frame() const { return m_frame; }
+
+  /// The lambda the closure was made from, with the captured variables
+  /// replaced by their values.
+  Ptr<Expr> source() const;
+
+private:
+  Ptr<ir::Node> m_lam;
+  Ptr<ir::Frame> m_frame;
+};
+
+
+/**
+ * Int arrays. There's no syntax for making them: they're made and used by
+ * builtins (\sa init_val_env), which work on the whole array at once.
+ * Elements can be read with `a.[i]` and changed in place with `a.[i] := x`
+ * (\sa IndexExpr). Copies share their elements, so a change made through one
+ * is seen through all of them.
+ */
+class ArrayExpr final:
+  public Expr, mem::Counted<mem::Kind::ARRAY_EXPR, ArrayExpr>
+{
+public:
+  using Elems = std::vector<long>;
+
+  ArrayExpr(const ArrayExpr&) = default;
+  ArrayExpr(ArrayExpr&&) = default;
+
+  ArrayExpr(Ptr<Elems> elems, Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_elems(elems)
+  {}
+
+  /// \return `ExprType::ARRAY`
+  inline ExprType type() const override { return ExprType::ARRAY; }
+
+  /// \param prec Ignored, since arrays are printed in brackets.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override
+  { return ptr<ArrayExpr>(elems(), start(), end()); }
+
+  /// The elements, which are only changed by assignments to elements.
+  inline Ptr<Elems> elems() const { return m_elems; }
+
+private:
+  Ptr<Elems> m_elems;
+};
+
+
+/**
+ * Reference cells, made by evaluating `ref e`. Copies share the cell, so an
+ * assignment through one is seen through all of them.
+ */
+class RefExpr final:
+  public Expr, mem::Counted<mem::Kind::REF_EXPR, RefExpr>
+{
+public:
+  RefExpr(const RefExpr&) = default;
+  RefExpr(RefExpr&&) = default;
+
+  /// A new cell holding \a val.
+  RefExpr(Ptr<Expr> val, Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_cell(ptr<Ptr<Expr>>(val))
+  {}
+
+  /// \return `ExprType::REF`
+  inline ExprType type() const override { return ExprType::REF; }
+
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override { return ptr<RefExpr>(*this); }
+
+  /// Current contents.
+  inline Ptr<Expr> get() const { return *m_cell; }
+  inline void set(Ptr<Expr> val) const { *m_cell = val; }
+  /// Which cell this is.
+  inline const void *cell() const { return m_cell.get(); }
+
+private:
+  Ptr<Ptr<Expr>> m_cell;
+};
+
+
+/// Keys of persistent maps: strings if #str is set, and ints otherwise.
+struct MapKey final
+{
+  long num;
+  Ptr<String> str;
+
+  inline bool operator==(const MapKey &other) const
+  {
+    return str? other.str && *str == *other.str:
+                !other.str && num == other.num;
+  }
+
+  inline bool operator<(const MapKey &other) const
+  { return str? *str < *other.str: num < other.num; }
+
+  struct Hash final
+  {
+    inline size_t operator()(const MapKey &k) const
+    { return k.str? std::hash<String>()(*k.str): std::hash<long>()(k.num); }
+  };
+};
+
+/**
+ * Persistent maps from ints or strings to ints. There's no syntax for them:
+ * they're made and used by builtins (\sa init_val_env). A map is never
+ * changed; inserting or removing makes a new one, which shares most of its
+ * nodes with the old one.
+ */
+class MapExpr final:
+  public Expr, mem::Counted<mem::Kind::MAP_EXPR, MapExpr>
+{
+public:
+  using Map = Hamt<MapKey, long, MapKey::Hash>;
+
+  MapExpr(const MapExpr&) = default;
+  MapExpr(MapExpr&&) = default;
+
+  /// \param strings Whether the keys are strings rather than ints.
+  MapExpr(bool strings, Map map = Map(), Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_strings(strings), m_map(map)
+  {}
+
+  /// \return `ExprType::MAP`
+  inline ExprType type() const override { return ExprType::MAP; }
+
+  /// \param prec Ignored, since maps are printed in brackets.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override { return ptr<MapExpr>(*this); }
+
+  inline bool strings() const { return m_strings; }
+  inline const Map &map() const { return m_map; }
+
+  /// The entries in order of their keys, for printing.
+  std::vector<std::pair<MapKey, long>> sorted() const;
+
+private:
+  bool m_strings;
+  Map m_map;
+};
+
+
+/**
+ * Suspended computations, made by evaluating `lazy e`: `e` isn't evaluated
+ * until the value is first forced (\sa UnOp::FORCE), and then what it gave
+ * is kept, so it's evaluated at most once. Copies share that, like reference
+ * cells.
+ */
+class LazyExpr final:
+  public Expr, mem::Counted<mem::Kind::LAZY_EXPR, LazyExpr>
+{
+public:
+  /// Evaluates the suspended expression, in the environment it was in.
+  using Thunk = std::function<Ptr<Expr>()>;
+
+  LazyExpr(const LazyExpr&) = default;
+  LazyExpr(LazyExpr&&) = default;
+
+  /// \param ty Type of the value, or `nullptr` if it isn't known (e.g. when
+  ///           made by the tree evaluator, which doesn't look at types).
+  LazyExpr(Thunk thunk, Ptr<Type> ty = nullptr,
+           Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_ty(ty), m_cell(ptr<Cell>(thunk))
+  {}
+
+  /// \return `ExprType::LAZY`
+  inline ExprType type() const override { return ExprType::LAZY; }
+
+  /// `<lazy>` until it's been forced, and `lazy v` after.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override { return ptr<LazyExpr>(*this); }
+
+  /// The value, evaluating it first if that hasn't been done. If evaluating
+  /// it fails, it's tried again next time. Forcing it again while it's
+  /// being evaluated is an error (\sa ThunkCycle), and other threads forcing
+  /// it at the same time wait for the first one.
+  Ptr<Expr> force() const;
+  /// Whether the value has been evaluated.
+  inline bool forced() const
+  { return m_cell->done.load(std::memory_order_acquire); }
+  /// The value if it's been evaluated, else `nullptr`.
+  inline Ptr<Expr> value() const { return forced()? m_cell->value: nullptr; }
+
+  /// Type of the value, if it's known.
+  inline Ptr<Type> ty() const { return m_ty; }
+
+private:
+  struct Cell final
+  {
+    Cell(Thunk thunk): thunk(thunk), done(false), running(false) {}
+
+    Thunk thunk;
+    Ptr<Expr> value;
+    /// Set once #value has been filled in.
+    std::atomic<bool> done;
+    /// Held while evaluating, since values can be shared between threads.
+    std::recursive_mutex mutex;
+    /// Set while evaluating, to catch a value which needs itself.
+    bool running;
+  };
+
+  Ptr<Type> m_ty;
+  Ptr<Cell> m_cell;
+};
+
+
+/// Streams of ints or strings, made by the `stream_` and `stringstream_`
+/// builtins. \sa Stream
+class StreamExpr final:
+  public Expr, mem::Counted<mem::Kind::STREAM_EXPR, StreamExpr>
+{
+public:
+  StreamExpr(const StreamExpr&) = default;
+  StreamExpr(StreamExpr&&) = default;
+
+  /// \param strings Whether the elements are strings rather than ints.
+  StreamExpr(bool strings, Ptr<const Stream> stream,
+             Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_strings(strings), m_stream(stream)
+  {}
+
+  /// \return `ExprType::STREAM`
+  inline ExprType type() const override { return ExprType::STREAM; }
+
+  /// `<stream>`, since the elements aren't there until it's consumed.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  inline Ptr<Expr> dup() const override { return ptr<StreamExpr>(*this); }
+
+  inline bool strings() const { return m_strings; }
+  inline const Ptr<const Stream> &stream() const { return m_stream; }
+
+private:
+  bool m_strings;
+  Ptr<const Stream> m_stream;
+};
+
+
+/// Unary operators. \sa UnOpExpr
+enum class UnOp
+{
+  REF,   ///< `ref e`, a new cell holding `e`
+  DEREF, ///< `!e`, the contents of the cell `e`
+  LAZY,  ///< `lazy e`, `e` suspended until it's forced (\sa LazyExpr)
+  FORCE, ///< `force e`, the value of the suspended computation `e`
+};
+
+/// Name of a unary operator as seen in the source.
+inline const Char *symbol(UnOp op)
+{
+  switch (op) {
+  case UnOp::REF:   return "ref";
+  case UnOp::DEREF: return "!";
+  case UnOp::LAZY:  return "lazy";
+  case UnOp::FORCE: return "force";
+#ifdef __GNUC__
+  default: std::abort();
+#endif
+  }
+}
+
+/// Name of a unary operator as seen in the source.
+inline Ptr<Ppr> name(UnOp op)
+{
+  return ppr::string(symbol(op));
+}
+
+/// Unary operator expressions.
+class UnOpExpr final:
+  public Expr, mem::Counted<mem::Kind::UNOP_EXPR, UnOpExpr>
+{
+public:
+  UnOpExpr(const UnOpExpr&) = default;
+  UnOpExpr(UnOpExpr&&) = default;
+
+  UnOpExpr(UnOp op, Ptr<Expr> expr, Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_op(op), m_expr(expr)
+  {}
+
+  ~UnOpExpr() { release(m_expr); }
+
+  /// \return `ExprType::UNOP`
+  inline ExprType type() const override { return ExprType::UNOP; }
+
+  Ptr<Expr> dup() const override;
+
+  /// Which operator this expression uses.
+  inline UnOp op() const { return m_op; }
+  /// Operand.
+  inline Ptr<Expr> expr() const { return m_expr; }
+
+private:
+  UnOp m_op;
+  Ptr<Expr> m_expr;
+};
+
+
+/// Array indexing `a.[i]`. As the left hand side of an assignment (\sa
+/// BinOp::ASSIGN) it's the element to change instead.
+class IndexExpr final:
+  public Expr, mem::Counted<mem::Kind::INDEX_EXPR, IndexExpr>
+{
+public:
+  IndexExpr(const IndexExpr&) = default;
+  IndexExpr(IndexExpr&&) = default;
+
+  IndexExpr(Ptr<Expr> array, Ptr<Expr> index,
+            Pos start = Pos(), Pos end = Pos()):
+    Expr(start, end), m_array(array), m_index(index)
+  {}
+
+  ~IndexExpr() { release(m_array); release(m_index); }
+
+  /// \return `ExprType::INDEX`
+  inline ExprType type() const override { return ExprType::INDEX; }
+
+  Ptr<Expr> dup() const override;
+
+  inline Ptr<Expr> array() const { return m_array; }
+  inline Ptr<Expr> index() const { return m_index; }
+
+private:
+  Ptr<Expr> m_array, m_index;
+};
+
+
 /// Operators. \sa OpExpr
 enum class BinOp
 {
   PLUS, MINUS, TIMES, DIVIDE,
   LESS, LEQ, EQUAL, GEQ, GREATER, NEQ,
   AND, OR, IFF,
+  ASSIGN, ///< `r := x` or `a.[i] := x`
   SEQ,
 };
 
@@ -462,22 +858,24 @@ inline unsigned prec(BinOp op)
   switch (op) {
   case BinOp::TIMES:
   case BinOp::DIVIDE:
-    return 7;
+    return 8;
   case BinOp::PLUS:
   case BinOp::MINUS:
-    return 6;
+    return 7;
   case BinOp::LESS:
   case BinOp::LEQ:
   case BinOp::EQUAL:
   case BinOp::GEQ:
   case BinOp::GREATER:
   case BinOp::NEQ:
-    return 5;
+    return 6;
   case BinOp::AND:
-    return 4;
+    return 5;
   case BinOp::OR:
-    return 3;
+    return 4;
   case BinOp::IFF:
+    return 3;
+  case BinOp::ASSIGN:
     return 2;
   case BinOp::SEQ:
     return 1;
@@ -488,29 +886,36 @@ inline unsigned prec(BinOp op)
 }
 
 /// Name of an operator as seen in the source.
-inline Ptr<Ppr> name(BinOp op)
+inline const Char *symbol(BinOp op)
 {
   switch (op) {
-  case BinOp::PLUS:    return '+'_p;
-  case BinOp::MINUS:   return '-'_p;
-  case BinOp::TIMES:   return '*'_p;
-  case BinOp::DIVIDE:  return '/'_p;
-  case BinOp::LESS:    return '<'_p;
-  case BinOp::LEQ:     return "<="_p;
-  case BinOp::EQUAL:   return "=="_p;
-  case BinOp::GEQ:     return ">="_p;
-  case BinOp::GREATER: return '>'_p;
-  case BinOp::NEQ:     return "!="_p;
-  case BinOp::AND:     return "&&"_p;
-  case BinOp::OR:      return "||"_p;
-  case BinOp::IFF:     return "<->"_p;
-  case BinOp::SEQ:     return ';'_p;
+  case BinOp::PLUS:    return "+";
+  case BinOp::MINUS:   return "-";
+  case BinOp::TIMES:   return "*";
+  case BinOp::DIVIDE:  return "/";
+  case BinOp::LESS:    return "<";
+  case BinOp::LEQ:     return "<=";
+  case BinOp::EQUAL:   return "==";
+  case BinOp::GEQ:     return ">=";
+  case BinOp::GREATER: return ">";
+  case BinOp::NEQ:     return "!=";
+  case BinOp::AND:     return "&&";
+  case BinOp::OR:      return "||";
+  case BinOp::IFF:     return "<->";
+  case BinOp::ASSIGN:  return ":=";
+  case BinOp::SEQ:     return ";";
 #ifdef __GNUC__
   default: std::abort();
 #endif
   }
 }
 
+/// Name of an operator as seen in the source.
+inline Ptr<Ppr> name(BinOp op)
+{
+  return ppr::string(symbol(op));
+}
+
 /// Associativity of operator.
 inline OpAssoc assoc(BinOp op)
 {
@@ -523,6 +928,7 @@ inline OpAssoc assoc(BinOp op)
   case BinOp::AND:
   case BinOp::OR:
   case BinOp::IFF:
+  case BinOp::ASSIGN:
     return OpAssoc::RIGHT;
   default:
     return OpAssoc::NONE;
@@ -530,7 +936,8 @@ inline OpAssoc assoc(BinOp op)
 }
 
 /// Binary operator expressions. \sa OpType
-class BinOpExpr final: public Expr
+class BinOpExpr final:
+  public Expr, mem::Counted<mem::Kind::BINOP_EXPR, BinOpExpr>
 {
 public:
   BinOpExpr(const BinOpExpr&) = default;
@@ -541,13 +948,12 @@ public:
     Expr(start, end), m_op(op), m_left(left), m_right(right)
   {}
 
+  ~BinOpExpr() { release(m_left); release(m_right); }
+
   /// \return ExprType::BINOP
   inline ExprType type() const override { return ExprType::BINOP; }
 
-  virtual Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
-  inline Ptr<Expr> dup() const override
-  { return ptr<BinOpExpr>(op(), left()->dup(), right()->dup()); }
+  Ptr<Expr> dup() const override;
 
   /// Which operator this expression uses.
   inline BinOp op() const { return m_op; }
@@ -562,18 +968,27 @@ private:
 };
 
 
-template <typename T, typename... Args>
+/**
+ * Passes which do something different for each class of expression. A pass
+ * `D` derives from `ExprVisitor<D, R, Args...>` and defines, for each class,
+ *
+ *     R v(const IdExpr&, const Ptr<Expr> &self, const Args&...);
+ *
+ * where `self` is the same expression again, for passes which give it back
+ * or keep hold of it. #operator() picks the overload by the expression's
+ * type and calls it directly: there are no virtual calls or RTTI lookups,
+ * the pointer isn't copied, and the compiler can inline the whole thing.
+ */
+template <typename D, typename R, typename... Args>
 struct ExprVisitor
 {
-  inline Ptr<T> operator()(Ptr<Expr> e, Args... args)
-  { return v(e, args...); }
-
-  virtual Ptr<T> v(Ptr<Expr> e, Args... args)
+  inline R operator()(const Ptr<Expr> &e, const Args&... args)
   {
+    auto &d = static_cast<D&>(*this);
     switch (e->type()) {
 #define CASE(x,t) \
       case ExprType::x: \
-        return v(std::dynamic_pointer_cast<t>(e), args...);
+        return d.v(static_cast<const t&>(*e), e, args...);
       CASE(ID,      IdExpr)
       CASE(APP,     AppExpr)
       CASE(LAM,     LamExpr)
@@ -586,25 +1001,29 @@ struct ExprVisitor
       CASE(TUPLE,   TupleExpr)
       CASE(DOT,     DotExpr)
       CASE(BUILTIN, BuiltinExpr)
+      CASE(CLOSURE, ClosureExpr)
+      CASE(ARRAY,   ArrayExpr)
+      CASE(UNOP,    UnOpExpr)
+      CASE(INDEX,   IndexExpr)
+      CASE(REF,     RefExpr)
+      CASE(MAP,     MapExpr)
+      CASE(LAZY,    LazyExpr)
+      CASE(STREAM,  StreamExpr)
 #undef CASE
 #ifdef __GNUC__
       default: std::abort();
 #endif
     }
   }
+};
 
-  virtual Ptr<T> v(Ptr<IdExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<AppExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<IntExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<BoolExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<StringExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<LamExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<IfExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<TypeExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<BinOpExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<TupleExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<DotExpr>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<BuiltinExpr>, Args...) = 0;
+/// Subexpressions, in the order they're evaluated, and the arguments a
+/// builtin has been given.
+template <>
+struct Tree<Expr> final
+{
+  static size_t arity(const Expr&);
+  static Ptr<Expr> child(const Expr&, size_t);
 };
 
 /// Free variables of an expression.
@@ -0,0 +1,130 @@
+#ifndef POOL_HXX_W2K8RJ5E
+#define POOL_HXX_W2K8RJ5E
+
+#include "ast/expr.hxx"
+#include "ast/type.hxx"
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace miniml
+{
+
+/**
+ * Flat representation of expressions. All the nodes added to a pool (e.g.
+ * all the definitions in a module) live in one contiguous array, tagged with
+ * their ExprType, and refer to their children by 32-bit index instead of
+ * being separate heap objects holding shared pointers to each other.
+ *
+ * It's what the IR keeps of the code it was typechecked from (\sa ir::Src),
+ * for the names of globals, positions for profiles and traces, and printing,
+ * so that the expression trees can be freed once they've been typechecked.
+ *
+ * Identifiers, strings and types are stored once each in side tables.
+ * Positions are kept out of the way in a separate array, since they're only
+ * needed for error messages and profiles, along with the Source each of them
+ * is in.
+ */
+class ExprPool final
+{
+public:
+  /// Index of a node in the pool.
+  using Ref = std::uint32_t;
+
+  /// A node. What the fields mean depends on the #kind:
+  ///   - `ID`: #a is the identifier's index.
+  ///   - `INT`: #a and #b are the low and high halves of the value.
+  ///   - `BOOL`: #a is the value.
+  ///   - `STRING`: #a is the string's index.
+  ///   - `APP`: #a and #b are the operator and operand.
+  ///   - `LAM`: #a, #b and #c are the variable, type and body.
+  ///   - `IF`: #a, #b and #c are the condition and branches.
+  ///   - `TYPE`: #a is the expression and #b the type.
+  ///   - `BINOP`: #op is the operator, #a and #b the operands.
+  ///   - `TUPLE`: the elements are #b list entries starting at #a.
+  ///   - `DOT`: #a is the tuple and #b the index.
+  ///   - `UNOP`: #op is the operator and #a the operand.
+  ///   - `INDEX`: #a and #b are the array and index.
+  ///   - anything else is a runtime value, and #a indexes those.
+  struct Node final
+  {
+    std::uint8_t kind, op;
+    std::uint16_t pad;
+    Ref a, b, c;
+
+    inline ExprType type() const { return ExprType(kind); }
+  };
+
+  ExprPool() = default;
+  ExprPool(const ExprPool&) = delete;
+  ExprPool &operator=(const ExprPool&) = delete;
+  ~ExprPool();
+
+  /// Flatten an expression into the pool. Its nodes are numbered from the
+  /// root, each before its children, in the order a \ref Walk visits them
+  /// (and the arguments a builtin value has been given come after it, as if
+  /// they were its children).
+  /// \return The index of its root.
+  Ref add(const Ptr<Expr>&);
+  /// Free the room left for adding more, once everything has been, and
+  /// count what's left as mem::Kind::POOL.
+  void shrink();
+
+  inline const Node &operator[](Ref r) const { return m_nodes[r]; }
+  inline size_t size() const { return m_nodes.size(); }
+
+  inline const Id &id(Ref r) const { return m_ids[r]; }
+  inline Ptr<String> string(Ref r) const { return m_strings[r]; }
+  inline Ptr<Type> type(Ref r) const { return m_types[r]; }
+  /// Element \a i of a `TUPLE` node.
+  inline Ref elem(const Node &n, Ref i) const { return m_lists[n.a + i]; }
+  /// Value of an `INT` node.
+  inline long int_val(const Node &n) const
+  { return long(std::uint64_t(n.a) | std::uint64_t(n.b) << 32); }
+
+  /// Source positions of a node.
+  inline Pos start(Ref r) const { return Pos(m_spans[r].first); }
+  inline Pos end(Ref r) const { return Pos(m_spans[r].second); }
+  /// The source a node is in, if it's anywhere.
+  Ptr<const Source> source(Ref) const;
+
+  /// Rebuild an ordinary expression from a node and its descendants, e.g.
+  /// to print it.
+  Ptr<Expr> expr(Ref) const;
+
+  /// Bytes used by the pool, including the side tables.
+  size_t bytes() const;
+
+private:
+  Ref node(const Expr&);
+  Ref intern(const Id&);
+  Ref type_ref(Ptr<Type>);
+  /// Subexpressions of a node, like Tree<Expr>.
+  Ref arity(const Node&) const;
+  Ref child(const Node&, Ref) const;
+
+  std::vector<Node> m_nodes;
+  /// Start & end offset of each node.
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> m_spans;
+  /// Tuple elements.
+  std::vector<Ref> m_lists;
+
+  std::vector<Id> m_ids;
+  /// Index of each identifier in #m_ids, only until #shrink.
+  std::unordered_map<Id, Ref> m_id_index;
+  std::vector<Ptr<String>> m_strings;
+  std::vector<Ptr<Type>> m_types;
+  /// Runtime values, e.g. builtins, which are kept as they are.
+  std::vector<Ptr<Expr>> m_values;
+  /// Sources the positions are in, kept so they can still be found.
+  std::vector<Ptr<const Source>> m_sources;
+
+  /// Bytes counted by #shrink.
+  size_t m_counted = 0;
+};
+
+
+}
+
+#endif /* end of include guard: POOL_HXX_W2K8RJ5E */
@@ -6,8 +6,10 @@
 #include "dup.hxx"
 #include "id.hxx"
 #include "ppr.hxx"
+#include "mem.hxx"
 #include "env.hxx"
 #include "visitor.hxx"
+#include "walk.hxx"
 #include <vector>
 
 namespace miniml
@@ -22,6 +24,11 @@ enum class TypeType
   STRING,
   ARROW,
   TUPLE,
+  ARRAY,
+  REF,
+  MAP,
+  LAZY,
+  STREAM,
 };
 
 /// Base class for types.
@@ -32,13 +39,22 @@ public:
   virtual TypeType type() const = 0;
   virtual bool operator==(const Type &other) const = 0;
   inline bool operator!=(const Type &other) const { return !(*this == other); }
+
+  using Pretty::ppr;
+  /// Subclasses with subtypes don't override this, so that they're all
+  /// printed together by one \ref Walk.
+  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
+
+  /// Like #ppr, but streamed and laid out to fit the stream's width.
+  void print(PprStream&, unsigned prec = 0) const override;
 protected:
   inline Type(Pos start = Pos(), Pos end = Pos()): HasPos(start, end) {}
 };
 
 
 /// Type names (other than `int`/`string`/`bool`).
-class IdType final: public Type
+class IdType final:
+  public Type, mem::Counted<mem::Kind::TYPE, IdType>
 {
 public:
   IdType(const IdType &other) = default;
@@ -58,7 +74,7 @@ public:
   inline Ptr<Type> dup() const override
   { return ptr<IdType>(id(), start(), end()); }
 
-  inline Id id() const { return m_id; }
+  inline const Id &id() const { return m_id; }
 
 private:
   Id m_id;
@@ -66,7 +82,8 @@ private:
 
 
 /// Integer type.
-class IntType final: public Type
+class IntType final:
+  public Type, mem::Counted<mem::Kind::TYPE, IntType>
 {
 public:
   IntType(const IntType &other) = default;
@@ -88,7 +105,8 @@ public:
 
 
 /// Boolean type.
-class BoolType final: public Type
+class BoolType final:
+  public Type, mem::Counted<mem::Kind::TYPE, BoolType>
 {
 public:
   BoolType(const BoolType &other) = default;
@@ -110,7 +128,8 @@ public:
 
 
 /// String type.
-class StringType final: public Type
+class StringType final:
+  public Type, mem::Counted<mem::Kind::TYPE, StringType>
 {
 public:
   StringType(const StringType &other) = default;
@@ -132,7 +151,8 @@ public:
 
 
 /// Arrow type `a -> b`.
-class ArrowType final: public Type
+class ArrowType final:
+  public Type, mem::Counted<mem::Kind::TYPE, ArrowType>
 {
 public:
   ArrowType(const ArrowType &other) = default;
@@ -143,14 +163,13 @@ public:
     Type(start, end), m_left(left), m_right(right)
   {}
 
+  ~ArrowType() { release(m_left); release(m_right); }
+
   inline TypeType type() const override { return TypeType::ARROW; }
 
   bool operator==(const Type &other) const override;
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
-  inline Ptr<Type> dup() const override
-  { return ptr<ArrowType>(left()->dup(), right()->dup(), start(), end()); }
+  Ptr<Type> dup() const override;
 
   /// Domain.
   inline Ptr<Type> left() const { return m_left; }
@@ -163,7 +182,8 @@ private:
 
 
 /// Tuple type `(a, b, c)`.
-class TupleType final: public Type
+class TupleType final:
+  public Type, mem::Counted<mem::Kind::TYPE, TupleType>
 {
 public:
   using Types = std::vector<Ptr<Type>>;
@@ -181,12 +201,17 @@ public:
     Type(start, end), m_tys(tys)
   {}
 
+  ~TupleType()
+  {
+    if (m_tys.use_count() == 1) {
+      for (auto &t: *m_tys) release(t);
+    }
+  }
+
   inline TypeType type() const override { return TypeType::TUPLE; }
 
   bool operator==(const Type &other) const override;
 
-  Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const override;
-
   inline Ptr<Type> dup() const override
   { return ptr<TupleType>(ptr<Types>(*tys())); }
 
@@ -198,36 +223,185 @@ private:
 };
 
 
-template <typename T, typename... Args>
-struct TypeVisitor
+/// Array type `a array`.
+class ArrayType final:
+  public Type, mem::Counted<mem::Kind::TYPE, ArrayType>
+{
+public:
+  ArrayType(const ArrayType&) = default;
+  ArrayType(ArrayType&&) = default;
+
+  ArrayType(Ptr<Type> elem, Pos start = Pos(), Pos end = Pos()):
+    Type(start, end), m_elem(elem)
+  {}
+
+  ~ArrayType() { release(m_elem); }
+
+  inline TypeType type() const override { return TypeType::ARRAY; }
+
+  bool operator==(const Type &other) const override;
+
+  Ptr<Type> dup() const override;
+
+  /// Type of the elements.
+  inline Ptr<Type> elem() const { return m_elem; }
+
+private:
+  Ptr<Type> m_elem;
+};
+
+
+/// Reference type `a ref`.
+class RefType final:
+  public Type, mem::Counted<mem::Kind::TYPE, RefType>
+{
+public:
+  RefType(const RefType&) = default;
+  RefType(RefType&&) = default;
+
+  RefType(Ptr<Type> elem, Pos start = Pos(), Pos end = Pos()):
+    Type(start, end), m_elem(elem)
+  {}
+
+  ~RefType() { release(m_elem); }
+
+  inline TypeType type() const override { return TypeType::REF; }
+
+  bool operator==(const Type &other) const override;
+
+  Ptr<Type> dup() const override;
+
+  /// Type of the contents.
+  inline Ptr<Type> elem() const { return m_elem; }
+
+private:
+  Ptr<Type> m_elem;
+};
+
+
+/// Persistent map type `k map`, from keys of type `k` (`int` or `string`)
+/// to ints.
+class MapType final:
+  public Type, mem::Counted<mem::Kind::TYPE, MapType>
+{
+public:
+  MapType(const MapType&) = default;
+  MapType(MapType&&) = default;
+
+  MapType(Ptr<Type> key, Pos start = Pos(), Pos end = Pos()):
+    Type(start, end), m_key(key)
+  {}
+
+  ~MapType() { release(m_key); }
+
+  inline TypeType type() const override { return TypeType::MAP; }
+
+  bool operator==(const Type &other) const override;
+
+  Ptr<Type> dup() const override;
+
+  /// Type of the keys.
+  inline Ptr<Type> key() const { return m_key; }
+
+private:
+  Ptr<Type> m_key;
+};
+
+
+/// Type `a lazy` of suspended computations of an `a`. \sa LazyExpr
+class LazyType final:
+  public Type, mem::Counted<mem::Kind::TYPE, LazyType>
+{
+public:
+  LazyType(const LazyType&) = default;
+  LazyType(LazyType&&) = default;
+
+  LazyType(Ptr<Type> elem, Pos start = Pos(), Pos end = Pos()):
+    Type(start, end), m_elem(elem)
+  {}
+
+  ~LazyType() { release(m_elem); }
+
+  inline TypeType type() const override { return TypeType::LAZY; }
+
+  bool operator==(const Type &other) const override;
+
+  Ptr<Type> dup() const override;
+
+  /// Type of the value once it's forced.
+  inline Ptr<Type> elem() const { return m_elem; }
+
+private:
+  Ptr<Type> m_elem;
+};
+
+
+/// Type `a stream` of lazy sequences of `a`s. \sa StreamExpr
+class StreamType final:
+  public Type, mem::Counted<mem::Kind::TYPE, StreamType>
 {
-  inline Ptr<T> operator()(Ptr<Type> t, Args... args)
-  { return v(t, args...); }
+public:
+  StreamType(const StreamType&) = default;
+  StreamType(StreamType&&) = default;
+
+  StreamType(Ptr<Type> elem, Pos start = Pos(), Pos end = Pos()):
+    Type(start, end), m_elem(elem)
+  {}
+
+  ~StreamType() { release(m_elem); }
+
+  inline TypeType type() const override { return TypeType::STREAM; }
+
+  bool operator==(const Type &other) const override;
 
-  virtual Ptr<T> v(Ptr<Type> t, Args... args)
+  Ptr<Type> dup() const override;
+
+  inline Ptr<Type> elem() const { return m_elem; }
+
+private:
+  Ptr<Type> m_elem;
+};
+
+
+/// Passes which do something different for each class of type, called
+/// without virtual dispatch in the same way as \ref ExprVisitor: the pass
+/// `D` defines `R v(const IdType&, const Ptr<Type> &self, const Args&...)`
+/// and so on.
+template <typename D, typename R, typename... Args>
+struct TypeVisitor
+{
+  inline R operator()(const Ptr<Type> &t, const Args&... args)
   {
+    auto &d = static_cast<D&>(*this);
     switch (t->type()) {
 #define CASE(x,T) \
       case TypeType::x: \
-        return v(std::dynamic_pointer_cast<T>(t), args...)
+        return d.v(static_cast<const T&>(*t), t, args...)
       CASE(ID, IdType);
       CASE(INT, IntType);
       CASE(STRING, StringType);
       CASE(BOOL, BoolType);
       CASE(ARROW, ArrowType);
       CASE(TUPLE, TupleType);
+      CASE(ARRAY, ArrayType);
+      CASE(REF, RefType);
+      CASE(MAP, MapType);
+      CASE(LAZY, LazyType);
+      CASE(STREAM, StreamType);
 #undef CASE
 #ifdef __GNUC__
       default: std::abort();
 #endif
     }
   }
-  virtual Ptr<T> v(Ptr<IdType>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<IntType>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<BoolType>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<StringType>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<ArrowType>, Args...) = 0;
-  virtual Ptr<T> v(Ptr<TupleType>, Args...) = 0;
+};
+
+/// Subtypes of arrow, tuple, array, reference, map, lazy and stream types.
+template <>
+struct Tree<Type> final
+{
+  static size_t arity(const Type&);
+  static Ptr<Type> child(const Type&, size_t);
 };
 
 /// Reduce a type to normal form, substituting names as given.
@@ -3,6 +3,7 @@
 
 #include "id.hxx"
 #include "ptr.hxx"
+#include "mem.hxx"
 #include <functional>
 #include <unordered_map>
 
@@ -27,15 +28,23 @@ public:
 
 /// Normal environments backed by a map data structure.
 template <typename T>
-class Env final: public EnvBase<T>
+class Env final: public EnvBase<T>, mem::Counted<mem::Kind::ENV, Env<T>>
 {
 public:
-  Env(const Ptr<EnvBase<T>> next): m_next(next) {}
+  Env(const Ptr<EnvBase<T>> next):
+    m_next(next), m_next_env(dynamic_cast<const Env*>(next.get()))
+  {}
   Env(): Env(nullptr) {}
+  ~Env()
+  {
+    auto n = m_elements.size();
+    mem::remove(mem::Kind::BINDING, n * binding_size, n);
+  }
 
   Ptr<T> lookup(const Id&) const override;
 
-  /// Add a new binding.
+  /// Add a new binding, replacing any existing one for the same name in this
+  /// layer.
   void insert(const Id&, const Ptr<T>);
 
   void debug() const
@@ -48,26 +57,46 @@ public:
   }
 
 private:
-  std::unordered_map<Id, Ptr<T>, std::hash<Id>> m_elements;
+  using Map = std::unordered_map<Id, Ptr<T>, std::hash<Id>>;
+
+  /// Bytes used by a binding: its key and value, and roughly what the map
+  /// needs to keep it.
+  static const size_t binding_size =
+    sizeof(typename Map::value_type) + 2 * sizeof(void*);
+
+  Map m_elements;
   const Ptr<EnvBase<T>> m_next;
+  /// #m_next, if it's another Env.
+  const Env *const m_next_env;
 };
 
 
 template <typename T>
 Ptr<T> Env<T>::lookup(const Id &id) const
 {
-  auto it = m_elements.find(id);
-  if (it == m_elements.end()) {
-    return m_next? m_next->lookup(id): nullptr;
-  } else {
-    return it->second;
+  // scopes can be nested very deeply, so go through the layers in a loop
+  auto env = this;
+  for (;;) {
+    auto it = env->m_elements.find(id);
+    if (it != env->m_elements.end()) {
+      return it->second;
+    } else if (env->m_next_env) {
+      env = env->m_next_env;
+    } else {
+      return env->m_next? env->m_next->lookup(id): nullptr;
+    }
   }
 }
 
 template <typename T>
 void Env<T>::insert(const Id &id, const Ptr<T> val)
 {
-  m_elements.insert(std::make_pair(id, val));
+  auto it = m_elements.emplace(id, val);
+  if (it.second) {
+    mem::add(mem::Kind::BINDING, binding_size);
+  } else {
+    it.first->second = val;
+  }
 }
 
 
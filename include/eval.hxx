@@ -2,6 +2,8 @@
 #define EVAL_HXX_F63P7CXN
 
 #include "ast.hxx"
+#include "eval/budget.hxx"
+#include "eval/exception.hxx"
 
 namespace miniml
 {
@@ -9,6 +11,10 @@ namespace miniml
 /// Evaluate an expression with the given value environment.
 Ptr<Expr> eval(Ptr<Expr>, Ptr<Env<Expr>>);
 
+/// Apply an evaluated function (a lambda, closure or builtin) to an evaluated
+/// argument.
+Ptr<Expr> apply(Ptr<Expr> fn, Ptr<Expr> arg);
+
 }
 
 #endif /* end of include guard: EVAL_HXX_F63P7CXN */
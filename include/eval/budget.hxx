@@ -0,0 +1,175 @@
+#ifndef BUDGET_HXX_P7WN3XGE
+#define BUDGET_HXX_P7WN3XGE
+
+#include "../ptr.hxx"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace miniml
+{
+
+/// Flag which any thread can set to stop the evaluations watching it.
+/// \sa Budget
+class CancelToken final
+{
+public:
+  inline void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+  inline void reset() { m_cancelled.store(false, std::memory_order_relaxed); }
+  inline bool cancelled() const
+  { return m_cancelled.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<bool> m_cancelled {false};
+};
+
+
+/// How much one evaluation is allowed to do. 0 means no limit.
+struct EvalLimits final
+{
+  /// IR nodes run.
+  unsigned long steps = 0;
+  /// Growth in the bytes counted by mem on the evaluating thread.
+  size_t heap = 0;
+  /// Calls of lambdas inside each other.
+  unsigned depth = 0;
+  /// Wall clock time.
+  std::chrono::milliseconds time {0};
+};
+
+
+/**
+ * While a Budget is alive, evaluation on its thread is held to some
+ * EvalLimits, and stops with LimitExceeded when it goes over one, or with
+ * Cancelled when its CancelToken is set. Either way the exception unwinds
+ * out of the evaluator like any other EvalException, and nothing is added
+ * to the environment.
+ *
+ * Steps and depth are checked every time; the heap, the clock and the token
+ * every #check_every steps, and the heap also before big allocations (\sa
+ * #reserve).
+ *
+ * Whether there's a budget or not, a Call (or #check_stack) also stops with
+ * LimitExceeded when less than #stack_headroom of the thread's stack is
+ * left, rather than letting deep recursion overflow it.
+ *
+ * A budget started inside another one, by `use`, only gets what's left of
+ * the outer one, and the steps it takes count towards the outer one too.
+ */
+class Budget final
+{
+public:
+  static const unsigned long check_every = 256;
+  /// Stack kept free by Call (or an eighth of the stack, if that's more),
+  /// for the builtins, printing and unwinding.
+  static const size_t stack_headroom = 256 * 1024;
+
+  /// \param cancel Token to watch, if any, or else the outer budget's. It
+  ///               isn't reset.
+  Budget(const EvalLimits&, Ptr<CancelToken> cancel = nullptr);
+  ~Budget();
+
+  Budget(const Budget&) = delete;
+  Budget &operator=(const Budget&) = delete;
+
+  /// Whether evaluation on this thread is held to a budget already.
+  static inline bool active() { return s_current; }
+
+  /// Count a step of the evaluation on this thread.
+  static inline void step() { if (s_current) s_current->take_step(); }
+  /// Count \a n steps at once, for work done in bulk.
+  static inline void steps(unsigned long n)
+  { if (s_current) s_current->take_steps(n); }
+
+  /// Check that \a bytes more can be allocated on this thread, before they
+  /// are.
+  static void reserve(size_t bytes);
+
+  /// Check there's enough of this thread's stack left to go deeper.
+  static inline void check_stack()
+  {
+    char here;
+    if (!s_stack_limit) find_stack_limit();
+    if (reinterpret_cast<std::uintptr_t>(&here) < s_stack_limit)
+      stack_exceeded();
+  }
+
+  /// While alive, evaluation on this thread is one call deeper.
+  class Call final
+  {
+  public:
+    inline Call(): m_budget(s_current)
+    {
+      check_stack();
+      if (m_budget) m_budget->enter();
+    }
+    inline ~Call() { if (m_budget) --m_budget->m_depth; }
+
+    Call(const Call&) = delete;
+    Call &operator=(const Call&) = delete;
+
+  private:
+    Budget *m_budget;
+  };
+
+private:
+  enum Limit { STEPS, HEAP, DEPTH, TIME };
+
+  /// Set #s_stack_limit for this thread.
+  static void find_stack_limit();
+  [[noreturn]] static void stack_exceeded();
+
+  inline void take_step()
+  {
+    if (++m_steps > m_limits.steps && m_limits.steps) exceeded(STEPS);
+    if (m_steps % check_every == 0) check();
+  }
+
+  inline void take_steps(unsigned long n)
+  {
+    auto before = m_steps;
+    m_steps += n;
+    if (m_steps > m_limits.steps && m_limits.steps) exceeded(STEPS);
+    if (m_steps / check_every != before / check_every) check();
+  }
+
+  inline void enter()
+  {
+    if (++m_depth > m_limits.depth && m_limits.depth) {
+      --m_depth;
+      exceeded(DEPTH);
+    }
+  }
+
+  /// Cut the limits down to what's left of the outer budget's.
+  void inherit();
+  /// Check the heap, the clock and the token.
+  void check();
+  /// Throw for going over a limit, which says what the limit was, even if
+  /// this budget only got part of it from the outer one.
+  [[noreturn]] void exceeded(Limit) const;
+
+  EvalLimits m_limits;
+  Ptr<CancelToken> m_cancel;
+  std::chrono::steady_clock::time_point m_deadline;
+  /// mem::thread_bytes when the budget started.
+  long m_heap_start;
+  unsigned long m_steps = 0;
+  unsigned m_depth = 0;
+  /// Bit for each Limit which is what was left of the outer budget's.
+  unsigned m_inherited = 0;
+
+  /// The budget this one is inside of, if any.
+  Budget *m_prev;
+  static thread_local Budget *s_current;
+  /// Address below which this thread's stack is too nearly full to call
+  /// anything, 1 if it's not known, or 0 until it's been looked for.
+  static thread_local std::uintptr_t s_stack_limit;
+  /// Size of this thread's stack, if it's known.
+  static thread_local size_t s_stack_size;
+};
+
+}
+
+#endif /* end of include guard: BUDGET_HXX_P7WN3XGE */
@@ -0,0 +1,108 @@
+#ifndef EXCEPTION_HXX_W5KD2RQB
+#define EXCEPTION_HXX_W5KD2RQB
+
+#include "../exception.hxx"
+#include "../id.hxx"
+#include "../ppr.hxx"
+#include <string>
+
+namespace miniml
+{
+
+/// Errors which stop a program while it's being evaluated.
+struct EvalException: public Exception
+{
+  virtual ~EvalException() noexcept {}
+  inline const char *what() const noexcept override { return msg.c_str(); }
+  String msg;
+};
+
+/// An array was indexed outside its bounds.
+struct OutOfBounds final: public EvalException
+{
+  OutOfBounds(long index, size_t size)
+  {
+    msg = "array index " + *ppr::num(index)->string() +
+          " out of bounds for an array of length " + std::to_string(size);
+  }
+};
+
+/// An array was asked for with a negative length.
+struct NegativeLength final: public EvalException
+{
+  NegativeLength(long length)
+  {
+    msg = "negative array length " + *ppr::num(length)->string();
+  }
+};
+
+/// An array was asked for which is too big to allocate.
+struct OutOfMemory final: public EvalException
+{
+  OutOfMemory(size_t length)
+  {
+    msg = "out of memory for an array of length " + std::to_string(length);
+  }
+};
+
+/// Arrays combined element by element have different lengths.
+struct LengthMismatch final: public EvalException
+{
+  LengthMismatch(size_t l, size_t r)
+  {
+    msg = "array lengths differ: " + std::to_string(l) + " and " +
+          std::to_string(r);
+  }
+};
+
+/// A key was looked up in a map which doesn't have it.
+struct NotFound final: public EvalException
+{
+  NotFound(const String &key)
+  {
+    msg = "key " + key + " not found in map";
+  }
+};
+
+/// A file a stream reads from couldn't be opened. \sa stream::lines
+struct FileError final: public EvalException
+{
+  FileError(const String &file)
+  {
+    msg = "couldn't read file " + file;
+  }
+};
+
+/// A lazy or recursive definition needs its own value. \sa EnvEntry::force
+struct LazyCycle final: public EvalException
+{
+  LazyCycle(const Id &name)
+  {
+    msg = "the definition of " + *name.val() + " depends on itself";
+  }
+};
+
+/// A `lazy` expression's value needs itself. \sa LazyExpr::force
+struct ThunkCycle final: public EvalException
+{
+  ThunkCycle() { msg = "a lazy value was forced while it was being computed"; }
+};
+
+/// An evaluation went over one of its limits. \sa Budget
+struct LimitExceeded final: public EvalException
+{
+  LimitExceeded(const String &limit)
+  {
+    msg = "evaluation stopped after using its limit of " + limit;
+  }
+};
+
+/// An evaluation was cancelled from outside. \sa CancelToken
+struct Cancelled final: public EvalException
+{
+  Cancelled() { msg = "evaluation cancelled"; }
+};
+
+}
+
+#endif /* end of include guard: EXCEPTION_HXX_W5KD2RQB */
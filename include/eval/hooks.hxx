@@ -0,0 +1,98 @@
+#ifndef HOOKS_HXX_T2LW9XRM
+#define HOOKS_HXX_T2LW9XRM
+
+#include "../ptr.hxx"
+
+namespace miniml
+{
+
+class Expr;
+class BuiltinExpr;
+
+/**
+ * Policies for watching the evaluators, which are templates over one (see
+ * #EvalHooks for which is used). A policy is a class with these static
+ * members, where `src` is the expression a node came from, so `src.start()`
+ * and `src.end()` are where it is in the source:
+ *
+ *     static constexpr bool enabled;
+ *     // before evaluating a node (of the IR, or an expression)
+ *     static void enter(const Expr &src);
+ *     // after, with its value
+ *     static void leave(const Expr &src, const Ptr<Expr> &val);
+ *     // instead of leave, when it's left by an exception
+ *     static void unwind(const Expr &src);
+ *     // before running the body of the lambda \a fn, given \a arg (the last
+ *     // of them, if a call gives it several at once)
+ *     static void call(const Expr &fn, const Ptr<Expr> &arg);
+ *     // after, with what it returned (not if it threw)
+ *     static void ret(const Expr &fn, const Ptr<Expr> &val);
+ *     // before running a builtin which has all its arguments
+ *     static void builtin(const BuiltinExpr&);
+ *
+ * The evaluators only call #enter, #leave and #unwind (and so only keep
+ * hold of the value, or catch anything) if `enabled`, and otherwise the
+ * calls are empty and inline, so with None they compile to what they'd be
+ * without any hooks at all.
+ */
+namespace hooks
+{
+  /// No hooks: the default.
+  struct None
+  {
+    static constexpr bool enabled = false;
+    static inline void enter(const Expr&) {}
+    static inline void leave(const Expr&, const Ptr<Expr>&) {}
+    static inline void unwind(const Expr&) {}
+    static inline void call(const Expr&, const Ptr<Expr>&) {}
+    static inline void ret(const Expr&, const Ptr<Expr>&) {}
+    static inline void builtin(const BuiltinExpr&) {}
+  };
+
+  /// Writes a line to `std::clog` for every hook, indented by how deeply
+  /// nested the node is: `> line:col expr` on entering one, `< line:col =
+  /// value` on leaving it, `! line:col` when an exception leaves it, `call
+  /// line:col arg` and `return value` around lambda bodies, and `builtin
+  /// type`. Expressions and values are cut short to fit on a line.
+  struct Trace
+  {
+    static constexpr bool enabled = true;
+    static void enter(const Expr &src);
+    static void leave(const Expr &src, const Ptr<Expr> &val);
+    static void unwind(const Expr &src);
+    static void call(const Expr &fn, const Ptr<Expr> &arg);
+    static void ret(const Expr &fn, const Ptr<Expr> &val);
+    static void builtin(const BuiltinExpr&);
+  };
+
+  /// A single-step debugger: traces like Trace, and stops before each node
+  /// to read a command from the terminal (`/dev/tty`, so not the REPL's
+  /// input). An empty line steps into the node, `n` steps over it, `o` runs
+  /// until the node it's in is left, `c` runs to the end of the evaluation
+  /// and `q` stops it with Cancelled. Without a terminal it just traces.
+  struct Step
+  {
+    static constexpr bool enabled = true;
+    static void enter(const Expr &src);
+    static inline void leave(const Expr &src, const Ptr<Expr> &val)
+    { Trace::leave(src, val); }
+    static inline void unwind(const Expr &src) { Trace::unwind(src); }
+    static inline void call(const Expr &fn, const Ptr<Expr> &arg)
+    { Trace::call(fn, arg); }
+    static inline void ret(const Expr &fn, const Ptr<Expr> &val)
+    { Trace::ret(fn, val); }
+    static inline void builtin(const BuiltinExpr &b) { Trace::builtin(b); }
+  };
+}
+
+/// The policy the evaluators are built with, picked at compile time by
+/// defining `MINIML_EVAL_HOOKS` as one in #hooks, e.g.
+/// `make DEFINES='-DNDEBUG -DMINIML_EVAL_HOOKS=Trace'`.
+#ifndef MINIML_EVAL_HOOKS
+#define MINIML_EVAL_HOOKS None
+#endif
+using EvalHooks = hooks::MINIML_EVAL_HOOKS;
+
+}
+
+#endif /* end of include guard: HOOKS_HXX_T2LW9XRM */
@@ -0,0 +1,272 @@
+#ifndef HAMT_HXX_Q4ZC8TNE
+#define HAMT_HXX_Q4ZC8TNE
+
+#include "ptr.hxx"
+#include "mem.hxx"
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace miniml
+{
+
+/**
+ * Persistent hash array mapped tries: maps from `K` to `V` which are never
+ * changed, so inserting or removing something makes a new map, sharing all
+ * of the old one but the path down to where the change was. That path is at
+ * most one node for every five bits of the hash, so updates and lookups
+ * take O(log n) time, and old versions of a map stay valid for as long as
+ * anything refers to them.
+ *
+ * Each node has 32 slots, picked by five bits of the hash, which each hold
+ * either an entry or a subtree; the slots in use are kept together and
+ * found by counting the bits set in a bitmap. Once the whole hash has been
+ * used, the keys left have equal hashes and are kept in a list instead.
+ * Subtrees always have at least two entries in them, so that a map has the
+ * same shape however it was made.
+ */
+template <typename K, typename V,
+          typename Hash = std::hash<K>, typename Eq = std::equal_to<K>>
+class Hamt final
+{
+public:
+  Hamt() = default;
+
+  /// Number of entries.
+  inline size_t size() const { return m_size; }
+  inline bool empty() const { return m_size == 0; }
+
+  /// The value for a key.
+  /// \return `nullptr` if the key isn't present.
+  const V *find(const K&) const;
+
+  /// A map which is the same, except that \a key maps to \a val.
+  Hamt insert(const K &key, const V &val) const;
+  /// A map which is the same, except that \a key isn't in it.
+  Hamt remove(const K &key) const;
+
+  /// Calls `f(key, val)` for each entry, in no particular order.
+  template <typename F>
+  void each(F f) const { if (m_root) each(*m_root, f); }
+
+private:
+  struct Entry final
+  {
+    K key;
+    V val;
+    size_t hash;
+  };
+
+  struct Node final: mem::Counted<mem::Kind::MAP_NODE, Node>
+  {
+    /// Which slots hold an entry, and which a subtree. Both are 0 in a node
+    /// below the last level, whose entries are in no order.
+    std::uint32_t datamap = 0, nodemap = 0;
+    std::vector<Entry> entries;
+    std::vector<Ptr<const Node>> kids;
+  };
+
+  using NodePtr = Ptr<const Node>;
+
+  static const unsigned bits = 5;
+  static const unsigned hash_bits = std::numeric_limits<size_t>::digits;
+
+  Hamt(NodePtr root, size_t size): m_root(root), m_size(size) {}
+
+  /// Bit for the slot used by \a hash at the level \a shift bits down.
+  static inline std::uint32_t bit(size_t hash, unsigned shift)
+  { return std::uint32_t(1) << ((hash >> shift) & 31); }
+
+  /// Position among the slots in use of the one for \a bit.
+  static inline size_t index(std::uint32_t map, std::uint32_t bit)
+  {
+#ifdef __GNUC__
+    return __builtin_popcount(map & (bit - 1));
+#else
+    size_t n = 0;
+    for (map &= bit - 1; map; map &= map - 1) ++n;
+    return n;
+#endif
+  }
+
+  static inline bool same(const Entry &e, const K &key, size_t hash)
+  { return e.hash == hash && Eq()(e.key, key); }
+
+  static NodePtr insert(const Node*, const Entry&, unsigned shift,
+                        bool &added);
+  static NodePtr pair(const Entry&, const Entry&, unsigned shift);
+  static NodePtr remove(const NodePtr&, const K&, size_t hash,
+                        unsigned shift, bool &removed);
+
+  template <typename F>
+  static void each(const Node &n, F &f)
+  {
+    for (auto &e: n.entries) f(e.key, e.val);
+    for (auto &k: n.kids) each(*k, f);
+  }
+
+  NodePtr m_root;
+  size_t m_size = 0;
+};
+
+
+template <typename K, typename V, typename Hash, typename Eq>
+const V *Hamt<K, V, Hash, Eq>::find(const K &key) const
+{
+  auto hash = Hash()(key);
+  auto n = m_root.get();
+  for (unsigned shift = 0; n; shift += bits) {
+    if (shift >= hash_bits) {
+      for (auto &e: n->entries) {
+        if (Eq()(e.key, key)) return &e.val;
+      }
+      return nullptr;
+    }
+
+    auto b = bit(hash, shift);
+    if (n->datamap & b) {
+      auto &e = n->entries[index(n->datamap, b)];
+      return same(e, key, hash)? &e.val: nullptr;
+    } else if (n->nodemap & b) {
+      n = n->kids[index(n->nodemap, b)].get();
+    } else {
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+template <typename K, typename V, typename Hash, typename Eq>
+Hamt<K, V, Hash, Eq> Hamt<K, V, Hash, Eq>::insert(const K &key,
+                                                  const V &val) const
+{
+  bool added = false;
+  auto root = insert(m_root.get(), Entry {key, val, Hash()(key)}, 0, added);
+  return Hamt(root, m_size + added);
+}
+
+template <typename K, typename V, typename Hash, typename Eq>
+Hamt<K, V, Hash, Eq> Hamt<K, V, Hash, Eq>::remove(const K &key) const
+{
+  bool removed = false;
+  auto root = m_root? remove(m_root, key, Hash()(key), 0, removed): m_root;
+  if (!removed) return *this;
+  return m_size > 1? Hamt(root, m_size - 1): Hamt();
+}
+
+template <typename K, typename V, typename Hash, typename Eq>
+auto Hamt<K, V, Hash, Eq>::insert(const Node *n, const Entry &e,
+                                  unsigned shift, bool &added) -> NodePtr
+{
+  auto m = n? ptr<Node>(*n): ptr<Node>();
+
+  if (shift >= hash_bits) {
+    for (auto &x: m->entries) {
+      if (Eq()(x.key, e.key)) {
+        x.val = e.val;
+        return m;
+      }
+    }
+    m->entries.push_back(e);
+    added = true;
+    return m;
+  }
+
+  auto b = bit(e.hash, shift);
+  if (m->datamap & b) {
+    auto i = index(m->datamap, b);
+    auto &x = m->entries[i];
+    if (same(x, e.key, e.hash)) {
+      x.val = e.val;
+      return m;
+    }
+    // two entries in one slot: move them both down a level
+    auto kid = pair(x, e, shift + bits);
+    m->entries.erase(m->entries.begin() + i);
+    m->datamap ^= b;
+    m->nodemap |= b;
+    m->kids.insert(m->kids.begin() + index(m->nodemap, b), kid);
+    added = true;
+  } else if (m->nodemap & b) {
+    auto &kid = m->kids[index(m->nodemap, b)];
+    kid = insert(kid.get(), e, shift + bits, added);
+  } else {
+    m->datamap |= b;
+    m->entries.insert(m->entries.begin() + index(m->datamap, b), e);
+    added = true;
+  }
+  return m;
+}
+
+template <typename K, typename V, typename Hash, typename Eq>
+auto Hamt<K, V, Hash, Eq>::pair(const Entry &a, const Entry &b,
+                                unsigned shift) -> NodePtr
+{
+  auto m = ptr<Node>();
+  if (shift >= hash_bits) {
+    m->entries = {a, b};
+    return m;
+  }
+
+  auto ba = bit(a.hash, shift), bb = bit(b.hash, shift);
+  if (ba == bb) {
+    m->nodemap = ba;
+    m->kids.push_back(pair(a, b, shift + bits));
+  } else {
+    m->datamap = ba | bb;
+    m->entries = ba < bb? std::vector<Entry> {a, b}: std::vector<Entry> {b, a};
+  }
+  return m;
+}
+
+template <typename K, typename V, typename Hash, typename Eq>
+auto Hamt<K, V, Hash, Eq>::remove(const NodePtr &n, const K &key,
+                                  size_t hash, unsigned shift,
+                                  bool &removed) -> NodePtr
+{
+  if (shift >= hash_bits) {
+    for (size_t i = 0; i < n->entries.size(); ++i) {
+      if (Eq()(n->entries[i].key, key)) {
+        auto m = ptr<Node>(*n);
+        m->entries.erase(m->entries.begin() + i);
+        removed = true;
+        return m;
+      }
+    }
+    return n;
+  }
+
+  auto b = bit(hash, shift);
+  if (n->datamap & b) {
+    auto i = index(n->datamap, b);
+    if (!same(n->entries[i], key, hash)) return n;
+    auto m = ptr<Node>(*n);
+    m->entries.erase(m->entries.begin() + i);
+    m->datamap ^= b;
+    removed = true;
+    return m;
+  } else if (n->nodemap & b) {
+    auto j = index(n->nodemap, b);
+    auto kid = remove(n->kids[j], key, hash, shift + bits, removed);
+    if (!removed) return n;
+
+    auto m = ptr<Node>(*n);
+    if (kid->kids.empty() && kid->entries.size() == 1) {
+      // a subtree with one entry left goes back into this node's slot
+      m->kids.erase(m->kids.begin() + j);
+      m->nodemap ^= b;
+      m->datamap |= b;
+      m->entries.insert(m->entries.begin() + index(m->datamap, b),
+                        kid->entries[0]);
+    } else {
+      m->kids[j] = kid;
+    }
+    return m;
+  }
+  return n;
+}
+
+}
+
+#endif /* end of include guard: HAMT_HXX_Q4ZC8TNE */
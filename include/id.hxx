@@ -5,6 +5,7 @@
 #include "string.hxx"
 #include "ptr.hxx"
 #include "ppr.hxx"
+#include "mem.hxx"
 
 #include <string>
 #include <ostream>
@@ -29,7 +30,7 @@ public:
 
   /// Copies a string onto the heap and constructs an identifier from it.
   Id(const String &str, Pos start = Pos(), Pos end = Pos()):
-    Id(ptr<String>(str), start, end)
+    Id(mem::string(String(str)), start, end)
   { }
 
   Id(const Id &other, Pos start, Pos end = Pos()):
@@ -65,7 +66,7 @@ private:
 template <typename T>
 inline Id Id::suffix(T suf)
 {
-  auto str = ptr<String>(*m_val + std::to_string(suf));
+  auto str = mem::string(*m_val + std::to_string(suf));
   return Id(str, start(), end());
 }
 
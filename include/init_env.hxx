@@ -4,18 +4,56 @@
 #include "ptr.hxx"
 #include "env.hxx"
 #include "ast.hxx"
+#include <atomic>
+#include <functional>
+#include <mutex>
 
 namespace miniml
 {
 /// An environment entry containing a type and a definition.
 struct EnvEntry final
 {
+  /// Computes a lazy definition.
+  using Thunk = std::function<Ptr<Expr>()>;
+
   inline EnvEntry(Ptr<Type> t, Ptr<Expr> v): type(t), value(v) {}
+  /// A lazy definition, which isn't evaluated until it's first looked up by
+  /// #force().  name is only for error messages.
+  EnvEntry(Ptr<Type> t, const Id &name, Thunk thunk);
+
   Ptr<Type> type;
+  /// The definition, or `nullptr` if it's lazy and hasn't been forced yet.
   Ptr<Expr> value;
 
+  /// The definition, evaluating it first if needed. If that fails, it's
+  /// tried again next time.
+  Ptr<Expr> force();
+  /// Whether the definition has been evaluated.
+  bool forced() const;
+
   Ptr<Ppr> ppr()
-  { return ppr::hcat({value->ppr(), ": "_p, type->ppr()}); }
+  {
+    return ppr::hcat({forced()? value->ppr(): "<lazy>"_p, ": "_p,
+                      type->ppr()});
+  }
+
+private:
+  struct Lazy final
+  {
+    Lazy(const Id &name, Thunk thunk):
+      name(name), thunk(thunk), done(false), running(false)
+    {}
+
+    Id name;
+    Thunk thunk;
+    /// Set once #value has been filled in.
+    std::atomic<bool> done;
+    /// Held while evaluating, since entries can be shared between threads.
+    std::recursive_mutex mutex;
+    /// Set while evaluating, to catch a definition which needs itself.
+    bool running;
+  };
+  Ptr<Lazy> m_lazy;
 };
 
 
@@ -26,13 +64,18 @@ extern Ptr<Type> int_;
 extern Ptr<Type> string_;
 extern Ptr<Type> bool_;
 extern Ptr<Type> unit;
+/// `int array`.
+extern Ptr<Type> int_array;
 
 /// The expression `()`.
 extern Ptr<Expr> UNIT;
 
 long INT(Ptr<Expr> e);
+bool BOOL(Ptr<Expr> e);
 String STRING(Ptr<Expr> e);
 Ptr<Expr> STRING(String &&e);
+const ArrayExpr::Elems &ARRAY(Ptr<Expr> e);
+Ptr<Expr> ARRAY(ArrayExpr::Elems &&e);
 
 Ptr<EnvEntry> builtin(Ptr<Type> ty, unsigned arity, BuiltinExpr::Effect eff);
 Ptr<EnvEntry> builtin(Ptr<Type> ty, std::function<Ptr<Expr>(Ptr<Expr>)> f);
@@ -43,6 +86,25 @@ Ptr<EnvEntry> builtin(Ptr<Type> ty, std::function<void()> f);
 
 /// Builds an environment containing the magical builtins.
 Ptr<Env<EnvEntry>> init_val_env();
+
+
+/// Stream that the printing builtins (and the REPL) write to. This is
+/// `std::cout` unless the current thread has redirected it. \sa Redirect
+OStream &output();
+
+/// Redirects #output() for the current thread for as long as it's alive.
+class Redirect final
+{
+public:
+  Redirect(OStream &out);
+  ~Redirect();
+
+  Redirect(const Redirect&) = delete;
+  Redirect &operator=(const Redirect&) = delete;
+
+private:
+  OStream *m_prev;
+};
 }
 
 #endif /* end of include guard: INIT_ENV_HXX_CE0WIC1R */
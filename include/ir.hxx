@@ -0,0 +1,158 @@
+#ifndef IR_HXX_C4TQ7M2A
+#define IR_HXX_C4TQ7M2A
+
+#include "ast.hxx"
+#include "env.hxx"
+#include "mem.hxx"
+#include <vector>
+
+namespace miniml
+{
+
+struct EnvEntry;
+
+/**
+ * Typed intermediate representation, produced by the typechecker
+ * (\sa typecheck) and run by #ir::eval.
+ *
+ * Every node knows its type, operators are specialised to the types of their
+ * operands, and variables bound by lambdas are resolved to an index into the
+ * enclosing frames. So evaluating it never has to check what kind of thing
+ * it's been given: the typechecker already did.
+ */
+namespace ir
+{
+
+/// Operations.
+enum class Op
+{
+  CONST,   ///< Literal or other value, in Node::value.
+  LOCAL,   ///< Lambda-bound variable, Node::index frames out.
+  GLOBAL,  ///< Variable from the global environment, Node::global.
+  APP,     ///< Application of `kids[0]` to `kids[1]`.
+  CALL,    ///< Application of `kids[0]` to the rest of the `kids` in turn,
+           ///< for `f a b ...`. When it's a closure whose lambda's body is
+           ///< another lambda, all the arguments they take are bound at
+           ///< once, without making the closures in between.
+  LAM,     ///< Lambda with body `kids[0]`.
+  IF,      ///< If `kids[0]` then `kids[1]` else `kids[2]`.
+  INT_ADD, INT_SUB, INT_MUL, INT_DIV,
+  INT_LT, INT_LE, INT_EQ, INT_GE, INT_GT, INT_NE,
+  BOOL_AND, BOOL_OR, BOOL_IFF,
+  SEQ,     ///< Evaluate `kids[0]` then `kids[1]`.
+  TUPLE,   ///< Tuple of the `kids`.
+  PROJ,    ///< Element Node::index of the tuple `kids[0]`.
+  SHARED,  ///< `kids[0]`, which is computed at most once per call of the
+           ///< enclosing lambda and kept in Frame::shared, slot Node::index.
+  REF,     ///< New reference cell holding `kids[0]`.
+  DEREF,   ///< Contents of the cell `kids[0]`.
+  ASSIGN,  ///< Set the cell `kids[0]` to `kids[1]`.
+  INDEX,   ///< Element `kids[1]` of the array `kids[0]`.
+  SET_INDEX, ///< Set element `kids[1]` of the array `kids[0]` to `kids[2]`.
+  LAZY,    ///< `kids[0]`, suspended in a LazyExpr until it's forced.
+  FORCE,   ///< Value of the LazyExpr `kids[0]`.
+};
+
+/// Expression a node came from, kept in the pool of the input (or module)
+/// it was in, rather than as the expression itself, so that the input's
+/// expressions don't all have to be kept as long as the IR is.
+struct Src final
+{
+  Ptr<const ExprPool> pool;
+  ExprPool::Ref ref;
+
+  inline Pos start() const { return pool->start(ref); }
+  inline Pos end() const { return pool->end(ref); }
+  inline Ptr<const Source> source() const { return pool->source(ref); }
+  /// The expression, made again from the pool.
+  inline Ptr<Expr> expr() const { return pool->expr(ref); }
+};
+
+/// IR node.
+struct Node final: mem::Counted<mem::Kind::IR, Node>
+{
+  Node(Op op, Ptr<Type> ty, Src src): op(op), ty(ty), src(std::move(src)) {}
+  Node(const Node&) = default;
+  ~Node() { for (auto &k: kids) release(k); }
+
+  /// Name of a #Op::GLOBAL.
+  inline const Id &name() const
+  { return src.pool->id((*src.pool)[src.ref].a); }
+
+  Op op;
+  /// De Bruijn index of a #Op::LOCAL, element of a #Op::PROJ, slot of a
+  /// #Op::SHARED, or number of slots a #Op::LAM's frames need.
+  unsigned index = 0;
+  /// Type of the expression this node computes.
+  Ptr<Type> ty;
+  /// Operands.
+  std::vector<Ptr<Node>> kids;
+  /// Expression the node came from.
+  Src src;
+  /// Value of a #Op::CONST.
+  Ptr<Expr> value;
+  /// Definition a #Op::GLOBAL refers to, once it's been bound (\sa bind).
+  Ptr<EnvEntry> global;
+};
+
+/// Values of the variables of the lambdas enclosing some code, innermost
+/// first.
+struct Frame final: mem::Counted<mem::Kind::FRAME, Frame>
+{
+  Frame(Ptr<Expr> val, Ptr<Frame> up, unsigned slots = 0):
+    val(val), up(up), shared(slots)
+  {}
+  Ptr<Expr> val;
+  Ptr<Frame> up;
+  /// Values of the #Op::SHARED nodes in the lambda's body which have been
+  /// run so far in this call.
+  std::vector<Ptr<Expr>> shared;
+};
+
+/// Bind each #Op::GLOBAL which isn't already to the definition its name has
+/// in \a env. That's the one it refers to from then on, even if the name is
+/// defined again.
+void bind(const Ptr<Node>&, const Ptr<Env<EnvEntry>> &env);
+
+/// Evaluate IR for a top-level expression (i.e. not inside any lambdas),
+/// whose globals have all been bound.
+Ptr<Expr> eval(Ptr<Node>);
+
+/// Apply a closure to an argument.
+Ptr<Expr> call(const ClosureExpr&, Ptr<Expr> arg);
+
+/// Apply a closure from ints to ints or bools to each of \a n ints, all at
+/// once, if its body is only arithmetic, comparisons and a few ifs on ints
+/// and bools (and the variables it closes over and globals it uses are ints
+/// or bools). The body is compiled to a kernel::Program, which runs one
+/// operation at a time on a whole column of elements, using SIMD lanes.
+/// Both sides of each if are computed, which is fine since nothing in
+/// them can fail or do anything. Bools come out as 0 and 1.
+/// \param out Results, which may be the same as \a xs.
+/// \return Whether it could be done that way. If not, nothing has been, and
+///         the closure has to be applied to each element in turn.
+bool map(const ClosureExpr&, const long *xs, long *out, size_t n);
+
+/// Common subexpression elimination: within each lambda body, repeated
+/// pure subexpressions are replaced by #Op::SHARED nodes, so each is only
+/// computed once per call. Nothing including a function call is pure, since
+/// it might print something or `use` a file, nor is anything which makes,
+/// reads or changes a reference or an array element, or which forces a
+/// `lazy` value. Globals are bound (\sa bind) by then, so redefining one
+/// doesn't change what a node computes.
+void cse(const Ptr<Node>&);
+
+}
+
+/// Operands of IR nodes.
+template <>
+struct Tree<ir::Node> final
+{
+  static inline size_t arity(const ir::Node &n) { return n.kids.size(); }
+  static inline Ptr<ir::Node> child(const ir::Node &n, size_t i)
+  { return n.kids[i]; }
+};
+
+}
+
+#endif /* end of include guard: IR_HXX_C4TQ7M2A */
@@ -0,0 +1,80 @@
+#ifndef KERNEL_HXX_V8MZ3QHE
+#define KERNEL_HXX_V8MZ3QHE
+
+#include <cstddef>
+#include <vector>
+
+namespace miniml
+{
+
+/**
+ * Loops over contiguous arrays of ints, for the array builtins. They work on
+ * several elements at once with the compiler's vector types where it has
+ * them (so even an unoptimised build uses SIMD instructions), and fall back
+ * to plain loops otherwise.
+ *
+ * Arithmetic wraps around on overflow. Outputs may be the same as inputs,
+ * but mustn't otherwise overlap them.
+ */
+namespace kernel
+{
+
+/// Sum of \a n elements.
+long sum(const long *xs, size_t n);
+
+/// Set \a n elements to \a x.
+void fill(long *out, size_t n, long x);
+/// Set \a n elements to `from`, `from + 1`, ...
+void iota(long *out, size_t n, long from);
+
+/// Element-wise `xs[i] + ys[i]`.
+void add(const long *xs, const long *ys, long *out, size_t n);
+/// Element-wise `xs[i] - ys[i]`.
+void sub(const long *xs, const long *ys, long *out, size_t n);
+/// Element-wise `xs[i] * ys[i]`.
+void mul(const long *xs, const long *ys, long *out, size_t n);
+
+/// Copy the elements whose \a keep flag is set to the start of \a out, in
+/// order, without branching on the flags.
+/// \return How many were kept.
+size_t compact(const long *xs, const bool *keep, size_t n, long *out);
+
+
+/// Operations of a Program.
+enum class Op
+{
+  ARG,     ///< The element the program is being run on.
+  CONST,   ///< Insn::k.
+  ADD, SUB, MUL,
+  DIV,     ///< Operand `a` divided by Insn::k, which isn't 0 or -1.
+  LT, LE, EQ, GE, GT, NE,
+  AND, OR, IFF,
+  SELECT,  ///< `b` if `a` is true, otherwise `c`.
+};
+
+/// Instruction of a Program. Its operands are the results of instructions
+/// before it.
+struct Insn final
+{
+  Op op;
+  unsigned a, b, c;
+  long k;
+};
+
+/// Straight-line code computing an int from an int, with no branches or
+/// loops, so that it can be run on a whole column of ints at once, one
+/// instruction at a time. Booleans are all ones for true and 0 for false.
+/// The last instruction gives the result.
+struct Program final
+{
+  std::vector<Insn> code;
+};
+
+/// Run a program on each of \a n elements.
+void run(const Program&, const long *xs, long *out, size_t n);
+
+}
+
+}
+
+#endif /* end of include guard: KERNEL_HXX_V8MZ3QHE */
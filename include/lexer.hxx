@@ -17,7 +17,11 @@ class Lexer
 {
 public:
   /// Creates a Lexer over the given string.
-  Lexer(const String&);
+  /// \param file Name of the file it came from, if any. \sa Source::add
+  Lexer(const String&, const String *file = nullptr);
+  /// Creates a Lexer over some source code which has already been added
+  /// with Source::add, or a part of it.
+  explicit Lexer(Ptr<const Source>);
 
   /// \return The tokens read.
   std::vector<Ptr<Token>> tokens() const;
@@ -28,7 +32,12 @@ private:
   const Char *p, *begin, *pe, *eof, *ts, *te;
   // }
 
-  Pos start, end;
+  /// What's being lexed, kept until the tokens have it.
+  Ptr<const Source> source;
+  /// Position of the start of the string.
+  Pos base;
+  /// Position of a character in it.
+  inline Pos at(const Char *c) const { return base + (c - begin); }
 
   /// The tokens.
   std::deque<Ptr<Token>> m_tokens;
@@ -0,0 +1,86 @@
+#ifndef MAPPER_HXX_R8MZ2KTW
+#define MAPPER_HXX_R8MZ2KTW
+
+#include "string.hxx"
+#include "ptr.hxx"
+#include "exception.hxx"
+#include "repl.hxx"
+#include <istream>
+#include <ostream>
+
+namespace miniml
+{
+
+/**
+ * Runs one function over a stream of newline-separated records, for
+ * `--map`: each line of the input is given to the function, and what it
+ * returns is written as a line of the output, in the same order.
+ *
+ * The function is looked up and checked once, and has to be from strings to
+ * strings or from ints to ints (written in decimal). Records are read and
+ * results written a block at a time, and with more than one thread the
+ * records are shared out between them in batches, which are written in
+ * order as they finish. A batch of ints given to a closure simple enough for
+ * ir::map is run all at once.
+ *
+ * The cells of references and arrays aren't safe to change from several
+ * threads at once, and records could share them, so a function that might
+ * assign to either (or `use` a file) is always run on one thread, whatever
+ * #threads() says. Only the code it can reach is looked at, not what it
+ * does at run time, so this errs on the side of one thread.
+ *
+ * Anything the function prints goes to `std::cerr`, so the output is only
+ * the results. A record the function fails on (or that isn't an int, for a
+ * function on ints) gives an empty line, and the error is reported on
+ * `std::cerr` with the record's line number.
+ */
+class Mapper final
+{
+public:
+  /// Exception when the function can't be used.
+  struct Error final: public Exception
+  {
+    Error(const String &what): msg(what) {}
+    inline const char *what() const noexcept override { return msg.c_str(); }
+    String msg;
+  };
+
+  /// \param repl Where to find the function, which must outlive the mapper.
+  /// \param name The function.
+  Mapper(const Repl &repl, const String &name);
+
+  /// Limits on applying the function to each record. \sa Budget
+  inline EvalLimits eval_limits() const { return m_eval_limits; }
+  inline void set_eval_limits(EvalLimits limits) { m_eval_limits = limits; }
+
+  /// Threads to apply the function on. 0 means one per core. Functions
+  /// which might change a reference or an array only ever get one.
+  inline unsigned threads() const { return m_threads; }
+  inline void set_threads(unsigned threads) { m_threads = threads; }
+
+  /// Map every record of \a in to \a out.
+  /// \return Whether the function succeeded on all of them.
+  bool run(std::istream &in, std::ostream &out);
+
+private:
+  struct Batch;
+
+  /// Apply the function to each record of a batch.
+  void apply(Batch&) const;
+  /// Apply the function to one record, which is number \a line.
+  /// \return Whether it succeeded.
+  bool apply(const String &record, String &result, size_t line,
+             String &errors) const;
+
+  Ptr<Expr> m_fn;
+  /// Whether #m_fn is on ints, rather than strings.
+  bool m_ints;
+  /// Whether #m_fn might change a cell, so it has to run on one thread.
+  bool m_writes;
+  EvalLimits m_eval_limits;
+  unsigned m_threads = 1;
+};
+
+}
+
+#endif /* end of include guard: MAPPER_HXX_R8MZ2KTW */
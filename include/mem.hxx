@@ -0,0 +1,142 @@
+#ifndef MEM_HXX_R8VJ2KQD
+#define MEM_HXX_R8VJ2KQD
+
+#include "string.hxx"
+#include "ptr.hxx"
+#include <cstddef>
+#include <cstdint>
+
+namespace miniml
+{
+
+class Expr;
+class ExprPool;
+
+/**
+ * Counts of the objects which are alive, and the bytes they use, by what
+ * kind of thing they are. Objects count themselves by inheriting from
+ * \ref Counted; strings and array elements are counted when they're made
+ * by #string or the `ARRAY` helper. The bytes are those of the objects
+ * themselves, not of what `std::shared_ptr` or the containers around them
+ * need, so they're an underestimate, but they're good for telling what is
+ * growing. While #profiling, the bytes are also put down to the places in
+ * the source whose evaluation made them.
+ *
+ * Each thread keeps its own counts, and adds them to the totals every so
+ * often (and when it reports them or exits), so allocating doesn't contend
+ * with other threads. So the peaks can miss rises and falls of less than
+ * 64KB, and the totals can be behind by up to that much for each other
+ * thread that's running.
+ */
+namespace mem
+{
+
+/// What an object is counted as.
+enum class Kind
+{
+  // expressions, in the same order as ExprType
+  ID_EXPR, APP_EXPR, LAM_EXPR, IF_EXPR, INT_EXPR, BOOL_EXPR, STRING_EXPR,
+  TYPE_EXPR, BINOP_EXPR, TUPLE_EXPR, DOT_EXPR, BUILTIN_EXPR, CLOSURE_EXPR,
+  ARRAY_EXPR, UNOP_EXPR, INDEX_EXPR, REF_EXPR, MAP_EXPR, LAZY_EXPR,
+  STREAM_EXPR,
+  TYPE,       ///< Type nodes of any sort
+  IR,         ///< Typed IR nodes
+  POOL,       ///< Flattened expressions the IR came from
+  FRAME,      ///< Frames of lambda calls, kept alive by closures
+  ENV,        ///< Environment layers
+  BINDING,    ///< Entries in environment layers
+  STRING,     ///< Contents of identifiers and strings
+  ARRAY_DATA, ///< Elements of arrays
+  MAP_NODE,   ///< Nodes of persistent maps
+  PPR,        ///< Pretty printed fragments
+  COUNT_      ///< Number of kinds
+};
+
+/// Name of a kind, as it appears in reports.
+const char *name(Kind);
+
+/// Count \a n more objects of some kind, using \a bytes altogether.
+void add(Kind, size_t bytes, size_t n = 1);
+/// Count \a n fewer objects of some kind.
+void remove(Kind, size_t bytes, size_t n = 1);
+
+/// Bytes counted on this thread, less those taken off the count on it.
+extern thread_local long thread_bytes;
+/// Objects counted on this thread, not taking any off.
+extern thread_local unsigned long thread_allocs;
+
+/// Base class for objects of type `T` which count themselves as a `K`.
+template <Kind K, typename T>
+struct Counted
+{
+  Counted() { add(K, sizeof(T)); }
+  Counted(const Counted&) { add(K, sizeof(T)); }
+  Counted &operator=(const Counted&) = default;
+  ~Counted() { remove(K, sizeof(T)); }
+};
+
+/// A string which is counted as long as it's alive.
+Ptr<String> string(String&&);
+
+/// Whether the objects counted are also put down to the expressions which
+/// made them, as they're evaluated. \sa Site
+extern bool profiling;
+inline void set_profiling(bool on) { profiling = on; }
+
+/// An expression, or one in an ExprPool (which is what the IR keeps).
+struct Where final
+{
+  const Expr *expr;
+  const ExprPool *pool;
+  /// Its ExprPool::Ref in #pool.
+  std::uint32_t ref;
+
+  inline explicit operator bool() const { return expr || pool; }
+};
+
+/// Expression being evaluated on this thread, if #profiling.
+extern thread_local Where site;
+
+/// While this is alive, objects counted on this thread were made by
+/// evaluating an expression (unless an expression inside it is being
+/// evaluated, which has a Site of its own).
+class Site final
+{
+public:
+  inline Site(const Expr &e): m_set(profiling)
+  {
+    if (m_set) {
+      m_prev = site;
+      site = Where {&e, nullptr, 0};
+    }
+  }
+  inline Site(const ExprPool &pool, std::uint32_t ref): m_set(profiling)
+  {
+    if (m_set) {
+      m_prev = site;
+      site = Where {nullptr, &pool, ref};
+    }
+  }
+  inline ~Site() { if (m_set) site = m_prev; }
+
+  Site(const Site&) = delete;
+  Site &operator=(const Site&) = delete;
+
+private:
+  bool m_set;
+  Where m_prev = Where();
+};
+
+/// Table of the live and peak counts and bytes for each kind.
+void report(OStream&);
+/// The same as JSON, for other programs to read.
+void dump(OStream&);
+/// The \a top places in the source which allocated the most bytes, with how
+/// many objects, and what the expression there looks like.
+void profile(OStream&, size_t top = 20);
+
+}
+
+}
+
+#endif /* end of include guard: MEM_HXX_R8VJ2KQD */
@@ -60,10 +60,30 @@ struct Parser final
   };
 
   /// Lex & parse a string. \sa Lexer
-  Ptr<Input> parse(const String&);
+  ///
+  /// A big module is split into chunks of declarations, which are lexed and
+  /// parsed on several threads at once.
+  Ptr<Input> parse(const String&, const String *file = nullptr);
   /// Parse a token stream that was already produced.
   Ptr<Input> parse(const std::vector<Ptr<Token>>&);
 
+  /// How many threads #parse uses for a big module: one per core if it's 0.
+  static unsigned threads;
+
+  /// How far a search for the end of an input has got, so that it can go on
+  /// from there once more has been read.
+  struct InputScan final
+  {
+    enum class In { CODE, STRING, COMMENT };
+    size_t from = 0; ///< Where to look next.
+    In in = In::CODE; ///< What \a from is in.
+  };
+
+  /// Find the `;;` ending the first input in \a src, which isn't one in a
+  /// string or a comment, starting from where \a scan got to.
+  /// \return Where it is, or `String::npos` if it isn't there yet.
+  static size_t input_end(const String &src, InputScan &scan);
+
 private:
   void *parser; ///< The object lemon produces.
 };
@@ -0,0 +1,68 @@
+#ifndef PGO_HXX_H2XV6RKA
+#define PGO_HXX_H2XV6RKA
+
+#include "ast.hxx"
+#include "env.hxx"
+#include "ir.hxx"
+#include "string.hxx"
+
+namespace miniml
+{
+
+/**
+ * Profile-guided optimisation. While #recording, the interpreter counts how
+ * many times each lambda's body is run and each call site is reached, and
+ * #save writes the counts out, with each lambda or call identified by the
+ * file and position it came from. A later run can #load them, and then
+ * #optimise uses them on the IR of everything it typechecks:
+ *
+ * - A hot call of a small, hot, top-level function whose arguments are
+ *   constants or variables has the function's body inlined in its place,
+ *   with the arguments substituted in.
+ * - A hot call with some constant arguments calls a copy of the function
+ *   specialised to them instead.
+ *
+ * In both, the parts of the body which are then constant are folded. Top
+ * level functions are looked up when the calls to them are optimised, so
+ * redefining one later doesn't change the calls already inlined or
+ * specialised. Places in input typed at the REPL are only told apart by
+ * their line and column within each input, so the profile is most use for
+ * code loaded from files.
+ */
+namespace pgo
+{
+
+/// Whether lambdas and calls are being counted.
+extern bool recording;
+/// Start counting lambdas and calls, to #save to \a file.
+void record(const String &file);
+
+/// Count a run of the body of the lambda \a src.
+void count_lam(const ir::Src &src);
+/// Count a call at \a src.
+void count_call(const ir::Src &src);
+
+inline void lam(const ir::Src &src) { if (recording) count_lam(src); }
+inline void call(const ir::Src &src) { if (recording) count_call(src); }
+
+/// Write the counts so far to the file given to #record.
+/// \return Whether it could be written.
+bool save();
+/// Read counts written by #save, to guide #optimise. Counts for the same
+/// place are added together.
+/// \return Whether it could be read.
+bool load(const String &file);
+/// Whether a profile has been loaded.
+bool loaded();
+
+/// Inline or specialise the hot calls in some IR, using the profile loaded
+/// and the functions its globals are bound to. Run after ir::bind and before
+/// ir::cse.
+/// \return The optimised IR, which shares what it can with the original.
+Ptr<ir::Node> optimise(const Ptr<ir::Node>&);
+
+}
+
+}
+
+#endif /* end of include guard: PGO_HXX_H2XV6RKA */
@@ -2,33 +2,110 @@
 #define POS_HXX_BITQRAWX
 
 #include "ppr.hxx"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace miniml
 {
 
-/// Source code position.
-struct Pos final: public Pretty
+/// Source code position, as a byte offset into the source code that's still
+/// in use (\sa Source). Which file, line and column that is is only worked
+/// out when it's asked for, e.g. for an error message, so it only means
+/// anything while something keeps its Source.
+struct Pos final
 {
-  size_t line = 1,  ///< Line number
-         col = 0,   ///< Column number
-         pos = 0;   ///< File position
+  inline Pos() = default;
+  inline explicit Pos(std::uint32_t offset): offset(offset) {}
 
-  Pos operator+(const char) const;
-  /// Advance the position depending on what the character is.
-  Pos &operator+=(const char);
+  /// Offset, or 0 for nowhere in particular.
+  std::uint32_t offset = 0;
 
-  Pos operator+(const String&) const;
-  /// Advance the position by the contents of a string.
-  /// \sa #operator+=(const char)
-  Pos &operator+=(const String&);
+  /// Line number, from 1.
+  size_t line() const;
+  /// Column number, from 0, with tab stops every 8 columns.
+  size_t col() const;
+  /// Name of the file, or `nullptr` for interactive input.
+  const String *file() const;
 
-  inline Ptr<Ppr> ppr(unsigned=0, bool=false) const override
-  { return ppr::hcat({ppr::num(line), ":"_p, ppr::num(col)}); }
+  /// The position \a n bytes further on.
+  inline Pos operator+(std::uint32_t n) const
+  { return offset? Pos(offset + n): Pos(); }
+
+  inline bool operator==(Pos other) const { return offset == other.offset; }
+  inline bool operator!=(Pos other) const { return offset != other.offset; }
+
+  inline Ptr<Ppr> ppr(unsigned=0, bool=false) const
+  { return ppr::hcat({ppr::num(line()), ":"_p, ppr::num(col())}); }
 };
 
 OStream &operator<<(OStream&, const Pos&);
 
 
+/// A piece of source code which positions point into. Each one takes up a
+/// range of offsets of its own for as long as something keeps it, i.e. for
+/// as long as any token or AST node in it is left, so a Pos on its own is
+/// enough to find it again. Its offsets are used again after that.
+class Source final: public std::enable_shared_from_this<Source>
+{
+public:
+  Source(const Source&) = delete;
+  Source &operator=(const Source&) = delete;
+  ~Source();
+
+  /// Keep a copy of some source code to find positions in.
+  /// \param file Name of the file it came from, if any.
+  /// \return The source, whose positions are all nowhere if 4GiB of
+  ///         offsets are already in use.
+  static Ptr<const Source> add(const String &text,
+                               const String *file = nullptr);
+
+  /// Part of this source's text, with offsets of its own, but the same lines
+  /// and columns. Parts are kept separately, so different threads can each
+  /// have one without sharing a count.
+  Ptr<const Source> part(size_t begin, size_t end) const;
+
+  /// The source code a position is in, or `nullptr` if it's nowhere. It
+  /// doesn't lock anything, so it's only safe while something keeps the
+  /// source the position is in.
+  static const Source *find(Pos);
+
+  /// Position of the first byte.
+  inline Pos start() const { return Pos(m_base); }
+  inline const Char *begin() const { return m_text->text.data() + m_begin; }
+  inline const Char *end() const { return m_text->text.data() + m_end; }
+
+  /// Line number and column of a position in this source.
+  std::pair<size_t, size_t> line_col(Pos) const;
+
+  /// Name of the file, or `nullptr` for interactive input.
+  inline const String *file() const
+  { return m_text->named? &m_text->file: nullptr; }
+
+private:
+  /// Text shared between a source and its parts.
+  struct Text final
+  {
+    String text, file;
+    bool named;
+
+    /// Offset into #text of the start of each line after the first, only
+    /// filled in the first time it's needed.
+    mutable std::vector<std::uint32_t> lines;
+    mutable std::once_flag lines_once;
+  };
+
+  Source(Ptr<const Text> text, size_t begin, size_t end);
+
+  Ptr<const Text> m_text;
+  /// Where in #m_text this source is.
+  size_t m_begin, m_end;
+  /// Offset of the first byte, or 0 if it didn't get any.
+  std::uint32_t m_base = 0;
+};
+
+
 /// Span of positions. \sa Pos
 struct Span final
 {
@@ -47,17 +124,20 @@ namespace ppr
 }
 
 
-/// Base class for values which have source code positions.
+/// Base class for values which have source code positions. Each one keeps
+/// the Source they're in.
 struct HasPos
 {
   inline Pos start() const { return m_start; }
   inline Pos end()   const { return m_end; }
+  /// The source they're in, if they're anywhere.
+  inline const Ptr<const Source> &source() const { return m_source; }
 
 protected:
-  inline HasPos(Pos start = Pos(), Pos end = Pos()): m_start(start), m_end(end)
-  {}
+  HasPos(Pos start = Pos(), Pos end = Pos());
 
 private:
+  Ptr<const Source> m_source;
   Pos m_start, m_end;
 };
 
@@ -3,16 +3,21 @@
 
 #include "string.hxx"
 #include "ptr.hxx"
+#include "walk.hxx"
+#include "mem.hxx"
 
 #include <string>
 #include <list>
 #include <initializer_list>
 #include <ostream>
 #include <sstream>
+#include <vector>
 
 namespace miniml
 {
 
+class PprStream;
+
 /// Abstract base class for pretty printed fragments.
 class Ppr
 {
@@ -25,9 +30,26 @@ public:
   /// Default indent amount.
   static const unsigned default_indent = 4;
 
-  /// Outputs the document to the given output stream.
+  /// Outputs the document to the given output stream. The fragments still
+  /// to be output are kept in a stack rather than recursing, so documents can
+  /// be as deep as you like.
   /// \param[in] indent The amount to indent, in characters.
-  virtual void output(OStream&, unsigned indent = 0) const = 0;
+  void output(OStream&, unsigned indent = 0) const;
+
+protected:
+  /// Fragment waiting to be output.
+  struct Task final
+  {
+    const Ppr *ppr;
+    unsigned indent;
+    /// Whether to start a new line first.
+    bool newline;
+  };
+
+  /// Output this fragment's own text, and push the fragments inside it onto
+  /// \a todo, last first.
+  virtual void output(OStream&, unsigned indent,
+                      std::vector<Task> &todo) const = 0;
 };
 
 
@@ -39,23 +61,30 @@ public:
   virtual Ptr<Ppr> ppr(unsigned prec = 0, bool pos = false) const = 0;
 
   inline Ptr<Ppr> ppr(bool pos) { return ppr(0, pos); }
+
+  /// Write to a \ref PprStream, laid out to fit its width. By default this
+  /// writes #ppr as it is, line by line.
+  virtual void print(PprStream&, unsigned prec = 0) const;
 };
 
 
 /// Pretty printed string fragment.
-class PprString final: public Ppr
+class PprString final:
+  public Ppr, mem::Counted<mem::Kind::PPR, PprString>
 {
 public:
   PprString(const String val): m_val(val) {}
 
-  void output(OStream&, unsigned indent = 0) const override;
+protected:
+  void output(OStream&, unsigned indent, std::vector<Task>&) const override;
 
 private:
   const String m_val;
 };
 
 /// Indents an existing document by a given amount.
-class PprIndent final: public Ppr
+class PprIndent final:
+  public Ppr, mem::Counted<mem::Kind::PPR, PprIndent>
 {
 public:
   PprIndent(Ptr<Ppr> child,
@@ -64,7 +93,10 @@ public:
     m_indent(indent)
   {}
 
-  void output(OStream&, unsigned indent = 0) const override;
+  ~PprIndent() { release(m_child); }
+
+protected:
+  void output(OStream&, unsigned indent, std::vector<Task>&) const override;
 
 private:
   Ptr<Ppr> m_child;
@@ -77,7 +109,12 @@ private:
 class PprCat: public Ppr
 {
 public:
-  virtual ~PprCat() {}
+  virtual ~PprCat()
+  {
+    if (m_children.use_count() == 1) {
+      for (auto &child: *m_children) release(child);
+    }
+  }
 
 protected:
   template <typename T> using List = std::list<T>;
@@ -95,7 +132,8 @@ protected:
 
 
 /// Vertically concatenated fragments.
-class PprVCat: public PprCat
+class PprVCat:
+  public PprCat, mem::Counted<mem::Kind::PPR, PprVCat>
 {
 public:
   PprVCat(std::initializer_list<Ptr<Ppr>> lst):
@@ -106,12 +144,14 @@ public:
     PprCat(lst)
   {}
 
-  void output(OStream&, unsigned indent = 0) const override;
+protected:
+  void output(OStream&, unsigned indent, std::vector<Task>&) const override;
 };
 
 
 /// Horizontally concatenated fragments.
-class PprHCat: public PprCat
+class PprHCat:
+  public PprCat, mem::Counted<mem::Kind::PPR, PprHCat>
 {
 public:
   PprHCat(std::initializer_list<Ptr<Ppr>> lst):
@@ -122,7 +162,8 @@ public:
     PprCat(lst)
   {}
 
-  void output(OStream&, unsigned indent = 0) const override;
+protected:
+  void output(OStream&, unsigned indent, std::vector<Task>&) const override;
 };
 
 
@@ -0,0 +1,180 @@
+#ifndef STREAM_HXX_K7V2PX9D
+#define STREAM_HXX_K7V2PX9D
+
+#include "string.hxx"
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace miniml
+{
+
+/**
+ * Pretty printer which lays text out as it's written, rather than building
+ * a document first like \ref Ppr.
+ *
+ * Output is divided into nested groups (#begin/#end) containing breaks
+ * (#space/#brk). If a group fits in what's left of the line, its breaks are
+ * printed as spaces; otherwise they become newlines, indented relative to the
+ * enclosing group. This is Oppen's algorithm: text is only buffered until
+ * it's known whether the groups around it fit, which is at most a line's
+ * worth, so printing takes linear time and constant space whatever the size
+ * of the output.
+ *
+ * The printers for values also respect a depth and length limit, replacing
+ * anything too deep or too long with `...`, so huge values are printed as a
+ * summary. \sa #enter \sa #more
+ */
+class PprStream final
+{
+public:
+  /// Limits on the size of the output. A limit of 0 means no limit.
+  struct Limits final
+  {
+    /// Width of the lines to fit things in.
+    unsigned width = 80;
+    /// How deeply values can be nested before being elided.
+    unsigned depth = 100;
+    /// How many elements of a tuple are printed before eliding the rest.
+    unsigned length = 1000;
+  };
+
+  /// How the breaks in a group are laid out when it doesn't fit.
+  enum class Breaks
+  {
+    CONSISTENT,   ///< All become newlines.
+    INCONSISTENT, ///< Only the ones where the next part wouldn't fit.
+  };
+
+  PprStream(OStream &out, Limits limits);
+  inline PprStream(OStream &out): PprStream(out, Limits()) {}
+  /// Calls #flush.
+  ~PprStream();
+
+  PprStream(const PprStream&) = delete;
+  PprStream &operator=(const PprStream&) = delete;
+
+  /// Write some text, which shouldn't contain newlines.
+  PprStream &text(const String&);
+  PprStream &text(const Char*);
+  PprStream &text(Char);
+  /// Write a number, like ppr::num.
+  template <typename T>
+  PprStream &num(T);
+
+  /// A break which is printed as \a blanks spaces if it doesn't become a
+  /// newline.
+  PprStream &brk(unsigned blanks = 0);
+  /// A break which is printed as a space if it doesn't become a newline.
+  inline PprStream &space() { return brk(1); }
+  /// A break which is always a newline. The groups around it don't fit.
+  PprStream &newline();
+
+  /// Start a group, whose lines after the first are indented by \a indent
+  /// more than the enclosing group's.
+  PprStream &begin(unsigned indent = 4, Breaks = Breaks::CONSISTENT);
+  /// End the group started by the matching #begin.
+  PprStream &end();
+
+  /// Start printing a nested value.
+  /// \return Whether that's within the depth limit. If not, `...` has been
+  ///         written instead, and #leave shouldn't be called.
+  bool enter();
+  /// Finish printing a nested value.
+  inline void leave() { --m_depth; }
+
+  /// Whether element \a i of a sequence is within the length limit. The first
+  /// time it isn't, `...` is written.
+  bool more(size_t i);
+
+  inline const Limits &limits() const { return m_limits; }
+
+  /// Lay out everything written so far and send it to the output stream. All
+  /// groups should have been ended.
+  void flush();
+
+private:
+  enum class Kind { TEXT, BREAK, BEGIN, END };
+
+  /// Buffered token. `size` is the width of the text, for `TEXT`; for the
+  /// others, it's negative until the width up to the next break (or the end
+  /// of the group) is known.
+  struct Token final
+  {
+    Kind kind;
+    long size;
+    /// Position of the text in #m_text, or the number of blanks of a break,
+    /// or the indent of a group.
+    size_t arg;
+    Breaks breaks;
+  };
+
+  /// Layout of an enclosing group that's been printed.
+  struct Frame final
+  {
+    bool fits;
+    Breaks breaks;
+    /// Indent before the group started.
+    long indent;
+  };
+
+  void push(Kind, long size, size_t arg, Breaks = Breaks::CONSISTENT);
+  inline Token &at(size_t index) { return m_buf[index - m_buf_start]; }
+  /// Clear the buffer when nothing is waiting to be laid out.
+  void reset();
+  /// Print tokens from the front of the buffer while the line is too full to
+  /// wait for their sizes.
+  void check_stream();
+  /// Print tokens from the front of the buffer whose sizes are known.
+  void advance_left();
+  /// Fill in the sizes of the innermost pending breaks & groups.
+  void check_stack(unsigned depth);
+
+  void print(const Token&);
+  void print_text(const Char*, size_t len);
+
+  OStream &m_out;
+  Limits m_limits;
+
+  /// Tokens whose layout isn't known yet.
+  std::deque<Token> m_buf;
+  /// Index of the first token in #m_buf since the last #reset.
+  size_t m_buf_start = 0;
+  /// Text of the `TEXT` tokens in #m_buf, starting from position
+  /// #m_text_base. Text before #m_text_done has already been printed.
+  String m_text;
+  size_t m_text_base = 0, m_text_done = 0;
+  /// Indices of the BEGIN, END & BREAK tokens whose sizes aren't known.
+  std::deque<size_t> m_scan;
+  /// Total width of the tokens printed & written since the last #reset.
+  long m_left_total = 0, m_right_total = 0;
+
+  /// Enclosing groups which have been printed.
+  std::vector<Frame> m_frames;
+  /// Space left on the current line.
+  long m_space;
+  /// Indent of the current group.
+  long m_indent = 0;
+  /// Spaces not yet written, so that lines don't end in spaces.
+  long m_pending = 0;
+  /// Laid out text that hasn't been sent to the output stream yet.
+  String m_pending_out;
+
+  unsigned m_depth = 0;
+};
+
+
+template <typename T>
+PprStream &PprStream::num(T x)
+{
+  static_assert(std::is_integral<T>::value, "non-numeric type");
+
+  auto str = std::to_string(x);
+  if (str[0] == '-') str[0] = '~';
+  return text(str);
+}
+
+}
+
+#endif /* end of include guard: STREAM_HXX_K7V2PX9D */
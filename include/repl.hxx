@@ -7,6 +7,11 @@
 #include "ast.hxx"
 #include "env.hxx"
 #include "init_env.hxx"
+#include "eval.hxx"
+#include "ppr/stream.hxx"
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace miniml
 {
@@ -15,15 +20,60 @@ namespace miniml
 class Repl final
 {
 public:
+  /// Set up the builtins and read the prelude.
   Repl();
+  /// Start a new session layered over an existing environment, e.g. another
+  /// Repl's (which is only read from, so it can be shared between sessions).
+  explicit Repl(Ptr<EnvBase<EnvEntry>> base);
 
   /// Run the repl then exit.
   [[noreturn]] void run();
 
+  /// Lex & parse an input, reporting errors to #output().
+  /// \param file Name of the file it came from, if any. \sa Source::add
+  /// \return The input, or `nullptr` if it couldn't be parsed.
+  Ptr<Input> parse(const String &input, const String *file = nullptr);
+  /// #process() an input, reporting errors to #output().
+  /// \return Whether it succeeded.
+  bool try_process(Ptr<Input> input, bool output = true);
+  /// Read a file and #process() its contents, reporting errors to
+  /// #output().
+  /// \return Whether it succeeded.
+  bool read_file(const char *filename, bool output = false);
+  /// Run a command starting with `:` rather than MiniML code, reporting to
+  /// #output(). `:mem` gives the live memory use, and `:mem json` the same
+  /// for other programs to read. `:profile` lists where the most memory was
+  /// allocated, when that's being recorded (\sa mem::set_profiling).
+  /// \return Whether it was understood.
+  bool command(const String &input);
+
   /// Prompt when expecting user input
   inline String prompt() const { return m_prompt; }
   inline void set_prompt(String prompt) { m_prompt = prompt; }
 
+  /// Width, depth & length limits for printing results.
+  inline PprStream::Limits print_limits() const { return m_print_limits; }
+  inline void set_print_limits(PprStream::Limits limits)
+  { m_print_limits = limits; }
+
+  /// Limits on evaluating each input (\sa Budget). Going over one is an
+  /// error like any other, which leaves the environment as it was.
+  inline EvalLimits eval_limits() const { return m_eval_limits; }
+  inline void set_eval_limits(EvalLimits limits) { m_eval_limits = limits; }
+  /// Token which stops the input being evaluated when it's set, from any
+  /// thread.
+  inline Ptr<CancelToken> cancel_token() const { return m_cancel; }
+  inline void set_cancel_token(Ptr<CancelToken> token) { m_cancel = token; }
+
+  /// Whether top-level `val`s that aren't functions are bound lazily, i.e.
+  /// only evaluated when they're first used. Then things like big tables in
+  /// a library module cost nothing unless they're needed.
+  inline bool lazy() const { return m_lazy; }
+  inline void set_lazy(bool lazy) { m_lazy = lazy; }
+  /// List the lazy `val`s that have never been evaluated, in the order they
+  /// were declared.
+  void report_unforced(OStream &out) const;
+
   /// Current environment.
   inline Ptr<Env<EnvEntry>> env() const { return m_env; }
   /// Types in #env().
@@ -34,23 +84,50 @@ public:
 private:
   /// Prompt for another line of input.
   void prompt_line(String&);
-  /// Split at the first ';;'
+  /// Split at the first ';;' that isn't in a string or a comment.
   std::pair<String, String> get_next(String);
   /// Try to parse an input and then #process() it.
-  bool try_parse_process(const String &input, bool output = true);
+  bool try_parse_process(const String &input, bool output = true,
+                         const String *file = nullptr);
   void process(Ptr<Input> decl, bool output);
   /// Evaluate an expression and output its value and type.
   void process(Ptr<Expr> decl, bool output);
   /// Add a declaration to the environment.
   void process(Ptr<Decl> decl, bool output);
-  void process_val(Ptr<ValDecl> val, bool output);
-  /// Read a file and #process() its contents.
-  void read_file(const char *filename, bool output = false);
+  /// \param pool If given, the pool \a val's definition has been added to,
+  ///             as \a root.
+  void process_val(Ptr<ValDecl> val, bool output,
+                   const Ptr<const ExprPool> &pool = nullptr,
+                   ExprPool::Ref root = 0);
+  /// Add a module's declarations to the environment. If the module has been
+  /// loaded before, only the declarations that changed (or depend on ones
+  /// that did) are processed again. The declarations are taken out of \a mod
+  /// as they're done with.
+  void process_module(Ptr<ModuleInput> mod, bool output);
+  /// Add the `use` builtin, which needs to refer to this Repl.
+  void add_use();
+
+  [[noreturn]] void quit();
 
-  [[noreturn]] inline void quit() { std::exit(0); }
+  /// What's known about a declaration from a module that was loaded.
+  struct Loaded final
+  {
+    /// Hash of the declaration and the types of its dependencies.
+    size_t fingerprint;
+    /// What it was bound to, to check it hasn't been redefined since.
+    Ptr<EnvEntry> entry;
+  };
 
   String m_prompt;
+  PprStream::Limits m_print_limits;
+  EvalLimits m_eval_limits;
+  Ptr<CancelToken> m_cancel = ptr<CancelToken>();
+  bool m_lazy = false;
+  /// Lazy declarations so far, for #report_unforced().
+  std::vector<std::pair<Id, Ptr<EnvEntry>>> m_lazy_vals;
   Ptr<Env<EnvEntry>> m_env;
+  /// Declarations of each module loaded so far, by name.
+  std::unordered_map<Id, std::unordered_map<Id, Loaded>> m_modules;
 };
 
 
@@ -61,7 +138,7 @@ inline Ptr<Env<Type>> Repl::type_env() const
 
 inline Ptr<Env<Expr>> Repl::value_env() const
 {
-  return map_env<Expr>(env(), [](Ptr<EnvEntry> x){ return x->value; });
+  return map_env<Expr>(env(), [](Ptr<EnvEntry> x){ return x->force(); });
 }
 
 
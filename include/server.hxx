@@ -0,0 +1,130 @@
+#ifndef SERVER_HXX_Q3UNZ8TD
+#define SERVER_HXX_Q3UNZ8TD
+
+#include "string.hxx"
+#include "ptr.hxx"
+#include "exception.hxx"
+#include "repl.hxx"
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace miniml
+{
+
+/// Latency histogram with power-of-two microsecond buckets.
+class Histogram final
+{
+public:
+  /// Bucket `i` counts latencies of at most 2<sup>i</sup>µs.
+  static const unsigned buckets = 32;
+
+  /// Record one latency.
+  void add(std::chrono::microseconds);
+
+  /// Number of latencies recorded.
+  inline unsigned long count() const { return m_count; }
+
+  /// Upper bound of the bucket containing the given quantile.
+  unsigned long quantile(double) const;
+
+  /// Write a summary line, followed by the non-empty buckets.
+  void output(OStream&, const String &name) const;
+
+private:
+  std::array<unsigned long, buckets> m_counts {};
+  unsigned long m_count = 0, m_total_us = 0;
+};
+
+
+/**
+ * Evaluation server listening on a Unix domain socket.
+ *
+ * The builtins and prelude are set up once, and every named session gets its
+ * own environment layered over them. Different sessions are served
+ * concurrently; requests to the same session are processed in order.
+ *
+ * Requests are terminated by `;;` like REPL inputs, and consist of a session
+ * name followed by the input, e.g. `main val x = 1;;`. Instead of a session
+ * name, a request can be a command:
+ *   - `:stats` gives the latency histograms for each kind of request;
+ *   - `:close NAME` throws away a session;
+ *   - `:cancel NAME` stops what a session is evaluating, which has to be
+ *     sent on another connection, since each one's requests are handled in
+ *     order. Anything waiting for the session when it's sent is stopped as
+ *     soon as it starts, and later requests run as normal.
+ *
+ * Each response is a header line `ok LENGTH` or `error LENGTH`, followed by
+ * `LENGTH` bytes of output, as the REPL would have printed it. A request
+ * longer than #max_request gets an error, and the connection is closed.
+ */
+class Server final
+{
+public:
+  /// Longest request accepted, in bytes.
+  static const size_t max_request = 16 << 20;
+
+  /// Exception when setting up the socket fails.
+  struct Error final: public Exception
+  {
+    Error(const String &what);
+    inline const char *what() const noexcept override { return msg.c_str(); }
+    String msg;
+  };
+
+  /// \param limits How to print the results.
+  /// \param eval_limits Limits on evaluating each request.
+  Server(const String &path, PprStream::Limits limits,
+         EvalLimits eval_limits = EvalLimits());
+  ~Server();
+
+  /// Accept connections forever.
+  [[noreturn]] void run();
+
+private:
+  /// A session's environment, and a lock so its requests run in order.
+  struct Session final
+  {
+    Session(Ptr<EnvBase<EnvEntry>> base): repl(base) {}
+    std::mutex mutex;
+    Repl repl;
+
+    /// Tokens of the requests running or waiting for #mutex, which a
+    /// `:cancel` sets. Each request has its own, so it's only stopped by
+    /// one sent after it arrived.
+    std::mutex pending_mutex;
+    std::vector<Ptr<CancelToken>> pending;
+  };
+
+  /// Serve a connection until the other end closes it.
+  void serve(int fd);
+  /// Process one request.
+  /// \return Whether it succeeded, with the output in \a out.
+  bool handle(const String &request, String &out);
+  /// Run a `:command` request.
+  bool command(const String &cmd, const String &arg, String &out);
+  /// Find or create a session.
+  Ptr<Session> session(const String &name);
+  /// Add a latency to the histogram for requests of some kind.
+  void record(const String &kind, std::chrono::microseconds);
+
+  String m_path;
+  int m_socket;
+  PprStream::Limits m_limits;
+  EvalLimits m_eval_limits;
+
+  /// Session containing the builtins & prelude, which the others share.
+  Repl m_base;
+
+  std::mutex m_sessions_mutex;
+  std::unordered_map<String, Ptr<Session>> m_sessions;
+
+  std::mutex m_stats_mutex;
+  std::unordered_map<String, Histogram> m_stats;
+};
+
+}
+
+#endif /* end of include guard: SERVER_HXX_Q3UNZ8TD */
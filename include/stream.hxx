@@ -0,0 +1,84 @@
+#ifndef STREAM_HXX_V7DN3QKE
+#define STREAM_HXX_V7DN3QKE
+
+#include "ptr.hxx"
+#include "string.hxx"
+#include <memory>
+#include <vector>
+
+namespace miniml
+{
+
+class Expr;
+
+/**
+ * Lazy sequences of values, made by the `stream_` and `stringstream_`
+ * builtins. A stream isn't its elements but a recipe for them: a source (a
+ * range of ints, an unfold, the lines of a file) with stages (map, filter,
+ * take...) stacked on top. Nothing happens until something consumes it,
+ * and then each element is pulled through all of the stages before the next
+ * one is made, so however many stages there are it's a single pass, with no
+ * intermediate sequences and only one element at a time alive. Consecutive
+ * maps, filters and takes are merged into one stage when they're stacked.
+ *
+ * Streams are never changed, so they can be shared freely: every consumer
+ * starts a new pass from the source, running any functions in it again.
+ */
+class Stream
+{
+public:
+  /// One pass over a stream.
+  class Cursor
+  {
+  public:
+    virtual ~Cursor() {}
+    /// Move to the next element.
+    /// \return Whether there was one; at the end, \a out is unchanged.
+    virtual bool next(Ptr<Expr> &out) = 0;
+  };
+
+  virtual ~Stream() {}
+
+  /// Start a pass from the beginning.
+  virtual std::unique_ptr<Cursor> open() const = 0;
+
+  /// Calls `f(x)` on each element in turn.
+  template <typename F>
+  void each(F f) const
+  {
+    auto c = open();
+    for (Ptr<Expr> x; c->next(x);) f(x);
+  }
+};
+
+namespace stream
+{
+  using S = Ptr<const Stream>;
+
+  /// Ints from \a from (inclusive) to \a to (not).
+  S range(long from, long to);
+  /// `x₀`, `x₁`... where `f sᵢ` gives `(more, xᵢ, sᵢ₊₁)` and `s₀` is
+  /// \a seed, stopping at the first which isn't `more`.
+  S unfold(Ptr<Expr> f, Ptr<Expr> seed);
+  /// The lines of a file, without their newlines. The file is opened (and
+  /// read a line at a time) on each pass, so a missing file is only an
+  /// error once the stream is used. \sa FileError
+  S lines(const String &file);
+
+  /// `f x` for each element `x`.
+  S map(Ptr<Expr> f, S s);
+  /// The elements for which `p x` is true.
+  S filter(Ptr<Expr> p, S s);
+  /// The first \a n elements, or all of them if there are fewer. Nothing
+  /// after them is pulled from \a s.
+  S take(long n, S s);
+  /// The elements before the first for which `p x` is false.
+  S take_while(Ptr<Expr> p, S s);
+  /// `f x y` for each pair of elements in the same place, as long as the
+  /// shorter one.
+  S zip(Ptr<Expr> f, S l, S r);
+}
+
+}
+
+#endif /* end of include guard: STREAM_HXX_V7DN3QKE */
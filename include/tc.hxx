@@ -3,11 +3,21 @@
 
 #include "ast.hxx"
 #include "env.hxx"
+#include "ir.hxx"
 #include "tc/exception.hxx"
 
 namespace miniml
 {
 
+/// Typechecks an expression, producing typed IR for it. The type of the
+/// expression is the root node's `ty`.
+Ptr<ir::Node> typecheck(Ptr<Expr> expr, Ptr<Env<Type>> env);
+/// Likewise, for an expression which has already been added to \a pool
+/// (e.g. with the rest of its module) as \a root. The IR's ir::Src are in
+/// \a pool.
+Ptr<ir::Node> typecheck(Ptr<Expr> expr, Ptr<Env<Type>> env,
+                        const Ptr<const ExprPool> &pool, ExprPool::Ref root);
+
 /// Typechecks an expression.
 Ptr<Type> type_of(Ptr<Expr> expr, Ptr<Env<Type>> env);
 
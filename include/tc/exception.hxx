@@ -64,6 +64,42 @@ struct CannotProject final: public TCException
   }
 };
 
+/// Something was dereferenced or assigned to which isn't a reference.
+struct NotRef final: public TCException
+{
+  NotRef(Ptr<Expr> expr, Ptr<Type> ty)
+  {
+    msg = *ppr::vcat({"not a reference:"_p,
+                      expr->ppr() >> 1,
+                      "which has type"_p,
+                      ty->ppr() >> 1})->string();
+  }
+};
+
+/// Something was forced which isn't lazy.
+struct NotLazy final: public TCException
+{
+  NotLazy(Ptr<Expr> expr, Ptr<Type> ty)
+  {
+    msg = *ppr::vcat({"not lazy:"_p,
+                      expr->ppr() >> 1,
+                      "which has type"_p,
+                      ty->ppr() >> 1})->string();
+  }
+};
+
+/// Something was indexed which isn't an array.
+struct NotArray final: public TCException
+{
+  NotArray(Ptr<Expr> expr, Ptr<Type> ty)
+  {
+    msg = *ppr::vcat({"not an array:"_p,
+                      expr->ppr() >> 1,
+                      "which has type"_p,
+                      ty->ppr() >> 1})->string();
+  }
+};
+
 /// A recursive value doesn't have a type.
 struct UntypedRec final: public TCException
 {
@@ -77,6 +77,15 @@ enum class Token::Type
   COMMA,    ///< `,`
 
   DOT,      ///< `.`
+
+  REF,      ///< `ref`
+  BANG,     ///< `!`
+  ASSIGN,   ///< `:=`
+  LBRACK,   ///< `[`
+  RBRACK,   ///< `]`
+
+  LAZY,     ///< `lazy`
+  FORCE,    ///< `force`
 };
 
 
@@ -96,7 +105,7 @@ struct IdToken final: public Token
 {
   IdToken(Id *id_, Pos start, Pos end): Token(start, end), id(id_) {}
   IdToken(const Char *c, std::ptrdiff_t size, Pos start, Pos end):
-    IdToken(new Id(ptr<String>(c, size)), start, end)
+    IdToken(new Id(mem::string(String(c, size))), start, end)
   {}
 
   ~IdToken() { delete id; }
@@ -0,0 +1,172 @@
+#ifndef WALK_HXX_Q3N8ZT5R
+#define WALK_HXX_Q3N8ZT5R
+
+#include "ptr.hxx"
+#include <utility>
+#include <vector>
+
+namespace miniml
+{
+
+/**
+ * How to find the children of a node of type `N`, for \ref Walk. Each kind of
+ * tree specialises this with
+ *
+ *     static size_t arity(const N&);
+ *     static Ptr<N> child(const N&, size_t i);
+ */
+template <typename N> struct Tree;
+
+/// Result or context for walks which don't need one.
+struct Unit final {};
+
+
+/**
+ * Depth-first traversal of a tree which keeps the path from the root in a
+ * stack on the heap, rather than recursing, so that it can handle trees of
+ * any depth (machine-generated code has long `;` chains and deeply nested
+ * tuples, which overflow the C++ stack quite quickly).
+ *
+ * A walk computes a result `R` for each node from the results of its
+ * children. Each node also has a context `C` passed down from its parent, such
+ * as the variables in scope or the surrounding precedence. A pass `D`
+ * derives from `Walk<D, N, R, C>` and defines any of these it needs, which
+ * are called directly rather than through a vtable, so they can be inlined
+ * into the loop:
+ *
+ * - #pre, before a node's children are visited. It can change the node's
+ *   context (and that of its children), or give the node's result straight
+ *   away, in which case its children aren't visited.
+ * - #down, before each child, to give the child's context. It sees the
+ *   results of the previous children.
+ * - #post, after the children, to combine their results. Every pass needs
+ *   this one.
+ * - #arity, the number of a node's children to visit.
+ */
+template <typename D, typename N, typename R, typename C = Unit>
+class Walk
+{
+public:
+  /// Walk the tree under \a root.
+  /// \return The root's result.
+  R operator()(const Ptr<N> &root, C ctx = C());
+
+  /// Walk a tree whose root isn't held by a \ref Ptr, like `*this`. The root
+  /// mustn't be kept hold of by the pass.
+  inline R operator()(const N &root, C ctx = C())
+  { return (*this)(Ptr<N>(Ptr<N>(), const_cast<N*>(&root)), ctx); }
+
+protected:
+  /// Called before visiting a node's children, which is the only time for
+  /// leaves. The node can be replaced by another to walk instead.
+  /// \return Whether the node's result has been set (in the last argument),
+  ///         and its children should be skipped.
+  inline bool pre(Ptr<N>&, C&, R&) { return false; }
+
+  /// Called before visiting each child, with its index and the results of
+  /// the children before it.
+  /// \return The context for the child.
+  inline C down(const Ptr<N>&, C &ctx, size_t, const R*) { return ctx; }
+
+  /// Called after visiting all of a node's children.
+  /// \param kids Results of the children.
+  /// \param n Number of children.
+  R post(const Ptr<N>&, C&, R *kids, size_t n) = delete;
+
+  /// Number of children of a node to visit. By default, all of them.
+  inline size_t arity(const N &node) { return Tree<N>::arity(node); }
+
+private:
+  inline D &self() { return static_cast<D&>(*this); }
+
+  struct Frame final
+  {
+    Ptr<N> node;
+    C ctx;
+    /// Next child to visit, and how many there are.
+    size_t next, arity;
+    /// Where the children's results start in the result stack.
+    size_t base;
+  };
+};
+
+
+template <typename D, typename N, typename R, typename C>
+R Walk<D, N, R, C>::operator()(const Ptr<N> &root, C ctx)
+{
+  std::vector<Frame> stack;
+  std::vector<R> results;
+
+  auto push = [&](Ptr<N> node, C c) {
+    R result;
+    if (self().pre(node, c, result)) {
+      results.push_back(std::move(result));
+    } else {
+      auto n = self().arity(*node);
+      stack.push_back(Frame {std::move(node), std::move(c), 0, n,
+                             results.size()});
+    }
+  };
+
+  push(root, std::move(ctx));
+  while (!stack.empty()) {
+    auto &f = stack.back();
+    if (f.next < f.arity) {
+      auto i = f.next++;
+      auto c = self().down(f.node, f.ctx, i, results.data() + f.base);
+      push(Tree<N>::child(*f.node, i), std::move(c));
+    } else {
+      auto result = self().post(f.node, f.ctx, results.data() + f.base,
+                                results.size() - f.base);
+      results.erase(results.begin() + f.base, results.end());
+      results.push_back(std::move(result));
+      stack.pop_back();
+    }
+  }
+
+  return std::move(results.back());
+}
+
+
+/**
+ * Drop a node's reference to a child, from its destructor. Freeing a tree
+ * recurses through the destructors of its nodes, so once that gets deep, the
+ * children whose last reference this was aren't destroyed straight away but
+ * queued, and destroyed in a loop by the outermost destructor still
+ * recursing. So freeing a tree of any depth doesn't overflow the stack.
+ */
+template <typename N>
+void release(Ptr<N> &child)
+{
+  /// How deep destructors can recurse before queueing children.
+  static const unsigned max_depth = 256;
+
+  static thread_local struct {
+    std::vector<Ptr<N>> queue;
+    unsigned depth = 0;
+    bool draining = false;
+  } state;
+
+  if (!child) return;
+  if (child.use_count() > 1 ||
+      (!state.draining && state.depth < max_depth)) {
+    ++state.depth;
+    child.reset();
+    --state.depth;
+    return;
+  }
+
+  state.queue.push_back(std::move(child));
+  if (state.draining) return;
+
+  state.draining = true;
+  while (!state.queue.empty()) {
+    auto last = std::move(state.queue.back());
+    state.queue.pop_back();
+    last.reset();
+  }
+  state.draining = false;
+}
+}
+
+#endif /* end of include guard: WALK_HXX_Q3N8ZT5R */
@@ -16,13 +16,29 @@ Ptr<Ppr> ValDecl::ppr(unsigned, bool pos) const
 
 Ptr<Type> ValDecl::type_of(Ptr<Env<Type>> env) const
 {
+  return typecheck(env)->ty;
+}
+
+Ptr<ir::Node> ValDecl::typecheck(Ptr<Env<Type>> env) const
+{
+  auto pool = ptr<ExprPool>();
+  auto root = pool->add(def());
+  pool->shrink();
+  return typecheck(env, pool, root);
+}
+
+Ptr<ir::Node> ValDecl::typecheck(Ptr<Env<Type>> env,
+                                 const Ptr<const ExprPool> &pool,
+                                 ExprPool::Ref root) const
+{
+  auto code = miniml::typecheck(def(), env, pool, root);
   if (ty()) {
     auto ty_ = nf(ty(), env);
-    check_eq(ty_, miniml::type_of(def(), env), def());
-    return ty_;
-  } else {
-    return miniml::type_of(def(), env);
+    check_eq(ty_, code->ty, def());
+    code = ptr<ir::Node>(*code);
+    code->ty = ty_;
   }
+  return code;
 }
 
 }
@@ -1,7 +1,14 @@
 #include "token.hxx"
 #include "ast/expr.hxx"
+#include "ir.hxx"
+#include "eval/exception.hxx"
+#include "ppr/stream.hxx"
+#include <algorithm>
 #include <sstream>
 #include <cassert>
+#include <cstdlib>
+#include <list>
+#include <unordered_map>
 
 namespace miniml
 {
@@ -34,299 +41,928 @@ Ptr<Ppr> StringExpr::ppr(unsigned, bool pos) const
 }
 
 
-Ptr<Ppr> AppExpr::ppr(unsigned prec, bool pos) const
+Ptr<Ppr> ArrayExpr::ppr(unsigned, bool pos) const
 {
-  return pos_if(pos,
-                parens_if(prec > 10 || pos,
-                          hcat({left()->ppr(10, pos),
-                                +right()->ppr(11, pos)})),
-                start(), end());
+  auto pprs = ptr<std::list<Ptr<Ppr>>>();
+  pprs->push_back("[|"_p);
+  bool first = true;
+  for (auto x: *elems()) {
+    if (!first) pprs->push_back(", "_p);
+    first = false;
+    pprs->push_back(num(x));
+  }
+  pprs->push_back("|]"_p);
+  return pos_if(pos, hcat(pprs), start(), end());
 }
 
 
-Ptr<Ppr> LamExpr::ppr(unsigned prec, bool pos) const
+std::vector<std::pair<MapKey, long>> MapExpr::sorted() const
 {
-  return pos_if(pos,
-                parens_if(prec > 0 || pos,
-                          vcat({hcat({"fn ("_p, var().ppr(pos),
-                                      ':'_p,
-                                      +ty()->ppr(pos), ')'_p, +"=>"_p}),
-                                (body()->ppr(pos) >> 1)})),
-                start(), end());
+  std::vector<std::pair<MapKey, long>> out;
+  out.reserve(m_map.size());
+  m_map.each([&](const MapKey &k, long v) { out.emplace_back(k, v); });
+  std::sort(out.begin(), out.end(),
+            [](const std::pair<MapKey, long> &a,
+               const std::pair<MapKey, long> &b) { return a.first < b.first; });
+  return out;
 }
 
-Ptr<Ppr> IfExpr::ppr(unsigned prec, bool pos) const
+namespace
 {
-  return pos_if(pos,
-                parens_if(prec > 10 || pos,
-                          vcat({hcat({"if "_p, cond()->ppr(10, pos)}),
-                                thenCase()->ppr(10, pos) >> 1,
-                                elseCase()->ppr(10, pos) >> 1})),
-                start(), end());
+  Ptr<Ppr> key_ppr(const MapKey &k)
+  {
+    if (!k.str) return num(k.num);
+    return hcat({'"'_p, string(escaped(*k.str)), '"'_p});
+  }
 }
 
-
-Ptr<Ppr> TypeExpr::ppr(unsigned prec, bool pos) const
+Ptr<Ppr> MapExpr::ppr(unsigned, bool pos) const
 {
-  return pos_if(pos,
-                parens_if(prec > 0 || pos,
-                          hcat({expr()->ppr(pos),
-                                ':'_p,
-                                +ty()->ppr(pos)})),
-                start(), end());
+  auto pprs = ptr<std::list<Ptr<Ppr>>>();
+  pprs->push_back("{|"_p);
+  bool first = true;
+  for (auto &e: sorted()) {
+    if (!first) pprs->push_back(", "_p);
+    first = false;
+    pprs->push_back(hcat({key_ppr(e.first), " => "_p, num(e.second)}));
+  }
+  pprs->push_back("|}"_p);
+  return pos_if(pos, hcat(pprs), start(), end());
 }
 
-Ptr<Ppr> BinOpExpr::ppr(unsigned pr, bool pos) const
+
+namespace
 {
-  unsigned oprec = prec(op()),
-           lprec = assoc(op()) == OpAssoc::LEFT?  oprec : oprec + 1,
-           rprec = assoc(op()) == OpAssoc::RIGHT? oprec : oprec + 1;
-  return pos_if(pos,
-                parens_if(pr > oprec || pos,
-                          hcat({left()->ppr(lprec, pos),
-                                +name(op()),
-                                +right()->ppr(rprec, pos)})),
-                start(), end());
-}
+  /// While alive, a reference cell is being printed on this thread, so that
+  /// one which contains itself (through a closure) is only printed once.
+  struct Printing final
+  {
+    Printing(const void *cell): cell(cell), first(cells.insert(cell).second)
+    {}
+    ~Printing() { if (first) cells.erase(cell); }
 
+    const void *cell;
+    /// Whether the cell wasn't already being printed.
+    bool first;
 
-void BuiltinExpr::give_arg(Ptr<Expr> arg)
-{
-  assert(need_arg());
-  args()->push_back(arg);
+    static thread_local std::unordered_set<const void*> cells;
+  };
+
+  thread_local std::unordered_set<const void*> Printing::cells;
 }
 
-Ptr<Expr> BuiltinExpr::run()
+Ptr<Ppr> RefExpr::ppr(unsigned prec, bool pos) const
 {
-  assert(!need_arg());
-  return effect()(*args());
+  Printing printing(cell());
+  return pos_if(pos,
+                parens_if(prec > 10 || pos,
+                          hcat({"ref"_p,
+                                +(printing.first? get()->ppr(11, pos):
+                                                  "..."_p)})),
+                start(), end());
 }
 
-Ptr<Expr> BuiltinExpr::dup() const
+
+Ptr<Expr> LazyExpr::force() const
 {
-  auto d = ptr<BuiltinExpr>(ty()->dup(), effect(), arity(), start(), end());
-  for (auto a: *args()) {
-    d->give_arg(a->dup());
+  if (forced()) return m_cell->value;
+
+  std::lock_guard<std::recursive_mutex> lock(m_cell->mutex);
+  if (m_cell->done) return m_cell->value;
+  if (m_cell->running) throw ThunkCycle();
+
+  m_cell->running = true;
+  try {
+    m_cell->value = m_cell->thunk();
+  } catch (...) {
+    m_cell->running = false;
+    throw;
   }
-  return d;
+  m_cell->running = false;
+  // the environment it was suspended in isn't needed any more
+  m_cell->thunk = nullptr;
+  m_cell->done.store(true, std::memory_order_release);
+  return m_cell->value;
 }
 
-Ptr<Ppr> TupleExpr::ppr(unsigned, bool pos) const
+Ptr<Ppr> LazyExpr::ppr(unsigned prec, bool pos) const
 {
-  auto pprs = ptr<std::list<Ptr<Ppr>>>();
-  for (auto e: *exprs()) {
-    pprs->push_back(e->ppr(0, pos));
-    pprs->push_back(", "_p);
-  }
-  if (pprs->size() > 0) pprs->pop_back(); // final comma
-  return pos_if(pos, parens_if(true, hcat(pprs)), start(), end());
+  auto val = value();
+  if (!val) return pos_if(pos, "<lazy>"_p, start(), end());
+  return pos_if(pos,
+                parens_if(prec > 10 || pos,
+                          hcat({"lazy"_p, +val->ppr(11, pos)})),
+                start(), end());
 }
 
 
-Ptr<Ppr> DotExpr::ppr(unsigned, bool pos) const
+Ptr<Ppr> StreamExpr::ppr(unsigned, bool pos) const
 {
-  return pos_if(pos,
-                hcat({expr()->ppr(), '.'_p, ppr::num(index())}),
-                start(), end());
+  return pos_if(pos, "<stream>"_p, start(), end());
 }
 
 
 namespace
 {
-  /// Free variables
-  struct FV: public ExprVisitor<unordered_set<Id>>
-  {
-    using ExprVisitor<unordered_set<Id>>::v;
+  /// Precedence of the left operand of an operator.
+  inline unsigned left_prec(BinOp op)
+  { return assoc(op) == OpAssoc::LEFT? prec(op): prec(op) + 1; }
 
-    typedef Ptr<unordered_set<Id>> Ret;
+  /// Precedence of the right operand of an operator.
+  inline unsigned right_prec(BinOp op)
+  { return assoc(op) == OpAssoc::RIGHT? prec(op): prec(op) + 1; }
 
-    Ret v(Ptr<IdExpr> i) override { return single(i->id()); }
-    Ret v(Ptr<IntExpr>) override { return Ret(); }
-    Ret v(Ptr<BoolExpr>) override { return Ret(); }
-    Ret v(Ptr<StringExpr>) override { return Ret(); }
 
-    Ret v(Ptr<AppExpr> e) override
+  /// Documents for expressions with subexpressions; the others print
+  /// themselves. The context is the surrounding precedence.
+  struct PprExpr final: public Walk<PprExpr, Expr, Ptr<Ppr>, unsigned>
+  {
+    PprExpr(bool pos): pos(pos) {}
+
+    bool pre(Ptr<Expr> &e, unsigned &prec, Ptr<Ppr> &doc)
     {
-      auto s1 = v(e->left()), s2 = v(e->right());
-      s1->insert(s2->begin(), s2->end());
-      return s1;
+      switch (e->type()) {
+      case ExprType::APP:
+      case ExprType::LAM:
+      case ExprType::IF:
+      case ExprType::TYPE:
+      case ExprType::BINOP:
+      case ExprType::TUPLE:
+      case ExprType::DOT:
+      case ExprType::UNOP:
+      case ExprType::INDEX:
+        return false;
+      default:
+        doc = e->ppr(prec, pos);
+        return true;
+      }
     }
 
-    Ret v(Ptr<LamExpr> e) override
+    unsigned down(const Ptr<Expr> &e, unsigned&, size_t i,
+                  const Ptr<Ppr>*)
     {
-      auto s = v(e->body());
-      s->erase(e->var());
-      return s;
+      switch (e->type()) {
+      case ExprType::APP:
+        return i == 0? 10: 11;
+      case ExprType::IF:
+        return 10;
+      case ExprType::BINOP: {
+        auto op = static_cast<const BinOpExpr&>(*e).op();
+        return i == 0? left_prec(op): right_prec(op);
+      }
+      case ExprType::DOT:
+        return 11;
+      case ExprType::UNOP:
+        return static_cast<const UnOpExpr&>(*e).op() == UnOp::DEREF? 11: 10;
+      case ExprType::INDEX:
+        return i == 0? 11: 0;
+      default:
+        return 0;
+      }
     }
 
-    Ret v(Ptr<IfExpr> e) override
+    Ptr<Ppr> post(const Ptr<Expr> &e, unsigned &prec, Ptr<Ppr> *kids,
+                  size_t n)
     {
-      auto s = ptr<unordered_set<Id>>(),
-           sc = v(e->cond()),
-           st = v(e->thenCase()),
-           se = v(e->elseCase());
-      s->insert(sc->begin(), sc->end());
-      s->insert(st->begin(), st->end());
-      s->insert(se->begin(), se->end());
-      return s;
+      Ptr<Ppr> doc;
+      switch (e->type()) {
+      case ExprType::APP:
+        doc = parens_if(prec > 10 || pos, hcat({kids[0], +kids[1]}));
+        break;
+      case ExprType::LAM: {
+        auto &l = static_cast<const LamExpr&>(*e);
+        doc = parens_if(prec > 0 || pos,
+                        vcat({hcat({"fn ("_p, l.var().ppr(pos),
+                                    ':'_p,
+                                    +l.ty()->ppr(pos), ')'_p, +"=>"_p}),
+                              kids[0] >> 1}));
+        break;
+      }
+      case ExprType::IF:
+        doc = parens_if(prec > 10 || pos,
+                        vcat({hcat({"if "_p, kids[0]}),
+                              kids[1] >> 1,
+                              kids[2] >> 1}));
+        break;
+      case ExprType::TYPE:
+        doc = parens_if(prec > 0 || pos,
+                        hcat({kids[0],
+                              ':'_p,
+                              +static_cast<const TypeExpr&>(*e).ty()
+                                 ->ppr(pos)}));
+        break;
+      case ExprType::BINOP: {
+        auto op = static_cast<const BinOpExpr&>(*e).op();
+        doc = parens_if(prec > miniml::prec(op) || pos,
+                        hcat({kids[0], +name(op), +kids[1]}));
+        break;
+      }
+      case ExprType::TUPLE: {
+        auto pprs = ptr<std::list<Ptr<Ppr>>>();
+        for (size_t i = 0; i < n; ++i) {
+          if (i > 0) pprs->push_back(", "_p);
+          pprs->push_back(kids[i]);
+        }
+        doc = parens_if(true, hcat(pprs));
+        break;
+      }
+      case ExprType::DOT:
+        doc = hcat({kids[0], '.'_p,
+                    num(static_cast<const DotExpr&>(*e).index())});
+        break;
+      case ExprType::UNOP: {
+        auto op = static_cast<const UnOpExpr&>(*e).op();
+        if (op == UnOp::DEREF) {
+          doc = hcat({'!'_p, kids[0]});
+        } else {
+          doc = parens_if(prec > 10 || pos, hcat({name(op), +kids[0]}));
+        }
+        break;
+      }
+      case ExprType::INDEX:
+        doc = hcat({kids[0], ".["_p, kids[1], ']'_p});
+        break;
+      default:
+        std::abort();
+      }
+      return pos_if(pos, doc, e->start(), e->end());
     }
 
-    Ret v(Ptr<TypeExpr> e) override
+    bool pos;
+  };
+
+
+  /// Streams expressions. The context is the surrounding precedence.
+  struct PrintExpr final: public Walk<PrintExpr, Expr, Unit, unsigned>
+  {
+    using Breaks = PprStream::Breaks;
+
+    PrintExpr(PprStream &out): out(out) {}
+
+    bool pre(Ptr<Expr> &e, unsigned &prec, Unit&)
     {
-      return v(e->expr());
+      switch (e->type()) {
+      case ExprType::ID:
+        out.text(*static_cast<const IdExpr&>(*e).id().val());
+        return true;
+      case ExprType::INT:
+        out.num(static_cast<const IntExpr&>(*e).val());
+        return true;
+      case ExprType::BOOL:
+        out.text(static_cast<const BoolExpr&>(*e).val()? "true": "false");
+        return true;
+      case ExprType::STRING:
+        out.text('"')
+           .text(escaped(*static_cast<const StringExpr&>(*e).val()))
+           .text('"');
+        return true;
+      case ExprType::BUILTIN:
+        out.text("<<builtin>>");
+        return true;
+      case ExprType::ARRAY:
+        array(static_cast<const ArrayExpr&>(*e));
+        return true;
+      case ExprType::MAP:
+        map(static_cast<const MapExpr&>(*e));
+        return true;
+      case ExprType::CLOSURE:
+        static_cast<const ClosureExpr&>(*e).source()->print(out, prec);
+        return true;
+      case ExprType::REF:
+        ref(static_cast<const RefExpr&>(*e), prec);
+        return true;
+      case ExprType::LAZY:
+        lazy(static_cast<const LazyExpr&>(*e), prec);
+        return true;
+      case ExprType::STREAM:
+        out.text("<stream>");
+        return true;
+      case ExprType::DOT:
+      case ExprType::INDEX:
+        return false;
+      case ExprType::UNOP:
+        if (static_cast<const UnOpExpr&>(*e).op() == UnOp::DEREF) {
+          out.text('!');
+          return false;
+        }
+        break;
+      case ExprType::TYPE:
+        open(prec > 0);
+        return false;
+      default:
+        break;
+      }
+
+      // everything else can be arbitrarily deep
+      if (!out.enter()) return true;
+
+      switch (e->type()) {
+      case ExprType::APP:
+      case ExprType::IF:
+        open(prec > 10);
+        out.begin();
+        if (e->type() == ExprType::IF) out.text("if ");
+        break;
+      case ExprType::LAM: {
+        auto &l = static_cast<const LamExpr&>(*e);
+        open(prec > 0);
+        out.begin().text("fn (").text(*l.var().val()).text(": ");
+        l.ty()->print(out);
+        out.text(") =>").space();
+        break;
+      }
+      case ExprType::BINOP:
+        open(prec > miniml::prec(static_cast<const BinOpExpr&>(*e).op()));
+        out.begin(4, Breaks::INCONSISTENT);
+        break;
+      case ExprType::TUPLE:
+        out.text('(').begin(1, Breaks::INCONSISTENT);
+        break;
+      case ExprType::UNOP:
+        open(prec > 10);
+        out.begin().text(symbol(static_cast<const UnOpExpr&>(*e).op()))
+           .space();
+        break;
+      default:
+        std::abort();
+      }
+      return false;
     }
 
-    Ret v(Ptr<BinOpExpr> e) override
+    unsigned down(const Ptr<Expr> &e, unsigned&, size_t i,
+                  const Unit*)
     {
-      auto s1 = v(e->left()), s2 = v(e->right());
-      s1->insert(s2->begin(), s2->end());
-      return s1;
+      switch (e->type()) {
+      case ExprType::APP:
+        if (i > 0) out.space();
+        return i == 0? 10: 11;
+      case ExprType::IF:
+        if (i > 0) out.space();
+        return 10;
+      case ExprType::BINOP: {
+        auto op = static_cast<const BinOpExpr&>(*e).op();
+        if (i == 0) return left_prec(op);
+        out.space();
+        out.text(symbol(op)).text(' ');
+        return right_prec(op);
+      }
+      case ExprType::TUPLE:
+        if (i > 0) out.text(',').space();
+        return 0;
+      case ExprType::TYPE:
+        return 1;
+      case ExprType::DOT:
+        return 11;
+      case ExprType::UNOP:
+        return static_cast<const UnOpExpr&>(*e).op() == UnOp::DEREF? 11: 10;
+      case ExprType::INDEX:
+        if (i == 0) return 11;
+        out.text(".[");
+        return 0;
+      default:
+        return 0;
+      }
     }
 
-    Ret v(Ptr<TupleExpr> es) override
+    Unit post(const Ptr<Expr> &e, unsigned &prec, Unit*, size_t n)
     {
-      auto s1 = ptr<unordered_set<Id>>();
-      for (auto e: *es->exprs()) {
-        auto s2 = v(e);
-        s1->insert(s2->begin(), s2->end());
+      switch (e->type()) {
+      case ExprType::DOT:
+        out.text('.').num(static_cast<const DotExpr&>(*e).index());
+        return Unit();
+      case ExprType::INDEX:
+        out.text(']');
+        return Unit();
+      case ExprType::UNOP:
+        if (static_cast<const UnOpExpr&>(*e).op() == UnOp::DEREF) {
+          return Unit();
+        }
+        out.end();
+        close(prec > 10);
+        break;
+      case ExprType::TYPE:
+        out.text(": ");
+        static_cast<const TypeExpr&>(*e).ty()->print(out);
+        close(prec > 0);
+        return Unit();
+      case ExprType::APP:
+      case ExprType::IF:
+        out.end();
+        close(prec > 10);
+        break;
+      case ExprType::LAM:
+        out.end();
+        close(prec > 0);
+        break;
+      case ExprType::BINOP:
+        out.end();
+        close(prec > miniml::prec(static_cast<const BinOpExpr&>(*e).op()));
+        break;
+      case ExprType::TUPLE:
+        if (n < static_cast<const TupleExpr&>(*e).exprs()->size()) {
+          out.text(',').space();
+          out.more(n);
+        }
+        out.end().text(')');
+        break;
+      default:
+        std::abort();
       }
-      return s1;
+
+      out.leave();
+      return Unit();
     }
 
-    inline Ret v(Ptr<DotExpr> e) override { return v(e->expr()); }
+    size_t arity(const Expr &e)
+    {
+      // only as many elements of a tuple as the length limit allows
+      auto n = Tree<Expr>::arity(e);
+      auto limit = out.limits().length;
+      return e.type() == ExprType::TUPLE && limit && n > limit? limit: n;
+    }
 
-    Ret v(Ptr<BuiltinExpr> e) override
+    inline void open(bool b) { if (b) out.text('('); }
+    inline void close(bool b) { if (b) out.text(')'); }
+
+    void array(const ArrayExpr &a)
     {
-      Ret fv;
-      for (auto arg: *e->args()) {
-        auto fv0 = v(arg);
-        fv->insert(fv0->begin(), fv0->end());
+      auto &xs = *a.elems();
+      out.text("[|").begin(2, Breaks::INCONSISTENT);
+      for (size_t i = 0; i < xs.size(); ++i) {
+        if (i > 0) out.text(',').space();
+        if (!out.more(i)) break;
+        out.num(xs[i]);
       }
-      return fv;
+      out.end().text("|]");
     }
 
-    static Ret single(const Id x)
+    void map(const MapExpr &m)
     {
-      auto set = ptr<unordered_set<Id>>();
-      set->insert(x);
-      return set;
+      auto es = m.sorted();
+      out.text("{|").begin(2, Breaks::INCONSISTENT);
+      for (size_t i = 0; i < es.size(); ++i) {
+        if (i > 0) out.text(',').space();
+        if (!out.more(i)) break;
+        auto &k = es[i].first;
+        if (k.str) {
+          out.text('"').text(escaped(*k.str)).text('"');
+        } else {
+          out.num(k.num);
+        }
+        out.text(" => ").num(es[i].second);
+      }
+      out.end().text("|}");
     }
-  };
 
-  struct Subst:
-    public ExprVisitor<Expr, const Id, Ptr<Expr>, Ptr<unordered_set<Id>>>
-  {
-    using ExprVisitor<Expr, const Id, Ptr<Expr>, Ptr<unordered_set<Id>>>::v;
+    void ref(const RefExpr &r, unsigned prec)
+    {
+      Printing printing(r.cell());
+      open(prec > 10);
+      out.text("ref ");
+      if (printing.first) {
+        r.get()->print(out, 11);
+      } else {
+        out.text("...");
+      }
+      close(prec > 10);
+    }
 
-    Ptr<Expr> v(Ptr<IdExpr> e, const Id x, Ptr<Expr> arg, FV::Ret) override
+    void lazy(const LazyExpr &l, unsigned prec)
     {
-      return e->id() == x? arg : e;
+      auto val = l.value();
+      if (!val) {
+        out.text("<lazy>");
+        return;
+      }
+      open(prec > 10);
+      out.text("lazy ");
+      val->print(out, 11);
+      close(prec > 10);
     }
 
-    Ptr<Expr> v(Ptr<AppExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv) override
+    PprStream &out;
+  };
+
+
+  /// Deep copies of expressions.
+  struct Copy final: public Walk<Copy, Expr, Ptr<Expr>>
+  {
+    bool pre(Ptr<Expr> &e, Unit&, Ptr<Expr> &copy)
     {
-      return ptr<AppExpr>(v(e->left(), x, arg, fv),
-                          v(e->right(), x, arg, fv));
+      switch (e->type()) {
+      case ExprType::ID:
+      case ExprType::INT:
+      case ExprType::BOOL:
+      case ExprType::STRING:
+      case ExprType::CLOSURE:
+      case ExprType::ARRAY:
+      case ExprType::REF:
+      case ExprType::MAP:
+      case ExprType::LAZY:
+      case ExprType::STREAM:
+        copy = e->dup();
+        return true;
+      default:
+        return false;
+      }
     }
 
-    Ptr<Expr> v(Ptr<IfExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv) override
+    Ptr<Expr> post(const Ptr<Expr> &e, Unit&, Ptr<Expr> *kids,
+                   size_t n)
     {
-      return ptr<IfExpr>(v(e->cond(), x, arg, fv),
-                         v(e->thenCase(), x, arg, fv),
-                         v(e->elseCase(), x, arg, fv));
+      auto s = e->start(), t = e->end();
+      switch (e->type()) {
+      case ExprType::APP:
+        return ptr<AppExpr>(kids[0], kids[1], s, t);
+      case ExprType::LAM: {
+        auto &l = static_cast<const LamExpr&>(*e);
+        return ptr<LamExpr>(l.var(), l.ty()->dup(), kids[0], s, t);
+      }
+      case ExprType::IF:
+        return ptr<IfExpr>(kids[0], kids[1], kids[2], s, t);
+      case ExprType::TYPE:
+        return ptr<TypeExpr>(kids[0],
+                             static_cast<const TypeExpr&>(*e).ty()->dup(),
+                             s, t);
+      case ExprType::BINOP:
+        return ptr<BinOpExpr>(static_cast<const BinOpExpr&>(*e).op(),
+                              kids[0], kids[1], s, t);
+      case ExprType::TUPLE:
+        return ptr<TupleExpr>(ptr<TupleExpr::Exprs>(kids, kids + n), s, t);
+      case ExprType::DOT:
+        return ptr<DotExpr>(kids[0], static_cast<const DotExpr&>(*e).index(),
+                            s, t);
+      case ExprType::UNOP:
+        return ptr<UnOpExpr>(static_cast<const UnOpExpr&>(*e).op(), kids[0],
+                             s, t);
+      case ExprType::INDEX:
+        return ptr<IndexExpr>(kids[0], kids[1], s, t);
+      case ExprType::BUILTIN: {
+        auto &b = static_cast<const BuiltinExpr&>(*e);
+        auto d = ptr<BuiltinExpr>(b.ty()->dup(), b.effect(), b.arity(), s, t);
+        for (size_t i = 0; i < n; ++i) d->give_arg(kids[i]);
+        return d;
+      }
+      default:
+        std::abort();
+      }
     }
+  };
+}
 
-    Ptr<Expr> v(Ptr<IntExpr> e, const Id, Ptr<Expr>, FV::Ret) override
-    { return e; }
 
-    Ptr<Expr> v(Ptr<BoolExpr> e, const Id, Ptr<Expr>, FV::Ret) override
-    { return e; }
+Ptr<Ppr> Expr::ppr(unsigned prec, bool pos) const
+{
+  return PprExpr(pos)(*this, prec);
+}
 
-    Ptr<Expr> v(Ptr<StringExpr> e, const Id, Ptr<Expr>, FV::Ret) override
-    { return e; }
+void Expr::print(PprStream &out, unsigned prec) const
+{
+  PrintExpr walk(out);
+  walk(*this, prec);
+}
 
 
-    Ptr<Expr> v(Ptr<LamExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv) override
-    {
-      // capture-avoiding substitution (λx.e)[y:=e']:
-      //   - if x = y, do nothing
-      //   - else
-      //     - if x ∈ FV(e'), use (λx'.e[x:=x']) instead for fresh x'
-      //     - subst body as normal
+size_t Tree<Expr>::arity(const Expr &e)
+{
+  switch (e.type()) {
+  case ExprType::APP:
+  case ExprType::BINOP:
+  case ExprType::INDEX:
+    return 2;
+  case ExprType::LAM:
+  case ExprType::TYPE:
+  case ExprType::DOT:
+  case ExprType::UNOP:
+    return 1;
+  case ExprType::IF:
+    return 3;
+  case ExprType::TUPLE:
+    return static_cast<const TupleExpr&>(e).exprs()->size();
+  case ExprType::BUILTIN:
+    return static_cast<const BuiltinExpr&>(e).args()->size();
+  default:
+    return 0;
+  }
+}
 
-      if (x == e->var()) return e;
+Ptr<Expr> Tree<Expr>::child(const Expr &e, size_t i)
+{
+  switch (e.type()) {
+  case ExprType::APP: {
+    auto &x = static_cast<const AppExpr&>(e);
+    return i == 0? x.left(): x.right();
+  }
+  case ExprType::BINOP: {
+    auto &x = static_cast<const BinOpExpr&>(e);
+    return i == 0? x.left(): x.right();
+  }
+  case ExprType::LAM:
+    return static_cast<const LamExpr&>(e).body();
+  case ExprType::TYPE:
+    return static_cast<const TypeExpr&>(e).expr();
+  case ExprType::DOT:
+    return static_cast<const DotExpr&>(e).expr();
+  case ExprType::UNOP:
+    return static_cast<const UnOpExpr&>(e).expr();
+  case ExprType::INDEX: {
+    auto &x = static_cast<const IndexExpr&>(e);
+    return i == 0? x.array(): x.index();
+  }
+  case ExprType::IF: {
+    auto &x = static_cast<const IfExpr&>(e);
+    return i == 0? x.cond(): i == 1? x.thenCase(): x.elseCase();
+  }
+  case ExprType::TUPLE:
+    return (*static_cast<const TupleExpr&>(e).exprs())[i];
+  case ExprType::BUILTIN:
+    return (*static_cast<const BuiltinExpr&>(e).args())[i];
+  default:
+    std::abort();
+  }
+}
 
-      // id = x, id2 = x'
-      auto id = e->var(), id2 = e->var();
-      if (fv->find(x) != fv->end()) {
-        // find fresh variable
-        unsigned i = 0;
-        while (fv->find(id) != fv->end())
-          id2 = id.suffix(i++);
-      }
 
-      auto body =
-        id == id2?
-          e->body()
-        : v(e->body(), id, ptr<IdExpr>(id2), FV::single(id2));
+Ptr<Expr> AppExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> LamExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> IfExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> TypeExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> TupleExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> DotExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> BinOpExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> BuiltinExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> UnOpExpr::dup() const { return Copy()(*this); }
+Ptr<Expr> IndexExpr::dup() const { return Copy()(*this); }
 
-      return ptr<LamExpr>(id2, e->ty(), v(body, x, arg, fv));
-    }
 
-    Ptr<Expr> v(Ptr<TypeExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv) override
+void BuiltinExpr::give_arg(Ptr<Expr> arg)
+{
+  assert(need_arg());
+  args()->push_back(arg);
+}
+
+Ptr<BuiltinExpr> BuiltinExpr::with_arg(Ptr<Expr> arg) const
+{
+  auto b = ptr<BuiltinExpr>(ty(), effect(), arity(), start(), end());
+  for (auto a: *args()) {
+    b->give_arg(a);
+  }
+  b->give_arg(arg);
+  return b;
+}
+
+Ptr<Expr> BuiltinExpr::run() const
+{
+  assert(!need_arg());
+  return effect()(*args());
+}
+
+namespace
+{
+  /// Find the variables in some IR which refer to a closure's frame rather
+  /// than to lambdas inside it, with their values. The context is the number
+  /// of lambdas the walk is inside.
+  struct Captured final: public Walk<Captured, ir::Node, Unit, unsigned>
+  {
+    Captured(const ir::Frame *frame): frame(frame) {}
+
+    bool pre(Ptr<ir::Node> &n, unsigned &depth, Unit&)
     {
-      return ptr<TypeExpr>(v(e->expr(), x, arg, fv), e->ty());
+      if (n->op == ir::Op::LOCAL && n->index >= depth) {
+        auto f = frame;
+        for (auto i = n->index - depth; i > 0; --i) f = f->up.get();
+        vals.emplace_back(n->name(), f->val);
+      }
+      if (n->op == ir::Op::LAM) ++depth;
+      return false;
     }
 
-    Ptr<Expr> v(Ptr<BinOpExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv)
-      override
+    Unit post(const Ptr<ir::Node>&, unsigned&, Unit*, size_t)
+    { return Unit(); }
+
+    const ir::Frame *frame;
+    std::vector<std::pair<Id, Ptr<Expr>>> vals;
+  };
+}
+
+Ptr<Expr> ClosureExpr::source() const
+{
+  // show the captured values in the lambda, like the substituting evaluator
+  // would have
+  Captured captured(frame().get());
+  captured(lam()->kids[0], 1);
+  auto e = lam()->src.expr();
+  for (auto &v: captured.vals) e = e->subst(v.first, v.second);
+  return e;
+}
+
+Ptr<Ppr> ClosureExpr::ppr(unsigned prec, bool pos) const
+{
+  return source()->ppr(prec, pos);
+}
+
+Ptr<Type> ClosureExpr::ty() const
+{
+  return lam()->ty;
+}
+
+
+namespace
+{
+  /// Free variables. Rather than building a set for each subexpression and
+  /// merging them, this keeps track of the variables bound by the lambdas
+  /// it's inside.
+  struct FV final: public Walk<FV, Expr, Unit>
+  {
+    typedef Ptr<unordered_set<Id>> Ret;
+
+    bool pre(Ptr<Expr> &e, Unit&, Unit&)
     {
-      return ptr<BinOpExpr>(e->op(),
-                            v(e->left(), x, arg, fv),
-                            v(e->right(), x, arg, fv));
+      switch (e->type()) {
+      case ExprType::ID: {
+        auto id = static_cast<const IdExpr&>(*e).id();
+        if (bound.find(id) == bound.end()) vars->insert(id);
+        return true;
+      }
+      case ExprType::LAM:
+        bound.insert(static_cast<const LamExpr&>(*e).var());
+        return false;
+      default:
+        return false;
+      }
     }
 
-    Ptr<Expr> v(Ptr<TupleExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv)
-      override
+    Unit post(const Ptr<Expr> &e, Unit&, Unit*, size_t)
     {
-      auto es = ptr<TupleExpr::Exprs>();
-      es->reserve(e->exprs()->size());
-      for (auto elt: *e->exprs()) {
-        es->push_back(v(elt, x, arg, fv));
+      if (e->type() == ExprType::LAM) {
+        bound.erase(bound.find(static_cast<const LamExpr&>(*e).var()));
+      }
+      return Unit();
+    }
+
+    Ret vars = ptr<unordered_set<Id>>();
+    std::unordered_multiset<Id> bound;
+  };
+
+
+  /// Substitutions to make, innermost first.
+  struct Binding final
+  {
+    Binding(Id var, Ptr<Expr> val, Ptr<Binding> next):
+      var(var), val(val), next(next)
+    {}
+    Id var;
+    Ptr<Expr> val;
+    Ptr<Binding> next;
+  };
+
+  /// \a bs without the bindings for \a var, which are shadowed.
+  Ptr<Binding> without(const Ptr<Binding> &bs, const Id &var)
+  {
+    std::vector<const Binding*> keep;
+    bool shadowed = false;
+    for (auto b = bs.get(); b; b = b->next.get()) {
+      if (b->var == var) {
+        shadowed = true;
+      } else {
+        keep.push_back(b);
       }
-      return ptr<TupleExpr>(es);
     }
+    if (!shadowed) return bs;
+
+    Ptr<Binding> out;
+    for (auto it = keep.rbegin(); it != keep.rend(); ++it) {
+      out = ptr<Binding>((*it)->var, (*it)->val, out);
+    }
+    return out;
+  }
 
-    inline Ptr<Expr> v(Ptr<DotExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv)
-      override
+  /// Capture-avoiding substitution. The context is the substitutions to make
+  /// in a subexpression.
+  struct Subst final: public Walk<Subst, Expr, Ptr<Expr>, Ptr<Binding>>
+  {
+    /// \param fv Free variables of the expressions being substituted in,
+    ///           which mustn't be captured by lambdas.
+    Subst(FV::Ret fv): avoid(fv->begin(), fv->end()) {}
+
+    bool pre(Ptr<Expr> &e, Ptr<Binding> &bs, Ptr<Expr> &out)
     {
-      return ptr<DotExpr>(v(e->expr(), x, arg, fv), e->index());
+      switch (e->type()) {
+      case ExprType::ID: {
+        auto id = static_cast<const IdExpr&>(*e).id();
+        out = e;
+        for (auto b = bs.get(); b; b = b->next.get()) {
+          if (b->var == id) {
+            out = b->val;
+            break;
+          }
+        }
+        return true;
+      }
+      case ExprType::LAM: {
+        // capture-avoiding substitution (λx.e)[y:=e']:
+        //   - if x = y, do nothing
+        //   - else
+        //     - if x ∈ FV(e'), use (λx'.e[x:=x']) instead for fresh x'
+        //     - subst body as normal
+        auto id = static_cast<const LamExpr&>(*e).var();
+        bs = without(bs, id);
+        if (!bs) {
+          out = e;
+          return true;
+        }
+
+        if (avoid.find(id) != avoid.end()) {
+          // find fresh variable, carrying on from the last one tried for
+          // the same name so that nested renamings don't start again from 0
+          auto &i = suffixes[id];
+          auto id2 = id;
+          while (avoid.find(id2) != avoid.end())
+            id2 = id.suffix(i++);
+          avoid.insert(id2);
+          bs = ptr<Binding>(id, ptr<IdExpr>(id2), bs);
+        }
+        return false;
+      }
+      case ExprType::INT:
+      case ExprType::BOOL:
+      case ExprType::STRING:
+      case ExprType::CLOSURE:
+      case ExprType::ARRAY:
+      case ExprType::REF:
+      case ExprType::MAP:
+      case ExprType::LAZY:
+      case ExprType::STREAM:
+        out = e;
+        return true;
+      default:
+        return false;
+      }
     }
 
-    Ptr<Expr> v(Ptr<BuiltinExpr> e, const Id x, Ptr<Expr> arg, FV::Ret fv)
-      override
+    Ptr<Expr> post(const Ptr<Expr> &e, Ptr<Binding> &bs, Ptr<Expr> *kids,
+                   size_t n)
     {
-      auto expr = ptr<BuiltinExpr>(e->ty(), e->effect(), e->arity());
-      for (auto a: *e->args()) {
-        expr->give_arg(v(a, x, arg, fv));
+      switch (e->type()) {
+      case ExprType::APP:
+        return ptr<AppExpr>(kids[0], kids[1]);
+      case ExprType::LAM: {
+        auto &l = static_cast<const LamExpr&>(*e);
+        // the bindings for the lambda's own variable were removed, so if
+        // there's one now it's the renaming
+        auto var = l.var();
+        if (bs->var == var) {
+          var = static_cast<const IdExpr&>(*bs->val).id();
+          avoid.erase(avoid.find(var));
+        }
+        return ptr<LamExpr>(var, l.ty(), kids[0]);
+      }
+      case ExprType::IF:
+        return ptr<IfExpr>(kids[0], kids[1], kids[2]);
+      case ExprType::TYPE:
+        return ptr<TypeExpr>(kids[0], static_cast<const TypeExpr&>(*e).ty());
+      case ExprType::BINOP:
+        return ptr<BinOpExpr>(static_cast<const BinOpExpr&>(*e).op(),
+                              kids[0], kids[1]);
+      case ExprType::TUPLE:
+        return ptr<TupleExpr>(ptr<TupleExpr::Exprs>(kids, kids + n));
+      case ExprType::DOT:
+        return ptr<DotExpr>(kids[0], static_cast<const DotExpr&>(*e).index());
+      case ExprType::UNOP:
+        return ptr<UnOpExpr>(static_cast<const UnOpExpr&>(*e).op(), kids[0]);
+      case ExprType::INDEX:
+        return ptr<IndexExpr>(kids[0], kids[1]);
+      case ExprType::BUILTIN: {
+        auto &b = static_cast<const BuiltinExpr&>(*e);
+        auto expr = ptr<BuiltinExpr>(b.ty(), b.effect(), b.arity());
+        for (size_t i = 0; i < n; ++i) expr->give_arg(kids[i]);
+        return expr;
+      }
+      default:
+        std::abort();
       }
-      return expr;
     }
+
+    std::unordered_multiset<Id> avoid;
+    std::unordered_map<Id, unsigned> suffixes;
   };
 }
 
 Ptr<unordered_set<Id>> fv(const Ptr<Expr> expr)
-{ return FV()(expr); }
+{
+  FV fv;
+  fv(expr);
+  return fv.vars;
+}
 
 Ptr<Expr> Expr::subst(const Id var, const Ptr<Expr> expr)
 {
-  return Subst()(dup(), var, expr, fv(expr));
+  return Subst(fv(expr))(dup(), ptr<Binding>(var, expr, nullptr));
 }
 
 Ptr<Expr> LamExpr::apply(const Ptr<Expr> arg) const
 {
-  auto fv = FV()(arg);
-  return Subst()(body(), var(), arg, fv);
+  return Subst(fv(arg))(body(), ptr<Binding>(var(), arg, nullptr));
 }
 
 }
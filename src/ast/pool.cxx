@@ -0,0 +1,336 @@
+#include "ast/pool.hxx"
+#include "mem.hxx"
+#include <algorithm>
+
+namespace miniml
+{
+
+namespace
+{
+  using Ref = ExprPool::Ref;
+
+  /// Which field of its parent a node still being flattened goes in. The
+  /// arguments a builtin value has been given aren't in any, but are still
+  /// added so that their IR has somewhere to point.
+  enum class Slot { ROOT, A, B, C, LIST, NONE };
+
+  struct Pending final
+  {
+    Ptr<Expr> expr;
+    Ref parent;
+    Slot slot;
+  };
+}
+
+
+ExprPool::~ExprPool()
+{
+  if (m_counted) mem::remove(mem::Kind::POOL, m_counted);
+}
+
+
+ExprPool::Ref ExprPool::add(const Ptr<Expr> &root)
+{
+  // nodes get their index before their children, so this can use a stack
+  // rather than recursion however deep the expression is
+  Ref result = 0;
+  std::vector<Pending> stack {{root, 0, Slot::ROOT}};
+
+  while (!stack.empty()) {
+    auto p = std::move(stack.back());
+    stack.pop_back();
+    auto &e = p.expr;
+    Ref r = node(*e);
+
+    switch (p.slot) {
+    case Slot::ROOT: result = r;                 break;
+    case Slot::A:    m_nodes[p.parent].a = r;    break;
+    case Slot::B:    m_nodes[p.parent].b = r;    break;
+    case Slot::C:    m_nodes[p.parent].c = r;    break;
+    case Slot::LIST: m_lists[p.parent] = r;      break;
+    case Slot::NONE:                             break;
+    }
+
+    Node &n = m_nodes[r];
+    switch (e->type()) {
+    case ExprType::ID:
+      n.a = intern(static_cast<const IdExpr&>(*e).id());
+      break;
+    case ExprType::INT: {
+      auto val = std::uint64_t(static_cast<const IntExpr&>(*e).val());
+      n.a = Ref(val);
+      n.b = Ref(val >> 32);
+      break;
+    }
+    case ExprType::BOOL:
+      n.a = static_cast<const BoolExpr&>(*e).val();
+      break;
+    case ExprType::STRING:
+      n.a = m_strings.size();
+      m_strings.push_back(static_cast<const StringExpr&>(*e).val());
+      break;
+    case ExprType::APP: {
+      auto &x = static_cast<const AppExpr&>(*e);
+      stack.push_back({x.right(), r, Slot::B});
+      stack.push_back({x.left(), r, Slot::A});
+      break;
+    }
+    case ExprType::LAM: {
+      auto &x = static_cast<const LamExpr&>(*e);
+      n.a = intern(x.var());
+      n.b = type_ref(x.ty());
+      stack.push_back({x.body(), r, Slot::C});
+      break;
+    }
+    case ExprType::IF: {
+      auto &x = static_cast<const IfExpr&>(*e);
+      stack.push_back({x.elseCase(), r, Slot::C});
+      stack.push_back({x.thenCase(), r, Slot::B});
+      stack.push_back({x.cond(), r, Slot::A});
+      break;
+    }
+    case ExprType::TYPE: {
+      auto &x = static_cast<const TypeExpr&>(*e);
+      n.b = type_ref(x.ty());
+      stack.push_back({x.expr(), r, Slot::A});
+      break;
+    }
+    case ExprType::BINOP: {
+      auto &x = static_cast<const BinOpExpr&>(*e);
+      n.op = std::uint8_t(x.op());
+      stack.push_back({x.right(), r, Slot::B});
+      stack.push_back({x.left(), r, Slot::A});
+      break;
+    }
+    case ExprType::TUPLE: {
+      auto &es = *static_cast<const TupleExpr&>(*e).exprs();
+      n.a = m_lists.size();
+      n.b = es.size();
+      m_lists.resize(m_lists.size() + es.size());
+      for (size_t i = es.size(); i > 0; --i) {
+        stack.push_back({es[i - 1], Ref(n.a + i - 1), Slot::LIST});
+      }
+      break;
+    }
+    case ExprType::DOT: {
+      auto &x = static_cast<const DotExpr&>(*e);
+      n.b = x.index();
+      stack.push_back({x.expr(), r, Slot::A});
+      break;
+    }
+    case ExprType::UNOP: {
+      auto &x = static_cast<const UnOpExpr&>(*e);
+      n.op = std::uint8_t(x.op());
+      stack.push_back({x.expr(), r, Slot::A});
+      break;
+    }
+    case ExprType::INDEX: {
+      auto &x = static_cast<const IndexExpr&>(*e);
+      stack.push_back({x.index(), r, Slot::B});
+      stack.push_back({x.array(), r, Slot::A});
+      break;
+    }
+    default:
+      n.a = m_values.size();
+      m_values.push_back(e);
+      for (size_t i = Tree<Expr>::arity(*e); i > 0; --i) {
+        stack.push_back({Tree<Expr>::child(*e, i - 1), 0, Slot::NONE});
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+void ExprPool::shrink()
+{
+  m_nodes.shrink_to_fit();
+  m_spans.shrink_to_fit();
+  m_lists.shrink_to_fit();
+  m_ids.shrink_to_fit();
+  std::unordered_map<Id, Ref>().swap(m_id_index);
+  m_strings.shrink_to_fit();
+  m_types.shrink_to_fit();
+  m_values.shrink_to_fit();
+  m_sources.shrink_to_fit();
+
+  if (m_counted) mem::remove(mem::Kind::POOL, m_counted);
+  m_counted = bytes();
+  mem::add(mem::Kind::POOL, m_counted);
+}
+
+
+ExprPool::Ref ExprPool::node(const Expr &e)
+{
+  Ref r = m_nodes.size();
+  Node n;
+  n.kind = std::uint8_t(e.type());
+  n.op = 0;
+  n.pad = 0;
+  n.a = n.b = n.c = 0;
+  m_nodes.push_back(n);
+  m_spans.emplace_back(e.start().offset, e.end().offset);
+
+  // a module's nodes are nearly all from one source, or a few parts of it
+  auto &s = e.source();
+  if (s && (m_sources.empty() || m_sources.back() != s) &&
+      std::find(m_sources.begin(), m_sources.end(), s) == m_sources.end()) {
+    m_sources.push_back(s);
+  }
+  return r;
+}
+
+ExprPool::Ref ExprPool::intern(const Id &id)
+{
+  auto it = m_id_index.find(id);
+  if (it != m_id_index.end()) return it->second;
+  Ref r = m_ids.size();
+  // the nodes have the positions
+  m_ids.emplace_back(id.val());
+  m_id_index.emplace(m_ids.back(), r);
+  return r;
+}
+
+ExprPool::Ref ExprPool::type_ref(Ptr<Type> ty)
+{
+  // consecutive lambdas often share a type annotation
+  if (!m_types.empty() && m_types.back() == ty) return m_types.size() - 1;
+  m_types.push_back(ty);
+  return m_types.size() - 1;
+}
+
+
+Ptr<const Source> ExprPool::source(Ref r) const
+{
+  auto &span = m_spans[r];
+  auto s = Source::find(Pos(span.first? span.first: span.second));
+  return s? s->shared_from_this(): nullptr;
+}
+
+
+ExprPool::Ref ExprPool::arity(const Node &n) const
+{
+  switch (n.type()) {
+  case ExprType::APP:
+  case ExprType::BINOP:
+  case ExprType::INDEX:
+    return 2;
+  case ExprType::TYPE:
+  case ExprType::DOT:
+  case ExprType::UNOP:
+  case ExprType::LAM:
+    return 1;
+  case ExprType::IF:
+    return 3;
+  case ExprType::TUPLE:
+    return n.b;
+  default:
+    return 0;
+  }
+}
+
+ExprPool::Ref ExprPool::child(const Node &n, Ref i) const
+{
+  switch (n.type()) {
+  case ExprType::LAM:
+    return n.c;
+  case ExprType::TUPLE:
+    return elem(n, i);
+  default:
+    return i == 0? n.a: i == 1? n.b: n.c;
+  }
+}
+
+Ptr<Expr> ExprPool::expr(Ref root) const
+{
+  // each node is rebuilt after its children, which are the last ones on
+  // #done by then; this uses explicit stacks so that deep expressions don't
+  // overflow the real one
+  std::vector<std::pair<Ref, bool>> todo {{root, false}};
+  std::vector<Ptr<Expr>> done;
+
+  while (!todo.empty()) {
+    auto t = todo.back();
+    todo.pop_back();
+    const Node &n = m_nodes[t.first];
+    Ref k = arity(n);
+    if (!t.second) {
+      todo.emplace_back(t.first, true);
+      for (Ref i = k; i > 0; --i) todo.emplace_back(child(n, i - 1), false);
+      continue;
+    }
+
+    auto kids = done.data() + done.size() - k;
+    Pos s = start(t.first), e = end(t.first);
+    Ptr<Expr> x;
+    switch (n.type()) {
+    case ExprType::ID:
+      x = ptr<IdExpr>(Id(id(n.a), s, e), s, e);
+      break;
+    case ExprType::INT:
+      x = ptr<IntExpr>(int_val(n), s, e);
+      break;
+    case ExprType::BOOL:
+      x = ptr<BoolExpr>(n.a != 0, s, e);
+      break;
+    case ExprType::STRING:
+      x = ptr<StringExpr>(string(n.a), s, e);
+      break;
+    case ExprType::APP:
+      x = ptr<AppExpr>(kids[0], kids[1], s, e);
+      break;
+    case ExprType::LAM:
+      x = ptr<LamExpr>(id(n.a), type(n.b), kids[0], s, e);
+      break;
+    case ExprType::IF:
+      x = ptr<IfExpr>(kids[0], kids[1], kids[2], s, e);
+      break;
+    case ExprType::TYPE:
+      x = ptr<TypeExpr>(kids[0], type(n.b), s, e);
+      break;
+    case ExprType::BINOP:
+      x = ptr<BinOpExpr>(BinOp(n.op), kids[0], kids[1], s, e);
+      break;
+    case ExprType::TUPLE:
+      x = ptr<TupleExpr>(ptr<TupleExpr::Exprs>(kids, kids + k), s, e);
+      break;
+    case ExprType::DOT:
+      x = ptr<DotExpr>(kids[0], n.b, s, e);
+      break;
+    case ExprType::UNOP:
+      x = ptr<UnOpExpr>(UnOp(n.op), kids[0], s, e);
+      break;
+    case ExprType::INDEX:
+      x = ptr<IndexExpr>(kids[0], kids[1], s, e);
+      break;
+    default:
+      x = m_values[n.a];
+      break;
+    }
+    done.resize(done.size() - k);
+    done.push_back(std::move(x));
+  }
+
+  return done.back();
+}
+
+
+size_t ExprPool::bytes() const
+{
+  // the strings are shared with the values made from them, so they're
+  // counted with those
+  return sizeof *this
+       + m_nodes.capacity() * sizeof(Node)
+       + m_spans.capacity() * sizeof m_spans[0]
+       + m_lists.capacity() * sizeof(Ref)
+       + m_ids.capacity() * sizeof(Id)
+       + m_id_index.size() * (sizeof(Id) + sizeof(Ref) + 2 * sizeof(void*))
+       + m_id_index.bucket_count() * sizeof(void*)
+       + m_strings.capacity() * sizeof(Ptr<String>)
+       + m_types.capacity() * sizeof(Ptr<Type>)
+       + m_values.capacity() * sizeof(Ptr<Expr>)
+       + m_sources.capacity() * sizeof(Ptr<const Source>);
+}
+
+}
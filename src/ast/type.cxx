@@ -1,10 +1,331 @@
 #include "ast/type.hxx"
+#include "ppr/stream.hxx"
+#include <cstdlib>
+#include <list>
+#include <utility>
 
 namespace miniml
 {
 
 using namespace ppr;
 
+namespace
+{
+  /// Documents for arrow, tuple, array, reference, map, lazy and stream
+  /// types; the others print themselves. The context is the surrounding
+  /// precedence.
+  struct PprType final: public Walk<PprType, Type, Ptr<Ppr>, unsigned>
+  {
+    PprType(bool pos): pos(pos) {}
+
+    bool pre(Ptr<Type> &t, unsigned &prec, Ptr<Ppr> &doc)
+    {
+      switch (t->type()) {
+      case TypeType::ARROW:
+      case TypeType::TUPLE:
+      case TypeType::ARRAY:
+      case TypeType::REF:
+      case TypeType::MAP:
+      case TypeType::LAZY:
+      case TypeType::STREAM:
+        return false;
+      default:
+        doc = t->ppr(prec, pos);
+        return true;
+      }
+    }
+
+    unsigned down(const Ptr<Type> &t, unsigned&, size_t i,
+                  const Ptr<Ppr>*)
+    {
+      switch (t->type()) {
+      case TypeType::ARROW:  return i == 0? 1: 0;
+      case TypeType::ARRAY:
+      case TypeType::REF:
+      case TypeType::MAP:
+      case TypeType::LAZY:
+      case TypeType::STREAM: return 1;
+      default:               return 0;
+      }
+    }
+
+    Ptr<Ppr> post(const Ptr<Type> &t, unsigned &prec, Ptr<Ppr> *kids,
+                  size_t n)
+    {
+      Ptr<Ppr> doc;
+      if (t->type() == TypeType::ARROW) {
+        doc = parens_if(prec > 0 || pos,
+                        hcat({kids[0], +"->"_p, +kids[1]}));
+      } else if (t->type() == TypeType::ARRAY) {
+        doc = hcat({kids[0], +"array"_p});
+      } else if (t->type() == TypeType::REF) {
+        doc = hcat({kids[0], +"ref"_p});
+      } else if (t->type() == TypeType::MAP) {
+        doc = hcat({kids[0], +"map"_p});
+      } else if (t->type() == TypeType::LAZY) {
+        doc = hcat({kids[0], +"lazy"_p});
+      } else if (t->type() == TypeType::STREAM) {
+        doc = hcat({kids[0], +"stream"_p});
+      } else {
+        auto pprs = ptr<std::list<Ptr<Ppr>>>();
+        for (size_t i = 0; i < n; ++i) {
+          if (i > 0) pprs->push_back(", "_p);
+          pprs->push_back(kids[i]);
+        }
+        doc = parens_if(true, hcat(pprs));
+      }
+      return pos_if(pos, doc, t->start(), t->end());
+    }
+
+    bool pos;
+  };
+
+
+  /// Streams types. The context is the surrounding precedence.
+  struct PrintType final: public Walk<PrintType, Type, Unit, unsigned>
+  {
+    using Breaks = PprStream::Breaks;
+
+    PrintType(PprStream &out): out(out) {}
+
+    bool pre(Ptr<Type> &t, unsigned &prec, Unit&)
+    {
+      switch (t->type()) {
+      case TypeType::ID:
+        out.text(*static_cast<const IdType&>(*t).id().val());
+        return true;
+      case TypeType::INT:
+        out.text("int");
+        return true;
+      case TypeType::BOOL:
+        out.text("bool");
+        return true;
+      case TypeType::STRING:
+        out.text("string");
+        return true;
+      case TypeType::ARROW:
+        if (prec > 0) out.text('(');
+        out.begin(4, Breaks::INCONSISTENT);
+        return false;
+      case TypeType::TUPLE:
+        out.text('(').begin(1, Breaks::INCONSISTENT);
+        return false;
+      case TypeType::ARRAY:
+      case TypeType::REF:
+      case TypeType::MAP:
+      case TypeType::LAZY:
+      case TypeType::STREAM:
+        return false;
+#ifdef __GNUC__
+      default: std::abort();
+#endif
+      }
+    }
+
+    unsigned down(const Ptr<Type> &t, unsigned&, size_t i,
+                  const Unit*)
+    {
+      if (t->type() == TypeType::ARROW) {
+        if (i == 0) return 1;
+        out.text(" ->").space();
+      } else if (t->type() == TypeType::ARRAY ||
+                 t->type() == TypeType::REF ||
+                 t->type() == TypeType::MAP ||
+                 t->type() == TypeType::LAZY ||
+                 t->type() == TypeType::STREAM) {
+        return 1;
+      } else if (i > 0) {
+        out.text(',').space();
+      }
+      return 0;
+    }
+
+    Unit post(const Ptr<Type> &t, unsigned &prec, Unit*, size_t)
+    {
+      if (t->type() == TypeType::ARRAY) {
+        out.text(" array");
+        return Unit();
+      } else if (t->type() == TypeType::REF) {
+        out.text(" ref");
+        return Unit();
+      } else if (t->type() == TypeType::MAP) {
+        out.text(" map");
+        return Unit();
+      } else if (t->type() == TypeType::LAZY) {
+        out.text(" lazy");
+        return Unit();
+      } else if (t->type() == TypeType::STREAM) {
+        out.text(" stream");
+        return Unit();
+      }
+
+      out.end();
+      if (t->type() == TypeType::TUPLE) {
+        out.text(')');
+      } else if (prec > 0) {
+        out.text(')');
+      }
+      return Unit();
+    }
+
+    PprStream &out;
+  };
+
+
+  /// Copies of arrow, array, reference, map, lazy and stream types; the
+  /// others copy themselves.
+  struct Copy final: public Walk<Copy, Type, Ptr<Type>>
+  {
+    bool pre(Ptr<Type> &t, Unit&, Ptr<Type> &copy)
+    {
+      switch (t->type()) {
+      case TypeType::ARROW:
+      case TypeType::ARRAY:
+      case TypeType::REF:
+      case TypeType::MAP:
+      case TypeType::LAZY:
+      case TypeType::STREAM:
+        return false;
+      default:
+        copy = t->dup();
+        return true;
+      }
+    }
+
+    Ptr<Type> post(const Ptr<Type> &t, Unit&, Ptr<Type> *kids, size_t)
+    {
+      if (t->type() == TypeType::ARRAY) {
+        return ptr<ArrayType>(kids[0], t->start(), t->end());
+      } else if (t->type() == TypeType::REF) {
+        return ptr<RefType>(kids[0], t->start(), t->end());
+      } else if (t->type() == TypeType::MAP) {
+        return ptr<MapType>(kids[0], t->start(), t->end());
+      } else if (t->type() == TypeType::LAZY) {
+        return ptr<LazyType>(kids[0], t->start(), t->end());
+      } else if (t->type() == TypeType::STREAM) {
+        return ptr<StreamType>(kids[0], t->start(), t->end());
+      }
+      return ptr<ArrowType>(kids[0], kids[1], t->start(), t->end());
+    }
+  };
+
+
+  /// Structural equality, keeping the pairs of subtypes still to compare in
+  /// a stack.
+  bool equal(const Type &s, const Type &t)
+  {
+    std::vector<std::pair<const Type*, const Type*>> todo {{&s, &t}};
+    while (!todo.empty()) {
+      auto &a = *todo.back().first, &b = *todo.back().second;
+      todo.pop_back();
+      if (a.type() != b.type()) return false;
+
+      switch (a.type()) {
+      case TypeType::ID:
+        if (!(static_cast<const IdType&>(a).id() ==
+              static_cast<const IdType&>(b).id()))
+          return false;
+        break;
+      case TypeType::ARROW: {
+        auto &a0 = static_cast<const ArrowType&>(a),
+             &b0 = static_cast<const ArrowType&>(b);
+        todo.emplace_back(a0.right().get(), b0.right().get());
+        todo.emplace_back(a0.left().get(), b0.left().get());
+        break;
+      }
+      case TypeType::TUPLE: {
+        auto &as = *static_cast<const TupleType&>(a).tys(),
+             &bs = *static_cast<const TupleType&>(b).tys();
+        if (as.size() != bs.size()) return false;
+        for (size_t i = as.size(); i > 0; --i) {
+          todo.emplace_back(as[i - 1].get(), bs[i - 1].get());
+        }
+        break;
+      }
+      case TypeType::ARRAY:
+        todo.emplace_back(static_cast<const ArrayType&>(a).elem().get(),
+                          static_cast<const ArrayType&>(b).elem().get());
+        break;
+      case TypeType::REF:
+        todo.emplace_back(static_cast<const RefType&>(a).elem().get(),
+                          static_cast<const RefType&>(b).elem().get());
+        break;
+      case TypeType::MAP:
+        todo.emplace_back(static_cast<const MapType&>(a).key().get(),
+                          static_cast<const MapType&>(b).key().get());
+        break;
+      case TypeType::LAZY:
+        todo.emplace_back(static_cast<const LazyType&>(a).elem().get(),
+                          static_cast<const LazyType&>(b).elem().get());
+        break;
+      case TypeType::STREAM:
+        todo.emplace_back(static_cast<const StreamType&>(a).elem().get(),
+                          static_cast<const StreamType&>(b).elem().get());
+        break;
+      default:
+        break;
+      }
+    }
+    return true;
+  }
+}
+
+
+Ptr<Ppr> Type::ppr(unsigned prec, bool pos) const
+{
+  return PprType(pos)(*this, prec);
+}
+
+void Type::print(PprStream &out, unsigned prec) const
+{
+  PrintType walk(out);
+  walk(*this, prec);
+}
+
+
+size_t Tree<Type>::arity(const Type &t)
+{
+  switch (t.type()) {
+  case TypeType::ARROW:
+    return 2;
+  case TypeType::TUPLE:
+    return static_cast<const TupleType&>(t).tys()->size();
+  case TypeType::ARRAY:
+  case TypeType::REF:
+  case TypeType::MAP:
+  case TypeType::LAZY:
+  case TypeType::STREAM:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+Ptr<Type> Tree<Type>::child(const Type &t, size_t i)
+{
+  switch (t.type()) {
+  case TypeType::ARROW: {
+    auto &a = static_cast<const ArrowType&>(t);
+    return i == 0? a.left(): a.right();
+  }
+  case TypeType::TUPLE:
+    return (*static_cast<const TupleType&>(t).tys())[i];
+  case TypeType::ARRAY:
+    return static_cast<const ArrayType&>(t).elem();
+  case TypeType::REF:
+    return static_cast<const RefType&>(t).elem();
+  case TypeType::MAP:
+    return static_cast<const MapType&>(t).key();
+  case TypeType::LAZY:
+    return static_cast<const LazyType&>(t).elem();
+  case TypeType::STREAM:
+    return static_cast<const StreamType&>(t).elem();
+  default:
+    std::abort();
+  }
+}
+
+
 bool IdType::operator==(const Type &other) const
 {
   if (type() == other.type())
@@ -15,100 +336,134 @@ bool IdType::operator==(const Type &other) const
 
 bool ArrowType::operator==(const Type &other) const
 {
-  if (type() == other.type()) {
-    auto other0 = dynamic_cast<const ArrowType&>(other);
-    return *left() == *other0.left() && *right() == *other0.right();
-  }
-  return false;
+  return equal(*this, other);
 }
 
-Ptr<Ppr> ArrowType::ppr(unsigned prec, bool pos) const
+Ptr<Type> ArrowType::dup() const
 {
-  return pos_if(pos,
-                parens_if(prec > 0 || pos,
-                          hcat({left()->ppr(1, pos),
-                                +"->"_p,
-                                +right()->ppr(0, pos)})),
-                start(), end());
+  return Copy()(*this);
 }
 
 
 bool TupleType::operator==(const Type &other) const
 {
-  if (type() == other.type()) {
-    auto other0 = dynamic_cast<const TupleType&>(other);
-    auto it1 = tys()->begin();
-    auto it2 = other0.tys()->begin();
-    for (; it1 != tys()->end() && it2 != other0.tys()->end();
-           ++it1, ++it2) {
-      if (*it1 != *it2) return false;
-    }
-    return (it1 == tys()->end() && it2 == other0.tys()->end());
-  }
-  return false;
+  return equal(*this, other);
 }
 
-Ptr<Ppr> TupleType::ppr(unsigned, bool pos) const
+
+bool ArrayType::operator==(const Type &other) const
 {
-  auto pprs = ptr<std::list<Ptr<Ppr>>>();
-  for (auto e: *tys()) {
-    pprs->push_back(e->ppr(0, pos));
-    pprs->push_back(", "_p);
-  }
-  if (pprs->size() > 0) pprs->pop_back(); // final comma
-  return pos_if(pos, parens_if(true, hcat(pprs)), start(), end());
+  return equal(*this, other);
+}
+
+Ptr<Type> ArrayType::dup() const
+{
+  return Copy()(*this);
 }
 
 
-namespace
+bool RefType::operator==(const Type &other) const
 {
-  struct TypeNF final: public TypeVisitor<Type, Ptr<Env<Type>>>
-  {
-    using TypeVisitor<Type, Ptr<Env<Type>>>::v;
+  return equal(*this, other);
+}
 
-    Ptr<Type> v(Ptr<IdType> id, Ptr<Env<Type>> env) override
-    {
-      auto t = env->lookup(id->id());
-      return t? v(t, env): id;
-    }
+Ptr<Type> RefType::dup() const
+{
+  return Copy()(*this);
+}
 
-    Ptr<Type> v(Ptr<IntType>, Ptr<Env<Type>>) override
-    {
-      return ptr<IntType>();
-    }
 
-    Ptr<Type> v(Ptr<BoolType>, Ptr<Env<Type>>) override
-    {
-      return ptr<BoolType>();
-    }
+bool MapType::operator==(const Type &other) const
+{
+  return equal(*this, other);
+}
 
-    Ptr<Type> v(Ptr<StringType>, Ptr<Env<Type>>) override
-    {
-      return ptr<StringType>();
-    }
+Ptr<Type> MapType::dup() const
+{
+  return Copy()(*this);
+}
+
+
+bool LazyType::operator==(const Type &other) const
+{
+  return equal(*this, other);
+}
+
+Ptr<Type> LazyType::dup() const
+{
+  return Copy()(*this);
+}
+
+
+bool StreamType::operator==(const Type &other) const
+{
+  return equal(*this, other);
+}
+
+Ptr<Type> StreamType::dup() const
+{
+  return Copy()(*this);
+}
+
+
+namespace
+{
+  struct TypeNF final: public Walk<TypeNF, Type, Ptr<Type>>
+  {
+    TypeNF(Ptr<Env<Type>> env): env(env) {}
 
-    Ptr<Type> v(Ptr<ArrowType> ty, Ptr<Env<Type>> env) override
+    bool pre(Ptr<Type> &t, Unit&, Ptr<Type> &out)
     {
-      auto l = v(ty->left(), env),
-           r = v(ty->right(), env);
-      return ptr<ArrowType>(l, r);
+      // names can stand for other types, including other names
+      while (t->type() == TypeType::ID) {
+        auto t0 = env->lookup(static_cast<const IdType&>(*t).id());
+        if (!t0) {
+          out = t;
+          return true;
+        }
+        t = t0;
+      }
+
+      switch (t->type()) {
+      case TypeType::INT:
+        out = ptr<IntType>();
+        return true;
+      case TypeType::BOOL:
+        out = ptr<BoolType>();
+        return true;
+      case TypeType::STRING:
+        out = ptr<StringType>();
+        return true;
+      default:
+        return false;
+      }
     }
 
-    Ptr<Type> v(Ptr<TupleType> ty, Ptr<Env<Type>> env) override
+    Ptr<Type> post(const Ptr<Type> &t, Unit&, Ptr<Type> *kids, size_t n)
     {
-      auto tys = ptr<std::vector<Ptr<Type>>>();
-      tys->reserve(ty->tys()->size());
-      for (auto t: *ty->tys()) {
-        tys->push_back(v(t, env));
+      switch (t->type()) {
+      case TypeType::ARROW:
+        return ptr<ArrowType>(kids[0], kids[1]);
+      case TypeType::ARRAY:
+        return ptr<ArrayType>(kids[0]);
+      case TypeType::REF:
+        return ptr<RefType>(kids[0]);
+      case TypeType::MAP:
+        return ptr<MapType>(kids[0]);
+      case TypeType::LAZY:
+        return ptr<LazyType>(kids[0]);
+      case TypeType::STREAM:
+        return ptr<StreamType>(kids[0]);
+      default:
+        return ptr<TupleType>(ptr<TupleType::Types>(kids, kids + n));
       }
-      return ptr<TupleType>(tys);
     }
-  };
-
 
+    Ptr<Env<Type>> env;
+  };
 }
 
 Ptr<Type> nf(Ptr<Type> t, Ptr<Env<Type>> env)
-{ return TypeNF()(t, env); }
+{ return TypeNF(env)(t); }
 
 }
@@ -0,0 +1,172 @@
+#include "ir.hxx"
+#include "eval.hxx"
+#include "eval/hooks.hxx"
+#include "init_env.hxx"
+#include "kernel.hxx"
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+
+namespace miniml
+{
+
+namespace ir
+{
+
+namespace
+{
+  /// Most instructions a batch program can have...
+  const size_t max_insns = 64;
+  /// ...and selects, since both sides of every one are computed for every
+  /// element.
+  const unsigned max_selects = 8;
+  /// Fewest elements worth compiling a program for.
+  const size_t min_batch = 64;
+  /// Elements to run between counting the steps taken, so that the limits
+  /// are still noticed in a long batch.
+  const size_t chunk = 4096;
+
+  /// Compile the body of a closure from ints to a kernel::Program, if it's
+  /// made of nothing but arithmetic, comparisons and ifs on ints and bools.
+  /// The variables it closes over, and the globals it uses, are the same
+  /// for every element, so they're constants.
+  struct Compile final
+  {
+    Compile(const ClosureExpr &c): closure(c) {}
+
+    /// \return The instruction computing \a n, or -1 if it can't be
+    ///         compiled.
+    long operator()(const Node &n)
+    {
+      // also stops the recursion getting deep
+      if (++visited > 2 * max_insns) return -1;
+
+      switch (n.op) {
+      case Op::CONST:
+        return constant(n.value);
+      case Op::LOCAL: {
+        if (n.index == 0) {
+          if (arg < 0) arg = emit(kernel::Op::ARG);
+          return arg;
+        }
+        auto f = closure.frame().get();
+        for (auto i = n.index; i > 1; --i) f = f->up.get();
+        return constant(f->val);
+      }
+      case Op::GLOBAL: {
+        auto t = n.ty->type();
+        if (t != TypeType::INT && t != TypeType::BOOL) return -1;
+        return constant(n.global->force());
+      }
+      case Op::SHARED: {
+        auto it = shared.find(n.index);
+        if (it != shared.end()) return it->second;
+        return shared[n.index] = (*this)(*n.kids[0]);
+      }
+      case Op::IF: {
+        if (++selects > max_selects) return -1;
+        return op(n, kernel::Op::SELECT);
+      }
+      case Op::INT_DIV: {
+        // only by a constant, so it can't fail on an element where the
+        // scalar evaluator wouldn't have divided at all
+        auto a = (*this)(*n.kids[0]), b = (*this)(*n.kids[1]);
+        if (a < 0 || b < 0) return -1;
+        auto &d = prog.code[b];
+        if (d.op != kernel::Op::CONST || d.k == 0 || d.k == -1) return -1;
+        return emit(kernel::Op::DIV, a, 0, 0, d.k);
+      }
+      case Op::INT_ADD:  return op(n, kernel::Op::ADD);
+      case Op::INT_SUB:  return op(n, kernel::Op::SUB);
+      case Op::INT_MUL:  return op(n, kernel::Op::MUL);
+      case Op::INT_LT:   return op(n, kernel::Op::LT);
+      case Op::INT_LE:   return op(n, kernel::Op::LE);
+      case Op::INT_EQ:   return op(n, kernel::Op::EQ);
+      case Op::INT_GE:   return op(n, kernel::Op::GE);
+      case Op::INT_GT:   return op(n, kernel::Op::GT);
+      case Op::INT_NE:   return op(n, kernel::Op::NE);
+      case Op::BOOL_AND: return op(n, kernel::Op::AND);
+      case Op::BOOL_OR:  return op(n, kernel::Op::OR);
+      case Op::BOOL_IFF: return op(n, kernel::Op::IFF);
+      default:
+        return -1;
+      }
+    }
+
+    long emit(kernel::Op op, unsigned a = 0, unsigned b = 0, unsigned c = 0,
+              long k = 0)
+    {
+      if (prog.code.size() >= max_insns) return -1;
+      prog.code.push_back(kernel::Insn {op, a, b, c, k});
+      return prog.code.size() - 1;
+    }
+
+    long constant(const Ptr<Expr> &val)
+    {
+      switch (val->type()) {
+      case ExprType::INT:
+        return emit(kernel::Op::CONST, 0, 0, 0,
+                    static_cast<const IntExpr&>(*val).val());
+      case ExprType::BOOL:
+        return emit(kernel::Op::CONST, 0, 0, 0,
+                    static_cast<const BoolExpr&>(*val).val()? -1: 0);
+      default:
+        return -1;
+      }
+    }
+
+    /// An instruction whose operands are the node's kids.
+    long op(const Node &n, kernel::Op op)
+    {
+      long k[3] = {0, 0, 0};
+      for (size_t i = 0; i < n.kids.size(); ++i) {
+        k[i] = (*this)(*n.kids[i]);
+        if (k[i] < 0) return -1;
+      }
+      return emit(op, k[0], k[1], k[2]);
+    }
+
+    const ClosureExpr &closure;
+    kernel::Program prog;
+    /// Instructions computing the #Op::SHARED slots, and the argument.
+    std::unordered_map<unsigned, long> shared;
+    long arg = -1;
+    size_t visited = 0;
+    unsigned selects = 0;
+  };
+}
+
+bool map(const ClosureExpr &c, const long *xs, long *out, size_t n)
+{
+  // a program doesn't go through the evaluator's hooks, so with any the
+  // elements are applied one at a time
+  if (n < min_batch || EvalHooks::enabled) return false;
+
+  auto &ty = static_cast<const ArrowType&>(*c.lam()->ty);
+  auto res = ty.right()->type();
+  if (ty.left()->type() != TypeType::INT ||
+      (res != TypeType::INT && res != TypeType::BOOL)) {
+    return false;
+  }
+
+  Compile compile(c);
+  if (compile(*c.lam()->kids[0]) < 0) return false;
+  auto &prog = compile.prog;
+  assert(!prog.code.empty());
+
+  // the same number of steps as evaluating the body one node at a time
+  // would take, more or less
+  for (size_t i = 0; i < n; i += chunk) {
+    auto m = std::min(chunk, n - i);
+    Budget::steps(m * prog.code.size());
+    kernel::run(prog, xs + i, out + i, m);
+  }
+  if (res == TypeType::BOOL) {
+    for (size_t i = 0; i < n; ++i) out[i] &= 1;
+  }
+  return true;
+}
+
+}
+
+}
@@ -0,0 +1,131 @@
+#include "eval/budget.hxx"
+#include "eval/exception.hxx"
+#include "mem.hxx"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+namespace miniml
+{
+
+const size_t Budget::stack_headroom;
+thread_local Budget *Budget::s_current = nullptr;
+thread_local std::uintptr_t Budget::s_stack_limit = 0;
+thread_local size_t Budget::s_stack_size = 0;
+
+
+Budget::Budget(const EvalLimits &limits, Ptr<CancelToken> cancel):
+  m_limits(limits), m_cancel(cancel),
+  m_deadline(std::chrono::steady_clock::now() + limits.time),
+  m_heap_start(mem::thread_bytes), m_prev(s_current)
+{
+  if (m_prev) inherit();
+  s_current = this;
+}
+
+Budget::~Budget()
+{
+  s_current = m_prev;
+  if (m_prev) m_prev->m_steps += m_steps;
+}
+
+void Budget::inherit()
+{
+  auto &outer = *m_prev;
+  auto &lim = outer.m_limits;
+  // a limit of 0 is none, so one that's all used up is gone over now
+  auto cut = [&](Limit which, unsigned long &mine, unsigned long limit,
+                 unsigned long used) {
+    if (!limit) return;
+    if (used >= limit) outer.exceeded(which);
+    if (!mine || limit - used < mine) {
+      mine = limit - used;
+      m_inherited |= 1u << which;
+    }
+  };
+
+  unsigned long steps = m_limits.steps, heap = m_limits.heap,
+    depth = m_limits.depth;
+  cut(STEPS, steps, lim.steps, outer.m_steps);
+  auto heap_used = mem::thread_bytes - outer.m_heap_start;
+  cut(HEAP, heap, lim.heap, heap_used > 0? heap_used: 0);
+  cut(DEPTH, depth, lim.depth, outer.m_depth);
+  m_limits.steps = steps;
+  m_limits.heap = heap;
+  m_limits.depth = depth;
+
+  if (lim.time.count() &&
+      (!m_limits.time.count() || outer.m_deadline < m_deadline)) {
+    m_deadline = outer.m_deadline;
+    m_limits.time = lim.time;
+    m_inherited |= 1u << TIME;
+  }
+  if (!m_cancel) m_cancel = outer.m_cancel;
+}
+
+
+void Budget::reserve(size_t bytes)
+{
+  auto b = s_current;
+  if (!b || !b->m_limits.heap) return;
+  auto used = mem::thread_bytes - b->m_heap_start;
+  if (used + long(bytes) > long(b->m_limits.heap)) b->exceeded(HEAP);
+}
+
+void Budget::find_stack_limit()
+{
+  s_stack_limit = 1;
+#ifdef __linux__
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+  void *addr;
+  size_t size;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    // the stack grows down from addr + size
+    auto keep = std::max(stack_headroom, size / 8);
+    if (keep < size) {
+      s_stack_limit = reinterpret_cast<std::uintptr_t>(addr) + keep;
+      s_stack_size = size;
+    }
+  }
+  pthread_attr_destroy(&attr);
+#endif
+}
+
+void Budget::stack_exceeded()
+{
+  throw LimitExceeded(std::to_string(s_stack_size / 1024) + "KB of stack");
+}
+
+void Budget::check()
+{
+  if (m_limits.heap && mem::thread_bytes - m_heap_start > long(m_limits.heap))
+    exceeded(HEAP);
+  if (m_limits.time.count() && std::chrono::steady_clock::now() > m_deadline)
+    exceeded(TIME);
+  if (m_cancel && m_cancel->cancelled())
+    throw Cancelled();
+}
+
+void Budget::exceeded(Limit limit) const
+{
+  if (m_inherited & (1u << limit)) m_prev->exceeded(limit);
+  switch (limit) {
+  case STEPS:
+    throw LimitExceeded(std::to_string(m_limits.steps) + " steps");
+  case HEAP:
+    throw LimitExceeded(std::to_string(m_limits.heap) + " bytes");
+  case DEPTH:
+    throw LimitExceeded(std::to_string(m_limits.depth) + " nested calls");
+  case TIME:
+    throw LimitExceeded(std::to_string(m_limits.time.count()) + "ms");
+#ifdef __GNUC__
+  default: std::abort();
+#endif
+  }
+}
+
+}
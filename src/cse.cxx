@@ -0,0 +1,203 @@
+#include "ir.hxx"
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace miniml
+{
+
+namespace ir
+{
+
+namespace
+{
+  /// What a pure node computes: its operation and the classes of its
+  /// operands. Lambda-bound variables are de Bruijn indices, so
+  /// alpha-equivalent expressions have equal keys.
+  struct Key final
+  {
+    Op op;
+    unsigned index;
+    /// Value of an int or bool constant, or the number given to the
+    /// definition a global refers to.
+    long lit;
+    /// Any other constant, which is only the same as itself.
+    const Expr *value;
+    std::vector<unsigned> kids;
+
+    bool operator==(const Key &other) const
+    {
+      return op == other.op && index == other.index && lit == other.lit &&
+             value == other.value && kids == other.kids;
+    }
+  };
+
+  struct KeyHash final
+  {
+    size_t operator()(const Key &k) const
+    {
+      size_t h = size_t(k.op);
+      auto mix = [&](size_t x) { h ^= x + 0x9e3779b9 + (h << 6) + (h >> 2); };
+      mix(k.index);
+      mix(std::hash<long>()(k.lit));
+      mix(std::hash<const Expr*>()(k.value));
+      for (auto c: k.kids) mix(c);
+      return h;
+    }
+  };
+
+  /// Equivalence classes of the subexpressions of a lambda body. Nested
+  /// lambdas run in frames of their own, so they aren't gone into, but
+  /// collected to do separately.
+  struct Classes final: public Walk<Classes, Node, unsigned>
+  {
+    Classes(std::vector<Ptr<Node>> &lams): lams(lams) {}
+
+    /// A kid of a node which could be shared.
+    struct Use final
+    {
+      Node *parent;
+      size_t kid;
+      unsigned cls;
+    };
+
+    /// What's known about each class.
+    struct Info final
+    {
+      /// Whether it can be shared at all.
+      bool pure;
+      /// Number of times it appears.
+      unsigned uses;
+    };
+
+    unsigned post(const Ptr<Node> &n, Unit&, unsigned *kids, size_t k)
+    {
+      Key key {n->op, 0, 0, nullptr, {}};
+      bool pure = true;
+
+      switch (n->op) {
+      case Op::CONST:
+        switch (n->value->type()) {
+        case ExprType::INT:
+          key.lit = static_cast<const IntExpr&>(*n->value).val();
+          break;
+        case ExprType::BOOL:
+          key.lit = static_cast<const BoolExpr&>(*n->value).val();
+          break;
+        default:
+          key.value = n->value.get();
+          break;
+        }
+        break;
+      case Op::LOCAL:
+      case Op::PROJ:
+        key.index = n->index;
+        break;
+      case Op::GLOBAL: {
+        auto g = n->global.get();
+        auto it = globals.find(g);
+        if (it == globals.end()) {
+          it = globals.emplace(g, globals.size()).first;
+        }
+        key.lit = it->second;
+        break;
+      }
+      case Op::LAM:
+        lams.push_back(n);
+        pure = false;
+        break;
+      // anything could happen in a call, including printing things, and the
+      // same goes for forcing a `lazy`
+      case Op::APP:
+      case Op::CALL:
+      case Op::FORCE:
+        pure = false;
+        break;
+      // reading mutable things can give something different each time, as
+      // well as changing them
+      case Op::SEQ:
+      case Op::REF:
+      case Op::DEREF:
+      case Op::ASSIGN:
+      case Op::INDEX:
+      case Op::SET_INDEX:
+      case Op::LAZY:
+        pure = false;
+        break;
+      default:
+        break;
+      }
+
+      for (size_t i = 0; i < k; ++i) {
+        auto &info = infos[kids[i]];
+        pure = pure && info.pure;
+        if (info.pure && shareable(*n->kids[i])) {
+          ++info.uses;
+          uses.push_back(Use {n.get(), i, kids[i]});
+        }
+      }
+
+      unsigned cls;
+      if (pure) {
+        key.kids.assign(kids, kids + k);
+        auto it = keys.find(key);
+        if (it != keys.end()) return it->second;
+        cls = keys[std::move(key)] = infos.size();
+      } else {
+        cls = infos.size();
+      }
+      infos.push_back(Info {pure, 0});
+      return cls;
+    }
+
+    size_t arity(const Node &n)
+    { return n.op == Op::LAM? 0: n.kids.size(); }
+
+    /// Whether it's worth sharing a node, rather than computing it again.
+    static bool shareable(const Node &n)
+    { return n.op != Op::CONST && n.op != Op::LOCAL; }
+
+    std::vector<Ptr<Node>> &lams;
+    std::unordered_map<Key, unsigned, KeyHash> keys;
+    std::unordered_map<const EnvEntry*, long> globals;
+    std::vector<Info> infos;
+    std::vector<Use> uses;
+  };
+}
+
+void cse(const Ptr<Node> &root)
+{
+  // nothing's shared outside lambdas, but there are lambdas to find
+  std::vector<Ptr<Node>> lams;
+  Classes top(lams);
+  top(root);
+
+  while (!lams.empty()) {
+    auto lam = lams.back();
+    lams.pop_back();
+
+    Classes classes(lams);
+    classes(lam->kids[0]);
+
+    // each repeated class gets a slot in the frame, filled in by whichever
+    // of its uses is run first
+    std::vector<unsigned> slots(classes.infos.size(), 0);
+    unsigned next = 0;
+    for (auto &u: classes.uses) {
+      auto &info = classes.infos[u.cls];
+      if (info.uses < 2) continue;
+      if (!slots[u.cls]) slots[u.cls] = ++next;
+
+      auto &kid = u.parent->kids[u.kid];
+      auto shared = ptr<Node>(Op::SHARED, kid->ty, kid->src);
+      shared->index = slots[u.cls] - 1;
+      shared->kids.push_back(kid);
+      kid = shared;
+    }
+    lam->index = next;
+  }
+}
+
+}
+
+}
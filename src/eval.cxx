@@ -1,4 +1,6 @@
 #include "eval.hxx"
+#include "eval/hooks.hxx"
+#include "ir.hxx"
 #include <functional>
 #include <cassert>
 
@@ -16,139 +18,254 @@ namespace
     return dyn_cast<T>(e)->val();
   }
 
-  struct Eval final: public ExprVisitor<Expr, ENV>
+  /// Element \a i of an evaluated array, checking it's there.
+  long &elem(Ptr<Expr> a, Ptr<Expr> i)
   {
-    using ExprVisitor<Expr, ENV>::v;
+    auto &xs = *dyn_cast<ArrayExpr>(a)->elems();
+    auto j = lit<ExprType::INT, IntExpr, long>(i);
+    if (j < 0 || size_t(j) >= xs.size()) throw OutOfBounds(j, xs.size());
+    return xs[j];
+  }
+
+  /// Apply an operator to evaluated operands.
+  Ptr<Expr> binop(BinOp op, Ptr<Expr> l, Ptr<Expr> r)
+  {
+    using namespace std;
+
+    auto to_int = lit<ExprType::INT, IntExpr, long>;
+    auto to_bool = lit<ExprType::BOOL, BoolExpr, bool>;
+
+    auto int_op =
+      [&](function<long(long, long)> f) {
+        return ptr<IntExpr>(f(to_int(l), to_int(r)));
+      };
+    auto bool_op =
+      [&](function<bool(bool, bool)> f) {
+        return ptr<BoolExpr>(f(to_bool(l), to_bool(r)));
+      };
+    auto int_cmp =
+      [&](function<bool(long, long)> f) {
+        return ptr<BoolExpr>(f(to_int(l), to_int(r)));
+      };
+
+    switch (op) {
+    case BinOp::PLUS:    return int_op(plus<long>());
+    case BinOp::MINUS:   return int_op(minus<long>());
+    case BinOp::TIMES:   return int_op(multiplies<long>());
+    case BinOp::DIVIDE:  return int_op(divides<long>());
+    case BinOp::AND:     return bool_op(logical_and<bool>());
+    case BinOp::OR:      return bool_op(logical_or<bool>());
+    case BinOp::IFF:     return bool_op(equal_to<bool>());
+    case BinOp::LESS:    return int_cmp(less<long>());
+    case BinOp::LEQ:     return int_cmp(less_equal<long>());
+    case BinOp::EQUAL:   return int_cmp(equal_to<long>());
+    case BinOp::GEQ:     return int_cmp(greater_equal<long>());
+    case BinOp::GREATER: return int_cmp(greater<long>());
+    case BinOp::NEQ:     return int_cmp(not_equal_to<long>());
+    case BinOp::SEQ:     return r;
+#ifdef __GNUC__
+    default:             std::abort();
+#endif
+    }
+  }
+
+
+  /// Apply an evaluated function to an evaluated argument.
+  Ptr<Expr> apply(Ptr<Expr> l, Ptr<Expr> r, ENV env)
+  {
+    Ptr<LamExpr> lam; Ptr<BuiltinExpr> bi;
 
-    Ptr<Expr> v(Ptr<IdExpr> x, ENV env) override
+    switch (l->type()) {
+    case ExprType::LAM: {
+      lam = dyn_cast<LamExpr>(l);
+      Budget::Call call;
+      EvalHooks::call(*lam, r);
+      auto val = eval(lam->apply(r), lam->env());
+      EvalHooks::ret(*lam, val);
+      return val;
+    }
+    case ExprType::CLOSURE:
+      return ir::call(static_cast<const ClosureExpr&>(*l), r);
+    case ExprType::BUILTIN:
+      bi = dyn_cast<BuiltinExpr>(l);
+      if (bi->need_arg()) {
+        return eval(bi->with_arg(r), env);
+      } // else fall thru
+    default:
+      return ptr<AppExpr>(l, r);
+    }
+  }
+
+
+  /// The tree evaluator, with the hooks \a H around each expression.
+  /// \sa hooks
+  template <typename H>
+  struct Eval final: public ExprVisitor<Eval<H>, Ptr<Expr>, ENV>
+  {
+    using SELF = const Ptr<Expr>&;
+    using Visitor = ExprVisitor<Eval<H>, Ptr<Expr>, ENV>;
+
+    inline Ptr<Expr> operator()(const Ptr<Expr> &e, const ENV &env)
     {
-      auto e = env->lookup(x->id());
-      assert(e);
-      if (e->type() == ExprType::BUILTIN) {
-        return v(e->dup(), env);
-      } else {
-        return v(e, env);
+      if (!H::enabled) return Visitor::operator()(e, env);
+
+      H::enter(*e);
+      Ptr<Expr> val;
+      try {
+        val = Visitor::operator()(e, env);
+      } catch (...) {
+        H::unwind(*e);
+        throw;
       }
+      H::leave(*e, val);
+      return val;
     }
 
-    Ptr<Expr> v(Ptr<AppExpr> x, ENV env) override
+    Ptr<Expr> v(const IdExpr &x, SELF, const ENV &env)
     {
-      auto l = v(x->left(),  env);
-      auto r = v(x->right(), env);
-
-      Ptr<LamExpr> lam; Ptr<BuiltinExpr> bi;
-
-      switch (l->type()) {
-      case ExprType::LAM:
-        lam = dyn_cast<LamExpr>(l);
-        return v(lam->apply(r), lam->env());
-      case ExprType::BUILTIN:
-        bi = dyn_cast<BuiltinExpr>(l);
-        if (bi->need_arg()) {
-          bi->give_arg(r);
-          return v(bi, env);
-        } // else fall thru
-      default:
-        return ptr<AppExpr>(l, r);
-      }
+      auto e = env->lookup(x.id());
+      assert(e);
+      return (*this)(e, env);
     }
 
-    inline Ptr<Expr> v(Ptr<IntExpr> x, ENV) override { return x; }
+    Ptr<Expr> v(const AppExpr &x, SELF, const ENV &env)
+    {
+      mem::Site site(x);
+      auto l = (*this)(x.left(),  env);
+      auto r = (*this)(x.right(), env);
+      return apply(l, r, env);
+    }
+
+    inline Ptr<Expr> v(const IntExpr&, SELF x, const ENV&) { return x; }
 
-    inline Ptr<Expr> v(Ptr<BoolExpr> x, ENV) override { return x; }
+    inline Ptr<Expr> v(const BoolExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const StringExpr&, SELF x, const ENV&) { return x; }
+
+    Ptr<Expr> v(const LamExpr &x, SELF self, const ENV &env)
+    {
+      // already a closure: keep the environment it was made in. otherwise
+      // copy rather than set the environment in place, since the term might
+      // be shared (e.g. between sessions)
+      if (x.env()) return self;
+      mem::Site site(x);
+      auto closure = ptr<LamExpr>(x);
+      closure->set_env(env);
+      return closure;
+    }
 
-    inline Ptr<Expr> v(Ptr<StringExpr> x, ENV) override { return x; }
+    Ptr<Expr> v(const IfExpr &x, SELF, const ENV &env)
+    {
+      if (lit<ExprType::BOOL, BoolExpr, bool>((*this)(x.cond(), env))) {
+        return (*this)(x.thenCase(), env);
+      } else {
+        return (*this)(x.elseCase(), env);
+      }
+    }
 
-    Ptr<Expr> v(Ptr<LamExpr> x, ENV env) override
+    inline Ptr<Expr> v(const BinOpExpr &x, SELF, const ENV &env)
     {
-      x->set_env(env);
-      return x;
+      mem::Site site(x);
+      if (x.op() == BinOp::ASSIGN) return assign(x, env);
+      auto l = (*this)(x.left(), env), r = (*this)(x.right(), env);
+      return binop(x.op(), l, r);
     }
 
-    Ptr<Expr> v(Ptr<IfExpr> x, ENV env) override
+    /// `r := e` or `a.[i] := e`, where the left hand side is a place to put
+    /// the value rather than something to evaluate.
+    Ptr<Expr> assign(const BinOpExpr &x, const ENV &env)
     {
-      if (lit<ExprType::BOOL, BoolExpr, bool>(v(x->cond(), env))) {
-        return v(x->thenCase(), env);
+      auto unit = ptr<TupleExpr>(ptr<TupleExpr::Exprs>());
+      if (x.left()->type() == ExprType::INDEX) {
+        auto &l = static_cast<const IndexExpr&>(*x.left());
+        auto a = (*this)(l.array(), env), i = (*this)(l.index(), env);
+        auto val = lit<ExprType::INT, IntExpr, long>((*this)(x.right(), env));
+        elem(a, i) = val;
       } else {
-        return v(x->elseCase(), env);
+        auto r = (*this)(x.left(), env);
+        assert(r->type() == ExprType::REF);
+        static_cast<const RefExpr&>(*r).set((*this)(x.right(), env));
       }
+      return unit;
     }
 
-    Ptr<Expr> v(Ptr<BinOpExpr> x, ENV env) override
+    Ptr<Expr> v(const UnOpExpr &x, SELF, const ENV &env)
     {
-      using namespace std;
-
-      auto l = v(x->left(), env), r = v(x->right(), env);
-
-      auto to_int = lit<ExprType::INT, IntExpr, long>;
-      auto to_bool = lit<ExprType::BOOL, BoolExpr, bool>;
-
-      auto int_op =
-        [&](function<long(long, long)> f) {
-          return ptr<IntExpr>(f(to_int(l), to_int(r)));
-        };
-      auto bool_op =
-        [&](function<bool(bool, bool)> f) {
-          return ptr<BoolExpr>(f(to_bool(l), to_bool(r)));
-        };
-      auto int_cmp =
-        [&](function<bool(long, long)> f) {
-          return ptr<BoolExpr>(f(to_int(l), to_int(r)));
-        };
-
-      switch (x->op()) {
-      case BinOp::PLUS:    return int_op(plus<long>());
-      case BinOp::MINUS:   return int_op(minus<long>());
-      case BinOp::TIMES:   return int_op(multiplies<long>());
-      case BinOp::DIVIDE:  return int_op(divides<long>());
-      case BinOp::AND:     return bool_op(logical_and<bool>());
-      case BinOp::OR:      return bool_op(logical_or<bool>());
-      case BinOp::IFF:     return bool_op(equal_to<bool>());
-      case BinOp::LESS:    return int_cmp(less<long>());
-      case BinOp::LEQ:     return int_cmp(less_equal<long>());
-      case BinOp::EQUAL:   return int_cmp(equal_to<long>());
-      case BinOp::GEQ:     return int_cmp(greater_equal<long>());
-      case BinOp::GREATER: return int_cmp(greater<long>());
-      case BinOp::NEQ:     return int_cmp(not_equal_to<long>());
-      case BinOp::SEQ:     return r;
+      mem::Site site(x);
+      if (x.op() == UnOp::LAZY) {
+        auto e = x.expr();
+        auto env0 = env;
+        return ptr<LazyExpr>([e, env0] { return eval(e, env0); }, nullptr,
+                             x.start(), x.end());
+      }
+      auto y = (*this)(x.expr(), env);
+      switch (x.op()) {
+      case UnOp::REF:
+        return ptr<RefExpr>(y);
+      case UnOp::DEREF:
+        assert(y->type() == ExprType::REF);
+        return static_cast<const RefExpr&>(*y).get();
+      case UnOp::FORCE:
+        assert(y->type() == ExprType::LAZY);
+        return static_cast<const LazyExpr&>(*y).force();
 #ifdef __GNUC__
-      default:             std::abort();
+      default: std::abort();
 #endif
       }
     }
 
-    inline Ptr<Expr> v(Ptr<TypeExpr> x, ENV env) override
-    { return v(x->expr(), env); }
+    Ptr<Expr> v(const IndexExpr &x, SELF, const ENV &env)
+    {
+      auto a = (*this)(x.array(), env), i = (*this)(x.index(), env);
+      return ptr<IntExpr>(elem(a, i));
+    }
+
+    inline Ptr<Expr> v(const TypeExpr &x, SELF, const ENV &env)
+    { return (*this)(x.expr(), env); }
 
-    Ptr<Expr> v(Ptr<TupleExpr> x, ENV env) override
+    Ptr<Expr> v(const TupleExpr &x, SELF, const ENV &env)
     {
+      mem::Site site(x);
       auto es = ptr<TupleExpr::Exprs>();
-      es->reserve(x->exprs()->size());
-      for (auto e: *x->exprs()) {
-        es->push_back(v(e, env));
+      es->reserve(x.exprs()->size());
+      for (auto &e: *x.exprs()) {
+        es->push_back((*this)(e, env));
       }
       return ptr<TupleExpr>(es);
     }
 
-    Ptr<Expr> v(Ptr<DotExpr> x, ENV env) override
+    Ptr<Expr> v(const DotExpr &x, SELF, const ENV &env)
     {
-      auto y = v(x->expr(), env);
-      auto i = x->index();
+      auto y = (*this)(x.expr(), env);
+      auto i = x.index();
       if (y->type() == ExprType::TUPLE) {
-        auto tup = dyn_cast<TupleExpr>(y);
-        assert(tup->exprs()->size() > i);
-        return tup->exprs()->at(i);
+        auto &tup = static_cast<const TupleExpr&>(*y);
+        assert(tup.exprs()->size() > i);
+        return tup.exprs()->at(i);
       } else {
         return ptr<DotExpr>(y, i);
       }
     }
 
-    Ptr<Expr> v(Ptr<BuiltinExpr> x, ENV env) override
+    inline Ptr<Expr> v(const ClosureExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const ArrayExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const RefExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const MapExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const LazyExpr&, SELF x, const ENV&) { return x; }
+
+    inline Ptr<Expr> v(const StreamExpr&, SELF x, const ENV&) { return x; }
+
+    Ptr<Expr> v(const BuiltinExpr &x, SELF self, const ENV &env)
     {
-      if (x->need_arg()) {
-        return x;
+      if (x.need_arg()) {
+        return self;
       } else {
-        return v(x->run(), env);
+        H::builtin(x);
+        return (*this)(x.run(), env);
       }
     }
   };
@@ -156,7 +273,12 @@ namespace
 
 Ptr<Expr> eval(Ptr<Expr> e, Ptr<Env<Expr>> env)
 {
-  Eval ev; return ev(e, env);
+  Eval<EvalHooks> ev; return ev(e, env);
+}
+
+Ptr<Expr> apply(Ptr<Expr> fn, Ptr<Expr> arg)
+{
+  return apply(fn, arg, ptr<Env<Expr>>());
 }
 
 }
@@ -0,0 +1,140 @@
+#include "eval/hooks.hxx"
+#include "eval/exception.hxx"
+#include "ast.hxx"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+
+namespace miniml
+{
+
+namespace hooks
+{
+
+namespace
+{
+  /// How many nodes are being evaluated on this thread.
+  thread_local unsigned depth = 0;
+
+  /// Short one-line version of something printable.
+  String brief(const Pretty &x)
+  {
+    const size_t max = 60;
+    auto str = x.ppr()->string();
+    String out;
+    for (auto c: *str) {
+      if (std::isspace(c)) {
+        if (!out.empty() && out.back() != ' ') out += ' ';
+      } else {
+        out += c;
+      }
+      if (out.size() > max) return out.substr(0, max - 3) + "...";
+    }
+    return out;
+  }
+
+  /// Start a line of the trace, indented for the current depth.
+  std::ostream &line()
+  {
+    return std::clog << String(std::min(depth, 40u) * 2, ' ');
+  }
+
+  /// `file:line:col` of the start of \a x.
+  String where(const HasPos &x)
+  {
+    if (!x.start().offset) return "-";
+    SStream out;
+    auto file = x.start().file();
+    out << (file? *file: "<input>") << ':' << x.start();
+    return out.str();
+  }
+}
+
+
+void Trace::enter(const Expr &src)
+{
+  line() << "> " << where(src) << ' ' << brief(src) << std::endl;
+  ++depth;
+}
+
+void Trace::leave(const Expr &src, const Ptr<Expr> &val)
+{
+  --depth;
+  line() << "< " << where(src) << " = " << brief(*val) << std::endl;
+}
+
+void Trace::unwind(const Expr &src)
+{
+  --depth;
+  line() << "! " << where(src) << std::endl;
+}
+
+void Trace::call(const Expr &fn, const Ptr<Expr> &arg)
+{
+  line() << "call " << where(fn) << ' ' << brief(*arg) << std::endl;
+}
+
+void Trace::ret(const Expr&, const Ptr<Expr> &val)
+{
+  line() << "return " << brief(*val) << std::endl;
+}
+
+void Trace::builtin(const BuiltinExpr &b)
+{
+  line() << "builtin " << brief(*b.ty()) << std::endl;
+}
+
+
+namespace
+{
+  /// Stop before entering a node at this depth or less, if it's not
+  /// #never.
+  const long never = -1, always = std::numeric_limits<long>::max();
+  thread_local long stop_at = always;
+  /// Only one thread reads from the terminal at once.
+  std::mutex tty_mutex;
+}
+
+void Step::enter(const Expr &src)
+{
+  // a new evaluation starts off stepping again
+  if (depth == 0) stop_at = always;
+
+  Trace::enter(src);
+  long here = depth - 1;
+  if (here > stop_at) return;
+
+  std::lock_guard<std::mutex> lock(tty_mutex);
+  static std::ifstream tty("/dev/tty");
+  if (!tty) {
+    stop_at = never;
+    return;
+  }
+  std::clog << "step> " << std::flush;
+  String cmd;
+  if (!std::getline(tty, cmd)) {
+    stop_at = never;
+    return;
+  }
+
+  if (cmd == "n") {
+    stop_at = here;
+  } else if (cmd == "o") {
+    stop_at = here - 1;
+  } else if (cmd == "c") {
+    stop_at = never;
+  } else if (cmd == "q") {
+    // it won't be left normally or unwound, since it was never entered
+    --depth;
+    throw Cancelled();
+  } else {
+    stop_at = always;
+  }
+}
+
+}
+
+}
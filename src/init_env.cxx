@@ -1,5 +1,14 @@
 #include "init_env.hxx"
+#include "eval.hxx"
+#include "eval/exception.hxx"
+#include "ir.hxx"
+#include "kernel.hxx"
+#include "mem.hxx"
+#include "stream.hxx"
+#include <algorithm>
 #include <cassert>
+#include <memory>
+#include <new>
 
 namespace miniml
 {
@@ -10,15 +19,47 @@ namespace
   template <typename T>
   std::initializer_list<Ptr<T>> empty()
   { return std::initializer_list<Ptr<T>>(); }
+
+  thread_local OStream *current_output = nullptr;
 }
 
 Ptr<Type> int_ = ptr<IntType>();
 Ptr<Type> string_ = ptr<StringType>();
 Ptr<Type> bool_ = ptr<BoolType>();
 Ptr<Type> unit = ptr<TupleType>(empty<Type>());
+Ptr<Type> int_array = ptr<ArrayType>(int_);
 
 Ptr<Expr> UNIT = ptr<TupleExpr>(empty<Expr>());
 
+EnvEntry::EnvEntry(Ptr<Type> t, const Id &name, Thunk thunk):
+  type(t), m_lazy(ptr<Lazy>(name, thunk))
+{}
+
+Ptr<Expr> EnvEntry::force()
+{
+  if (forced()) return value;
+
+  std::lock_guard<std::recursive_mutex> lock(m_lazy->mutex);
+  if (m_lazy->done) return value;
+  if (m_lazy->running) throw LazyCycle(m_lazy->name);
+
+  m_lazy->running = true;
+  try {
+    value = m_lazy->thunk();
+  } catch (...) {
+    m_lazy->running = false;
+    throw;
+  }
+  m_lazy->running = false;
+  m_lazy->thunk = nullptr;
+  m_lazy->done.store(true, std::memory_order_release);
+  return value;
+}
+
+bool EnvEntry::forced() const
+{ return !m_lazy || m_lazy->done.load(std::memory_order_acquire); }
+
+
 Ptr<Type> arr(Ptr<Type> l, Ptr<Type> r)
 { return ptr<ArrowType>(l, r); }
 
@@ -28,6 +69,12 @@ long INT(Ptr<Expr> e)
   return dyn_cast<IntExpr>(e)->val();
 }
 
+bool BOOL(Ptr<Expr> e)
+{
+  assert(e->type() == ExprType::BOOL);
+  return dyn_cast<BoolExpr>(e)->val();
+}
+
 String STRING(Ptr<Expr> e)
 {
   assert(e->type() == ExprType::STRING);
@@ -37,6 +84,25 @@ String STRING(Ptr<Expr> e)
 Ptr<Expr> STRING(String &&e)
 { return ptr<StringExpr>(std::forward<String>(e)); }
 
+const ArrayExpr::Elems &ARRAY(Ptr<Expr> e)
+{
+  assert(e->type() == ExprType::ARRAY);
+  return *dyn_cast<ArrayExpr>(e)->elems();
+}
+
+Ptr<Expr> ARRAY(ArrayExpr::Elems &&e)
+{
+  // not ptr(), which would copy the elements
+  auto bytes = e.capacity() * sizeof(long);
+  mem::add(mem::Kind::ARRAY_DATA, bytes);
+  return ptr<ArrayExpr>(Ptr<ArrayExpr::Elems>(
+    new ArrayExpr::Elems(std::move(e)),
+    [bytes](ArrayExpr::Elems *elems) {
+      mem::remove(mem::Kind::ARRAY_DATA, bytes);
+      delete elems;
+    }));
+}
+
 Ptr<EnvEntry> builtin(Ptr<Type> ty, unsigned arity, BuiltinExpr::Effect eff)
 {
   return ptr<EnvEntry>(ty, ptr<BuiltinExpr>(ty, eff, arity));
@@ -64,11 +130,328 @@ Ptr<EnvEntry> builtin(Ptr<Type> ty, std::function<void()> f)
 }
 
 
+namespace
+{
+  using Elems = ArrayExpr::Elems;
+
+  /// Elements for an array of length \a n, held to the Budget's heap limit
+  /// along with \a scratch bytes more that are needed meanwhile.
+  Elems alloc(size_t n, size_t scratch = 0)
+  {
+    if (n > Elems().max_size()) throw OutOfMemory(n);
+    Budget::reserve(n * sizeof(long) + scratch);
+    try {
+      return Elems(n);
+    } catch (std::bad_alloc&) {
+      throw OutOfMemory(n);
+    }
+  }
+
+  /// Scratch flags for \a n elements, once they've been reserved.
+  std::unique_ptr<bool[]> flags(size_t n)
+  {
+    std::unique_ptr<bool[]> xs(new (std::nothrow) bool[n]);
+    if (!xs) throw OutOfMemory(n);
+    return xs;
+  }
+
+  Elems make(long n)
+  {
+    if (n < 0) throw NegativeLength(n);
+    return alloc(n);
+  }
+
+  /// Builtin combining two arrays element by element with a kernel.
+  Ptr<EnvEntry> zip(void (*k)(const long*, const long*, long*, size_t))
+  {
+    return builtin(arr(int_array, arr(int_array, int_array)),
+                   [k] (Ptr<Expr> l, Ptr<Expr> r) {
+                     auto &xs = ARRAY(l), &ys = ARRAY(r);
+                     if (xs.size() != ys.size()) {
+                       throw LengthMismatch(xs.size(), ys.size());
+                     }
+                     auto zs = alloc(xs.size());
+                     k(xs.data(), ys.data(), zs.data(), zs.size());
+                     return ARRAY(std::move(zs));
+                   });
+  }
+
+  /// Apply \a f to each of \a n ints, all at once if it's a closure simple
+  /// enough for ir::map.
+  /// \return Whether it could be.
+  bool batch(const Ptr<Expr> &f, const long *xs, long *out, size_t n)
+  {
+    return f->type() == ExprType::CLOSURE &&
+           ir::map(static_cast<const ClosureExpr&>(*f), xs, out, n);
+  }
+
+  /// The `array_` builtins. Whole-array operations are done by the kernels;
+  /// ones taking a function apply it to a whole column of elements at once
+  /// if they can (\sa batch), and otherwise to each element in turn.
+  void add_array_builtins(Env<EnvEntry> &env)
+  {
+    auto int_int = arr(int_, int_);
+
+    env.insert("array_make"_i,
+               builtin(arr(int_, arr(int_, int_array)),
+                       [] (Ptr<Expr> n, Ptr<Expr> x) {
+                         auto xs = make(INT(n));
+                         kernel::fill(xs.data(), xs.size(), INT(x));
+                         return ARRAY(std::move(xs));
+                       }));
+    env.insert("array_range"_i,
+               builtin(arr(int_, arr(int_, int_array)),
+                       [] (Ptr<Expr> from, Ptr<Expr> to) {
+                         auto a = INT(from), b = INT(to);
+                         // b - a can overflow a long, but not an unsigned one
+                         auto xs = alloc(b > a? (unsigned long) b - a: 0);
+                         kernel::iota(xs.data(), xs.size(), a);
+                         return ARRAY(std::move(xs));
+                       }));
+    env.insert("array_init"_i,
+               builtin(arr(int_, arr(int_int, int_array)),
+                       [] (Ptr<Expr> n, Ptr<Expr> f) {
+                         auto xs = make(INT(n));
+                         kernel::iota(xs.data(), xs.size(), 0);
+                         if (batch(f, xs.data(), xs.data(), xs.size())) {
+                           return ARRAY(std::move(xs));
+                         }
+                         for (size_t i = 0; i < xs.size(); ++i) {
+                           xs[i] = INT(apply(f, ptr<IntExpr>(i)));
+                         }
+                         return ARRAY(std::move(xs));
+                       }));
+
+    env.insert("array_length"_i,
+               builtin(arr(int_array, int_),
+                       [] (Ptr<Expr> a) {
+                         return ptr<IntExpr>(ARRAY(a).size());
+                       }));
+    env.insert("array_get"_i,
+               builtin(arr(int_array, arr(int_, int_)),
+                       [] (Ptr<Expr> a, Ptr<Expr> i) {
+                         auto &xs = ARRAY(a);
+                         auto j = INT(i);
+                         if (j < 0 || size_t(j) >= xs.size()) {
+                           throw OutOfBounds(j, xs.size());
+                         }
+                         return ptr<IntExpr>(xs[j]);
+                       }));
+
+    env.insert("array_sum"_i,
+               builtin(arr(int_array, int_),
+                       [] (Ptr<Expr> a) {
+                         auto &xs = ARRAY(a);
+                         return ptr<IntExpr>(kernel::sum(xs.data(),
+                                                         xs.size()));
+                       }));
+    env.insert("array_add"_i, zip(kernel::add));
+    env.insert("array_sub"_i, zip(kernel::sub));
+    env.insert("array_mul"_i, zip(kernel::mul));
+
+    env.insert("array_map"_i,
+               builtin(arr(int_int, arr(int_array, int_array)),
+                       [] (Ptr<Expr> f, Ptr<Expr> a) {
+                         auto &xs = ARRAY(a);
+                         auto ys = alloc(xs.size());
+                         if (batch(f, xs.data(), ys.data(), xs.size())) {
+                           return ARRAY(std::move(ys));
+                         }
+                         for (size_t i = 0; i < xs.size(); ++i) {
+                           ys[i] = INT(apply(f, ptr<IntExpr>(xs[i])));
+                         }
+                         return ARRAY(std::move(ys));
+                       }));
+    env.insert("array_fold"_i,
+               builtin(arr(arr(int_, int_int),
+                           arr(int_, arr(int_array, int_))),
+                       3,
+                       [] (Args &args) {
+                         auto f = args[0];
+                         auto acc = args[1];
+                         for (auto x: ARRAY(args[2])) {
+                           acc = apply(apply(f, acc), ptr<IntExpr>(x));
+                         }
+                         return acc;
+                       }));
+    env.insert("array_filter"_i,
+               builtin(arr(arr(int_, bool_), arr(int_array, int_array)),
+                       [] (Ptr<Expr> p, Ptr<Expr> a) {
+                         auto &xs = ARRAY(a);
+                         auto ys = alloc(xs.size(), xs.size() * sizeof(bool));
+                         auto keep = flags(xs.size());
+                         if (batch(p, xs.data(), ys.data(), xs.size())) {
+                           std::copy(ys.begin(), ys.end(), keep.get());
+                         } else {
+                           for (size_t i = 0; i < xs.size(); ++i) {
+                             keep[i] = BOOL(apply(p, ptr<IntExpr>(xs[i])));
+                           }
+                         }
+                         ys.resize(kernel::compact(xs.data(), keep.get(),
+                                                   xs.size(), ys.data()));
+                         return ARRAY(std::move(ys));
+                       }));
+    env.insert("array_sort"_i,
+               builtin(arr(int_array, int_array),
+                       [] (Ptr<Expr> a) {
+                         auto &xs = ARRAY(a);
+                         auto ys = alloc(xs.size());
+                         std::copy(xs.begin(), xs.end(), ys.begin());
+                         std::sort(ys.begin(), ys.end());
+                         return ARRAY(std::move(ys));
+                       }));
+  }
+
+
+  const MapExpr::Map &MAP(Ptr<Expr> e)
+  {
+    assert(e->type() == ExprType::MAP);
+    return static_cast<const MapExpr&>(*e).map();
+  }
+
+  /// The `intmap_` or `stringmap_` builtins, for maps from \a key to ints.
+  void add_map_builtins(Env<EnvEntry> &env, const String &prefix,
+                        Ptr<Type> key)
+  {
+    bool strings = key->type() == TypeType::STRING;
+    auto map = ptr<MapType>(key);
+    auto name = [&](const char *op) { return Id(prefix + op); };
+    auto to_key = [strings](Ptr<Expr> e) {
+      return strings? MapKey {0, dyn_cast<StringExpr>(e)->val()}:
+                      MapKey {INT(e), nullptr};
+    };
+    auto from_key = [](const MapKey &k) -> Ptr<Expr> {
+      if (k.str) return ptr<StringExpr>(k.str);
+      return ptr<IntExpr>(k.num);
+    };
+    auto make = [strings](MapExpr::Map &&m) {
+      return ptr<MapExpr>(strings, std::move(m));
+    };
+
+    env.insert(name("empty"), ptr<EnvEntry>(map, make(MapExpr::Map())));
+    env.insert(name("insert"),
+               builtin(arr(key, arr(int_, arr(map, map))), 3,
+                       [=] (Args &args) {
+                         return make(MAP(args[2]).insert(to_key(args[0]),
+                                                         INT(args[1])));
+                       }));
+    env.insert(name("remove"),
+               builtin(arr(key, arr(map, map)),
+                       [=] (Ptr<Expr> k, Ptr<Expr> m) {
+                         return make(MAP(m).remove(to_key(k)));
+                       }));
+    env.insert(name("find"),
+               builtin(arr(map, arr(key, int_)),
+                       [=] (Ptr<Expr> m, Ptr<Expr> k) {
+                         auto val = MAP(m).find(to_key(k));
+                         if (!val) throw NotFound(*k->ppr()->string());
+                         return ptr<IntExpr>(*val);
+                       }));
+    env.insert(name("has"),
+               builtin(arr(map, arr(key, bool_)),
+                       [=] (Ptr<Expr> m, Ptr<Expr> k) {
+                         return ptr<BoolExpr>(MAP(m).find(to_key(k)) != nullptr);
+                       }));
+    env.insert(name("size"),
+               builtin(arr(map, int_),
+                       [] (Ptr<Expr> m) {
+                         return ptr<IntExpr>(MAP(m).size());
+                       }));
+    env.insert(name("fold"),
+               builtin(arr(arr(int_, arr(key, arr(int_, int_))),
+                           arr(int_, arr(map, int_))),
+                       3,
+                       [=] (Args &args) {
+                         auto f = args[0];
+                         auto acc = args[1];
+                         MAP(args[2]).each([&](const MapKey &k, long v) {
+                           acc = apply(apply(apply(f, acc), from_key(k)),
+                                       ptr<IntExpr>(v));
+                         });
+                         return acc;
+                       }));
+  }
+
+
+  const stream::S &STREAM(Ptr<Expr> e)
+  {
+    assert(e->type() == ExprType::STREAM);
+    return static_cast<const StreamExpr&>(*e).stream();
+  }
+
+  /// The `stream_` or `stringstream_` builtins, for streams of \a elem.
+  /// Stages just stack up on the stream they're given, and it's only `fold`
+  /// (and `stream_array`) which run them, in one pass. \sa Stream
+  void add_stream_builtins(Env<EnvEntry> &env, const String &prefix,
+                           Ptr<Type> elem)
+  {
+    bool strings = elem->type() == TypeType::STRING;
+    auto stream_ = ptr<StreamType>(elem);
+    auto name = [&](const char *op) { return Id(prefix + op); };
+    auto make = [strings](stream::S s) {
+      return ptr<StreamExpr>(strings, s);
+    };
+    auto pred = arr(elem, bool_);
+    // (more, x, next state)
+    auto step = ptr<TupleType>(std::initializer_list<Ptr<Type>> {
+                                 bool_, elem, elem});
+
+    env.insert(name("unfold"),
+               builtin(arr(arr(elem, step), arr(elem, stream_)),
+                       [=] (Ptr<Expr> f, Ptr<Expr> seed) {
+                         return make(stream::unfold(f, seed));
+                       }));
+
+    env.insert(name("map"),
+               builtin(arr(arr(elem, elem), arr(stream_, stream_)),
+                       [=] (Ptr<Expr> f, Ptr<Expr> xs) {
+                         return make(stream::map(f, STREAM(xs)));
+                       }));
+    env.insert(name("filter"),
+               builtin(arr(pred, arr(stream_, stream_)),
+                       [=] (Ptr<Expr> p, Ptr<Expr> xs) {
+                         return make(stream::filter(p, STREAM(xs)));
+                       }));
+    env.insert(name("take"),
+               builtin(arr(int_, arr(stream_, stream_)),
+                       [=] (Ptr<Expr> n, Ptr<Expr> xs) {
+                         return make(stream::take(INT(n), STREAM(xs)));
+                       }));
+    env.insert(name("take_while"),
+               builtin(arr(pred, arr(stream_, stream_)),
+                       [=] (Ptr<Expr> p, Ptr<Expr> xs) {
+                         return make(stream::take_while(p, STREAM(xs)));
+                       }));
+    env.insert(name("zip"),
+               builtin(arr(arr(elem, arr(elem, elem)),
+                           arr(stream_, arr(stream_, stream_))),
+                       3,
+                       [=] (Args &args) {
+                         return make(stream::zip(args[0], STREAM(args[1]),
+                                                 STREAM(args[2])));
+                       }));
+
+    env.insert(name("fold"),
+               builtin(arr(arr(int_, arr(elem, int_)),
+                           arr(int_, arr(stream_, int_))),
+                       3,
+                       [] (Args &args) {
+                         auto f = args[0];
+                         auto acc = args[1];
+                         STREAM(args[2])->each([&](const Ptr<Expr> &x) {
+                           acc = apply(apply(f, acc), x);
+                         });
+                         return acc;
+                       }));
+  }
+}
+
+
 Ptr<Env<EnvEntry>> init_val_env()
 {
   auto env = ptr<Env<EnvEntry>>();
   env->insert("newline"_i,
-              builtin(arr(unit, unit), [] { std::cout << std::endl; }));
+              builtin(arr(unit, unit), [] { output() << std::endl; }));
   env->insert("string_int"_i,
               builtin(arr(int_, string_),
                       [] (Ptr<Expr> e) {
@@ -76,12 +459,57 @@ Ptr<Env<EnvEntry>> init_val_env()
                       }));
   env->insert("print"_i,
               builtin_v(arr(string_, unit),
-                        [] (Ptr<Expr> e) { std::cout << STRING(e); }));
+                        [] (Ptr<Expr> e) { output() << STRING(e); }));
   env->insert("app"_i,
               builtin(arr(string_, arr(string_, string_)),
                       [] (Ptr<Expr> s, Ptr<Expr> t) {
                         return STRING(STRING(s) + STRING(t));
                       }));
+  add_array_builtins(*env);
+  add_map_builtins(*env, "intmap_", int_);
+  add_map_builtins(*env, "stringmap_", string_);
+
+  add_stream_builtins(*env, "stream_", int_);
+  add_stream_builtins(*env, "stringstream_", string_);
+  env->insert("stream_range"_i,
+              builtin(arr(int_, arr(int_, ptr<StreamType>(int_))),
+                      [] (Ptr<Expr> from, Ptr<Expr> to) {
+                        return ptr<StreamExpr>(false, stream::range(INT(from),
+                                                                    INT(to)));
+                      }));
+  env->insert("stream_array"_i,
+              builtin(arr(ptr<StreamType>(int_), int_array),
+                      [] (Ptr<Expr> xs) {
+                        Elems ys;
+                        STREAM(xs)->each([&](const Ptr<Expr> &x) {
+                          if (ys.size() == ys.capacity()) {
+                            Budget::reserve(ys.size() * sizeof(long));
+                          }
+                          try {
+                            ys.push_back(INT(x));
+                          } catch (std::bad_alloc&) {
+                            throw OutOfMemory(ys.size() + 1);
+                          }
+                        });
+                        return ARRAY(std::move(ys));
+                      }));
+  env->insert("stringstream_lines"_i,
+              builtin(arr(string_, ptr<StreamType>(string_)),
+                      [] (Ptr<Expr> file) {
+                        return ptr<StreamExpr>(true,
+                                               stream::lines(STRING(file)));
+                      }));
   return env;
 }
+
+
+OStream &output()
+{ return current_output? *current_output: std::cout; }
+
+Redirect::Redirect(OStream &out):
+  m_prev(current_output)
+{ current_output = &out; }
+
+Redirect::~Redirect()
+{ current_output = m_prev; }
 }
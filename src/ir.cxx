@@ -0,0 +1,306 @@
+#include "ir.hxx"
+#include "eval.hxx"
+#include "eval/hooks.hxx"
+#include "init_env.hxx"
+#include "pgo.hxx"
+#include "walk.hxx"
+#include <cassert>
+#include <vector>
+
+namespace miniml
+{
+
+namespace ir
+{
+
+namespace
+{
+  // the typechecker has already made sure these are what they claim to be
+
+  inline long ival(const Ptr<Expr> &e)
+  { return static_cast<const IntExpr&>(*e).val(); }
+
+  inline bool bval(const Ptr<Expr> &e)
+  { return static_cast<const BoolExpr&>(*e).val(); }
+
+  inline const RefExpr &rval(const Ptr<Expr> &e)
+  { return static_cast<const RefExpr&>(*e); }
+
+  inline const LazyExpr &lval(const Ptr<Expr> &e)
+  { return static_cast<const LazyExpr&>(*e); }
+
+  /// Element \a i of an array, checking it's there.
+  long &elem(const Ptr<Expr> &a, const Ptr<Expr> &i)
+  {
+    auto &xs = *static_cast<const ArrayExpr&>(*a).elems();
+    auto j = ival(i);
+    if (j < 0 || size_t(j) >= xs.size()) throw OutOfBounds(j, xs.size());
+    return xs[j];
+  }
+
+  const Ptr<Expr> &unit()
+  {
+    static const Ptr<Expr> u = ptr<TupleExpr>(ptr<TupleExpr::Exprs>());
+    return u;
+  }
+
+  template <typename H>
+  Ptr<Expr> call(const Node&, const Ptr<Frame>&);
+  template <typename H>
+  Ptr<Expr> exec(const Ptr<Node>&, const Ptr<Frame>&);
+
+  /// Run a node, with the hooks \a H around it. \sa hooks
+  template <typename H>
+  inline Ptr<Expr> run(const Ptr<Node> &node, const Ptr<Frame> &frame)
+  {
+    if (!H::enabled) return exec<H>(node, frame);
+
+    // the hooks are only for debugging, so it's fine to make the
+    // expression again each time
+    auto expr = node->src.expr();
+    auto &src = *expr;
+    H::enter(src);
+    Ptr<Expr> val;
+    try {
+      val = exec<H>(node, frame);
+    } catch (...) {
+      H::unwind(src);
+      throw;
+    }
+    H::leave(src, val);
+    return val;
+  }
+
+  /// Run the body of a lambda.
+  /// \param lam The (innermost, if several are called at once) lambda.
+  /// \param arg Its argument, bound in \a frame.
+  template <typename H>
+  inline Ptr<Expr> run_body(const Node &lam, const Ptr<Expr> &arg,
+                            const Ptr<Frame> &frame)
+  {
+    Budget::Call call;
+    if (H::enabled) H::call(*lam.src.expr(), arg);
+    auto val = run<H>(lam.kids[0], frame);
+    if (H::enabled) H::ret(*lam.src.expr(), val);
+    return val;
+  }
+
+  template <typename H>
+  Ptr<Expr> exec(const Ptr<Node> &node, const Ptr<Frame> &frame)
+  {
+    const Node &n = *node;
+    mem::Site site(*n.src.pool, n.src.ref);
+    Budget::step();
+    // deeply nested code recurses here without any calls
+    Budget::check_stack();
+    auto kid = [&](unsigned i) { return run<H>(n.kids[i], frame); };
+
+    // operands are evaluated left to right, like the tree evaluator
+#define INT_OP(op) { auto l = ival(kid(0)); auto r = ival(kid(1)); \
+                     return ptr<IntExpr>(l op r); }
+#define INT_CMP(op) { auto l = ival(kid(0)); auto r = ival(kid(1)); \
+                      return ptr<BoolExpr>(l op r); }
+#define BOOL_OP(op) { auto l = bval(kid(0)); auto r = bval(kid(1)); \
+                      return ptr<BoolExpr>(l op r); }
+
+    switch (n.op) {
+    case Op::CONST:
+      return n.value;
+    case Op::LOCAL: {
+      auto f = frame.get();
+      for (auto i = n.index; i > 0; --i) f = f->up.get();
+      return f->val;
+    }
+    case Op::GLOBAL:
+      assert(n.global);
+      return n.global->force();
+    case Op::APP: {
+      pgo::call(n.src);
+      auto f = kid(0);
+      auto x = kid(1);
+      if (f->type() == ExprType::CLOSURE) {
+        auto &c = static_cast<const ClosureExpr&>(*f);
+        pgo::lam(c.lam()->src);
+        return run_body<H>(*c.lam(), x,
+                           ptr<Frame>(x, c.frame(), c.lam()->index));
+      } else {
+        return apply(f, x);
+      }
+    }
+    case Op::CALL:
+      return call<H>(n, frame);
+    case Op::LAM:
+      return ptr<ClosureExpr>(node, frame);
+    case Op::IF:
+      return bval(kid(0))? kid(1): kid(2);
+    case Op::INT_ADD:  INT_OP(+)
+    case Op::INT_SUB:  INT_OP(-)
+    case Op::INT_MUL:  INT_OP(*)
+    case Op::INT_DIV:  INT_OP(/)
+    case Op::INT_LT:   INT_CMP(<)
+    case Op::INT_LE:   INT_CMP(<=)
+    case Op::INT_EQ:   INT_CMP(==)
+    case Op::INT_GE:   INT_CMP(>=)
+    case Op::INT_GT:   INT_CMP(>)
+    case Op::INT_NE:   INT_CMP(!=)
+    case Op::BOOL_AND: BOOL_OP(&&)
+    case Op::BOOL_OR:  BOOL_OP(||)
+    case Op::BOOL_IFF: BOOL_OP(==)
+    case Op::SEQ: {
+      if (n.kids[0]->op != Op::SEQ) {
+        kid(0);
+        return kid(1);
+      }
+      // a long chain of ;s is nested to the left, so go down it in a loop
+      // rather than recursing
+      std::vector<const Ptr<Node>*> rest;
+      auto s = &node;
+      for (; (*s)->op == Op::SEQ; s = &(*s)->kids[0]) {
+        rest.push_back(&(*s)->kids[1]);
+      }
+      auto val = run<H>(*s, frame);
+      for (auto it = rest.rbegin(); it != rest.rend(); ++it) {
+        val = run<H>(**it, frame);
+      }
+      return val;
+    }
+    case Op::TUPLE: {
+      auto es = ptr<TupleExpr::Exprs>();
+      es->reserve(n.kids.size());
+      for (auto &k: n.kids) {
+        es->push_back(run<H>(k, frame));
+      }
+      return ptr<TupleExpr>(es);
+    }
+    case Op::PROJ:
+      return (*static_cast<const TupleExpr&>(*kid(0)).exprs())[n.index];
+    case Op::SHARED: {
+      auto &val = frame->shared[n.index];
+      if (!val) val = kid(0);
+      return val;
+    }
+    case Op::REF:
+      return ptr<RefExpr>(kid(0));
+    case Op::DEREF:
+      return rval(kid(0)).get();
+    case Op::ASSIGN: {
+      auto r = kid(0);
+      rval(r).set(kid(1));
+      return unit();
+    }
+    case Op::INDEX: {
+      auto a = kid(0);
+      return ptr<IntExpr>(elem(a, kid(1)));
+    }
+    case Op::SET_INDEX: {
+      auto a = kid(0);
+      auto i = kid(1);
+      auto x = ival(kid(2));
+      elem(a, i) = x;
+      return unit();
+    }
+    case Op::LAZY: {
+      // run later in the same frame, which the thunk keeps alive
+      auto body = n.kids[0];
+      auto f = frame;
+      return ptr<LazyExpr>([body, f] { return run<H>(body, f); },
+                           body->ty, n.src.start(), n.src.end());
+    }
+    case Op::FORCE:
+      return lval(kid(0)).force();
+#ifdef __GNUC__
+    default: std::abort();
+#endif
+    }
+
+#undef INT_OP
+#undef INT_CMP
+#undef BOOL_OP
+  }
+}
+
+namespace
+{
+  /// An #Op::CALL. The arguments are still evaluated one at a time, after
+  /// the function and the arguments before them, so that anything the
+  /// function does before taking its next argument happens in the same order
+  /// as if it was applied to one argument at a time.
+  template <typename H>
+  Ptr<Expr> call(const Node &n, const Ptr<Frame> &frame)
+  {
+    pgo::call(n.src);
+    auto f = run<H>(n.kids[0], frame);
+    size_t i = 1, k = n.kids.size();
+    auto arg = [&] { return run<H>(n.kids[i++], frame); };
+
+    while (i < k) {
+      switch (f->type()) {
+      case ExprType::CLOSURE: {
+        // bind an argument to each lambda directly inside the last one
+        auto &c = static_cast<const ClosureExpr&>(*f);
+        auto lam = c.lam().get();
+        pgo::lam(lam->src);
+        auto inner = ptr<Frame>(arg(), c.frame(), lam->index);
+        while (i < k && lam->kids[0]->op == Op::LAM) {
+          lam = lam->kids[0].get();
+          pgo::lam(lam->src);
+          inner = ptr<Frame>(arg(), inner, lam->index);
+        }
+        f = run_body<H>(*lam, inner->val, inner);
+        break;
+      }
+      case ExprType::BUILTIN: {
+        // give it all the arguments it needs before running it
+        auto &b = static_cast<const BuiltinExpr&>(*f);
+        if (!b.need_arg()) {
+          f = apply(f, arg());
+          break;
+        }
+        auto given = b.with_arg(arg());
+        while (i < k && given->need_arg()) given->give_arg(arg());
+        f = given->need_arg()? given: miniml::eval(given, ptr<Env<Expr>>());
+        break;
+      }
+      default:
+        f = apply(f, arg());
+        break;
+      }
+    }
+    return f;
+  }
+}
+
+namespace
+{
+  struct Bind final: public Walk<Bind, Node, Unit>
+  {
+    Bind(const Ptr<Env<EnvEntry>> &env): env(env) {}
+
+    Unit post(const Ptr<Node> &n, Unit&, Unit*, size_t)
+    {
+      if (n->op == Op::GLOBAL && !n->global) {
+        n->global = env->lookup(n->name());
+      }
+      return Unit();
+    }
+
+    const Ptr<Env<EnvEntry>> &env;
+  };
+}
+
+void bind(const Ptr<Node> &code, const Ptr<Env<EnvEntry>> &env)
+{ Bind b(env); b(code); }
+
+Ptr<Expr> eval(Ptr<Node> n)
+{ return run<EvalHooks>(n, nullptr); }
+
+Ptr<Expr> call(const ClosureExpr &c, Ptr<Expr> arg)
+{
+  pgo::lam(c.lam()->src);
+  return run_body<EvalHooks>(*c.lam(), arg,
+                             ptr<Frame>(arg, c.frame(), c.lam()->index));
+}
+
+}
+
+}
@@ -0,0 +1,215 @@
+#include "kernel.hxx"
+#include <algorithm>
+#include <cstdlib>
+
+namespace miniml
+{
+
+namespace kernel
+{
+
+namespace
+{
+#ifdef __GNUC__
+  /// Elements processed at once: a 16 byte register, which every x86-64 (SSE2)
+  /// and ARMv8 (NEON) processor has. Wider ones would have to be checked for
+  /// when the program starts.
+  const size_t lanes = 2;
+
+  /// A vector of #lanes elements. It's only aligned like a single element,
+  /// and may alias them, so one can be read from anywhere in an array.
+  typedef long Lanes
+    __attribute__((vector_size(lanes * sizeof(long)),
+                   aligned(sizeof(long)), may_alias));
+
+  inline Lanes load(const long *p)
+  { return *reinterpret_cast<const Lanes*>(p); }
+
+  inline void store(long *p, Lanes v)
+  { *reinterpret_cast<Lanes*>(p) = v; }
+
+  inline Lanes splat(long x)
+  { return Lanes {x, x}; }
+#endif
+
+  // through unsigned, so that overflow wraps rather than being undefined
+  using Word = unsigned long;
+
+  inline long wrap_add(long x, long y) { return long(Word(x) + Word(y)); }
+  inline long wrap_sub(long x, long y) { return long(Word(x) - Word(y)); }
+  inline long wrap_mul(long x, long y) { return long(Word(x) * Word(y)); }
+}
+
+
+long sum(const long *xs, size_t n)
+{
+  size_t i = 0;
+  long total = 0;
+#ifdef __GNUC__
+  // several accumulators, so that consecutive additions don't wait on each
+  // other
+  Lanes a = splat(0), b = splat(0), c = splat(0), d = splat(0);
+  for (; i + 4 * lanes <= n; i += 4 * lanes) {
+    a += load(xs + i);
+    b += load(xs + i + lanes);
+    c += load(xs + i + 2 * lanes);
+    d += load(xs + i + 3 * lanes);
+  }
+  a += b + c + d;
+  for (size_t j = 0; j < lanes; ++j) total = wrap_add(total, a[j]);
+#endif
+  for (; i < n; ++i) total = wrap_add(total, xs[i]);
+  return total;
+}
+
+
+void fill(long *out, size_t n, long x)
+{
+  size_t i = 0;
+#ifdef __GNUC__
+  auto v = splat(x);
+  for (; i + lanes <= n; i += lanes) store(out + i, v);
+#endif
+  for (; i < n; ++i) out[i] = x;
+}
+
+void iota(long *out, size_t n, long from)
+{
+  size_t i = 0;
+#ifdef __GNUC__
+  Lanes v = {from, wrap_add(from, 1)};
+  auto step = splat(lanes);
+  for (; i + lanes <= n; i += lanes) {
+    store(out + i, v);
+    v += step;
+  }
+#endif
+  for (; i < n; ++i) out[i] = wrap_add(from, long(i));
+}
+
+
+// element-wise operators: #lanes elements at a time, then whatever's left
+#ifdef __GNUC__
+#define ZIP_LANES(op) \
+  for (; i + lanes <= n; i += lanes) { \
+    store(out + i, load(xs + i) op load(ys + i)); \
+  }
+#else
+#define ZIP_LANES(op)
+#endif
+#define ZIP(name, op, wrap) \
+  void name(const long *xs, const long *ys, long *out, size_t n) \
+  { \
+    size_t i = 0; \
+    ZIP_LANES(op) \
+    for (; i < n; ++i) out[i] = wrap(xs[i], ys[i]); \
+  }
+
+ZIP(add, +, wrap_add)
+ZIP(sub, -, wrap_sub)
+ZIP(mul, *, wrap_mul)
+
+#undef ZIP
+#undef ZIP_LANES
+
+size_t compact(const long *xs, const bool *keep, size_t n, long *out)
+{
+  size_t k = 0;
+  for (size_t i = 0; i < n; ++i) {
+    out[k] = xs[i];
+    k += keep[i];
+  }
+  return k;
+}
+
+
+namespace
+{
+  /// Elements a Program is run on at once: enough that going through the
+  /// instructions costs little, and few enough that the columns stay in the
+  /// cache.
+  const size_t block = 256;
+}
+
+// one instruction for a column: #lanes elements at a time with the vector
+// expression, then whatever's left with the scalar one, in terms of the
+// operands x, y and z
+#ifdef __GNUC__
+#define COLUMN_LANES(vec) \
+  for (; j + lanes <= m; j += lanes) { \
+    Lanes x = load(a + j), y = load(b + j), z = load(c + j); \
+    (void) x; (void) y; (void) z; \
+    store(r + j, vec); \
+  }
+#else
+#define COLUMN_LANES(vec)
+#endif
+#define COLUMN(vec, scalar) \
+  { \
+    size_t j = 0; \
+    COLUMN_LANES(vec) \
+    for (; j < m; ++j) { \
+      long x = a[j], y = b[j], z = c[j]; \
+      (void) x; (void) y; (void) z; \
+      r[j] = scalar; \
+    } \
+    break; \
+  }
+
+void run(const Program &p, const long *xs, long *out, size_t n)
+{
+  auto &code = p.code;
+  if (code.empty()) return;
+
+  std::vector<long> cols(code.size() * block);
+  auto col = [&](unsigned i) { return cols.data() + i * block; };
+  // constants are the same for every block
+  for (unsigned i = 0; i < code.size(); ++i) {
+    if (code[i].op == Op::CONST) fill(col(i), block, code[i].k);
+  }
+
+  for (size_t base = 0; base < n; base += block) {
+    auto m = std::min(block, n - base);
+    for (unsigned i = 0; i < code.size(); ++i) {
+      auto &in = code[i];
+      auto r = col(i);
+      const long *a = col(in.a), *b = col(in.b), *c = col(in.c);
+
+      switch (in.op) {
+      case Op::ARG:
+        std::copy(xs + base, xs + base + m, r);
+        break;
+      case Op::CONST:
+        break;
+      case Op::ADD: COLUMN(x + y, wrap_add(x, y))
+      case Op::SUB: COLUMN(x - y, wrap_sub(x, y))
+      case Op::MUL: COLUMN(x * y, wrap_mul(x, y))
+      case Op::DIV:
+        // there's no vector division, so this is as good as it gets
+        for (size_t j = 0; j < m; ++j) r[j] = a[j] / in.k;
+        break;
+      case Op::LT: COLUMN(x < y, -long(x < y))
+      case Op::LE: COLUMN(x <= y, -long(x <= y))
+      case Op::EQ: COLUMN(x == y, -long(x == y))
+      case Op::GE: COLUMN(x >= y, -long(x >= y))
+      case Op::GT: COLUMN(x > y, -long(x > y))
+      case Op::NE: COLUMN(x != y, -long(x != y))
+      case Op::AND: COLUMN(x & y, x & y)
+      case Op::OR: COLUMN(x | y, x | y)
+      case Op::IFF: COLUMN(~(x ^ y), ~(x ^ y))
+      case Op::SELECT: COLUMN((x & y) | (~x & z), (x & y) | (~x & z))
+#ifdef __GNUC__
+      default: std::abort();
+#endif
+      }
+    }
+    std::copy(col(code.size() - 1), col(code.size() - 1) + m, out + base);
+  }
+}
+
+#undef COLUMN
+#undef COLUMN_LANES
+
+}
+
+}
@@ -3,6 +3,7 @@
   #include "token.hxx"
   #include "parser.hxx"
   #include <cassert>
+  #include <new>
   #include <utility>
 
   using namespace miniml;
@@ -26,6 +27,22 @@
     inline String get_string(Token *t)
     { return dynamic_cast<StringToken*>(t)->val; }
 
+    /// Postfix type constructor, e.g. `int array`.
+    inline Type *applied_type(Type *t, Token *name)
+    {
+      auto i = get_id(name);
+      if (*i == String("array")) {
+        return new ArrayType(ptr(t), t->start(), name->end());
+      } else if (*i == String("map")) {
+        return new MapType(ptr(t), t->start(), name->end());
+      } else if (*i == String("stream")) {
+        return new StreamType(ptr(t), t->start(), name->end());
+      } else {
+        delete t;
+        throw Parser::ParseFail(name);
+      }
+    }
+
     inline Type *id_type(Id *i)
     {
       if (*i == String("int")) {
@@ -44,7 +61,8 @@
     {
       auto e = ptr(body);
       for (auto a: args) {
-        e = ptr<LamExpr>(a->name, ptr(a->type), e);
+        e = ptr<LamExpr>(a->name, ptr(a->type), e,
+                         a->name.start(), e->end());
       }
       return e;
     }
@@ -82,6 +100,13 @@
   throw Parser::ParseFail(yyminor.yy0);
 }
 
+// grow the parser's stack as needed, rather than failing on anything nested
+// more than 100 deep (or a tuple with that many elements)
+%stack_size 0
+%stack_overflow {
+  throw std::bad_alloc();
+}
+
 %token_prefix TOK_
 %token_type {Token*}
 
@@ -91,12 +116,14 @@
 %nonassoc COLON.
 %left SEQ.
 %left FN.
+%right ASSIGN.
 %right IFF.
 %right OR.
 %right AND.
 %left LESS LEQ EQUAL GEQ GREATER NEQ.
 %left PLUS MINUS.
 %left TIMES DIVIDE.
+%right BANG.
 %left DOT.
 
 %type start {Input*}
@@ -129,6 +156,12 @@ expr(X) ::= aexprs(A).
   { X = A; }
 expr(X) ::= FN(L) LPAR id(I) COLON type(T) RPAR ARROW expr(R).
   { X = new LamExpr(*I, ptr(T), ptr(R),  L->start(), R->end()); }
+expr(X) ::= REF(L) aexprs(A).
+  { X = new UnOpExpr(UnOp::REF, ptr(A), L->start(), A->end()); }
+expr(X) ::= LAZY(L) aexprs(A).
+  { X = new UnOpExpr(UnOp::LAZY, ptr(A), L->start(), A->end()); }
+expr(X) ::= FORCE(L) aexprs(A).
+  { X = new UnOpExpr(UnOp::FORCE, ptr(A), L->start(), A->end()); }
 expr(X) ::= IF(L) aexpr(B) aexpr(T) aexpr(E).
   { X = new IfExpr(ptr(B), ptr(T), ptr(E), L->start(), E->end()); }
 expr(X) ::= expr(A) COLON type(T).
@@ -159,6 +192,8 @@ expr(X) ::= expr(L) GREATER expr(R).
   { X = new BinOpExpr(BinOp::GREATER, ptr(L), ptr(R), L->start(), R->end()); }
 expr(X) ::= expr(L) NEQ expr(R).
   { X = new BinOpExpr(BinOp::NEQ, ptr(L), ptr(R), L->start(), R->end()); }
+expr(X) ::= expr(L) ASSIGN expr(R).
+  { X = new BinOpExpr(BinOp::ASSIGN, ptr(L), ptr(R), L->start(), R->end()); }
 expr(X) ::= expr(L) SEQ expr(R).
   { X = new BinOpExpr(BinOp::SEQ, ptr(L), ptr(R), L->start(), R->end()); }
 %destructor expr {delete $$;}
@@ -181,6 +216,10 @@ aexpr(X) ::= STRING(S).
   { X = new StringExpr(get_string(S), S->start(), S->end()); }
 aexpr(X) ::= aexpr(E) DOT INT(I).
   { X = new DotExpr(ptr(E), get_int(I), E->start(), I->end()); }
+aexpr(X) ::= aexpr(A) DOT LBRACK expr(I) RBRACK(R).
+  { X = new IndexExpr(ptr(A), ptr(I), A->start(), R->end()); }
+aexpr(X) ::= BANG(B) aexpr(E).
+  { X = new UnOpExpr(UnOp::DEREF, ptr(E), B->start(), E->end()); }
 aexpr(X) ::= LPAR expr(A) RPAR.
   { X = A; }
 aexpr(X) ::= LPAR(L) RPAR(R).
@@ -205,14 +244,25 @@ bool(X) ::= FALSE(T).
 
 
 %type type {Type*}
-type(X) ::= id(I).
-  { X = id_type(I); }
-type(X) ::= type(L) TYARROW type(R).
+type(X) ::= atype(T).
+  { X = T; }
+type(X) ::= atype(L) TYARROW type(R).
   { X = new ArrowType(ptr(L), ptr(R),  L->start(), R->end()); }
-type(X) ::= LPAR types(T) RPAR.
-  { X = new TupleType(ptr(T), T->front()->start(), T->back()->end()); }
 %destructor type {delete $$;}
 
+%type atype {Type*}
+atype(X) ::= id(I).
+  { X = id_type(I); }
+atype(X) ::= LPAR types(T) RPAR.
+  { X = new TupleType(ptr(T), T->front()->start(), T->back()->end()); }
+atype(X) ::= atype(T) ID(I).
+  { X = applied_type(T, I); }
+atype(X) ::= atype(T) REF(R).
+  { X = new RefType(ptr(T), T->start(), R->end()); }
+atype(X) ::= atype(T) LAZY(R).
+  { X = new LazyType(ptr(T), T->start(), R->end()); }
+%destructor atype {delete $$;}
+
 %type types {TupleType::Types*}
 types(X) ::= .
   { X = new TupleType::Types; }
@@ -7,53 +7,57 @@ namespace miniml
 
 using TokType = Token::Type;
 
-#define ATOMIC(t) Token::atomic<TokType::t>(start, end)
+#define ATOMIC(t) Token::atomic<TokType::t>(at(ts), at(te))
 
 %%{
 machine Lexer;
 alphtype char;
 
-action ws   { end = start += fc; }
-action bump { end += fc; }
-
 idstart  = (alpha | "_");
 idletter = (idstart | digit | "'");
 
 strelt = (print - ["\\]) | ('\\' [nrtfvae"]) | ('\\' digit{3});
 
-ID      = (idstart idletter*) $bump;
-INT     = ('~'? [0-9]+) $bump;
-STRING  = '"' (strelt*) '"' $bump;
-FN      = "fn" $bump;
-IF      = "if" $bump;
-ARROW   = "=>" $bump;
-TYARROW = "->" $bump;
-LPAR    = "(" $bump;
-RPAR    = ")" $bump;
-COLON   = ":" $bump;
-PLUS    = "+" $bump;
-MINUS   = "-" $bump;
-TIMES   = "*" $bump;
-DIVIDE  = "/" $bump;
-VAL     = "val" $bump;
-REC     = "rec" $bump;
-FUN     = "fun" $bump;
-EQ      = "=" $bump;
-TRUE    = "true" $bump;
-FALSE   = "false" $bump;
-AND     = "&&" $bump;
-OR      = "||" $bump;
-IFF     = "<->" $bump;
-LESS    = "<" $bump;
-LEQ     = "<=" $bump;
-EQUAL   = "==" $bump;
-GEQ     = ">=" $bump;
-GREATER = ">" $bump;
-NEQ     = "!=" $bump;
-SEQ     = ";" $bump;
-COMMA   = "," $bump;
-DOT     = "." $bump;
-WS      = (space+ | ("//" . [^\n] . "\n")) $ws;
+ID      = (idstart idletter*);
+INT     = ('~'? [0-9]+);
+STRING  = '"' (strelt*) '"';
+FN      = "fn";
+IF      = "if";
+ARROW   = "=>";
+TYARROW = "->";
+LPAR    = "(";
+RPAR    = ")";
+COLON   = ":";
+PLUS    = "+";
+MINUS   = "-";
+TIMES   = "*";
+DIVIDE  = "/";
+VAL     = "val";
+REC     = "rec";
+FUN     = "fun";
+EQ      = "=";
+TRUE    = "true";
+FALSE   = "false";
+AND     = "&&";
+OR      = "||";
+IFF     = "<->";
+LESS    = "<";
+LEQ     = "<=";
+EQUAL   = "==";
+GEQ     = ">=";
+GREATER = ">";
+NEQ     = "!=";
+SEQ     = ";";
+COMMA   = ",";
+DOT     = ".";
+REF     = "ref";
+BANG    = "!";
+ASSIGN  = ":=";
+LBRACK  = "[";
+RBRACK  = "]";
+LAZY    = "lazy";
+FORCE   = "force";
+WS      = (space+ | ("//" . [^\n] . "\n"));
 
 token := |*
   FN      => { push(ATOMIC(FN)); };
@@ -85,16 +89,23 @@ token := |*
   SEQ     => { push(ATOMIC(SEQ)); };
   COMMA   => { push(ATOMIC(COMMA)); };
   DOT     => { push(ATOMIC(DOT)); };
-  ID      => { push(ptr<IdToken>(ts, te - ts, start, end)); };
+  REF     => { push(ATOMIC(REF)); };
+  BANG    => { push(ATOMIC(BANG)); };
+  ASSIGN  => { push(ATOMIC(ASSIGN)); };
+  LBRACK  => { push(ATOMIC(LBRACK)); };
+  RBRACK  => { push(ATOMIC(RBRACK)); };
+  LAZY    => { push(ATOMIC(LAZY)); };
+  FORCE   => { push(ATOMIC(FORCE)); };
+  ID      => { push(ptr<IdToken>(ts, te - ts, at(ts), at(te))); };
   INT     => {
     std::string str(ts, te - ts);
     if (str[0] == '~') { str[0] = '-'; }
     long x = std::stol(str);
-    push(ptr<IntToken>(x, start, end));
+    push(ptr<IntToken>(x, at(ts), at(te)));
   };
   STRING  => {
     std::string str(ts, te - ts);
-    push(ptr<StringToken>(unescaped(str, start), start, end));
+    push(ptr<StringToken>(unescaped(str, at(ts)), at(ts), at(te)));
   };
   WS;
 *|;
@@ -107,21 +118,26 @@ token := |*
 #pragma GCC diagnostic pop
 
 
-Lexer::Lexer(const String &str)
+Lexer::Lexer(const String &str, const String *file):
+  Lexer(Source::add(str, file))
+{}
+
+Lexer::Lexer(Ptr<const Source> source_)
 {
-  p = begin = str.data();
-  eof = pe = str.data() + str.size();
+  source = source_;
+  base = source->start();
+  p = begin = source->begin();
+  eof = pe = source->end();
   %% write init;
   %% write exec;
 
   if (cs == Lexer_error)
-    throw LexicalError(*p, end);
+    throw LexicalError(*p, at(p));
 }
 
 void Lexer::push(Ptr<Token> &&tok)
 {
   m_tokens.push_back(tok);
-  start = end;
 }
 
 
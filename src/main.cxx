@@ -1,10 +1,16 @@
 #include "repl.hxx"
+#include "server.hxx"
+#include "mapper.hxx"
 #include "ast.hxx"
 #include "lexer.hxx"
 #include "parser.hxx"
 #include "tc.hxx"
 #include "eval.hxx"
+#include "mem.hxx"
+#include "pgo.hxx"
 
+#include <chrono>
+#include <cstdlib>
 #include <memory>
 #include <iostream>
 #include <fstream>
@@ -28,7 +34,140 @@ namespace
 }
 */
 
-int main(int, char**)
+namespace
+{
+  void usage(const char *prog)
+  {
+    std::cerr << "usage: " << prog << " [--server SOCKET]"
+              << " [--width N] [--depth N] [--length N] [--lazy]"
+              << " [--profile]" << std::endl
+              << "       [--max-steps N] [--max-heap N] [--max-calls N]"
+              << " [--timeout N]" << std::endl
+              << "       [--pgo-record FILE] [--pgo-use FILE]" << std::endl
+              << "       [--map FILE FUNCTION [--threads N]]" << std::endl
+              << "  --width N   lay results out to fit N columns" << std::endl
+              << "  --depth N   elide values nested more than N deep"
+              << std::endl
+              << "  --length N  elide tuple elements after the first N"
+              << std::endl
+              << "  (0 means no limit)" << std::endl
+              << "  --lazy      only evaluate top-level vals when they're used"
+              << std::endl
+              << "  --profile   record where memory is allocated, for :profile"
+              << std::endl
+              << "  --max-steps N  stop evaluating an input after N steps,"
+              << std::endl
+              << "  --max-heap N   or once it's used N more bytes,"
+              << std::endl
+              << "  --max-calls N  or when it nests calls N deep,"
+              << std::endl
+              << "  --timeout N    or after N milliseconds" << std::endl
+              << "  --pgo-record FILE  count calls, and save the counts to FILE"
+              << std::endl
+              << "  --pgo-use FILE     inline and specialise the calls which"
+              << " FILE says are hot" << std::endl
+              << "  --map FILE FUNCTION  load FILE, then apply FUNCTION to each"
+              << " line of the input" << std::endl
+              << "  --threads N        on N threads (default 1, 0 for one per"
+              << " core)" << std::endl;
+    std::exit(1);
+  }
+
+  unsigned number(const char *prog, const char *arg)
+  {
+    char *end;
+    auto n = std::strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') usage(prog);
+    return n;
+  }
+}
+
+int main(int argc, char **argv)
 {
-  miniml::Repl().run();
+  using namespace miniml;
+
+  const char *socket = nullptr, *map_file = nullptr, *map_fn = nullptr;
+  unsigned threads = 1;
+  PprStream::Limits limits;
+  EvalLimits eval_limits;
+  bool lazy = false;
+  for (int i = 1; i < argc; ++i) {
+    String arg = argv[i];
+    if (arg == "--server" && i + 1 < argc) {
+      socket = argv[++i];
+    } else if (arg == "--map" && i + 2 < argc) {
+      map_file = argv[++i];
+      map_fn = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = number(argv[0], argv[++i]);
+    } else if (arg == "--width" && i + 1 < argc) {
+      limits.width = number(argv[0], argv[++i]);
+    } else if (arg == "--depth" && i + 1 < argc) {
+      limits.depth = number(argv[0], argv[++i]);
+    } else if (arg == "--length" && i + 1 < argc) {
+      limits.length = number(argv[0], argv[++i]);
+    } else if (arg == "--max-steps" && i + 1 < argc) {
+      eval_limits.steps = number(argv[0], argv[++i]);
+    } else if (arg == "--max-heap" && i + 1 < argc) {
+      eval_limits.heap = number(argv[0], argv[++i]);
+    } else if (arg == "--max-calls" && i + 1 < argc) {
+      eval_limits.depth = number(argv[0], argv[++i]);
+    } else if (arg == "--timeout" && i + 1 < argc) {
+      auto ms = number(argv[0], argv[++i]);
+      eval_limits.time = std::chrono::milliseconds(ms);
+    } else if (arg == "--lazy") {
+      lazy = true;
+    } else if (arg == "--profile") {
+      mem::set_profiling(true);
+    } else if (arg == "--pgo-record" && i + 1 < argc) {
+      pgo::record(argv[++i]);
+    } else if (arg == "--pgo-use" && i + 1 < argc) {
+      if (!pgo::load(argv[++i])) {
+        std::cerr << "couldn't read the call profile " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (socket) {
+    try {
+      Server(socket, limits, eval_limits).run();
+    } catch (Server::Error &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (map_file) {
+    Repl repl;
+    repl.set_lazy(lazy);
+    {
+      // only the results go to stdout
+      Redirect redirect(std::cerr);
+      if (!repl.read_file(map_file)) return 1;
+    }
+    try {
+      Mapper mapper(repl, map_fn);
+      mapper.set_eval_limits(eval_limits);
+      mapper.set_threads(threads);
+      std::ios::sync_with_stdio(false);
+      bool ok = mapper.run(std::cin, std::cout);
+      if (pgo::recording && !pgo::save()) {
+        std::cerr << "couldn't write the call profile" << std::endl;
+      }
+      return ok? 0: 1;
+    } catch (Mapper::Error &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  Repl repl;
+  repl.set_print_limits(limits);
+  repl.set_eval_limits(eval_limits);
+  repl.set_lazy(lazy);
+  repl.run();
 }
@@ -0,0 +1,311 @@
+#include "mapper.hxx"
+#include "eval.hxx"
+#include "init_env.hxx"
+#include "ir.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace miniml
+{
+
+namespace
+{
+  using namespace std;
+
+  /// Bytes read from the input at once.
+  const size_t block = 1 << 20;
+  /// Records given to a thread at once...
+  const size_t batch_size = 1024;
+  /// ...and batches read for each thread before any of them are run, so
+  /// one slow batch doesn't hold the others up much.
+  const size_t batches_per_thread = 16;
+
+  /// Reads lines a block at a time.
+  class Reader final
+  {
+  public:
+    Reader(istream &in): m_in(in), m_buf(block) {}
+
+    /// The next line, without its newline.
+    /// \return Whether there was one.
+    bool line(String &into)
+    {
+      into.clear();
+      bool any = false;
+      while (true) {
+        if (m_pos == m_len && !fill()) return any;
+        any = true;
+        const char *start = m_buf.data() + m_pos;
+        auto nl = static_cast<const char*>(memchr(start, '\n', m_len - m_pos));
+        if (nl) {
+          into.append(start, nl);
+          m_pos += nl - start + 1;
+          return true;
+        }
+        into.append(start, m_len - m_pos);
+        m_pos = m_len;
+      }
+    }
+
+  private:
+    bool fill()
+    {
+      m_in.read(m_buf.data(), m_buf.size());
+      m_pos = 0;
+      m_len = m_in.gcount();
+      return m_len > 0;
+    }
+
+    istream &m_in;
+    vector<char> m_buf;
+    size_t m_pos = 0, m_len = 0;
+  };
+
+  /// Read an int in decimal, which has to be the whole of \a str.
+  bool number(const String &str, long &n)
+  {
+    if (str.empty() || isspace(static_cast<unsigned char>(str[0]))) {
+      return false;
+    }
+    char *end;
+    errno = 0;
+    n = strtol(str.c_str(), &end, 10);
+    return errno == 0 && end == str.c_str() + str.size();
+  }
+
+  /// Whether a type might have functions in it.
+  bool has_arrow(const Type &ty)
+  {
+    // names are only left in types that weren't normalised, so be careful
+    if (ty.type() == TypeType::ARROW || ty.type() == TypeType::ID) {
+      return true;
+    }
+    for (size_t i = 0; i < Tree<Type>::arity(ty); ++i) {
+      if (has_arrow(*Tree<Type>::child(ty, i))) return true;
+    }
+    return false;
+  }
+
+  /// Whether applying a function might write to a reference or an array
+  /// (which could be shared between records), or change the environment
+  /// with `use`. It looks through the code the function can run: its own,
+  /// that of the global functions it calls, and that of any closures it
+  /// has hold of. Where it can't see the code (a suspended `lazy`, a
+  /// stream's stages, a global which isn't a function but has some in it,
+  /// a lambda for the tree evaluator) it assumes the worst.
+  class Writes final
+  {
+  public:
+    bool operator()(const Ptr<Expr> &v)
+    {
+      if (!v || !seen.insert(v.get()).second) return false;
+      switch (v->type()) {
+      case ExprType::CLOSURE: {
+        auto &c = static_cast<const ClosureExpr&>(*v);
+        for (auto f = c.frame().get(); f; f = f->up.get()) {
+          if (!seen.insert(f).second) break;
+          if ((*this)(f->val)) return true;
+          for (auto &x: f->shared) if ((*this)(x)) return true;
+        }
+        return code(c.lam());
+      }
+      case ExprType::BUILTIN:
+        for (auto &a: *static_cast<const BuiltinExpr&>(*v).args()) {
+          if ((*this)(a)) return true;
+        }
+        return false;
+      case ExprType::TUPLE:
+        for (auto &x: *static_cast<const TupleExpr&>(*v).exprs()) {
+          if ((*this)(x)) return true;
+        }
+        return false;
+      case ExprType::REF:
+        return (*this)(static_cast<const RefExpr&>(*v).get());
+      case ExprType::LAZY: {
+        auto &l = static_cast<const LazyExpr&>(*v);
+        return !l.forced() || (*this)(l.value());
+      }
+      case ExprType::STREAM:
+      case ExprType::LAM:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+  private:
+    bool code(const Ptr<ir::Node> &n)
+    {
+      if (!seen.insert(n.get()).second) return false;
+      switch (n->op) {
+      case ir::Op::ASSIGN:
+      case ir::Op::SET_INDEX:
+        return true;
+      case ir::Op::CONST:
+        if ((*this)(n->value)) return true;
+        break;
+      case ir::Op::GLOBAL:
+        if (n->name() == "use"_i) return true;
+        if (has_arrow(*n->ty)) {
+          // functions are never lazy, so their definitions are there
+          // already, but other values might not be
+          if (n->ty->type() != TypeType::ARROW) return true;
+          if ((*this)(n->global->value)) return true;
+        }
+        break;
+      default:
+        break;
+      }
+      for (auto &k: n->kids) if (code(k)) return true;
+      return false;
+    }
+
+    unordered_set<const void*> seen;
+  };
+}
+
+
+/// Some consecutive records, and what became of them.
+struct Mapper::Batch final
+{
+  /// Line number of the first record.
+  size_t line;
+  vector<String> records;
+  /// Results, a line each.
+  String out;
+  /// Messages for the records the function failed on.
+  String errors;
+  bool ok = true;
+};
+
+
+Mapper::Mapper(const Repl &repl, const String &name)
+{
+  Id id(name);
+  auto ty = repl.type_env()->lookup(id);
+  if (!ty) throw Error("no function " + name);
+
+  if (*ty == *arr(int_, int_)) {
+    m_ints = true;
+  } else if (*ty == *arr(string_, string_)) {
+    m_ints = false;
+  } else {
+    throw Error(name + " has type " + *ty->ppr()->string() +
+                ", not string -> string or int -> int");
+  }
+
+  m_fn = repl.value_env()->lookup(id);
+  m_writes = Writes()(m_fn);
+}
+
+
+bool Mapper::run(istream &in, ostream &out)
+{
+  auto threads = m_threads? m_threads: thread::hardware_concurrency();
+  // threads sharing a cell would race on it
+  threads = m_writes? 1: max(1u, threads);
+
+  Reader reader(in);
+  size_t line = 1;
+  bool ok = true, more = true;
+
+  while (more) {
+    vector<Batch> batches;
+    while (more && batches.size() < threads * batches_per_thread) {
+      Batch b;
+      b.line = line;
+      String record;
+      while (b.records.size() < batch_size && (more = reader.line(record))) {
+        b.records.push_back(move(record));
+      }
+      line += b.records.size();
+      if (!b.records.empty()) batches.push_back(move(b));
+    }
+
+    auto n = min<size_t>(threads, batches.size());
+    if (n <= 1) {
+      for (auto &b: batches) apply(b);
+    } else {
+      atomic<size_t> next {0};
+      auto work = [&] {
+        for (size_t i; (i = next++) < batches.size();) apply(batches[i]);
+      };
+      vector<thread> pool;
+      for (size_t i = 1; i < n; ++i) pool.emplace_back(work);
+      work();
+      for (auto &t: pool) t.join();
+    }
+
+    for (auto &b: batches) {
+      out.write(b.out.data(), b.out.size());
+      cerr << b.errors;
+      ok = ok && b.ok;
+    }
+  }
+
+  out.flush();
+  return ok && out.good();
+}
+
+
+void Mapper::apply(Batch &b) const
+{
+  Redirect redirect(cerr);
+  auto n = b.records.size();
+
+  if (m_ints && m_fn->type() == ExprType::CLOSURE) {
+    vector<long> xs(n);
+    bool all = true;
+    for (size_t i = 0; i < n && all; ++i) all = number(b.records[i], xs[i]);
+    auto &c = static_cast<const ClosureExpr&>(*m_fn);
+    if (all && ir::map(c, xs.data(), xs.data(), n)) {
+      for (auto x: xs) b.out += to_string(x) + '\n';
+      return;
+    }
+  }
+
+  String result;
+  for (size_t i = 0; i < n; ++i) {
+    if (!apply(b.records[i], result, b.line + i, b.errors)) b.ok = false;
+    b.out += result;
+    b.out += '\n';
+  }
+}
+
+bool Mapper::apply(const String &record, String &result, size_t line,
+                   String &errors) const
+{
+  result.clear();
+  auto fail = [&](const String &msg) {
+    errors += "record " + to_string(line) + ": " + msg + "\n";
+    return false;
+  };
+
+  Ptr<Expr> arg;
+  if (m_ints) {
+    long n;
+    if (!number(record, n)) return fail("not an int");
+    arg = ptr<IntExpr>(n);
+  } else {
+    arg = ptr<StringExpr>(record);
+  }
+
+  try {
+    Budget budget(m_eval_limits);
+    auto res = miniml::apply(m_fn, arg);
+    result = m_ints? to_string(INT(res)): STRING(res);
+  } catch (EvalException &e) {
+    return fail(e.what());
+  }
+  return true;
+}
+
+}
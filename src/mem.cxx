@@ -0,0 +1,301 @@
+#include "mem.hxx"
+#include "ast.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace miniml
+{
+
+namespace mem
+{
+
+namespace
+{
+  const size_t kinds = size_t(Kind::COUNT_);
+
+  /// A count which remembers the highest it's been.
+  struct Gauge final
+  {
+    std::atomic<long> now {0}, peak {0};
+
+    void add(long n)
+    {
+      auto x = now.fetch_add(n, std::memory_order_relaxed) + n;
+      auto p = peak.load(std::memory_order_relaxed);
+      while (x > p &&
+             !peak.compare_exchange_weak(p, x, std::memory_order_relaxed)) {}
+    }
+  };
+
+  struct Stats final
+  {
+    Gauge count, bytes;
+  };
+
+  /// Each kind, then the total.
+  Stats stats[kinds + 1];
+
+  /// Counts a thread has made which haven't been added to #stats yet, so
+  /// that threads don't all update the same atomics every time.
+  struct Pending final
+  {
+    /// Most objects counted between adding them to #stats.
+    static const unsigned max_ops = 1024;
+    /// Most bytes by which the total can change between adding them.
+    static const long max_bytes = 64 * 1024;
+
+    long count[kinds + 1] = {}, bytes[kinds + 1] = {};
+    unsigned ops = 0;
+
+    ~Pending() { flush(); }
+
+    inline void add(size_t k, long c, long b)
+    {
+      count[k] += c;
+      bytes[k] += b;
+      count[kinds] += c;
+      bytes[kinds] += b;
+      if (++ops >= max_ops || bytes[kinds] >= max_bytes ||
+          bytes[kinds] <= -max_bytes) {
+        flush();
+      }
+    }
+
+    void flush()
+    {
+      // the total first, so its peak is as high as any kind's could be
+      for (size_t i = kinds + 1; i-- > 0;) {
+        if (count[i]) stats[i].count.add(count[i]);
+        if (bytes[i]) stats[i].bytes.add(bytes[i]);
+        count[i] = bytes[i] = 0;
+      }
+      ops = 0;
+    }
+  };
+
+  thread_local Pending pending;
+
+  const char *names[kinds] = {
+    "IdExpr", "AppExpr", "LamExpr", "IfExpr", "IntExpr", "BoolExpr",
+    "StringExpr", "TypeExpr", "BinOpExpr", "TupleExpr", "DotExpr",
+    "BuiltinExpr", "ClosureExpr", "ArrayExpr", "UnOpExpr", "IndexExpr",
+    "RefExpr", "MapExpr", "LazyExpr", "StreamExpr",
+    "Type", "IR", "ExprPool", "Frame", "Env", "Binding", "String",
+    "ArrayData", "MapNode", "Ppr",
+  };
+
+  /// Where in the source something was allocated: the start and end of the
+  /// expression, since nested ones can start at the same place.
+  using Place = std::pair<std::uint32_t, std::uint32_t>;
+
+  /// What was allocated at one place.
+  struct Allocs final
+  {
+    size_t count = 0, bytes = 0;
+    /// What the expression there looks like.
+    String sample;
+    /// The source it's in, kept so that the place can still be found when
+    /// it's printed.
+    Ptr<const Source> source;
+  };
+
+  std::mutex profile_mutex;
+  std::map<Place, Allocs> places;
+
+  /// Allocations a thread has put down to places which haven't been added
+  /// to #places yet, so that threads don't take #profile_mutex every time.
+  struct PendingPlaces final
+  {
+    /// Most allocations put down between adding them to #places.
+    static const unsigned max_ops = 1024;
+
+    std::map<Place, Allocs> places;
+    /// Places this thread has already made a sample of.
+    std::set<Place> sampled;
+    unsigned ops = 0;
+
+    ~PendingPlaces() { flush(); }
+
+    void flush()
+    {
+      std::lock_guard<std::mutex> lock(profile_mutex);
+      for (auto &p: places) {
+        auto &a = mem::places[p.first];
+        if (a.sample.empty()) a.sample = std::move(p.second.sample);
+        if (!a.source) a.source = std::move(p.second.source);
+        a.count += p.second.count;
+        a.bytes += p.second.bytes;
+      }
+      places.clear();
+      ops = 0;
+    }
+  };
+
+  thread_local PendingPlaces pending_places;
+
+  /// Short one-line version of an expression.
+  String sample(const Expr &e)
+  {
+    const size_t max = 60;
+    auto str = e.ppr()->string();
+    String out;
+    for (auto c: *str) {
+      if (std::isspace(c)) {
+        if (!out.empty() && out.back() != ' ') out += ' ';
+      } else {
+        out += c;
+      }
+      if (out.size() > max) return out.substr(0, max - 3) + "...";
+    }
+    return out;
+  }
+
+  void attribute(Where w, size_t bytes, size_t n)
+  {
+    // printing the sample allocates things too, which don't count
+    auto prev = site;
+    site = Where();
+
+    auto &p = pending_places;
+    Place place = w.expr?
+      Place(w.expr->start().offset, w.expr->end().offset):
+      Place(w.pool->start(w.ref).offset, w.pool->end(w.ref).offset);
+    auto &a = p.places[place];
+    if (p.sampled.insert(place).second) {
+      if (w.expr) {
+        a.sample = sample(*w.expr);
+        a.source = w.expr->source();
+      } else {
+        a.sample = sample(*w.pool->expr(w.ref));
+        a.source = w.pool->source(w.ref);
+      }
+    }
+    a.count += n;
+    a.bytes += bytes;
+    if (++p.ops >= p.max_ops) p.flush();
+
+    site = prev;
+  }
+
+
+  /// String which takes itself off the count when it's deleted.
+  struct CountedString final
+  {
+    CountedString(size_t bytes): bytes(bytes) {}
+    void operator()(String *str) const
+    {
+      remove(Kind::STRING, bytes);
+      delete str;
+    }
+    size_t bytes;
+  };
+}
+
+bool profiling = false;
+thread_local Where site;
+thread_local long thread_bytes = 0;
+thread_local unsigned long thread_allocs = 0;
+
+
+const char *name(Kind k)
+{ return names[size_t(k)]; }
+
+void add(Kind k, size_t bytes, size_t n)
+{
+  pending.add(size_t(k), n, bytes);
+  thread_bytes += bytes;
+  thread_allocs += n;
+  if (profiling && site) attribute(site, bytes, n);
+}
+
+void remove(Kind k, size_t bytes, size_t n)
+{
+  pending.add(size_t(k), -long(n), -long(bytes));
+  thread_bytes -= bytes;
+}
+
+Ptr<String> string(String &&str)
+{
+  auto bytes = sizeof(String) + str.capacity();
+  add(Kind::STRING, bytes);
+  return Ptr<String>(new String(std::move(str)), CountedString(bytes));
+}
+
+
+void report(OStream &out)
+{
+  pending.flush();
+  out << std::left << std::setw(12) << "kind" << std::right
+      << std::setw(10) << "live" << std::setw(12) << "bytes"
+      << std::setw(10) << "peak" << std::setw(12) << "bytes" << std::endl;
+
+  for (size_t i = 0; i <= kinds; ++i) {
+    auto &s = stats[i];
+    // leave out the kinds there's never been any of
+    if (i < kinds && s.count.peak == 0) continue;
+    out << std::left << std::setw(12) << (i < kinds? names[i]: "total")
+        << std::right
+        << std::setw(10) << s.count.now << std::setw(12) << s.bytes.now
+        << std::setw(10) << s.count.peak << std::setw(12) << s.bytes.peak
+        << std::endl;
+  }
+}
+
+void profile(OStream &out, size_t top)
+{
+  pending_places.flush();
+  std::vector<std::pair<Place, Allocs>> sorted;
+  {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    sorted.assign(places.begin(), places.end());
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<Place, Allocs> &a,
+               const std::pair<Place, Allocs> &b) {
+              return a.second.bytes > b.second.bytes;
+            });
+  if (sorted.size() > top) sorted.resize(top);
+
+  out << std::left << std::setw(24) << "place" << std::right
+      << std::setw(10) << "objects" << std::setw(12) << "bytes"
+      << "  expression" << std::endl;
+  for (auto &p: sorted) {
+    SStream place;
+    Pos pos(p.first.first);
+    auto file = pos.file();
+    place << (file? *file: "<input>") << ':' << pos;
+    out << std::left << std::setw(24) << place.str() << std::right
+        << std::setw(10) << p.second.count << std::setw(12) << p.second.bytes
+        << "  " << p.second.sample << std::endl;
+  }
+}
+
+void dump(OStream &out)
+{
+  pending.flush();
+  auto entry = [&](const char *name, const Stats &s) {
+    out << '"' << name << "\": {\"live\": " << s.count.now
+        << ", \"live_bytes\": " << s.bytes.now
+        << ", \"peak\": " << s.count.peak
+        << ", \"peak_bytes\": " << s.bytes.peak << '}';
+  };
+
+  out << '{';
+  for (size_t i = 0; i < kinds; ++i) {
+    entry(names[i], stats[i]);
+    out << ", ";
+  }
+  entry("total", stats[kinds]);
+  out << '}' << std::endl;
+}
+
+}
+
+}
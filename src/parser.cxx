@@ -1,6 +1,10 @@
 #include "parser.hxx"
 #include "lexer.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cstdlib>
+#include <thread>
 
 using namespace miniml;
 
@@ -16,6 +20,8 @@ void MiniMLParserTrace(FILE*, char*);
 namespace
 {
   int token_id(const Token &tok);
+
+  Ptr<Input> parse_chunks(const String&, const String *file);
 }
 
 namespace miniml
@@ -39,13 +45,16 @@ const char *Parser::ParseFail::what() const noexcept
 
 
 
+unsigned Parser::threads = 0;
+
 Parser::Parser():
   parser(MiniMLParserAlloc(&std::malloc))
 { }
 
-Ptr<Input> Parser::parse(const String &input)
+Ptr<Input> Parser::parse(const String &input, const String *file)
 {
-  return parse(Lexer(input).tokens());
+  auto module = parse_chunks(input, file);
+  return module? module: parse(Lexer(input, file).tokens());
 }
 
 Ptr<Input> Parser::parse(const std::vector<Ptr<Token>>& toks)
@@ -72,6 +81,47 @@ Parser::~Parser()
   MiniMLParserFree(parser, &std::free);
 }
 
+size_t Parser::input_end(const String &src, InputScan &scan)
+{
+  using In = InputScan::In;
+  auto size = src.size();
+  auto &i = scan.from;
+
+  for (; i < size; ++i) {
+    switch (scan.in) {
+    case In::CODE:
+      if (i + 1 == size && (src[i] == ';' || src[i] == '/')) {
+        // the rest of a `;;` or a `//` might be still to come
+        return String::npos;
+      } else if (src.compare(i, 2, ";;") == 0) {
+        return i;
+      } else if (src[i] == '"') {
+        scan.in = In::STRING;
+      } else if (src.compare(i, 2, "//") == 0) {
+        scan.in = In::COMMENT;
+        ++i;
+      }
+      break;
+    case In::STRING:
+      if (src[i] == '\\') {
+        if (i + 1 == size) return String::npos;
+        ++i;
+      } else if (src[i] == '"') {
+        scan.in = In::CODE;
+      }
+      break;
+    case In::COMMENT:
+      if (src[i] == '\n') scan.in = In::CODE;
+      break;
+#ifdef __GNUC__
+    default:
+      std::abort();
+#endif
+    }
+  }
+  return String::npos;
+}
+
 }
 
 
@@ -114,6 +164,13 @@ namespace
       CASE(SEQ);
       CASE(COMMA);
       CASE(DOT);
+      CASE(REF);
+      CASE(BANG);
+      CASE(ASSIGN);
+      CASE(LBRACK);
+      CASE(RBRACK);
+      CASE(LAZY);
+      CASE(FORCE);
 #undef CASE
 #ifdef __GNUC__
       default: std::abort();
@@ -121,3 +178,161 @@ namespace
     }
   }
 }
+
+
+namespace
+{
+  /// Inputs at least this big are parsed in chunks, if they're modules.
+  const size_t parallel_min = 1 << 20;
+  /// Smallest chunk worth a thread.
+  const size_t chunk_min = 256 << 10;
+
+  inline bool id_letter(Char c)
+  { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' ||
+           c == '\''; }
+
+  /// If a string or a comment starts at \a i, where it ends: just after the
+  /// closing quote, or at the newline.
+  /// \return \a i if there's neither, or `String::npos` if it doesn't end.
+  size_t skip_literal(const String &src, size_t i)
+  {
+    auto size = src.size();
+    if (src[i] == '"') {
+      // to the closing quote, skipping escaped ones
+      for (++i; i < size && src[i] != '"'; ++i) {
+        if (src[i] == '\\') ++i;
+      }
+      return i < size? i + 1: String::npos;
+    } else if (src.compare(i, 2, "//") == 0) {
+      return src.find('\n', i);
+    }
+    return i;
+  }
+
+  /// Skip whitespace and comments from \a i.
+  size_t skip_space(const String &src, size_t i)
+  {
+    while (i < src.size()) {
+      if (std::isspace(static_cast<unsigned char>(src[i]))) {
+        ++i;
+      } else if (src.compare(i, 2, "//") == 0) {
+        i = src.find('\n', i);
+        if (i == String::npos) return src.size();
+      } else {
+        break;
+      }
+    }
+    return i;
+  }
+
+  /// Whether some source code starts like a module, with `name =>`.
+  bool module_header(const String &src)
+  {
+    auto i = skip_space(src, 0);
+    if (i == src.size() || !(std::isalpha(static_cast<unsigned char>(src[i]))
+                             || src[i] == '_')) {
+      return false;
+    }
+    while (i < src.size() && id_letter(src[i])) ++i;
+    i = skip_space(src, i);
+    return src.compare(i, 2, "=>") == 0;
+  }
+
+  /// Split some source code into about \a n chunks, each ending where a
+  /// declaration starts: at a `val` or `fun` keyword outside of strings and
+  /// comments, which can't be anywhere else, since declarations don't nest.
+  /// It only has to look for quotes, slashes and those keywords, so it's
+  /// much quicker than lexing.
+  /// \return Where each chunk starts, the first at 0.
+  std::vector<size_t> split(const String &src, size_t n)
+  {
+    std::vector<size_t> starts {0};
+    auto size = src.size();
+    size_t next = size / n;
+    for (size_t i = 0; i < size && starts.size() < n;) {
+      auto c = src[i];
+      auto end = skip_literal(src, i);
+      if (end == String::npos) {
+        break;
+      } else if (end != i) {
+        i = end;
+      } else if (id_letter(c)) {
+        auto j = i;
+        while (j < size && id_letter(src[j])) ++j;
+        if (i >= next && j - i == 3 &&
+            (src.compare(i, 3, "val") == 0 || src.compare(i, 3, "fun") == 0)) {
+          starts.push_back(i);
+          next = size / n * starts.size();
+        }
+        i = j;
+      } else {
+        ++i;
+      }
+    }
+    return starts;
+  }
+
+  /// Lex and parse a big module a chunk at a time, on Parser::threads
+  /// threads, and put the declarations back together in order.
+  /// Every chunk is lexed as a part of the whole source, so the lines and
+  /// columns are the same as if it had been done in one go, but each chunk
+  /// has its own count of what's using it.
+  /// If any chunk fails, the whole module is parsed again in one go, so the
+  /// error is exactly the one that gives.
+  /// \return `nullptr` if it's not worth doing that way, or not a module.
+  Ptr<Input> parse_chunks(const String &src, const String *file)
+  {
+    if (src.size() < parallel_min || !module_header(src)) return nullptr;
+    size_t threads = Parser::threads? Parser::threads:
+                     std::max(1u, std::thread::hardware_concurrency());
+    auto starts = split(src, std::min(threads, src.size() / chunk_min));
+    auto n = starts.size();
+    if (n < 2) return nullptr;
+
+    auto source = Source::add(src, file);
+    std::vector<Ptr<ModuleInput>> parts(n);
+    std::atomic<bool> failed {false};
+    std::atomic<size_t> next {0};
+
+    auto work = [&] {
+      for (size_t i; !failed && (i = next++) < n;) {
+        try {
+          auto begin = starts[i];
+          auto end = i + 1 < n? starts[i + 1]: src.size();
+          auto toks = Lexer(source->part(begin, end)).tokens();
+          if (i > 0) {
+            // only the first chunk has the module's header, so the rest
+            // get one to make them modules too
+            Ptr<Token> header[] = {
+              ptr<IdToken>("_", 1, Pos(), Pos()),
+              Token::atomic<Token::Type::ARROW>(Pos(), Pos())
+            };
+            toks.insert(toks.begin(), header, header + 2);
+          }
+          parts[i] = dyn_cast<ModuleInput>(Parser().parse(toks));
+        } catch (...) {
+          failed = true;
+        }
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min(threads, n); ++t) pool.emplace_back(work);
+    work();
+    for (auto &t: pool) t.join();
+
+    // where a chunk goes wrong depends on where the source was split (a
+    // declaration cut short only shows at the start of the next chunk), so
+    // leave the error to parsing it in one go
+    if (failed) {
+      return Parser().parse(Lexer(source).tokens());
+    }
+
+    auto &decls = *parts[0]->decls;
+    for (size_t i = 1; i < n; ++i) {
+      decls.insert(decls.end(), parts[i]->decls->begin(),
+                   parts[i]->decls->end());
+    }
+    return parts[0];
+  }
+}
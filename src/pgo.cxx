@@ -0,0 +1,415 @@
+#include "pgo.hxx"
+#include "init_env.hxx"
+#include "walk.hxx"
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace miniml
+{
+
+namespace pgo
+{
+
+namespace
+{
+  /// Where in the source something is: the start and end of the
+  /// expression, since nested ones can start at the same place.
+  inline std::uint64_t place(const ir::Src &e)
+  { return std::uint64_t(e.start().offset) << 32 | e.end().offset; }
+
+  /// The same, in a form which means the same thing in another run.
+  String place_name(std::uint64_t p)
+  {
+    Pos start(p >> 32), end(p & 0xffffffff);
+    auto file = start.file();
+    SStream out;
+    out << (file? *file: "<input>") << ':' << start << '-' << end;
+    return out.str();
+  }
+
+  String record_file;
+
+  /// How many times something ran, and the source it's in, which has to be
+  /// kept for #place_name to find it later.
+  struct Count final
+  {
+    unsigned long n = 0;
+    Ptr<const Source> source;
+  };
+
+  using Counts = std::unordered_map<std::uint64_t, Count>;
+
+  /// Count something in a run.
+  inline void count(Counts &m, const ir::Src &src)
+  {
+    auto &c = m[place(src)];
+    if (!c.n++) c.source = src.source();
+  }
+
+  std::mutex mutex;
+  /// Counts from this run.
+  Counts lams, calls;
+
+  /// Counts loaded, by #place_name.
+  struct Profile final
+  {
+    std::map<String, unsigned long> counts;
+    unsigned long total = 0;
+
+    /// Whether something counts as hot: run often enough to be worth
+    /// optimising, and often enough compared to everything else.
+    bool hot(const ir::Src &e) const
+    {
+      static const unsigned long min_hot = 16;
+      auto it = counts.find(place_name(place(e)));
+      if (it == counts.end()) return false;
+      return it->second >= min_hot && it->second * 1000 >= total;
+    }
+  };
+
+  bool have_profile = false;
+  Profile lam_profile, call_profile;
+}
+
+bool recording = false;
+
+void record(const String &file)
+{
+  record_file = file;
+  recording = true;
+}
+
+void count_lam(const ir::Src &src)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  count(lams, src);
+}
+
+void count_call(const ir::Src &src)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  count(calls, src);
+}
+
+bool save()
+{
+  std::ofstream out(record_file);
+  if (out.fail()) return false;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto write = [&](const char *kind, const Counts &m) {
+    // places which are the same in the source are counted together
+    std::map<String, unsigned long> named;
+    for (auto &c: m) named[place_name(c.first)] += c.second.n;
+    for (auto &c: named) {
+      out << kind << ' ' << c.second << ' ' << c.first << std::endl;
+    }
+  };
+  write("lam", lams);
+  write("call", calls);
+  return out.good();
+}
+
+bool load(const String &file)
+{
+  std::ifstream in(file);
+  if (in.fail()) return false;
+
+  String kind;
+  unsigned long count;
+  while (in >> kind >> count) {
+    String name;
+    std::getline(in >> std::ws, name);
+    Profile *p = kind == "lam"? &lam_profile:
+                 kind == "call"? &call_profile: nullptr;
+    if (!p) return false;
+    p->counts[name] += count;
+    p->total += count;
+  }
+  have_profile = true;
+  return in.eof();
+}
+
+bool loaded()
+{ return have_profile; }
+
+
+namespace
+{
+  using namespace ir;
+
+  /// Bodies with at most this many nodes are inlined when all the arguments
+  /// are trivial...
+  const size_t max_inline = 32;
+  /// ...and at most this many when they're all constant, since most of the
+  /// body might fold away, or specialised when only some are.
+  const size_t max_special = 200;
+
+  /// Whether a tree has at most \a max nodes, without recursing.
+  bool small(const Ptr<Node> &root, size_t max)
+  {
+    std::vector<const Node*> todo {root.get()};
+    size_t n = 0;
+    while (!todo.empty()) {
+      auto node = todo.back();
+      todo.pop_back();
+      if (++n > max) return false;
+      for (auto &k: node->kids) todo.push_back(k.get());
+    }
+    return true;
+  }
+
+  /// Whether an argument can be put in place of each use of the parameter,
+  /// rather than being evaluated once before the call. Global functions are
+  /// the same wherever they're looked up; other globals might be lazy ones
+  /// which would be forced at a different time.
+  bool trivial(const Node &n)
+  {
+    return n.op == Op::CONST || n.op == Op::LOCAL ||
+           (n.op == Op::GLOBAL && n.ty->type() == TypeType::ARROW);
+  }
+
+  inline bool is_const(const Node &n) { return n.op == Op::CONST; }
+  inline long ival(const Node &n)
+  { return static_cast<const IntExpr&>(*n.value).val(); }
+  inline bool bval(const Node &n)
+  { return static_cast<const BoolExpr&>(*n.value).val(); }
+
+  /// Work out a node whose operands are constants, if it's that sort of
+  /// node.
+  Ptr<Node> fold(const Ptr<Node> &n)
+  {
+    auto &ks = n->kids;
+    auto constant = [&](Ptr<Expr> value) {
+      auto c = ptr<Node>(Op::CONST, n->ty, n->src);
+      c->value = value;
+      return c;
+    };
+
+#define INT_OP(op) return constant(ptr<IntExpr>(ival(*ks[0]) op ival(*ks[1])))
+#define INT_CMP(op) \
+    return constant(ptr<BoolExpr>(ival(*ks[0]) op ival(*ks[1])))
+#define BOOL_OP(op) \
+    return constant(ptr<BoolExpr>(bval(*ks[0]) op bval(*ks[1])))
+
+    switch (n->op) {
+    case Op::IF:
+      if (is_const(*ks[0])) return bval(*ks[0])? ks[1]: ks[2];
+      return n;
+    case Op::SEQ:
+      return is_const(*ks[0])? ks[1]: n;
+    default:
+      break;
+    }
+
+    if (ks.size() != 2 || !is_const(*ks[0]) || !is_const(*ks[1])) return n;
+    switch (n->op) {
+    case Op::INT_ADD: INT_OP(+);
+    case Op::INT_SUB: INT_OP(-);
+    case Op::INT_MUL: INT_OP(*);
+    case Op::INT_DIV:
+      // leave dividing by zero to fail when it's run
+      if (ival(*ks[1]) == 0) return n;
+      INT_OP(/);
+    case Op::INT_LT:  INT_CMP(<);
+    case Op::INT_LE:  INT_CMP(<=);
+    case Op::INT_EQ:  INT_CMP(==);
+    case Op::INT_GE:  INT_CMP(>=);
+    case Op::INT_GT:  INT_CMP(>);
+    case Op::INT_NE:  INT_CMP(!=);
+    case Op::BOOL_AND: BOOL_OP(&&);
+    case Op::BOOL_OR:  BOOL_OP(||);
+    case Op::BOOL_IFF: BOOL_OP(==);
+    default:
+      return n;
+    }
+
+#undef INT_OP
+#undef INT_CMP
+#undef BOOL_OP
+  }
+
+  /// Copy of the body of a chain of lambdas with some of their parameters
+  /// replaced by arguments, and the rest renumbered for a new chain of
+  /// lambdas taking just them. The copy is folded as it's made, and has no
+  /// #Op::SHARED nodes, since they were numbered for the old frames; ir::cse
+  /// puts them back.
+  struct Subst final
+  {
+    /// \param args Argument for each parameter, outermost first, or null
+    ///             for the ones kept.
+    Subst(const std::vector<Ptr<Node>> &args): args(args), kept(args.size())
+    {
+      unsigned q = 0;
+      for (size_t r = 0; r < args.size(); ++r) {
+        if (!args[r]) kept[r] = q++;
+      }
+      nkept = q;
+    }
+
+    /// \param depth Number of lambdas inside the body \a n is.
+    Ptr<Node> operator()(const Ptr<Node> &n, unsigned depth) const
+    {
+      switch (n->op) {
+      case Op::LOCAL: {
+        if (n->index < depth) return n;
+        auto r = args.size() - 1 - (n->index - depth);
+        auto m = ptr<Node>(*n);
+        if (args[r]) {
+          m = ptr<Node>(*args[r]);
+          if (m->op == Op::LOCAL) m->index += depth;
+        } else {
+          m->index = depth + nkept - 1 - kept[r];
+        }
+        return m;
+      }
+      case Op::SHARED:
+        return (*this)(n->kids[0], depth);
+      default: {
+        auto m = ptr<Node>(*n);
+        auto d = depth + (n->op == Op::LAM);
+        for (auto &k: m->kids) k = (*this)(k, d);
+        if (m->op == Op::LAM) m->index = 0;
+        return fold(m);
+      }
+      }
+    }
+
+    const std::vector<Ptr<Node>> &args;
+    /// Position of each parameter kept among those kept.
+    std::vector<unsigned> kept;
+    unsigned nkept;
+  };
+
+  /// Whether a body only refers to the parameters of the \a p lambdas
+  /// around it, and not to the frame they were closed over in.
+  bool closed(const Ptr<Node> &body, unsigned p)
+  {
+    std::vector<std::pair<const Node*, unsigned>> todo {{body.get(), 0}};
+    while (!todo.empty()) {
+      auto n = todo.back();
+      todo.pop_back();
+      if (n.first->op == Op::LOCAL && n.first->index >= n.second + p) {
+        return false;
+      }
+      auto d = n.second + (n.first->op == Op::LAM);
+      for (auto &k: n.first->kids) todo.emplace_back(k.get(), d);
+    }
+    return true;
+  }
+
+  /// Inline or specialise the hot calls in some code, innermost first. The
+  /// context is the number of lambdas a node is inside, and the result is
+  /// what to replace it with.
+  struct Optimise final: public Walk<Optimise, Node, Ptr<Node>, unsigned>
+  {
+    unsigned down(const Ptr<Node> &n, unsigned &depth, size_t, const Ptr<Node>*)
+    { return depth + (n->op == Op::LAM); }
+
+    Ptr<Node> post(const Ptr<Node> &n, unsigned&, Ptr<Node> *kids, size_t k)
+    {
+      auto m = n;
+      for (size_t i = 0; i < k; ++i) {
+        if (kids[i] == n->kids[i]) continue;
+        if (m == n) m = ptr<Node>(*n);
+        m->kids[i] = kids[i];
+      }
+      if (m->op == Op::APP || m->op == Op::CALL) return call(m);
+      return m;
+    }
+
+    /// A call with the function's body in place of it, or a call of a
+    /// specialised version of it, or the call itself if it isn't worth
+    /// doing either.
+    Ptr<Node> call(const Ptr<Node> &n)
+    {
+      auto &f = n->kids[0];
+      if (f->op != Op::GLOBAL || f->ty->type() != TypeType::ARROW ||
+          !call_profile.hot(n->src)) {
+        return n;
+      }
+      // a recursive function's calls of itself aren't bound yet
+      if (!f->global || !f->global->forced()) return n;
+      auto val = f->global->value;
+      if (val->type() != ExprType::CLOSURE) return n;
+      auto &c = static_cast<const ClosureExpr&>(*val);
+      if (c.frame() || !lam_profile.hot(c.lam()->src)) return n;
+
+      // the lambdas the arguments go to
+      std::vector<Ptr<Node>> chain {c.lam()};
+      auto nargs = n->kids.size() - 1;
+      while (chain.size() < nargs && chain.back()->kids[0]->op == Op::LAM) {
+        chain.push_back(chain.back()->kids[0]);
+      }
+      auto p = chain.size();
+      auto &body = chain.back()->kids[0];
+      if (!closed(body, p)) return n;
+
+      std::vector<Ptr<Node>> args(n->kids.begin() + 1,
+                                  n->kids.begin() + 1 + p);
+      bool all_trivial = true, all_const = true, any_const = false;
+      for (auto &a: args) {
+        all_trivial = all_trivial && trivial(*a);
+        all_const = all_const && is_const(*a);
+        any_const = any_const || is_const(*a);
+      }
+
+      Ptr<Node> head;
+      std::vector<Ptr<Node>> rest;
+      if ((all_trivial && small(body, max_inline)) ||
+          (all_const && small(body, max_special))) {
+        head = Subst(args)(body, 0);
+      } else if (any_const && small(body, max_special)) {
+        head = specialise(chain, args, rest);
+      } else {
+        return n;
+      }
+
+      rest.insert(rest.end(), n->kids.begin() + 1 + p, n->kids.end());
+      if (rest.empty()) return head;
+      auto m = ptr<Node>(rest.size() > 1? Op::CALL: Op::APP, n->ty, n->src);
+      m->kids.push_back(head);
+      m->kids.insert(m->kids.end(), rest.begin(), rest.end());
+      return m;
+    }
+
+    /// A copy of a function with its constant arguments substituted in.
+    /// \param rest Gets the arguments which are left to give it.
+    Ptr<Node> specialise(const std::vector<Ptr<Node>> &chain,
+                         std::vector<Ptr<Node>> args,
+                         std::vector<Ptr<Node>> &rest)
+    {
+      for (auto &a: args) {
+        if (is_const(*a)) continue;
+        rest.push_back(a);
+        a = nullptr;
+      }
+
+      auto lam = Subst(args)(chain.back()->kids[0], 0);
+      for (auto r = chain.size(); r-- > 0;) {
+        if (args[r]) continue;
+        auto arg_ty = static_cast<const ArrowType&>(*chain[r]->ty).left();
+        auto l = ptr<Node>(Op::LAM, ptr<ArrowType>(arg_ty, lam->ty),
+                           chain[r]->src);
+        l->kids.push_back(lam);
+        lam = l;
+      }
+      cse(lam);
+
+      auto k = ptr<Node>(Op::CONST, lam->ty, chain[0]->src);
+      k->value = ptr<ClosureExpr>(lam, nullptr);
+      return k;
+    }
+  };
+}
+
+Ptr<ir::Node> optimise(const Ptr<ir::Node> &code)
+{ return Optimise()(code, 0); }
+
+}
+
+}
@@ -1,4 +1,8 @@
 #include "pos.hxx"
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <map>
 
 namespace miniml
 {
@@ -12,47 +16,178 @@ namespace ppr
 
 }
 
-Pos Pos::operator+(const char c) const
+
+size_t Pos::line() const
 {
-  Pos p2 = *this;
-  p2 += c;
-  return p2;
+  auto src = Source::find(*this);
+  return src? src->line_col(*this).first: 1;
 }
 
-Pos &Pos::operator+=(const char c)
+size_t Pos::col() const
 {
-  ++pos;
-  switch (c) {
-    case '\n':
-    case '\r':
-    case '\f': // form feed
-    case '\v': // vertical tab
-      ++line;
-      col = 0;
-      break;
-    case '\t':
-      col += 8 - (col % 8);
-      break;
-    default:
-      ++col;
+  auto src = Source::find(*this);
+  return src? src->line_col(*this).second: 0;
+}
+
+const String *Pos::file() const
+{
+  auto src = Source::find(*this);
+  return src? src->file(): nullptr;
+}
+
+
+namespace
+{
+  /// Offsets are given out a page at a time, so that a page only ever has
+  /// one source in it, and a position's page is enough to find it.
+  const unsigned page_bits = 12, leaf_bits = 10;
+  const std::uint32_t pages = 1u << (32 - page_bits),
+                      leaf_mask = (1u << leaf_bits) - 1;
+
+  /// Pages needed for a source of some size, with room for the position just
+  /// after its end.
+  inline std::uint64_t pages_for(size_t size)
+  { return (std::uint64_t(size) >> page_bits) + 1; }
+
+  /// The source in each page, looked up without locking. It's split into
+  /// leaves of 4MiB of offsets each, which are only made when they're first
+  /// used, and kept after that (8MiB at the very most).
+  using Slot = std::atomic<const Source*>;
+  std::atomic<Slot*> table[pages >> leaf_bits];
+
+  std::mutex mutex;
+  using Runs = std::map<std::uint32_t, std::uint32_t>;
+
+  /// Runs of unused pages: the first page of each, and how many there are.
+  /// Page 0 is never used, since offset 0 is nowhere. It's never destroyed,
+  /// since sources can be kept by other statics, e.g. a memory profile.
+  Runs &unused_runs()
+  {
+    static auto runs = new Runs {{1, pages - 1}};
+    return *runs;
   }
-  return *this;
 }
 
+Source::Source(Ptr<const Text> text, size_t begin, size_t end):
+  m_text(text), m_begin(begin), m_end(end)
+{
+  auto n = pages_for(end - begin);
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &unused = unused_runs();
+  auto run = std::find_if(unused.begin(), unused.end(),
+                          [n](const std::pair<const std::uint32_t,
+                                              std::uint32_t> &r)
+                          { return r.second >= n; });
+  if (run == unused.end()) return;
+
+  auto first = run->first, last = std::uint32_t(first + n - 1);
+  for (auto leaf = first >> leaf_bits; leaf <= last >> leaf_bits; ++leaf) {
+    if (!table[leaf].load(std::memory_order_relaxed)) {
+      table[leaf].store(new Slot[1u << leaf_bits](),
+                        std::memory_order_release);
+    }
+  }
+  for (auto page = first; page <= last; ++page) {
+    table[page >> leaf_bits].load(std::memory_order_relaxed)[page & leaf_mask]
+      .store(this, std::memory_order_release);
+  }
+  if (run->second > n) unused.emplace(last + 1, run->second - n);
+  unused.erase(run);
+  m_base = first << page_bits;
+}
 
-Pos Pos::operator+(const String &s) const
+Source::~Source()
 {
-  Pos p2 = *this;
-  p2 += s;
-  return p2;
+  if (!m_base) return;
+  std::uint32_t first = m_base >> page_bits, n = pages_for(m_end - m_begin);
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto page = first; page < first + n; ++page) {
+    table[page >> leaf_bits].load(std::memory_order_relaxed)[page & leaf_mask]
+      .store(nullptr, std::memory_order_relaxed);
+  }
+
+  // give the pages back, joined up with any unused ones either side
+  auto &unused = unused_runs();
+  auto next = unused.lower_bound(first);
+  if (next != unused.end() && next->first == first + n) {
+    n += next->second;
+    next = unused.erase(next);
+  }
+  if (next != unused.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == first) {
+      prev->second += n;
+      return;
+    }
+  }
+  unused.emplace_hint(next, first, n);
+}
+
+Ptr<const Source> Source::add(const String &text, const String *file)
+{
+  auto t = ptr<Text>();
+  t->text = text;
+  t->file = file? *file: String();
+  t->named = file;
+  return Ptr<const Source>(new Source(t, 0, text.size()));
+}
+
+Ptr<const Source> Source::part(size_t begin, size_t end) const
+{
+  return Ptr<const Source>(new Source(m_text, m_begin + begin,
+                                      m_begin + end));
+}
+
+const Source *Source::find(Pos p)
+{
+  if (!p.offset) return nullptr;
+  auto page = p.offset >> page_bits;
+  auto leaf = table[page >> leaf_bits].load(std::memory_order_acquire);
+  return leaf? leaf[page & leaf_mask].load(std::memory_order_acquire)
+             : nullptr;
 }
 
-Pos &Pos::operator+=(const String &s)
+std::pair<size_t, size_t> Source::line_col(Pos p) const
 {
-  for (char c: s) {
-    *this += c;
+  auto &t = *m_text;
+  std::call_once(t.lines_once, [&t] {
+    for (size_t i = 0; i < t.text.size(); ++i) {
+      switch (t.text[i]) {
+      case '\n':
+      case '\r':
+      case '\f': // form feed
+      case '\v': // vertical tab
+        t.lines.push_back(i + 1);
+        break;
+      default:
+        break;
+      }
+    }
+  });
+
+  size_t offset = m_begin + std::min<size_t>(p.offset - m_base,
+                                             m_end - m_begin);
+  auto it = std::upper_bound(t.lines.begin(), t.lines.end(), offset);
+  size_t line = it - t.lines.begin() + 1;
+  size_t start = it == t.lines.begin()? 0: *(it - 1);
+
+  size_t col = 0;
+  for (size_t i = start; i < offset; ++i) {
+    if (t.text[i] == '\t') {
+      col += 8 - (col % 8);
+    } else {
+      ++col;
+    }
   }
-  return *this;
+  return {line, col};
+}
+
+
+HasPos::HasPos(Pos start, Pos end):
+  m_start(start), m_end(end)
+{
+  auto src = Source::find(start.offset? start: end);
+  if (src) m_source = src->shared_from_this();
 }
 
 }
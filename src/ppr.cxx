@@ -1,4 +1,6 @@
 #include "ppr.hxx"
+#include "ppr/stream.hxx"
+#include <iterator>
 #include <list>
 
 namespace miniml
@@ -12,37 +14,61 @@ Ptr<String> Ppr::string() const
 }
 
 
-void PprString::output(OStream &out, unsigned indent) const
+void Pretty::print(PprStream &out, unsigned prec) const
 {
-  out << String(indent, ' ') << m_val;
+  auto str = ppr(prec)->string();
+  size_t start = 0, nl;
+  while ((nl = str->find('\n', start)) != String::npos) {
+    out.text(str->substr(start, nl - start)).newline();
+    start = nl + 1;
+  }
+  out.text(str->substr(start));
+}
+
+
+void Ppr::output(OStream &out, unsigned indent) const
+{
+  std::vector<Task> todo {{this, indent, false}};
+  while (!todo.empty()) {
+    auto task = todo.back();
+    todo.pop_back();
+    if (task.newline) out << std::endl;
+    task.ppr->output(out, task.indent, todo);
+  }
+}
+
+
+void PprString::output(OStream &out, unsigned indent,
+                       std::vector<Task>&) const
+{
+  if (indent) out << String(indent, ' ');
+  out << m_val;
 }
 
 
-void PprIndent::output(OStream &out, unsigned indent) const
+void PprIndent::output(OStream&, unsigned indent,
+                       std::vector<Task> &todo) const
 {
-  m_child->output(out, indent + m_indent);
+  todo.push_back({m_child.get(), indent + m_indent, false});
 }
 
 
-void PprHCat::output(OStream &out, unsigned indent) const
+void PprHCat::output(OStream &out, unsigned indent,
+                     std::vector<Task> &todo) const
 {
-  out << String(indent, ' ');
-  for (auto child: *m_children) {
-    child->output(out, 0);
+  if (indent) out << String(indent, ' ');
+  for (auto it = m_children->rbegin(); it != m_children->rend(); ++it) {
+    todo.push_back({it->get(), 0, false});
   }
 }
 
 
-void PprVCat::output(OStream &out, unsigned indent) const
+void PprVCat::output(OStream&, unsigned indent,
+                     std::vector<Task> &todo) const
 {
-  bool first = true;
-  for (auto child: *m_children) {
-    if (first) {
-      first = false;
-    } else {
-      out << std::endl;
-    }
-    child->output(out, indent);
+  for (auto it = m_children->rbegin(); it != m_children->rend(); ++it) {
+    // all but the first start on a new line
+    todo.push_back({it->get(), indent, std::next(it) != m_children->rend()});
   }
 }
 
@@ -0,0 +1,266 @@
+#include "ppr/stream.hxx"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace miniml
+{
+
+namespace
+{
+  /// Size of things which are known not to fit.
+  const long infinity = 0xffffff;
+  /// Flush the laid out text to the output stream when it gets this long.
+  const size_t chunk = 4096;
+}
+
+
+PprStream::PprStream(OStream &out, Limits limits):
+  m_out(out), m_limits(limits)
+{
+  if (m_limits.width == 0) m_limits.width = infinity;
+  m_space = m_limits.width;
+}
+
+PprStream::~PprStream()
+{
+  flush();
+}
+
+
+PprStream &PprStream::text(const String &str)
+{
+  if (m_scan.empty()) {
+    print_text(str.data(), str.size());
+  } else {
+    push(Kind::TEXT, str.size(), m_text_base + m_text.size());
+    m_text += str;
+    m_right_total += str.size();
+    check_stream();
+  }
+  return *this;
+}
+
+PprStream &PprStream::text(const Char *str)
+{
+  return text(String(str));
+}
+
+PprStream &PprStream::text(Char c)
+{
+  return text(String(1, c));
+}
+
+
+PprStream &PprStream::brk(unsigned blanks)
+{
+  if (m_scan.empty()) {
+    reset();
+  } else {
+    check_stack(0);
+  }
+  m_scan.push_back(m_buf_start + m_buf.size());
+  push(Kind::BREAK, -m_right_total, blanks);
+  m_right_total += blanks;
+  return *this;
+}
+
+PprStream &PprStream::newline()
+{
+  return brk(infinity);
+}
+
+
+PprStream &PprStream::begin(unsigned indent, Breaks breaks)
+{
+  if (m_scan.empty()) reset();
+  m_scan.push_back(m_buf_start + m_buf.size());
+  push(Kind::BEGIN, -m_right_total, indent, breaks);
+  return *this;
+}
+
+PprStream &PprStream::end()
+{
+  if (m_scan.empty()) {
+    print(Token {Kind::END, 0, 0, Breaks::CONSISTENT});
+  } else {
+    m_scan.push_back(m_buf_start + m_buf.size());
+    push(Kind::END, -1, 0);
+  }
+  return *this;
+}
+
+
+bool PprStream::enter()
+{
+  if (m_limits.depth && m_depth >= m_limits.depth) {
+    text("...");
+    return false;
+  }
+  ++m_depth;
+  return true;
+}
+
+bool PprStream::more(size_t i)
+{
+  if (m_limits.length && i >= m_limits.length) {
+    if (i == m_limits.length) text("...");
+    return false;
+  }
+  return true;
+}
+
+
+void PprStream::flush()
+{
+  if (!m_scan.empty()) {
+    check_stack(0);
+    advance_left();
+  }
+  m_out << m_pending_out;
+  m_out.flush();
+  m_pending_out.clear();
+}
+
+
+void PprStream::push(Kind kind, long size, size_t arg, Breaks breaks)
+{
+  m_buf.push_back(Token {kind, size, arg, breaks});
+}
+
+void PprStream::reset()
+{
+  m_left_total = m_right_total = 1;
+  m_buf_start += m_buf.size();
+  m_buf.clear();
+  m_text_base += m_text.size();
+  m_text_done = m_text_base;
+  m_text.clear();
+}
+
+void PprStream::check_stream()
+{
+  while (m_right_total - m_left_total > m_space) {
+    if (!m_scan.empty() && m_scan.front() == m_buf_start) {
+      m_scan.pop_front();
+      m_buf.front().size = infinity;
+    }
+    advance_left();
+    if (m_buf.empty()) break;
+  }
+}
+
+void PprStream::advance_left()
+{
+  while (!m_buf.empty() && m_buf.front().size >= 0) {
+    auto tok = m_buf.front();
+    m_buf.pop_front();
+    ++m_buf_start;
+
+    print(tok);
+    if (tok.kind == Kind::TEXT) {
+      m_left_total += tok.size;
+    } else if (tok.kind == Kind::BREAK) {
+      m_left_total += tok.arg;
+    }
+  }
+}
+
+void PprStream::check_stack(unsigned depth)
+{
+  while (!m_scan.empty()) {
+    auto &tok = at(m_scan.back());
+    switch (tok.kind) {
+    case Kind::BEGIN:
+      if (depth == 0) return;
+      m_scan.pop_back();
+      tok.size += m_right_total;
+      --depth;
+      break;
+    case Kind::END:
+      m_scan.pop_back();
+      tok.size = 1;
+      ++depth;
+      break;
+    default:
+      m_scan.pop_back();
+      tok.size += m_right_total;
+      if (depth == 0) return;
+    }
+  }
+}
+
+
+void PprStream::print(const Token &tok)
+{
+  switch (tok.kind) {
+  case Kind::TEXT:
+    print_text(m_text.data() + (tok.arg - m_text_base), tok.size);
+    m_text_done = tok.arg + tok.size;
+    // forget the text that's been printed once there's a lot of it
+    if (m_text_done - m_text_base > chunk &&
+        m_text_done - m_text_base > m_text.size() / 2) {
+      m_text.erase(0, m_text_done - m_text_base);
+      m_text_base = m_text_done;
+    }
+    break;
+
+  case Kind::BEGIN:
+    if (tok.size > m_space) {
+      m_frames.push_back(Frame {false, tok.breaks, m_indent});
+      // past half the width, groups aren't indented any further, otherwise
+      // deeply nested ones would be printed as mostly spaces
+      m_indent = std::min(m_indent + long(tok.arg),
+                          std::max(m_indent, long(m_limits.width) / 2));
+    } else {
+      m_frames.push_back(Frame {true, tok.breaks, m_indent});
+    }
+    break;
+
+  case Kind::END:
+    assert(!m_frames.empty());
+    m_indent = m_frames.back().indent;
+    m_frames.pop_back();
+    break;
+
+  case Kind::BREAK: {
+    bool fits;
+    if (m_frames.empty()) {
+      fits = tok.size <= m_space;
+    } else if (m_frames.back().fits) {
+      fits = true;
+    } else {
+      fits = m_frames.back().breaks == Breaks::INCONSISTENT &&
+             tok.size <= m_space;
+    }
+
+    if (fits && long(tok.arg) < infinity) {
+      m_pending += tok.arg;
+      m_space -= tok.arg;
+    } else {
+      m_pending_out += '\n';
+      m_pending = m_indent;
+      // if things are very deeply indented, overflow the line rather than
+      // squeezing everything into a narrow column
+      m_space = std::max(long(m_limits.width) - m_indent,
+                         long(m_limits.width) / 2);
+    }
+    break;
+  }
+  }
+}
+
+void PprStream::print_text(const Char *str, size_t len)
+{
+  m_pending_out.append(m_pending, ' ');
+  m_pending = 0;
+  m_pending_out.append(str, len);
+  m_space -= len;
+
+  if (m_pending_out.size() > chunk) {
+    m_out << m_pending_out;
+    m_pending_out.clear();
+  }
+}
+
+}
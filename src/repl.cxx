@@ -2,30 +2,87 @@
 #include "parser.hxx"
 #include "tc.hxx"
 #include "eval.hxx"
+#include "ir.hxx"
 #include "ppr.hxx"
+#include "mem.hxx"
+#include "pgo.hxx"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <cassert>
 
 namespace miniml
 {
 
-namespace { using namespace std; }
+namespace
+{
+  using namespace std;
+
+  /// Hash of a declaration's source (pretty printed, so layout and comments
+  /// don't matter).
+  size_t source_hash(const ValDecl &val)
+  {
+    SStream str;
+    str << (val.rec()? "rec ": "") << *val.ppr();
+    if (val.ty()) str << endl << ": " << *val.ty()->ppr();
+    return hash<String>()(str.str());
+  }
+
+  /// Hash of a declaration's #source_hash and of the types its free
+  /// variables currently have.
+  size_t fingerprint(size_t source, const unordered_set<Id> &deps,
+                     Ptr<Env<Type>> types)
+  {
+    SStream str;
+    str << source;
+
+    vector<String> names;
+    for (auto &d: deps) names.push_back(*d.val());
+    sort(names.begin(), names.end());
+    for (auto &n: names) {
+      auto ty = types->lookup(Id(n));
+      str << endl << n << ": ";
+      if (ty) str << *ty->ppr();
+    }
+
+    return hash<String>()(str.str());
+  }
+
+  /// Whether an error stops the whole input, rather than just a file it
+  /// `use`s.
+  bool stops_input(const EvalException &e)
+  {
+    return dynamic_cast<const LimitExceeded*>(&e) ||
+           dynamic_cast<const Cancelled*>(&e);
+  }
+}
 
 Repl::Repl():
   m_prompt("miniml> ")
 {
   m_env = init_val_env();
   read_file("prelude.mml");
+  add_use();
+#ifndef NDEBUG
+  m_env->debug();
+#endif
+}
+
+Repl::Repl(Ptr<EnvBase<EnvEntry>> base):
+  m_prompt("miniml> "),
+  m_env(ptr<Env<EnvEntry>>(base))
+{
+  add_use();
+}
+
+
+void Repl::add_use()
+{
   m_env->insert("use"_i,
                 builtin_v(arr(string_, unit),
                           [&](Ptr<Expr> file) {
                             read_file(STRING(file).data());
                           }));
-#ifndef NDEBUG
-  m_env->debug();
-#endif
-  cin.exceptions(cin.badbit | cin.failbit);
 }
 
 
@@ -35,7 +92,7 @@ void Repl::prompt_line(String &into)
   flush(cout);
   try {
     getline(cin, into);
-  } catch (ios_base::failure) {
+  } catch (const ios_base::failure&) {
     if (cin.eof()) {
       quit();
     } else {
@@ -49,27 +106,17 @@ pair<String, String>
 Repl::get_next(String rest)
 {
   String input(move(rest));
-  size_t semi = input.find(';');
+  Parser::InputScan scan;
+  size_t end;
 
-  if (semi == String::npos) {
-    semi = 0;
+  while ((end = Parser::input_end(input, scan)) == String::npos) {
     String line;
-    size_t semi_line = 0;
-
-    do {
-      prompt_line(line);
-      input += line;
-      semi_line = line.find(";;");
-      semi += semi_line == String::npos? line.size() : semi_line;
-    } while (semi_line == String::npos);
-
+    prompt_line(line);
+    input += line;
+    input += '\n';
   }
 
-  assert(semi <= input.length());
-  assert(input[semi]   == ';' &&
-         input[semi+1] == ';');
-
-  return make_pair(input.substr(0, semi), input.substr(semi+2));
+  return make_pair(input.substr(0, end), input.substr(end + 2));
 }
 
 void Repl::process(Ptr<Input> inp, bool output)
@@ -82,22 +129,27 @@ void Repl::process(Ptr<Input> inp, bool output)
     process(dyn_cast<ExprInput>(inp)->expr, output);
     break;
   case InputType::MODULE:
-    for (auto decl: *dyn_cast<ModuleInput>(inp)->decls) {
-      process(decl, output);
-    }
+    process_module(dyn_cast<ModuleInput>(inp), output);
   }
 }
 
 
 void Repl::process(Ptr<Expr> expr, bool output)
 {
-  using namespace ppr;
-
-  auto ty = type_of(expr, type_env());
-  auto nf = eval(expr, value_env());
+  auto code = typecheck(expr, type_env());
+  ir::bind(code, env());
+  if (pgo::loaded()) code = pgo::optimise(code);
+  ir::cse(code);
+  auto ty = code->ty;
+  auto nf = ir::eval(code);
 
   if (output) {
-    cout << *vcat({nf->ppr(), hcat({": "_p, ty->ppr()}) >> 1}) << endl;
+    PprStream out(miniml::output(), m_print_limits);
+    out.begin();
+    nf->print(out, 1);
+    out.space().text(": ");
+    ty->print(out);
+    out.end().newline();
   }
 }
 
@@ -110,7 +162,8 @@ void Repl::process(Ptr<Decl> decl, bool output)
   }
 }
 
-void Repl::process_val(Ptr<ValDecl> val, bool output)
+void Repl::process_val(Ptr<ValDecl> val, bool output,
+                       const Ptr<const ExprPool> &pool, ExprPool::Ref root)
 {
   auto local_env = type_env();
 
@@ -122,49 +175,227 @@ void Repl::process_val(Ptr<ValDecl> val, bool output)
     local_env->insert(val->name(), val->ty());
   }
 
-  auto ty = val->type_of(local_env);
-  auto def = eval(val->def(), value_env());
+  auto code = pool? val->typecheck(local_env, pool, root):
+                    val->typecheck(local_env);
+  // the globals are the ones in scope now, even if they're defined again
+  // later, apart from a recursive definition itself
+  ir::bind(code, env());
+  if (pgo::loaded()) code = pgo::optimise(code);
+  ir::cse(code);
+  auto ty = code->ty;
+  Ptr<EnvEntry> entry;
+
+  // functions are values already, so there'd be nothing to save
+  bool lazy =
+    m_lazy && ty->type() != TypeType::ARROW && code->op != ir::Op::CONST;
+  if (lazy || val->rec()) {
+    entry = ptr<EnvEntry>(ty, val->name(), [code]() {
+      return ir::eval(code);
+    });
+    if (val->rec()) {
+      // so it finds itself (and fails with LazyCycle if it's needed before
+      // it's been worked out)
+      auto self = ptr<Env<EnvEntry>>(env());
+      self->insert(val->name(), entry);
+      ir::bind(code, self);
+    }
+    if (lazy) {
+      m_lazy_vals.emplace_back(val->name(), entry);
+    } else {
+      entry->force();
+    }
+  } else {
+    entry = ptr<EnvEntry>(ty, ir::eval(code));
+  }
 
-  env()->insert(val->name(), ptr<EnvEntry>(ty, def));
+  env()->insert(val->name(), entry);
 
   if (output) {
-    auto msg = ppr::vcat({ppr::hcat({"val"_p, +val->name().ppr(),
-                                     ':'_p, +ty->ppr(), +'='_p}),
-                          def->ppr() >> 1});
-    cout << *msg << endl;
+    PprStream out(miniml::output(), m_print_limits);
+    out.begin().text("val ").text(*val->name().val()).text(": ");
+    ty->print(out);
+    out.text(" =").space();
+    if (entry->forced()) {
+      entry->value->print(out);
+    } else {
+      out.text("<lazy>");
+    }
+    out.end().newline();
+  }
+}
+
+void Repl::report_unforced(OStream &out) const
+{
+  size_t n = 0;
+  for (auto &v: m_lazy_vals) {
+    if (v.second->forced()) continue;
+    out << (n++? ", ": "never forced: ") << v.first;
   }
+  if (n) out << endl;
 }
 
-bool Repl::try_parse_process(const String &input, bool output)
+Ptr<Input> Repl::parse(const String &input, const String *file)
 {
-  Ptr<Input> inp;
   Parser p;
   try {
-    inp = p.parse(input);
-    process(inp, output);
+    return p.parse(input, file);
   } catch (LexerError &e) {
-    cout << e.what() << endl;
-    return false;
+    miniml::output() << e.what() << endl;
   } catch (Parser::ParseFail &e) {
-    cout << e.what() << endl;
-    return false;
+    miniml::output() << e.what() << endl;
+  }
+  return nullptr;
+}
+
+bool Repl::try_process(Ptr<Input> inp, bool output)
+{
+  bool nested = Budget::active();
+  try {
+    Budget budget(m_eval_limits, m_cancel);
+    process(inp, output);
   } catch (TCException &e) {
-    cout << e.what() << endl;
+    miniml::output() << e.what() << endl;
+    return false;
+  } catch (EvalException &e) {
+    if (nested && stops_input(e)) throw;
+    miniml::output() << e.what() << endl;
+    return false;
+  }
+  return true;
+}
+
+void Repl::process_module(Ptr<ModuleInput> mod, bool output)
+{
+  auto &loaded = m_modules[mod->name];
+  bool reload = !loaded.empty();
+
+  unordered_map<Id, Loaded> now;
+  unordered_set<Id> changed;
+  vector<Id> redone;
+  size_t skipped = 0;
+
+  // whether a declaration has to be processed, given the #source_hash of
+  // its source and the names defined by the ones before it which have been;
+  // its fingerprint is put in \a fp, if that's wanted
+  auto dirty = [&](const ValDecl &val, size_t source,
+                   const unordered_set<Id> &done, size_t *fp) {
+    auto name = val.name();
+    auto old = loaded.find(name);
+    bool redefined = old == loaded.end() || done.count(name) ||
+                     env()->lookup(name) != old->second.entry;
+    if (redefined && !fp) return true;
+
+    auto deps = fv(val.def());
+    deps->erase(name);
+    auto f = fingerprint(source, *deps, type_env());
+    if (fp) *fp = f;
+
+    if (redefined || old->second.fingerprint != f) return true;
+    for (auto &d: *deps) {
+      if (done.count(d)) return true;
+    }
+    return false;
+  };
+
+  // the definitions to process are flattened into one pool, which is all
+  // their IR keeps of them. It can't change once there's IR using it, so
+  // which they are is worked out first; if processing one changes that for
+  // a later one (by `use`ing a file that redefines something, say), that
+  // one is typechecked with a pool of its own.
+  auto &decls = *mod->decls;
+  auto pool = ptr<ExprPool>();
+  unordered_map<size_t, ExprPool::Ref> roots;
+  vector<size_t> sources;
+  sources.reserve(decls.size());
+  {
+    unordered_set<Id> will_change;
+    for (size_t i = 0; i < decls.size(); ++i) {
+      auto val = dyn_cast<ValDecl>(decls[i]);
+      sources.push_back(source_hash(*val));
+      if (dirty(*val, sources[i], will_change, nullptr)) {
+        roots[i] = pool->add(val->def());
+        will_change.insert(val->name());
+      }
+    }
+  }
+  pool->shrink();
+
+  for (size_t i = 0; i < decls.size(); ++i) {
+    // the IR only needs the pool, so each declaration is dropped once it's
+    // been processed rather than keeping the whole module's until the end
+    auto decl = move(decls[i]);
+    auto val = dyn_cast<ValDecl>(decl);
+    auto name = val->name();
+    size_t fp;
+
+    if (dirty(*val, sources[i], changed, &fp)) {
+      auto root = roots.find(i);
+      if (root != roots.end()) {
+        process_val(val, output, pool, root->second);
+      } else {
+        process(decl, output);
+      }
+      changed.insert(name);
+      redone.push_back(name);
+      now[name] = Loaded {fp, env()->lookup(name)};
+    } else {
+      ++skipped;
+      now[name] = loaded.find(name)->second;
+    }
+  }
+
+  // only remember the new state once everything has been processed, so if
+  // something fails then the next reload tries again
+  m_modules[mod->name] = move(now);
+
+  if (reload) {
+    auto &out = miniml::output();
+    out << "module " << mod->name << ": reprocessed " << redone.size();
+    for (size_t i = 0; i < redone.size(); ++i) {
+      out << (i? ", ": " (") << redone[i] << (i + 1 == redone.size()? ")": "");
+    }
+    out << ", skipped " << skipped << endl;
+  }
+}
+
+
+bool Repl::command(const String &input)
+{
+  SStream words(input);
+  String cmd, arg;
+  words >> cmd >> arg;
+
+  if (cmd == ":mem" && arg.empty()) {
+    mem::report(miniml::output());
+  } else if (cmd == ":mem" && arg == "json") {
+    mem::dump(miniml::output());
+  } else if (cmd == ":profile" && arg.empty()) {
+    mem::profile(miniml::output());
+  } else {
+    miniml::output() << "unknown command " << input << endl;
     return false;
   }
   return true;
 }
 
 
-void Repl::read_file(const char *filename, bool output)
+bool Repl::try_parse_process(const String &input, bool output,
+                             const String *file)
+{
+  auto inp = parse(input, file);
+  return inp && try_process(inp, output);
+}
+
+
+bool Repl::read_file(const char *filename, bool output)
 {
 #ifndef NDEBUG
   clog << "reading " << filename << " ..." << endl;
 #endif
   ifstream in(filename);
   if (in.fail()) {
-    cerr << "file " << filename << " doesn't exist" << endl;
-    return;
+    miniml::output() << "file " << filename << " doesn't exist" << endl;
+    return false;
   }
   string contents;
   while (in.good()) {
@@ -172,7 +403,19 @@ void Repl::read_file(const char *filename, bool output)
     getline(in, line);
     contents += line + "\n";
   }
-  try_parse_process(contents, output);
+  String name(filename);
+  return try_parse_process(contents, output, &name);
+}
+
+
+[[noreturn]] void Repl::quit()
+{
+  if (m_lazy) report_unforced(cerr);
+  if (mem::profiling) mem::profile(cerr);
+  if (pgo::recording && !pgo::save()) {
+    cerr << "couldn't write the call profile" << endl;
+  }
+  exit(0);
 }
 
 
@@ -180,11 +423,15 @@ void Repl::read_file(const char *filename, bool output)
 {
   String input, rest;
 
+  cin.exceptions(cin.badbit | cin.failbit);
+
   while (true) {
     auto input_pair = get_next(rest);
     input = input_pair.first;
     rest = input_pair.second;
-    if (!try_parse_process(input)) {
+    auto start = input.find_first_not_of(" \t\r\n");
+    bool is_command = start != String::npos && input[start] == ':';
+    if (!(is_command? command(input): try_parse_process(input))) {
       input = "";
     }
   }
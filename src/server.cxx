@@ -0,0 +1,293 @@
+#include "server.hxx"
+#include "init_env.hxx"
+#include "mem.hxx"
+#include "parser.hxx"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace miniml
+{
+
+namespace
+{
+  using namespace std;
+  using namespace std::chrono;
+
+  /// Send all of a string, or give up if the connection has gone away.
+  bool send_all(int fd, const String &str)
+  {
+    const char *p = str.data();
+    size_t left = str.size();
+    while (left > 0) {
+      auto n = ::send(fd, p, left, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      p += n; left -= n;
+    }
+    return true;
+  }
+
+  /// Split off the first word of a request.
+  pair<String, String> first_word(const String &str)
+  {
+    const char *ws = " \t\r\n";
+    auto start = str.find_first_not_of(ws);
+    if (start == String::npos) return make_pair("", "");
+    auto end = str.find_first_of(ws, start);
+    if (end == String::npos) return make_pair(str.substr(start), "");
+    return make_pair(str.substr(start, end - start), str.substr(end + 1));
+  }
+
+  const char *kind_name(InputType ty)
+  {
+    switch (ty) {
+    case InputType::DECL:   return "decl";
+    case InputType::EXPR:   return "expr";
+    case InputType::MODULE: return "module";
+#ifdef __GNUC__
+    default: std::abort();
+#endif
+    }
+  }
+}
+
+
+void Histogram::add(microseconds us)
+{
+  unsigned long n = us.count() < 0? 0: us.count();
+  unsigned i = 0;
+  while (i < buckets - 1 && (1ul << i) < n) ++i;
+  ++m_counts[i];
+  ++m_count;
+  m_total_us += n;
+}
+
+unsigned long Histogram::quantile(double q) const
+{
+  unsigned long want = q * m_count, seen = 0;
+  for (unsigned i = 0; i < buckets; ++i) {
+    seen += m_counts[i];
+    if (seen > want) return 1ul << i;
+  }
+  return 1ul << (buckets - 1);
+}
+
+void Histogram::output(OStream &out, const String &name) const
+{
+  out << name << ": count=" << m_count
+      << " mean=" << (m_count? m_total_us / m_count: 0) << "us"
+      << " p50<=" << quantile(0.5) << "us"
+      << " p90<=" << quantile(0.9) << "us"
+      << " p99<=" << quantile(0.99) << "us" << endl;
+  for (unsigned i = 0; i < buckets; ++i) {
+    if (m_counts[i]) {
+      out << "    <=" << (1ul << i) << "us: " << m_counts[i] << endl;
+    }
+  }
+}
+
+
+Server::Error::Error(const String &what):
+  msg(what + ": " + strerror(errno))
+{}
+
+
+Server::Server(const String &path, PprStream::Limits limits,
+               EvalLimits eval_limits):
+  m_path(path), m_limits(limits), m_eval_limits(eval_limits)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
+    throw Error("can't use socket " + path);
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+
+  m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_socket < 0) throw Error("can't create socket");
+  ::unlink(path.c_str());
+  if (::bind(m_socket, (sockaddr*) &addr, sizeof addr) < 0 ||
+      ::listen(m_socket, SOMAXCONN) < 0) {
+    ::close(m_socket);
+    throw Error("can't listen on " + path);
+  }
+}
+
+Server::~Server()
+{
+  ::close(m_socket);
+  ::unlink(m_path.c_str());
+}
+
+
+[[noreturn]] void Server::run()
+{
+  while (true) {
+    int fd = ::accept(m_socket, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno != EINTR) cerr << Error("accept failed").what() << endl;
+      continue;
+    }
+    thread(&Server::serve, this, fd).detach();
+  }
+}
+
+
+void Server::serve(int fd)
+{
+  String buf;
+  Parser::InputScan scan;
+  char chunk[4096];
+
+  while (true) {
+    auto n = ::recv(fd, chunk, sizeof chunk, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    buf.append(chunk, n);
+
+    size_t semi;
+    while ((semi = Parser::input_end(buf, scan)) != String::npos) {
+      String out;
+      bool ok = handle(buf.substr(0, semi), out);
+      buf.erase(0, semi + 2);
+      scan = Parser::InputScan();
+      auto header = (ok? "ok ": "error ") + to_string(out.size()) + "\n";
+      if (!send_all(fd, header + out)) goto done;
+    }
+    if (buf.size() > max_request) {
+      String out = "request of more than " + to_string(max_request) +
+        " bytes\n";
+      send_all(fd, "error " + to_string(out.size()) + "\n" + out);
+      break;
+    }
+  }
+
+done:
+  ::close(fd);
+}
+
+
+bool Server::handle(const String &request, String &out)
+{
+  auto start = steady_clock::now();
+  auto split = first_word(request);
+  String kind = "error";
+  bool ok = false;
+
+  if (split.first.empty()) {
+    out = "empty request\n";
+  } else if (split.first[0] == ':') {
+    kind = split.first;
+    ok = command(split.first, split.second, out);
+  } else {
+    auto sess = session(split.first);
+    // before waiting for the session, so a :cancel sent while it waits
+    // isn't forgotten
+    auto cancel = ptr<CancelToken>();
+    {
+      lock_guard<mutex> lock(sess->pending_mutex);
+      sess->pending.push_back(cancel);
+    }
+    SStream str;
+    try {
+      lock_guard<mutex> lock(sess->mutex);
+      sess->repl.set_cancel_token(cancel);
+      Redirect redirect(str);
+      auto inp = sess->repl.parse(split.second);
+      if (inp) {
+        kind = kind_name(inp->type());
+        ok = sess->repl.try_process(inp);
+      }
+    } catch (std::exception &e) {
+      str << e.what() << endl;
+    }
+    {
+      lock_guard<mutex> lock(sess->pending_mutex);
+      auto &p = sess->pending;
+      p.erase(find(p.begin(), p.end(), cancel));
+    }
+    out = str.str();
+  }
+
+  record(ok? kind: "error", duration_cast<microseconds>(steady_clock::now() -
+                                                        start));
+  return ok;
+}
+
+
+bool Server::command(const String &cmd, const String &arg, String &out)
+{
+  SStream str;
+  bool ok = true;
+
+  if (cmd == ":stats") {
+    lock_guard<mutex> lock(m_stats_mutex);
+    for (auto &h: m_stats) {
+      h.second.output(str, h.first);
+    }
+  } else if (cmd == ":mem") {
+    if (first_word(arg).first == "json") {
+      mem::dump(str);
+    } else {
+      mem::report(str);
+    }
+  } else if (cmd == ":profile") {
+    mem::profile(str);
+  } else if (cmd == ":cancel") {
+    auto name = first_word(arg).first;
+    lock_guard<mutex> lock(m_sessions_mutex);
+    auto it = m_sessions.find(name);
+    if (it != m_sessions.end()) {
+      auto &sess = *it->second;
+      lock_guard<mutex> pending(sess.pending_mutex);
+      for (auto &t: sess.pending) t->cancel();
+    } else {
+      str << "no session " << name << endl;
+      ok = false;
+    }
+  } else if (cmd == ":close") {
+    auto name = first_word(arg).first;
+    lock_guard<mutex> lock(m_sessions_mutex);
+    if (!m_sessions.erase(name)) {
+      str << "no session " << name << endl;
+      ok = false;
+    }
+  } else {
+    str << "unknown command " << cmd << endl;
+    ok = false;
+  }
+
+  out = str.str();
+  return ok;
+}
+
+
+Ptr<Server::Session> Server::session(const String &name)
+{
+  lock_guard<mutex> lock(m_sessions_mutex);
+  auto &sess = m_sessions[name];
+  if (!sess) {
+    sess = ptr<Session>(m_base.env());
+    sess->repl.set_print_limits(m_limits);
+    sess->repl.set_eval_limits(m_eval_limits);
+  }
+  return sess;
+}
+
+
+void Server::record(const String &kind, microseconds us)
+{
+  lock_guard<mutex> lock(m_stats_mutex);
+  m_stats[kind].add(us);
+}
+
+}
@@ -0,0 +1,254 @@
+#include "stream.hxx"
+#include "eval.hxx"
+#include "init_env.hxx"
+#include <fstream>
+
+namespace miniml
+{
+
+namespace stream
+{
+
+namespace
+{
+  using Cursor = Stream::Cursor;
+  using CursorPtr = std::unique_ptr<Cursor>;
+
+  struct Range final: public Stream
+  {
+    Range(long from, long to): from(from), to(to) {}
+
+    struct C final: public Cursor
+    {
+      C(long from, long to): i(from), to(to) {}
+
+      bool next(Ptr<Expr> &out) override
+      {
+        if (i >= to) return false;
+        Budget::step();
+        out = ptr<IntExpr>(i++);
+        return true;
+      }
+
+      long i, to;
+    };
+
+    CursorPtr open() const override { return CursorPtr(new C(from, to)); }
+
+    long from, to;
+  };
+
+
+  struct Unfold final: public Stream
+  {
+    Unfold(Ptr<Expr> f, Ptr<Expr> seed): f(f), seed(seed) {}
+
+    struct C final: public Cursor
+    {
+      C(const Unfold &u): f(u.f), state(u.seed) {}
+
+      bool next(Ptr<Expr> &out) override
+      {
+        if (!state) return false;
+        Budget::step();
+        auto step = apply(f, state);
+        auto &xs = *dyn_cast<TupleExpr>(step)->exprs();
+        if (!BOOL(xs[0])) {
+          state = nullptr;
+          return false;
+        }
+        out = xs[1];
+        state = xs[2];
+        return true;
+      }
+
+      Ptr<Expr> f;
+      /// `nullptr` once it's finished.
+      Ptr<Expr> state;
+    };
+
+    CursorPtr open() const override { return CursorPtr(new C(*this)); }
+
+    Ptr<Expr> f, seed;
+  };
+
+
+  struct Lines final: public Stream
+  {
+    Lines(const String &file): file(file) {}
+
+    struct C final: public Cursor
+    {
+      C(const String &file): in(file)
+      {
+        if (!in) throw FileError(file);
+      }
+
+      bool next(Ptr<Expr> &out) override
+      {
+        String line;
+        if (!std::getline(in, line)) return false;
+        Budget::step();
+        out = STRING(std::move(line));
+        return true;
+      }
+
+      std::ifstream in;
+    };
+
+    CursorPtr open() const override { return CursorPtr(new C(file)); }
+
+    String file;
+  };
+
+
+  /// Any number of maps, filters and takes, one after another over the same
+  /// stream, run as one stage.
+  struct Pipe final: public Stream
+  {
+    struct Op final
+    {
+      enum Kind { MAP, FILTER, TAKE, WHILE } kind;
+      /// The function, for all but TAKE.
+      Ptr<Expr> fn;
+      /// How many to take.
+      long n;
+    };
+
+    Pipe(S source, std::vector<Op> ops): source(source), ops(ops) {}
+
+    /// \a s with \a op after it, added to the ops if it's a pipe already.
+    static S add(S s, Op op)
+    {
+      auto p = std::dynamic_pointer_cast<const Pipe>(s);
+      if (!p) return ptr<Pipe>(s, std::vector<Op> {op});
+      auto ops = p->ops;
+      ops.push_back(op);
+      return ptr<Pipe>(p->source, std::move(ops));
+    }
+
+    struct C final: public Cursor
+    {
+      C(const Pipe &p): up(p.source->open()), ops(p.ops), left(ops.size())
+      {
+        for (size_t i = 0; i < ops.size(); ++i) {
+          if (ops[i].kind != Op::TAKE) continue;
+          left[i] = ops[i].n;
+          if (left[i] <= 0) done = true;
+        }
+      }
+
+      bool next(Ptr<Expr> &out) override
+      {
+        Ptr<Expr> x;
+        while (!done && up->next(x)) {
+          if (run(x)) {
+            out = x;
+            return true;
+          }
+        }
+        done = true;
+        return false;
+      }
+
+      /// Put \a x through the ops.
+      /// \return Whether it came out of the end.
+      bool run(Ptr<Expr> &x)
+      {
+        for (size_t i = 0; i < ops.size(); ++i) {
+          auto &op = ops[i];
+          switch (op.kind) {
+          case Op::MAP:
+            x = apply(op.fn, x);
+            break;
+          case Op::FILTER:
+            if (!BOOL(apply(op.fn, x))) return false;
+            break;
+          case Op::WHILE:
+            if (!BOOL(apply(op.fn, x))) {
+              done = true;
+              return false;
+            }
+            break;
+          case Op::TAKE:
+            // once it's had all it takes, nothing more can come out, so
+            // stop now rather than pulling another element through
+            if (--left[i] == 0) done = true;
+            break;
+#ifdef __GNUC__
+          default: std::abort();
+#endif
+          }
+        }
+        return true;
+      }
+
+      CursorPtr up;
+      std::vector<Op> ops;
+      /// Elements still to take, for each TAKE.
+      std::vector<long> left;
+      bool done = false;
+    };
+
+    CursorPtr open() const override { return CursorPtr(new C(*this)); }
+
+    S source;
+    std::vector<Op> ops;
+  };
+
+
+  struct Zip final: public Stream
+  {
+    Zip(Ptr<Expr> f, S l, S r): f(f), l(l), r(r) {}
+
+    struct C final: public Cursor
+    {
+      C(const Zip &z): f(z.f), l(z.l->open()), r(z.r->open()) {}
+
+      bool next(Ptr<Expr> &out) override
+      {
+        Ptr<Expr> x, y;
+        if (!l->next(x) || !r->next(y)) return false;
+        out = apply(apply(f, x), y);
+        return true;
+      }
+
+      Ptr<Expr> f;
+      CursorPtr l, r;
+    };
+
+    CursorPtr open() const override { return CursorPtr(new C(*this)); }
+
+    Ptr<Expr> f;
+    S l, r;
+  };
+}
+
+
+S range(long from, long to)
+{ return ptr<Range>(from, to); }
+
+S unfold(Ptr<Expr> f, Ptr<Expr> seed)
+{ return ptr<Unfold>(f, seed); }
+
+S lines(const String &file)
+{ return ptr<Lines>(file); }
+
+S map(Ptr<Expr> f, S s)
+{ return Pipe::add(s, Pipe::Op {Pipe::Op::MAP, f, 0}); }
+
+S filter(Ptr<Expr> p, S s)
+{ return Pipe::add(s, Pipe::Op {Pipe::Op::FILTER, p, 0}); }
+
+S take(long n, S s)
+{ return Pipe::add(s, Pipe::Op {Pipe::Op::TAKE, nullptr, n}); }
+
+S take_while(Ptr<Expr> p, S s)
+{ return Pipe::add(s, Pipe::Op {Pipe::Op::WHILE, p, 0}); }
+
+S zip(Ptr<Expr> f, S l, S r)
+{ return ptr<Zip>(f, l, r); }
+
+}
+
+}
@@ -1,153 +1,350 @@
 #include "tc.hxx"
+#include <cassert>
 #include <cstdlib>
+#include <vector>
 
 namespace miniml
 {
 
 namespace
 {
-  struct TypeOf final: public ExprVisitor<Type, Ptr<Env<Type>>>
+  using ir::Node;
+  using ir::Op;
+  using ir::Src;
+
+  /// Variables bound by the enclosing lambdas, innermost first.
+  struct Scope final
   {
-    using ExprVisitor<Type, Ptr<Env<Type>>>::v;
+    Scope(Id var, Ptr<Scope> up): var(var), up(up) {}
+    Id var;
+    Ptr<Scope> up;
+  };
 
-    Ptr<Type> v(Ptr<IdExpr> id, Ptr<Env<Type>> env) override
-    {
-      auto ty = env->lookup(id->id());
-      return ty? ty: throw NotInScope(id->id());
-    }
+  using SCOPE = Ptr<Scope>;
 
-    inline Ptr<Type> v(Ptr<IntExpr>, Ptr<Env<Type>>) override
-    {
-      return ptr<IntType>();
-    }
+  inline Ptr<Node> node(Op op, Ptr<Type> ty, Src src,
+                        std::initializer_list<Ptr<Node>> kids = {})
+  {
+    auto n = ptr<Node>(op, ty, std::move(src));
+    n->kids = kids;
+    return n;
+  }
 
-    inline Ptr<Type> v(Ptr<BoolExpr>, Ptr<Env<Type>>) override
-    {
-      return ptr<BoolType>();
-    }
+  inline Ptr<Node> value(Ptr<Type> ty, Src src, Ptr<Expr> val)
+  {
+    auto n = node(Op::CONST, ty, std::move(src));
+    n->value = val;
+    return n;
+  }
 
-    inline Ptr<Type> v(Ptr<StringExpr>, Ptr<Env<Type>>) override
-    {
-      return ptr<StringType>();
-    }
+  /// Where an expression is: the types of the variables in scope, and the
+  /// variables bound by the lambdas around it.
+  struct Ctx final
+  {
+    Ptr<Env<Type>> env;
+    SCOPE scope;
+  };
+
+  struct TypeOf final: public Walk<TypeOf, Expr, Ptr<Node>, Ctx>
+  {
+    TypeOf(const Ptr<const ExprPool> &pool, ExprPool::Ref root):
+      pool(pool), next(root)
+    {}
 
-    Ptr<Type> v(Ptr<AppExpr> e, Ptr<Env<Type>> env) override
+    bool pre(Ptr<Expr> &e, Ctx &ctx, Ptr<Node> &out)
     {
-      auto ty_f0 = v(e->left(), env);
-      auto ty_x = v(e->right(), env);
+      // the walk visits the nodes in the order the pool numbered them
+      assert((*pool)[next].type() == e->type());
+      Src here {pool, next++};
 
-      if (ty_f0->type() == TypeType::ARROW) {
-        auto ty_f = dyn_cast<ArrowType>(ty_f0);
-        check_eq(ty_f->left(), ty_x, e->left());
-        return ty_f->right();
-      } else {
-        throw NotArrow(ty_f0);
+      switch (e->type()) {
+      case ExprType::ID: {
+        auto id = static_cast<const IdExpr&>(*e).id();
+        auto ty = ctx.env->lookup(id);
+        if (!ty) throw NotInScope(id);
+
+        unsigned i = 0;
+        for (auto s = ctx.scope.get(); s; s = s->up.get(), ++i) {
+          if (s->var == id) {
+            out = node(Op::LOCAL, ty, here);
+            out->index = i;
+            return true;
+          }
+        }
+        out = node(Op::GLOBAL, ty, here);
+        return true;
+      }
+      case ExprType::INT:
+        out = value(ptr<IntType>(), here, e);
+        return true;
+      case ExprType::BOOL:
+        out = value(ptr<BoolType>(), here, e);
+        return true;
+      case ExprType::STRING:
+        out = value(ptr<StringType>(), here, e);
+        return true;
+      case ExprType::CLOSURE:
+        out = value(static_cast<const ClosureExpr&>(*e).ty(), here, e);
+        return true;
+      case ExprType::ARRAY:
+        out = value(ptr<ArrayType>(ptr<IntType>()), here, e);
+        return true;
+      case ExprType::MAP:
+        if (static_cast<const MapExpr&>(*e).strings()) {
+          out = value(ptr<MapType>(ptr<StringType>()), here, e);
+        } else {
+          out = value(ptr<MapType>(ptr<IntType>()), here, e);
+        }
+        return true;
+      case ExprType::STREAM:
+        if (static_cast<const StreamExpr&>(*e).strings()) {
+          out = value(ptr<StreamType>(ptr<StringType>()), here, e);
+        } else {
+          out = value(ptr<StreamType>(ptr<IntType>()), here, e);
+        }
+        return true;
+      case ExprType::LAM: {
+        auto &l = static_cast<const LamExpr&>(*e);
+        auto inner = ptr<Env<Type>>(ctx.env);
+        inner->insert(l.var(), l.ty());
+        ctx = Ctx {inner, ptr<Scope>(l.var(), ctx.scope)};
+        open.push_back(here.ref);
+        return false;
+      }
+      default:
+        open.push_back(here.ref);
+        return false;
       }
     }
 
-    Ptr<Type> v(Ptr<LamExpr> e, Ptr<Env<Type>> env) override
+    Ctx down(const Ptr<Expr> &e, Ctx &ctx, size_t i, const Ptr<Node> *kids)
     {
-      auto inner = ptr<Env<Type>>(env);
-      inner->insert(e->var(), e->ty());
-      auto t = v(e->body(), inner);
-      return ptr<ArrowType>(e->ty(), t);
+      if (e->type() == ExprType::IF && i == 1) {
+        check_eq(kids[0]->ty, ptr<BoolType>(),
+                 static_cast<const IfExpr&>(*e).cond());
+      }
+      return ctx;
     }
 
-    Ptr<Type> v(Ptr<IfExpr> e, Ptr<Env<Type>> env) override
+    Ptr<Node> post(const Ptr<Expr> &e, Ctx &ctx, Ptr<Node> *kids, size_t n)
     {
-      check_eq(v(e->cond(), env), ptr<BoolType>(), e->cond());
-      auto t = v(e->thenCase(), env);
-      check_eq(t, v(e->elseCase(), env), e->elseCase());
-      return t;
-    }
+      Src src {pool, open.back()};
+      open.pop_back();
 
-    inline Ptr<Type> v(Ptr<TypeExpr> e, Ptr<Env<Type>> env) override
-    {
-      check_eq(v(e->expr(), env), nf(e->ty(), env), e->expr());
-      return e->ty();
+      switch (e->type()) {
+      case ExprType::APP: {
+        auto &f = kids[0], &x = kids[1];
+        if (f->ty->type() == TypeType::ARROW) {
+          auto ty_f = dyn_cast<ArrowType>(f->ty);
+          check_eq(ty_f->left(), x->ty,
+                   static_cast<const AppExpr&>(*e).left());
+          if (f->op != Op::APP && f->op != Op::CALL) {
+            return node(Op::APP, ty_f->right(), src, {f, x});
+          }
+          // `f a b`: another argument for the same call
+          auto call = node(Op::CALL, ty_f->right(), src);
+          call->kids = f->kids;
+          call->kids.push_back(x);
+          return call;
+        } else {
+          throw NotArrow(f->ty);
+        }
+      }
+      case ExprType::LAM: {
+        auto &body = kids[0];
+        return node(Op::LAM,
+                    ptr<ArrowType>(static_cast<const LamExpr&>(*e).ty(),
+                                   body->ty),
+                    src, {body});
+      }
+      case ExprType::IF: {
+        auto &t = kids[1], &f = kids[2];
+        check_eq(t->ty, f->ty, static_cast<const IfExpr&>(*e).elseCase());
+        return node(Op::IF, t->ty, src, {kids[0], t, f});
+      }
+      case ExprType::TYPE: {
+        auto &t = static_cast<const TypeExpr&>(*e);
+        check_eq(kids[0]->ty, nf(t.ty(), ctx.env), t.expr());
+        auto n = ptr<Node>(*kids[0]);
+        n->ty = t.ty();
+        return n;
+      }
+      case ExprType::BINOP:
+        return binop(static_cast<const BinOpExpr&>(*e), src, kids[0],
+                     kids[1]);
+      case ExprType::TUPLE: {
+        // tuples of constants are constants, so that nested data doesn't
+        // have to be built by a deep recursion when it's run
+        bool constant = true;
+        auto ts = ptr<TupleType::Types>();
+        ts->reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+          ts->push_back(kids[i]->ty);
+          constant = constant && kids[i]->op == Op::CONST;
+        }
+
+        if (constant) {
+          auto vals = ptr<TupleExpr::Exprs>();
+          vals->reserve(n);
+          for (size_t i = 0; i < n; ++i) vals->push_back(kids[i]->value);
+          return value(ptr<TupleType>(ts), src, ptr<TupleExpr>(vals));
+        }
+
+        auto t = node(Op::TUPLE, ptr<TupleType>(ts), src);
+        t->kids.assign(kids, kids + n);
+        return t;
+      }
+      case ExprType::DOT: {
+        auto &x = kids[0];
+        auto &d = static_cast<const DotExpr&>(*e);
+        auto i = d.index();
+        if (x->ty->type() == TypeType::TUPLE) {
+          auto tys = dyn_cast<TupleType>(x->ty)->tys();
+          if (i < tys->size()) {
+            auto p = node(Op::PROJ, tys->at(i), src, {x});
+            p->index = i;
+            return p;
+          }
+        }
+        throw CannotProject(e, x->ty, i);
+      }
+      case ExprType::UNOP: {
+        auto &x = kids[0];
+        auto &u = static_cast<const UnOpExpr&>(*e);
+        switch (u.op()) {
+        case UnOp::REF:
+          return node(Op::REF, ptr<RefType>(x->ty), src, {x});
+        case UnOp::DEREF:
+          if (x->ty->type() != TypeType::REF) throw NotRef(u.expr(), x->ty);
+          return node(Op::DEREF, dyn_cast<RefType>(x->ty)->elem(), src,
+                      {x});
+        case UnOp::LAZY:
+          return node(Op::LAZY, ptr<LazyType>(x->ty), src, {x});
+        case UnOp::FORCE:
+          if (x->ty->type() != TypeType::LAZY) throw NotLazy(u.expr(), x->ty);
+          return node(Op::FORCE, dyn_cast<LazyType>(x->ty)->elem(), src,
+                      {x});
+#ifdef __GNUC__
+        default: std::abort();
+#endif
+        }
+      }
+      case ExprType::INDEX: {
+        auto &a = kids[0], &i = kids[1];
+        auto &x = static_cast<const IndexExpr&>(*e);
+        if (a->ty->type() != TypeType::ARRAY) throw NotArray(x.array(), a->ty);
+        check_eq(ptr<IntType>(), i->ty, x.index());
+        return node(Op::INDEX, dyn_cast<ArrayType>(a->ty)->elem(), src,
+                    {a, i});
+      }
+      case ExprType::REF: {
+        auto &r = static_cast<const RefExpr&>(*e);
+        return value(ptr<RefType>(typecheck(r.get(), ctx.env)->ty), src, e);
+      }
+      case ExprType::LAZY: {
+        // only the tree evaluator makes them without a type, and then the
+        // value has to be found to know it
+        auto &l = static_cast<const LazyExpr&>(*e);
+        auto ty = l.ty()? l.ty(): typecheck(l.force(), ctx.env)->ty;
+        return value(ptr<LazyType>(ty), src, e);
+      }
+      case ExprType::BUILTIN: {
+        auto &b = static_cast<const BuiltinExpr&>(*e);
+        auto ty = b.ty();
+        for (size_t i = 0; i < n; ++i) {
+          if (ty->type() == TypeType::ARROW) {
+            auto aty = dyn_cast<ArrowType>(ty);
+            check_eq(kids[i]->ty, aty->left(), (*b.args())[i]);
+            ty = aty->right();
+          } else {
+            throw NotArrow(ty);
+          }
+        }
+        return value(ty, src, e);
+      }
+      default:
+        std::abort();
+      }
     }
 
-    Ptr<Type> v(Ptr<BinOpExpr> e, Ptr<Env<Type>> env) override
+    Ptr<Node> binop(const BinOpExpr &e, const Src &src,
+                    const Ptr<Node> &l, const Ptr<Node> &r)
     {
       auto int_ = ptr<IntType>();
       auto bool_ = ptr<BoolType>();
-      switch (e->op()) {
-      case BinOp::PLUS:
-      case BinOp::MINUS:
-      case BinOp::TIMES:
-      case BinOp::DIVIDE:
-        check_eq(v(e->left(), env), int_, e->left());
-        check_eq(v(e->right(), env), int_, e->right());
-        return int_;
-      case BinOp::LESS:
-      case BinOp::LEQ:
-      case BinOp::EQUAL:
-      case BinOp::GEQ:
-      case BinOp::GREATER:
-      case BinOp::NEQ:
-        check_eq(v(e->left(), env), int_, e->left());
-        check_eq(v(e->right(), env), int_, e->right());
-        return bool_;
-      case BinOp::IFF:
-      case BinOp::AND:
-      case BinOp::OR:
-        check_eq(v(e->left(), env), bool_, e->left());
-        check_eq(v(e->right(), env), bool_, e->right());
-        return bool_;
+
+      Op op;
+      Ptr<Type> arg, res;
+      switch (e.op()) {
+      case BinOp::PLUS:    op = Op::INT_ADD;  arg = res = int_; break;
+      case BinOp::MINUS:   op = Op::INT_SUB;  arg = res = int_; break;
+      case BinOp::TIMES:   op = Op::INT_MUL;  arg = res = int_; break;
+      case BinOp::DIVIDE:  op = Op::INT_DIV;  arg = res = int_; break;
+      case BinOp::LESS:    op = Op::INT_LT;   arg = int_; res = bool_; break;
+      case BinOp::LEQ:     op = Op::INT_LE;   arg = int_; res = bool_; break;
+      case BinOp::EQUAL:   op = Op::INT_EQ;   arg = int_; res = bool_; break;
+      case BinOp::GEQ:     op = Op::INT_GE;   arg = int_; res = bool_; break;
+      case BinOp::GREATER: op = Op::INT_GT;   arg = int_; res = bool_; break;
+      case BinOp::NEQ:     op = Op::INT_NE;   arg = int_; res = bool_; break;
+      case BinOp::IFF:     op = Op::BOOL_IFF; arg = res = bool_; break;
+      case BinOp::AND:     op = Op::BOOL_AND; arg = res = bool_; break;
+      case BinOp::OR:      op = Op::BOOL_OR;  arg = res = bool_; break;
       case BinOp::SEQ:
-        return v(e->right(), env);
+        return node(Op::SEQ, r->ty, src, {l, r});
+      case BinOp::ASSIGN:
+        return assign(e, src, l, r);
 #ifdef __GNUC__
       default: std::abort();
 #endif
       }
-    }
 
-    Ptr<Type> v(Ptr<TupleExpr> es, Ptr<Env<Type>> env) override
-    {
-      auto ts = ptr<TupleType::Types>();
-      ts->reserve(es->exprs()->size());
-      for (auto e: *es->exprs()) {
-        ts->push_back(v(e, env));
-      }
-      return ptr<TupleType>(ts);
+      check_eq(l->ty, arg, e.left());
+      check_eq(r->ty, arg, e.right());
+      return node(op, res, src, {l, r});
     }
 
-    Ptr<Type> v(Ptr<DotExpr> e, Ptr<Env<Type>> env) override
+    /// `r := x` or `a.[i] := x`, whose left hand side has already been
+    /// checked as `!r` or `a.[i]` would be.
+    Ptr<Node> assign(const BinOpExpr &e, const Src &src,
+                     const Ptr<Node> &l, const Ptr<Node> &r)
     {
-      auto ty = v(e->expr(), env);
-      auto i = e->index();
-      if (ty->type() == TypeType::TUPLE) {
-        auto tys = dyn_cast<TupleType>(ty)->tys();
-        if (i < tys->size()) {
-          return tys->at(i);
-        } else {
-          throw CannotProject(e, ty, i);
-        }
-      } else {
-        throw CannotProject(e, ty, i);
+      auto unit = ptr<TupleType>(ptr<TupleType::Types>());
+      check_eq(l->op == Op::INDEX? l->ty: ref_elem(e.left(), l->ty), r->ty,
+               e.right());
+      if (l->op == Op::INDEX) {
+        return node(Op::SET_INDEX, unit, src, {l->kids[0], l->kids[1], r});
       }
+      return node(Op::ASSIGN, unit, src, {l, r});
     }
 
-    Ptr<Type> v(Ptr<BuiltinExpr> e, Ptr<Env<Type>> env) override
+    static Ptr<Type> ref_elem(const Ptr<Expr> &e, const Ptr<Type> &ty)
     {
-      auto ty = e->ty();
-      for (auto a: *e->args()) {
-        if (ty->type() == TypeType::ARROW) {
-          auto aty = dyn_cast<ArrowType>(ty);
-          check_eq(v(a, env), aty->left(), a);
-          ty = aty->right();
-        } else {
-          throw NotArrow(ty);
-        }
-      }
-      return ty;
+      if (ty->type() != TypeType::REF) throw NotRef(e, ty);
+      return dyn_cast<RefType>(ty)->elem();
     }
 
+    const Ptr<const ExprPool> &pool;
+    /// Next node to be visited.
+    ExprPool::Ref next;
+    /// Nodes whose children are being visited.
+    std::vector<ExprPool::Ref> open;
   };
 }
 
+Ptr<ir::Node> typecheck(Ptr<Expr> expr, Ptr<Env<Type>> env)
+{
+  auto pool = ptr<ExprPool>();
+  auto root = pool->add(expr);
+  pool->shrink();
+  return typecheck(expr, env, pool, root);
+}
+
+Ptr<ir::Node> typecheck(Ptr<Expr> expr, Ptr<Env<Type>> env,
+                        const Ptr<const ExprPool> &pool, ExprPool::Ref root)
+{ return TypeOf(pool, root)(expr, Ctx {env, nullptr}); }
+
 Ptr<Type> type_of(Ptr<Expr> expr, Ptr<Env<Type>> env)
-{ return TypeOf()(expr, env); }
+{ return typecheck(expr, env)->ty; }
 
 void check_eq(Ptr<Type> s, Ptr<Type> t, Ptr<Expr> e)
 { if (*s != *t) throw Clash(s, t, e); }
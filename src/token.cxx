@@ -11,15 +11,12 @@ String unescaped(const String &str, Pos pos)
   String out; out.reserve(str.size());
   for (size_t i = 1; i < str.size() - 1; ++i) { // 1's because quotes
     char c = str[i];
-    pos += c;
     if (c == '\\') {
       ++i; c = str[i];
       if (c >= '0' && c <= '9') {
-        auto idx_ = str.substr(i, 3);
-        pos += idx_;
-        int idx = std::stoi(idx_);
+        int idx = std::stoi(str.substr(i, 3));
         if (idx > std::numeric_limits<char>::max()) {
-          throw InvalidEscape(idx, pos);
+          throw InvalidEscape(idx, pos + (i - 1));
         }
         out.push_back((char) idx);
         i += 3;
@@ -70,7 +67,7 @@ String escaped(const String &str)
 
 OStream &operator<<(OStream &out, const Pos &p)
 {
-  return out << p.line << ':' << p.col;
+  return out << p.line() << ':' << p.col();
 }
 
 
@@ -124,6 +121,13 @@ ATOMIC_OUT(NEQ, "'!='")
 ATOMIC_OUT(SEQ, "';'")
 ATOMIC_OUT(COMMA, "','")
 ATOMIC_OUT(DOT, "'.'")
+ATOMIC_OUT(REF, "'ref'")
+ATOMIC_OUT(BANG, "'!'")
+ATOMIC_OUT(ASSIGN, "':='")
+ATOMIC_OUT(LBRACK, "'['")
+ATOMIC_OUT(RBRACK, "']'")
+ATOMIC_OUT(LAZY, "'lazy'")
+ATOMIC_OUT(FORCE, "'force'")
 #undef ATOMIC_OUT
 
 OStream &operator<<(OStream &out, const Token &tok)